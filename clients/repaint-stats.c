@@ -0,0 +1,256 @@
+/*
+ * Copyright © 2008 Kristian Høgsberg
+ * Copyright © 2026 agent <agent@local>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Prints the repaint latency statistics weston keeps for each output.
+ * Needs repaint-stats-protocol=true in the [core] section of weston.ini. */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <wayland-client.h>
+#include "weston-repaint-stats-client-protocol.h"
+#include "shared/helpers.h"
+#include "shared/xalloc.h"
+
+static const char *metric_names[] = {
+	[WESTON_REPAINT_STATS_METRIC_COMMIT_TO_REPAINT] = "commit-to-repaint",
+	[WESTON_REPAINT_STATS_METRIC_REPAINT_CPU] = "repaint CPU",
+	[WESTON_REPAINT_STATS_METRIC_REPAINT_TO_PRESENT] = "repaint-to-present",
+};
+
+struct stats_output {
+	struct wl_output *output;
+	int x, y;
+	char *make, *model;
+	struct wl_list link;
+};
+
+static struct weston_repaint_stats *repaint_stats;
+static struct wl_list output_list;
+static int show_buckets;
+static int report_done;
+
+static void
+display_handle_geometry(void *data,
+			struct wl_output *wl_output,
+			int x,
+			int y,
+			int physical_width,
+			int physical_height,
+			int subpixel,
+			const char *make,
+			const char *model,
+			int transform)
+{
+	struct stats_output *output = data;
+
+	output->x = x;
+	output->y = y;
+	free(output->make);
+	free(output->model);
+	output->make = xstrdup(make);
+	output->model = xstrdup(model);
+}
+
+static void
+display_handle_mode(void *data,
+		    struct wl_output *wl_output,
+		    uint32_t flags,
+		    int width,
+		    int height,
+		    int refresh)
+{
+}
+
+static const struct wl_output_listener output_listener = {
+	display_handle_geometry,
+	display_handle_mode
+};
+
+static const char *
+metric_name(uint32_t metric)
+{
+	if (metric >= ARRAY_LENGTH(metric_names) || !metric_names[metric])
+		return "unknown";
+
+	return metric_names[metric];
+}
+
+static void
+report_handle_histogram(void *data, struct weston_repaint_report *report,
+			uint32_t metric, uint32_t count, uint32_t min,
+			uint32_t max, uint32_t mean, uint32_t p50,
+			uint32_t p90, uint32_t p99, uint32_t p999)
+{
+	printf("  %-20s %8u samples", metric_name(metric), count);
+	if (count > 0)
+		printf(", min %u, mean %u, p50 %u, p90 %u, p99 %u, "
+		       "p99.9 %u, max %u us", min, mean, p50, p90, p99,
+		       p999, max);
+	printf("\n");
+}
+
+static void
+report_handle_bucket(void *data, struct weston_repaint_report *report,
+		     uint32_t metric, uint32_t lower, uint32_t upper,
+		     uint32_t count)
+{
+	if (show_buckets)
+		printf("    %10u - %10u us: %u\n", lower, upper, count);
+}
+
+static void
+report_handle_frames(void *data, struct weston_repaint_report *report,
+		     uint32_t presented, uint32_t missed,
+		     uint32_t missed_vblanks)
+{
+	printf("  %u frames presented, %u late by %u vblanks in total\n",
+	       presented, missed, missed_vblanks);
+}
+
+static void
+report_handle_done(void *data, struct weston_repaint_report *report)
+{
+	/* the compositor destroys the report */
+	weston_repaint_report_destroy(report);
+	report_done = 1;
+}
+
+static const struct weston_repaint_report_listener report_listener = {
+	report_handle_histogram,
+	report_handle_bucket,
+	report_handle_frames,
+	report_handle_done,
+};
+
+static void
+handle_global(void *data, struct wl_registry *registry,
+	      uint32_t name, const char *interface, uint32_t version)
+{
+	struct stats_output *output;
+
+	if (strcmp(interface, "wl_output") == 0) {
+		output = xzalloc(sizeof *output);
+		output->output = wl_registry_bind(registry, name,
+						  &wl_output_interface, 1);
+		wl_list_insert(output_list.prev, &output->link);
+		wl_output_add_listener(output->output, &output_listener,
+				       output);
+	} else if (strcmp(interface, "weston_repaint_stats") == 0) {
+		repaint_stats = wl_registry_bind(registry, name,
+						 &weston_repaint_stats_interface,
+						 1);
+	}
+}
+
+static void
+handle_global_remove(void *data, struct wl_registry *registry, uint32_t name)
+{
+	/* XXX: unimplemented */
+}
+
+static const struct wl_registry_listener registry_listener = {
+	handle_global,
+	handle_global_remove
+};
+
+static void
+usage(int error_code)
+{
+	fprintf(stderr, "Usage: weston-repaint-stats [OPTIONS]\n\n"
+		"Prints the repaint latency statistics of each output.\n\n"
+		"Options:\n"
+		"  --buckets\t\talso print the histogram buckets\n"
+		"  --reset\t\tclear the statistics after printing them\n"
+		"  --help\t\tthis help text\n\n");
+
+	exit(error_code);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct wl_display *display;
+	struct wl_registry *registry;
+	struct weston_repaint_report *report;
+	struct stats_output *output;
+	int i, reset = 0;
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--buckets") == 0)
+			show_buckets = 1;
+		else if (strcmp(argv[i], "--reset") == 0)
+			reset = 1;
+		else if (strcmp(argv[i], "--help") == 0)
+			usage(EXIT_SUCCESS);
+		else
+			usage(EXIT_FAILURE);
+	}
+
+	display = wl_display_connect(NULL);
+	if (display == NULL) {
+		fprintf(stderr, "failed to create display: %m\n");
+		return -1;
+	}
+
+	wl_list_init(&output_list);
+	registry = wl_display_get_registry(display);
+	wl_registry_add_listener(registry, &registry_listener, NULL);
+	wl_display_dispatch(display);
+	wl_display_roundtrip(display);
+	if (repaint_stats == NULL) {
+		fprintf(stderr, "display doesn't support repaint stats, "
+			"set repaint-stats-protocol=true in weston.ini\n");
+		return -1;
+	}
+
+	wl_list_for_each(output, &output_list, link) {
+		printf("output at %d,%d (%s %s):\n", output->x, output->y,
+		       output->make, output->model);
+
+		report = weston_repaint_stats_get_report(repaint_stats,
+							 output->output);
+		weston_repaint_report_add_listener(report, &report_listener,
+						   NULL);
+		report_done = 0;
+		while (!report_done)
+			if (wl_display_dispatch(display) < 0)
+				return -1;
+
+		if (reset)
+			weston_repaint_stats_reset(repaint_stats,
+						   output->output);
+	}
+
+	weston_repaint_stats_destroy(repaint_stats);
+	wl_display_roundtrip(display);
+
+	return 0;
+}
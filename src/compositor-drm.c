@@ -76,6 +76,33 @@
 
 static int option_current_mode = 0;
 
+/* KMS object properties used by atomic commits */
+enum drm_plane_property {
+	PLANE_TYPE = 0,
+	PLANE_SRC_X,
+	PLANE_SRC_Y,
+	PLANE_SRC_W,
+	PLANE_SRC_H,
+	PLANE_CRTC_X,
+	PLANE_CRTC_Y,
+	PLANE_CRTC_W,
+	PLANE_CRTC_H,
+	PLANE_FB_ID,
+	PLANE_CRTC_ID,
+	PLANE__COUNT
+};
+
+enum drm_crtc_property {
+	CRTC_MODE_ID = 0,
+	CRTC_ACTIVE,
+	CRTC__COUNT
+};
+
+enum drm_connector_property {
+	CONNECTOR_CRTC_ID = 0,
+	CONNECTOR__COUNT
+};
+
 enum output_config {
 	OUTPUT_CONFIG_INVALID = 0,
 	OUTPUT_CONFIG_OFF,
@@ -124,6 +151,8 @@ struct drm_backend {
 
 	int use_pixman;
 
+	int atomic_modeset;
+
 	uint32_t prev_state;
 
 	struct udev_input input;
@@ -193,6 +222,25 @@ struct drm_output {
 
 	struct vaapi_recorder *recorder;
 	struct wl_listener recorder_frame_listener;
+
+	/* Used by atomic modesetting */
+	uint32_t primary_plane_id;
+	uint32_t primary_props[PLANE__COUNT];
+	uint32_t cursor_plane_id;
+	uint32_t cursor_props[PLANE__COUNT];
+	struct drm_fb *cursor_fb;
+	uint32_t crtc_props[CRTC__COUNT];
+	uint32_t connector_props[CONNECTOR__COUNT];
+	uint32_t mode_blob_id;
+
+	/* Plane of each view in the last assignment, replayed while the
+	 * scene is unchanged, see drm_assign_planes() */
+	struct {
+		uint64_t key;
+		int valid;
+		struct weston_plane **planes;
+		int size;
+	} plane_cache;
 };
 
 /*
@@ -217,6 +265,8 @@ struct drm_sprite {
 	uint32_t dest_x, dest_y;
 	uint32_t dest_w, dest_h;
 
+	uint32_t props[PLANE__COUNT];
+
 	uint32_t formats[];
 };
 
@@ -443,6 +493,399 @@ drm_output_release_fb(struct drm_output *output, struct drm_fb *fb)
 	}
 }
 
+#ifdef HAVE_DRM_ATOMIC
+static const char * const plane_property_names[] = {
+	[PLANE_TYPE] = "type",
+	[PLANE_SRC_X] = "SRC_X",
+	[PLANE_SRC_Y] = "SRC_Y",
+	[PLANE_SRC_W] = "SRC_W",
+	[PLANE_SRC_H] = "SRC_H",
+	[PLANE_CRTC_X] = "CRTC_X",
+	[PLANE_CRTC_Y] = "CRTC_Y",
+	[PLANE_CRTC_W] = "CRTC_W",
+	[PLANE_CRTC_H] = "CRTC_H",
+	[PLANE_FB_ID] = "FB_ID",
+	[PLANE_CRTC_ID] = "CRTC_ID",
+};
+
+static const char * const crtc_property_names[] = {
+	[CRTC_MODE_ID] = "MODE_ID",
+	[CRTC_ACTIVE] = "ACTIVE",
+};
+
+static const char * const connector_property_names[] = {
+	[CONNECTOR_CRTC_ID] = "CRTC_ID",
+};
+
+/**
+ * Look up the ids of the named properties of a KMS object
+ *
+ * Properties the object does not have are left as 0. If values is not
+ * NULL, it receives the current value of each property found.
+ */
+static void
+drm_object_get_properties(int fd, uint32_t object_id, uint32_t object_type,
+			  const char * const *names, uint32_t *ids,
+			  uint64_t *values, int count)
+{
+	drmModeObjectPropertiesPtr props;
+	drmModePropertyPtr prop;
+	uint32_t i;
+	int j;
+
+	memset(ids, 0, count * sizeof ids[0]);
+
+	props = drmModeObjectGetProperties(fd, object_id, object_type);
+	if (!props)
+		return;
+
+	for (i = 0; i < props->count_props; i++) {
+		prop = drmModeGetProperty(fd, props->props[i]);
+		if (!prop)
+			continue;
+
+		for (j = 0; j < count; j++) {
+			if (strcmp(prop->name, names[j]) != 0)
+				continue;
+
+			ids[j] = prop->prop_id;
+			if (values)
+				values[j] = props->prop_values[i];
+		}
+
+		drmModeFreeProperty(prop);
+	}
+
+	drmModeFreeObjectProperties(props);
+}
+
+/* Returns the DRM_PLANE_TYPE_* of a plane and fills in its property
+ * ids, or returns -1 if the plane has no type. */
+static int
+drm_plane_get_type(int fd, uint32_t plane_id, uint32_t *props)
+{
+	uint64_t values[PLANE__COUNT];
+
+	drm_object_get_properties(fd, plane_id, DRM_MODE_OBJECT_PLANE,
+				  plane_property_names, props, values,
+				  PLANE__COUNT);
+	if (!props[PLANE_TYPE])
+		return -1;
+
+	return values[PLANE_TYPE];
+}
+
+static int
+drm_plane_is_claimed(struct drm_backend *b, uint32_t plane_id)
+{
+	struct drm_output *output;
+
+	wl_list_for_each(output, &b->compositor->output_list, base.link)
+		if (output->primary_plane_id == plane_id ||
+		    output->cursor_plane_id == plane_id)
+			return 1;
+
+	return 0;
+}
+
+/**
+ * Find the KMS objects an output commits atomically
+ *
+ * Universal planes expose the primary and cursor planes of a CRTC like
+ * the overlay planes; each output claims one of each that can be used
+ * with its CRTC. A cursor plane is optional.
+ */
+static int
+drm_output_init_planes(struct drm_backend *b, struct drm_output *output)
+{
+	drmModePlaneRes *plane_res;
+	drmModePlane *plane;
+	uint32_t props[PLANE__COUNT];
+	uint32_t i;
+	int type;
+
+	drm_object_get_properties(b->drm.fd, output->crtc_id,
+				  DRM_MODE_OBJECT_CRTC, crtc_property_names,
+				  output->crtc_props, NULL, CRTC__COUNT);
+	drm_object_get_properties(b->drm.fd, output->connector_id,
+				  DRM_MODE_OBJECT_CONNECTOR,
+				  connector_property_names,
+				  output->connector_props, NULL,
+				  CONNECTOR__COUNT);
+
+	plane_res = drmModeGetPlaneResources(b->drm.fd);
+	if (!plane_res) {
+		weston_log("failed to get plane resources: %s\n",
+			   strerror(errno));
+		return -1;
+	}
+
+	for (i = 0; i < plane_res->count_planes; i++) {
+		plane = drmModeGetPlane(b->drm.fd, plane_res->planes[i]);
+		if (!plane)
+			continue;
+
+		if (!(plane->possible_crtcs & (1 << output->pipe)) ||
+		    drm_plane_is_claimed(b, plane->plane_id)) {
+			drmModeFreePlane(plane);
+			continue;
+		}
+
+		type = drm_plane_get_type(b->drm.fd, plane->plane_id, props);
+		if (type == DRM_PLANE_TYPE_PRIMARY &&
+		    !output->primary_plane_id) {
+			output->primary_plane_id = plane->plane_id;
+			memcpy(output->primary_props, props, sizeof props);
+		} else if (type == DRM_PLANE_TYPE_CURSOR &&
+			   !output->cursor_plane_id) {
+			output->cursor_plane_id = plane->plane_id;
+			memcpy(output->cursor_props, props, sizeof props);
+		}
+
+		drmModeFreePlane(plane);
+	}
+
+	drmModeFreePlaneResources(plane_res);
+
+	if (!output->primary_plane_id) {
+		weston_log("no primary plane for crtc %d\n", output->crtc_id);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+drm_atomic_add(drmModeAtomicReq *req, uint32_t object_id,
+	       uint32_t property_id, uint64_t value)
+{
+	if (property_id == 0)
+		return -1;
+
+	if (drmModeAtomicAddProperty(req, object_id, property_id, value) < 0)
+		return -1;
+
+	return 0;
+}
+
+/* Adds the state of a plane to req, with the source rectangle in 16.16
+ * fixed point. A NULL fb turns the plane off. */
+static int
+drm_atomic_add_plane(drmModeAtomicReq *req, uint32_t plane_id,
+		     const uint32_t *props, uint32_t crtc_id, struct drm_fb *fb,
+		     int32_t src_x, int32_t src_y,
+		     uint32_t src_w, uint32_t src_h,
+		     int32_t dest_x, int32_t dest_y,
+		     uint32_t dest_w, uint32_t dest_h)
+{
+	int ret = 0;
+
+	if (!fb) {
+		crtc_id = 0;
+		src_x = src_y = src_w = src_h = 0;
+		dest_x = dest_y = dest_w = dest_h = 0;
+	}
+
+	ret |= drm_atomic_add(req, plane_id, props[PLANE_FB_ID],
+			      fb ? fb->fb_id : 0);
+	ret |= drm_atomic_add(req, plane_id, props[PLANE_CRTC_ID], crtc_id);
+	ret |= drm_atomic_add(req, plane_id, props[PLANE_SRC_X], src_x);
+	ret |= drm_atomic_add(req, plane_id, props[PLANE_SRC_Y], src_y);
+	ret |= drm_atomic_add(req, plane_id, props[PLANE_SRC_W], src_w);
+	ret |= drm_atomic_add(req, plane_id, props[PLANE_SRC_H], src_h);
+	ret |= drm_atomic_add(req, plane_id, props[PLANE_CRTC_X], dest_x);
+	ret |= drm_atomic_add(req, plane_id, props[PLANE_CRTC_Y], dest_y);
+	ret |= drm_atomic_add(req, plane_id, props[PLANE_CRTC_W], dest_w);
+	ret |= drm_atomic_add(req, plane_id, props[PLANE_CRTC_H], dest_h);
+
+	return ret;
+}
+
+/**
+ * Add the complete state of an output to an atomic request
+ *
+ * @param output DRM output
+ * @param req Atomic request to fill in
+ * @param fb Framebuffer for the primary plane
+ * @param mode_blob_id Mode to set on the CRTC, or 0 to keep the mode
+ * @returns 0 on success, -1 if a property is missing or cannot be added
+ *
+ * The overlay planes are taken from the sprites assigned to the output
+ * and the cursor plane from the last drm_output_set_cursor().
+ */
+static int
+drm_output_populate_atomic(struct drm_output *output, drmModeAtomicReq *req,
+			   struct drm_fb *fb, uint32_t mode_blob_id)
+{
+	struct drm_backend *b =
+		(struct drm_backend *)output->base.compositor->backend;
+	struct weston_mode *mode = output->base.current_mode;
+	struct drm_sprite *s;
+	int ret = 0;
+
+	if (mode_blob_id) {
+		ret |= drm_atomic_add(req, output->crtc_id,
+				      output->crtc_props[CRTC_MODE_ID],
+				      mode_blob_id);
+		ret |= drm_atomic_add(req, output->crtc_id,
+				      output->crtc_props[CRTC_ACTIVE], 1);
+		ret |= drm_atomic_add(req, output->connector_id,
+				      output->connector_props[CONNECTOR_CRTC_ID],
+				      output->crtc_id);
+	}
+
+	ret |= drm_atomic_add_plane(req, output->primary_plane_id,
+				    output->primary_props, output->crtc_id, fb,
+				    0, 0, mode->width << 16, mode->height << 16,
+				    0, 0, mode->width, mode->height);
+
+	wl_list_for_each(s, &b->sprite_list, link) {
+		if (s->output != output || (!s->current && !s->next))
+			continue;
+
+		ret |= drm_atomic_add_plane(req, s->plane_id, s->props,
+					    output->crtc_id,
+					    b->sprites_hidden ? NULL : s->next,
+					    s->src_x, s->src_y,
+					    s->src_w, s->src_h,
+					    s->dest_x, s->dest_y,
+					    s->dest_w, s->dest_h);
+	}
+
+	if (output->cursor_plane_id)
+		ret |= drm_atomic_add_plane(req, output->cursor_plane_id,
+					    output->cursor_props,
+					    output->crtc_id, output->cursor_fb,
+					    0, 0,
+					    b->cursor_width << 16,
+					    b->cursor_height << 16,
+					    output->cursor_plane.x,
+					    output->cursor_plane.y,
+					    b->cursor_width, b->cursor_height);
+
+	return ret;
+}
+
+/* Asks the kernel whether the planes assigned so far for the next
+ * frame can be shown, without changing anything on screen. */
+static int
+drm_output_test_atomic(struct drm_output *output)
+{
+	struct drm_backend *b =
+		(struct drm_backend *)output->base.compositor->backend;
+	struct drm_fb *fb = output->next ? output->next : output->current;
+	drmModeAtomicReq *req;
+	int ret;
+
+	/* Planes can only be tested once the mode is set */
+	if (!output->current || !fb)
+		return -1;
+
+	req = drmModeAtomicAlloc();
+	if (!req)
+		return -1;
+
+	ret = drm_output_populate_atomic(output, req, fb, 0);
+	if (ret == 0)
+		ret = drmModeAtomicCommit(b->drm.fd, req,
+					  DRM_MODE_ATOMIC_TEST_ONLY, NULL);
+
+	drmModeAtomicFree(req);
+
+	return ret;
+}
+
+/* Shows the next frame of an output, planes and cursor included, with
+ * a single atomic commit. The page flip event completes it. */
+static int
+drm_output_repaint_atomic(struct drm_output *output)
+{
+	struct drm_backend *b =
+		(struct drm_backend *)output->base.compositor->backend;
+	struct drm_mode *mode =
+		container_of(output->base.current_mode, struct drm_mode, base);
+	uint32_t flags = DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_ATOMIC_NONBLOCK;
+	uint32_t blob_id = 0;
+	drmModeAtomicReq *req;
+	struct drm_sprite *s;
+	int ret;
+
+	/* The first frame after a mode change also sets the mode */
+	if (!output->current) {
+		if (drmModeCreatePropertyBlob(b->drm.fd, &mode->mode_info,
+					      sizeof mode->mode_info,
+					      &blob_id) != 0) {
+			weston_log("failed to create mode blob: %m\n");
+			goto err;
+		}
+		flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
+	}
+
+	drm_output_set_cursor(output);
+
+	req = drmModeAtomicAlloc();
+	if (!req)
+		goto err_blob;
+
+	ret = drm_output_populate_atomic(output, req, output->next, blob_id);
+	if (ret == 0)
+		ret = drmModeAtomicCommit(b->drm.fd, req, flags, output);
+
+	drmModeAtomicFree(req);
+
+	if (ret != 0) {
+		weston_log("atomic commit failed: %m\n");
+		output->plane_cache.valid = 0;
+		goto err_blob;
+	}
+
+	if (blob_id) {
+		if (output->mode_blob_id)
+			drmModeDestroyPropertyBlob(b->drm.fd,
+						   output->mode_blob_id);
+		output->mode_blob_id = blob_id;
+		output->dpms = WESTON_DPMS_ON;
+	}
+
+	output->page_flip_pending = 1;
+
+	return 0;
+
+err_blob:
+	if (blob_id)
+		drmModeDestroyPropertyBlob(b->drm.fd, blob_id);
+err:
+	wl_list_for_each(s, &b->sprite_list, link) {
+		if (s->output != output)
+			continue;
+
+		drm_output_release_fb(output, s->next);
+		s->next = NULL;
+	}
+
+	return -1;
+}
+#endif
+
+/* Atomic commits flip the sprites of an output together with its
+ * primary plane, so they complete on the output's page flip. */
+static void
+drm_output_flip_sprites(struct drm_output *output)
+{
+	struct drm_backend *b =
+		(struct drm_backend *)output->base.compositor->backend;
+	struct drm_sprite *s;
+
+	wl_list_for_each(s, &b->sprite_list, link) {
+		if (s->output != output)
+			continue;
+
+		drm_output_release_fb(output, s->current);
+		s->current = s->next;
+		s->next = NULL;
+	}
+}
+
 static uint32_t
 drm_output_check_scanout_format(struct drm_output *output,
 				struct weston_surface *es, struct gbm_bo *bo)
@@ -475,7 +918,7 @@ drm_output_check_scanout_format(struct drm_output *output,
 
 static struct weston_plane *
 drm_output_prepare_scanout_view(struct drm_output *output,
-				struct weston_view *ev)
+				struct weston_view *ev, int test)
 {
 	struct drm_backend *b =
 		(struct drm_backend *)output->base.compositor->backend;
@@ -517,6 +960,14 @@ drm_output_prepare_scanout_view(struct drm_output *output,
 
 	drm_fb_set_buffer(output->next, buffer);
 
+#ifdef HAVE_DRM_ATOMIC
+	if (test && drm_output_test_atomic(output) < 0) {
+		drm_output_release_fb(output, output->next);
+		output->next = NULL;
+		return NULL;
+	}
+#endif
+
 	return &output->fb_plane;
 }
 
@@ -651,6 +1102,14 @@ drm_output_repaint(struct weston_output *output_base,
 	if (!output->next)
 		return -1;
 
+#ifdef HAVE_DRM_ATOMIC
+	if (backend->atomic_modeset) {
+		if (drm_output_repaint_atomic(output) < 0)
+			goto err_pageflip;
+		return 0;
+	}
+#endif
+
 	mode = container_of(output->base.current_mode, struct drm_mode, base);
 	if (!output->current ||
 	    output->current->stride != output->next->stride) {
@@ -846,6 +1305,8 @@ page_flip_handler(int fd, unsigned int frame,
 		  unsigned int sec, unsigned int usec, void *data)
 {
 	struct drm_output *output = (struct drm_output *) data;
+	struct drm_backend *b =
+		(struct drm_backend *)output->base.compositor->backend;
 	struct timespec ts;
 	uint32_t flags = WP_PRESENTATION_FEEDBACK_KIND_VSYNC |
 			 WP_PRESENTATION_FEEDBACK_KIND_HW_COMPLETION |
@@ -860,6 +1321,9 @@ page_flip_handler(int fd, unsigned int frame,
 		drm_output_release_fb(output, output->current);
 		output->current = output->next;
 		output->next = NULL;
+
+		if (b->atomic_modeset)
+			drm_output_flip_sprites(output);
 	}
 
 	output->page_flip_pending = 0;
@@ -879,10 +1343,9 @@ page_flip_handler(int fd, unsigned int frame,
 }
 
 static uint32_t
-drm_output_check_sprite_format(struct drm_sprite *s,
-			       struct weston_view *ev, struct gbm_bo *bo)
+drm_view_get_sprite_format(struct weston_view *ev, struct gbm_bo *bo)
 {
-	uint32_t i, format;
+	uint32_t format;
 
 	format = gbm_bo_get_format(bo);
 
@@ -900,13 +1363,35 @@ drm_output_check_sprite_format(struct drm_sprite *s,
 		pixman_region32_fini(&r);
 	}
 
+	return format;
+}
+
+static int
+drm_sprite_supports_format(struct drm_sprite *s, uint32_t format)
+{
+	uint32_t i;
+
 	for (i = 0; i < s->count_formats; i++)
 		if (s->formats[i] == format)
-			return format;
+			return 1;
 
 	return 0;
 }
 
+static int
+drm_sprite_is_available(struct drm_output *output, struct drm_sprite *s)
+{
+	if (!drm_sprite_crtc_supported(output, s->possible_crtcs))
+		return 0;
+
+	/* A plane still showing on another CRTC can't move within one
+	 * commit of this output */
+	if (s->backend->atomic_modeset && s->current && s->output != output)
+		return 0;
+
+	return s->next == NULL;
+}
+
 static int
 drm_view_transform_supported(struct weston_view *ev)
 {
@@ -914,9 +1399,23 @@ drm_view_transform_supported(struct weston_view *ev)
 		(ev->transform.matrix.type < WESTON_MATRIX_TRANSFORM_ROTATE);
 }
 
+/**
+ * Try to show a view on an overlay plane
+ *
+ * @param output DRM output
+ * @param ev View to place
+ * @param only Sprite to use, or NULL to try every free sprite
+ * @param test Validate the assignment with a TEST_ONLY commit
+ * @returns The sprite's plane, or NULL if the view stays on another plane
+ *
+ * Sprites differ in formats and in what the display engine can do with
+ * them next to the planes already in use, so each free sprite that
+ * takes the format is proposed in turn until the kernel accepts one.
+ */
 static struct weston_plane *
 drm_output_prepare_overlay_view(struct drm_output *output,
-				struct weston_view *ev)
+				struct weston_view *ev,
+				struct drm_sprite *only, int test)
 {
 	struct weston_compositor *ec = output->base.compositor;
 	struct drm_backend *b = (struct drm_backend *)ec->backend;
@@ -924,10 +1423,11 @@ drm_output_prepare_overlay_view(struct drm_output *output,
 	struct wl_resource *buffer_resource;
 	struct drm_sprite *s;
 	struct linux_dmabuf_buffer *dmabuf;
-	int found = 0;
+	struct drm_fb *fb;
 	struct gbm_bo *bo;
 	pixman_region32_t dest_rect, src_rect;
-	pixman_box32_t *box, tbox;
+	pixman_box32_t *box, tbox, dest_box, src_box;
+	int32_t plane_x, plane_y;
 	uint32_t format;
 	wl_fixed_t sx1, sy1, sx2, sy2;
 
@@ -960,17 +1460,12 @@ drm_output_prepare_overlay_view(struct drm_output *output,
 		return NULL;
 
 	wl_list_for_each(s, &b->sprite_list, link) {
-		if (!drm_sprite_crtc_supported(output, s->possible_crtcs))
-			continue;
-
-		if (!s->next) {
-			found = 1;
+		if ((!only || s == only) && drm_sprite_is_available(output, s))
 			break;
-		}
 	}
 
 	/* No sprites available */
-	if (!found)
+	if (&s->link == &b->sprite_list)
 		return NULL;
 
 	if ((dmabuf = linux_dmabuf_buffer_get(buffer_resource))) {
@@ -1005,23 +1500,31 @@ drm_output_prepare_overlay_view(struct drm_output *output,
 	if (!bo)
 		return NULL;
 
-	format = drm_output_check_sprite_format(s, ev, bo);
-	if (format == 0) {
+	format = drm_view_get_sprite_format(ev, bo);
+
+	/* Do not create a framebuffer no sprite can show */
+	wl_list_for_each(s, &b->sprite_list, link) {
+		if ((!only || s == only) && drm_sprite_is_available(output, s) &&
+		    drm_sprite_supports_format(s, format))
+			break;
+	}
+
+	if (&s->link == &b->sprite_list) {
 		gbm_bo_destroy(bo);
 		return NULL;
 	}
 
-	s->next = drm_fb_get_from_bo(bo, b, format);
-	if (!s->next) {
+	fb = drm_fb_get_from_bo(bo, b, format);
+	if (!fb) {
 		gbm_bo_destroy(bo);
 		return NULL;
 	}
 
-	drm_fb_set_buffer(s->next, ev->surface->buffer_ref.buffer);
+	drm_fb_set_buffer(fb, ev->surface->buffer_ref.buffer);
 
 	box = pixman_region32_extents(&ev->transform.boundingbox);
-	s->plane.x = box->x1;
-	s->plane.y = box->y1;
+	plane_x = box->x1;
+	plane_y = box->y1;
 
 	/*
 	 * Calculate the source & dest rects properly based on actual
@@ -1033,15 +1536,11 @@ drm_output_prepare_overlay_view(struct drm_output *output,
 				  &output->base.region);
 	pixman_region32_translate(&dest_rect, -output->base.x, -output->base.y);
 	box = pixman_region32_extents(&dest_rect);
-	tbox = weston_transformed_rect(output->base.width,
-				       output->base.height,
-				       output->base.transform,
-				       output->base.current_scale,
-				       *box);
-	s->dest_x = tbox.x1;
-	s->dest_y = tbox.y1;
-	s->dest_w = tbox.x2 - tbox.x1;
-	s->dest_h = tbox.y2 - tbox.y1;
+	dest_box = weston_transformed_rect(output->base.width,
+					   output->base.height,
+					   output->base.transform,
+					   output->base.current_scale,
+					   *box);
 	pixman_region32_fini(&dest_rect);
 
 	pixman_region32_init(&src_rect);
@@ -1072,19 +1571,48 @@ drm_output_prepare_overlay_view(struct drm_output *output,
 	tbox.x2 = sx2;
 	tbox.y2 = sy2;
 
-	tbox = weston_transformed_rect(wl_fixed_from_int(ev->surface->width),
-				       wl_fixed_from_int(ev->surface->height),
-				       viewport->buffer.transform,
-				       viewport->buffer.scale,
-				       tbox);
-
-	s->src_x = tbox.x1 << 8;
-	s->src_y = tbox.y1 << 8;
-	s->src_w = (tbox.x2 - tbox.x1) << 8;
-	s->src_h = (tbox.y2 - tbox.y1) << 8;
+	src_box = weston_transformed_rect(wl_fixed_from_int(ev->surface->width),
+					  wl_fixed_from_int(ev->surface->height),
+					  viewport->buffer.transform,
+					  viewport->buffer.scale,
+					  tbox);
 	pixman_region32_fini(&src_rect);
 
-	return &s->plane;
+	wl_list_for_each(s, &b->sprite_list, link) {
+		if ((only && s != only) ||
+		    !drm_sprite_is_available(output, s) ||
+		    !drm_sprite_supports_format(s, format))
+			continue;
+
+		s->next = fb;
+		s->output = output;
+		s->plane.x = plane_x;
+		s->plane.y = plane_y;
+
+		s->dest_x = dest_box.x1;
+		s->dest_y = dest_box.y1;
+		s->dest_w = dest_box.x2 - dest_box.x1;
+		s->dest_h = dest_box.y2 - dest_box.y1;
+
+		s->src_x = src_box.x1 << 8;
+		s->src_y = src_box.y1 << 8;
+		s->src_w = (src_box.x2 - src_box.x1) << 8;
+		s->src_h = (src_box.y2 - src_box.y1) << 8;
+
+#ifdef HAVE_DRM_ATOMIC
+		if (test && drm_output_test_atomic(output) < 0) {
+			s->next = NULL;
+			continue;
+		}
+#endif
+
+		return &s->plane;
+	}
+
+	/* No sprite takes the buffer */
+	drm_output_release_fb(output, fb);
+
+	return NULL;
 }
 
 static struct weston_plane *
@@ -1179,7 +1707,10 @@ drm_output_set_cursor(struct drm_output *output)
 
 	output->cursor_view = NULL;
 	if (ev == NULL) {
-		drmModeSetCursor(b->drm.fd, output->crtc_id, 0, 0, 0);
+		/* With a cursor plane, the atomic commit turns it off */
+		output->cursor_fb = NULL;
+		if (!output->cursor_plane_id)
+			drmModeSetCursor(b->drm.fd, output->crtc_id, 0, 0, 0);
 		output->cursor_plane.x = INT32_MIN;
 		output->cursor_plane.y = INT32_MIN;
 		return;
@@ -1195,11 +1726,18 @@ drm_output_set_cursor(struct drm_output *output)
 		bo = output->gbm_cursor_bo[output->current_cursor];
 
 		cursor_bo_update(b, bo, ev);
-		handle = gbm_bo_get_handle(bo).s32;
-		if (drmModeSetCursor(b->drm.fd, output->crtc_id, handle,
-				b->cursor_width, b->cursor_height)) {
-			weston_log("failed to set cursor: %m\n");
-			b->cursors_are_broken = 1;
+		if (output->cursor_plane_id) {
+			output->cursor_fb =
+				drm_fb_get_from_bo(bo, b, GBM_FORMAT_ARGB8888);
+			if (!output->cursor_fb)
+				b->cursors_are_broken = 1;
+		} else {
+			handle = gbm_bo_get_handle(bo).s32;
+			if (drmModeSetCursor(b->drm.fd, output->crtc_id, handle,
+					b->cursor_width, b->cursor_height)) {
+				weston_log("failed to set cursor: %m\n");
+				b->cursors_are_broken = 1;
+			}
 		}
 	}
 
@@ -1212,7 +1750,8 @@ drm_output_set_cursor(struct drm_output *output)
 	y = (y - output->base.y) * output->base.current_scale;
 
 	if (output->cursor_plane.x != x || output->cursor_plane.y != y) {
-		if (drmModeMoveCursor(b->drm.fd, output->crtc_id, x, y)) {
+		if (!output->cursor_plane_id &&
+		    drmModeMoveCursor(b->drm.fd, output->crtc_id, x, y)) {
 			weston_log("failed to move cursor: %m\n");
 			b->cursors_are_broken = 1;
 		}
@@ -1222,6 +1761,209 @@ drm_output_set_cursor(struct drm_output *output)
 	}
 }
 
+static uint64_t
+hash_data(uint64_t hash, const void *data, size_t size)
+{
+	const uint8_t *p = data;
+	size_t i;
+
+	/* FNV-1a */
+	for (i = 0; i < size; i++) {
+		hash ^= p[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+/* Only GBM can tell the format of a wl_drm buffer; it is looked up
+ * once and kept until the buffer is destroyed. */
+struct drm_buffer_format {
+	struct wl_listener destroy_listener;
+	uint32_t format;
+};
+
+static void
+drm_buffer_format_destroy(struct wl_listener *listener, void *data)
+{
+	struct drm_buffer_format *bf =
+		container_of(listener, struct drm_buffer_format,
+			     destroy_listener);
+
+	wl_list_remove(&bf->destroy_listener.link);
+	free(bf);
+}
+
+static uint32_t
+drm_buffer_get_format(struct drm_backend *b, struct weston_buffer *buffer)
+{
+	struct drm_buffer_format *bf;
+	struct wl_listener *listener;
+	struct gbm_bo *bo;
+
+	listener = wl_signal_get(&buffer->destroy_signal,
+				 drm_buffer_format_destroy);
+	if (listener) {
+		bf = container_of(listener, struct drm_buffer_format,
+				  destroy_listener);
+		return bf->format;
+	}
+
+	bf = zalloc(sizeof *bf);
+	if (!bf)
+		return 0;
+
+	/* wl_drm buffers only wrap an existing image, importing one
+	 * allocates nothing */
+	bo = gbm_bo_import(b->gbm, GBM_BO_IMPORT_WL_BUFFER,
+			   buffer->resource, GBM_BO_USE_SCANOUT);
+	if (bo) {
+		bf->format = gbm_bo_get_format(bo);
+		gbm_bo_destroy(bo);
+	}
+
+	bf->destroy_listener.notify = drm_buffer_format_destroy;
+	wl_signal_add(&buffer->destroy_signal, &bf->destroy_listener);
+
+	return bf->format;
+}
+
+/*
+ * Hash everything drm_assign_planes() decides on, except the buffer
+ * contents: a new buffer of the same size and kind can go where the
+ * previous one of the view went.
+ */
+static uint64_t
+drm_output_scene_key(struct drm_output *output)
+{
+	struct weston_compositor *ec = output->base.compositor;
+	struct drm_backend *b = (struct drm_backend *)ec->backend;
+	struct weston_view *ev;
+	struct weston_buffer *buffer;
+	struct wl_shm_buffer *shm_buffer;
+	struct linux_dmabuf_buffer *dmabuf;
+	uint64_t key = 0xcbf29ce484222325ULL;
+	struct {
+		struct weston_mode *mode;
+		int32_t x, y, scale;
+		uint32_t transform;
+		int sprites_are_broken, sprites_hidden, cursors_are_broken;
+	} o;
+	struct {
+		struct weston_view *view;
+		pixman_box32_t bounding, opaque;
+		float alpha;
+		uint32_t output_mask;
+		int transform_enabled, matrix_type, scissor_enabled;
+		int32_t width, height;
+		uint32_t buffer_transform;
+		int32_t buffer_scale;
+		int has_buffer, buffer_width, buffer_height;
+		int is_shm, is_dmabuf;
+		uint32_t format;
+		uint64_t modifier;
+	} v;
+
+	memset(&o, 0, sizeof o);
+	o.mode = output->base.current_mode;
+	o.x = output->base.x;
+	o.y = output->base.y;
+	o.scale = output->base.current_scale;
+	o.transform = output->base.transform;
+	o.sprites_are_broken = b->sprites_are_broken;
+	o.sprites_hidden = b->sprites_hidden;
+	o.cursors_are_broken = b->cursors_are_broken;
+	key = hash_data(key, &o, sizeof o);
+
+	wl_list_for_each(ev, &ec->view_list, link) {
+		memset(&v, 0, sizeof v);
+		v.view = ev;
+		v.bounding = *pixman_region32_extents(&ev->transform.boundingbox);
+		v.opaque = *pixman_region32_extents(&ev->surface->opaque);
+		v.alpha = ev->alpha;
+		v.output_mask = ev->output_mask;
+		v.transform_enabled = ev->transform.enabled;
+		v.matrix_type = ev->transform.matrix.type;
+		v.scissor_enabled = ev->geometry.scissor_enabled;
+		v.width = ev->surface->width;
+		v.height = ev->surface->height;
+		v.buffer_transform = ev->surface->buffer_viewport.buffer.transform;
+		v.buffer_scale = ev->surface->buffer_viewport.buffer.scale;
+
+		buffer = ev->surface->buffer_ref.buffer;
+		if (buffer) {
+			v.has_buffer = 1;
+			v.buffer_width = buffer->width;
+			v.buffer_height = buffer->height;
+			shm_buffer = wl_shm_buffer_get(buffer->resource);
+			dmabuf = linux_dmabuf_buffer_get(buffer->resource);
+			if (shm_buffer) {
+				v.is_shm = 1;
+				v.format =
+					wl_shm_buffer_get_format(shm_buffer);
+			} else if (dmabuf) {
+				v.is_dmabuf = 1;
+				v.format = dmabuf->attributes.format;
+				v.modifier = dmabuf->attributes.modifier[0];
+			} else if (b->gbm) {
+				v.format = drm_buffer_get_format(b, buffer);
+			}
+		}
+
+		key = hash_data(key, &v, sizeof v);
+	}
+
+	return key;
+}
+
+/* Places a view on the plane it had in the cached assignment, without
+ * TEST_ONLY commits: the same configuration passed them before. */
+static struct weston_plane *
+drm_output_replay_view(struct drm_output *output, struct weston_view *ev,
+		       struct weston_plane *plane)
+{
+	struct drm_backend *b =
+		(struct drm_backend *)output->base.compositor->backend;
+	struct drm_sprite *s;
+
+	if (plane == &output->cursor_plane)
+		return drm_output_prepare_cursor_view(output, ev);
+
+	if (plane == &output->fb_plane)
+		return drm_output_prepare_scanout_view(output, ev, 0);
+
+	wl_list_for_each(s, &b->sprite_list, link)
+		if (plane == &s->plane)
+			return drm_output_prepare_overlay_view(output, ev,
+							       s, 0);
+
+	return NULL;
+}
+
+static void
+drm_output_cache_plane(struct drm_output *output, int i,
+		       struct weston_plane *plane)
+{
+	struct weston_plane **planes;
+	int size;
+
+	if (i >= output->plane_cache.size) {
+		size = output->plane_cache.size * 2;
+		if (size <= i)
+			size = i + 16;
+		planes = realloc(output->plane_cache.planes,
+				 size * sizeof *planes);
+		if (!planes) {
+			output->plane_cache.valid = 0;
+			return;
+		}
+		output->plane_cache.planes = planes;
+		output->plane_cache.size = size;
+	}
+
+	output->plane_cache.planes[i] = plane;
+}
+
 static void
 drm_assign_planes(struct weston_output *output_base)
 {
@@ -1231,6 +1973,8 @@ drm_assign_planes(struct weston_output *output_base)
 	struct weston_view *ev, *next;
 	pixman_region32_t overlap, surface_overlap;
 	struct weston_plane *primary, *next_plane;
+	uint64_t key;
+	int i = 0, replay, test;
 
 	/*
 	 * Find a surface for each sprite in the output using some heuristics:
@@ -1244,10 +1988,24 @@ drm_assign_planes(struct weston_output *output_base)
 	 * the main display surface may not need to update at all, and
 	 * the client buffer can be used directly for the sprite surface
 	 * as we do for flipping full screen surfaces.
+	 *
+	 * With atomic modesetting, every candidate plane is validated
+	 * with a TEST_ONLY commit, and a view that one sprite can't
+	 * take is offered to the next. The result is replayed without
+	 * tests for as long as the scene stays the same.
 	 */
 	pixman_region32_init(&overlap);
 	primary = &output_base->compositor->primary_plane;
 
+	key = drm_output_scene_key(output);
+	replay = output->plane_cache.valid && output->plane_cache.key == key;
+	test = b->atomic_modeset && !replay;
+
+	/* TEST_ONLY commits fail until the mode is set, so what they
+	 * rejected before then is not worth keeping. */
+	output->plane_cache.key = key;
+	output->plane_cache.valid = !b->atomic_modeset || output->current;
+
 	wl_list_for_each_safe(ev, next, &output_base->compositor->view_list, link) {
 		struct weston_surface *es = ev->surface;
 
@@ -1273,17 +2031,31 @@ drm_assign_planes(struct weston_output *output_base)
 					  &ev->transform.boundingbox);
 
 		next_plane = NULL;
-		if (pixman_region32_not_empty(&surface_overlap))
+		if (pixman_region32_not_empty(&surface_overlap)) {
 			next_plane = primary;
-		if (next_plane == NULL)
+		} else if (replay) {
+			next_plane = drm_output_replay_view(output, ev,
+					output->plane_cache.planes[i]);
+		} else {
 			next_plane = drm_output_prepare_cursor_view(output, ev);
-		if (next_plane == NULL)
-			next_plane = drm_output_prepare_scanout_view(output, ev);
-		if (next_plane == NULL)
-			next_plane = drm_output_prepare_overlay_view(output, ev);
+			if (next_plane == NULL)
+				next_plane = drm_output_prepare_scanout_view(
+							output, ev, test);
+			if (next_plane == NULL)
+				next_plane = drm_output_prepare_overlay_view(
+							output, ev, NULL, test);
+		}
 		if (next_plane == NULL)
 			next_plane = primary;
 
+		/* If the replay went wrong, search with tests for the
+		 * remaining views */
+		if (replay && next_plane != output->plane_cache.planes[i]) {
+			replay = 0;
+			test = b->atomic_modeset;
+		}
+		drm_output_cache_plane(output, i++, next_plane);
+
 		weston_view_move_to_plane(ev, next_plane);
 
 		if (next_plane == primary)
@@ -1316,6 +2088,7 @@ drm_output_destroy(struct weston_output *output_base)
 	struct drm_backend *b =
 		(struct drm_backend *)output->base.compositor->backend;
 	drmModeCrtcPtr origcrtc = output->original_crtc;
+	struct drm_sprite *s;
 
 	if (output->page_flip_pending) {
 		output->destroy_pending = 1;
@@ -1331,6 +2104,17 @@ drm_output_destroy(struct weston_output *output_base)
 	/* Turn off hardware cursor */
 	drmModeSetCursor(b->drm.fd, output->crtc_id, 0, 0, 0);
 
+	wl_list_for_each(s, &b->sprite_list, link)
+		if (s->output == output)
+			s->output = NULL;
+
+	free(output->plane_cache.planes);
+
+#ifdef HAVE_DRM_ATOMIC
+	if (output->mode_blob_id)
+		drmModeDestroyPropertyBlob(b->drm.fd, output->mode_blob_id);
+#endif
+
 	/* Restore original CRTC state */
 	drmModeSetCrtc(b->drm.fd, origcrtc->crtc_id, origcrtc->buffer_id,
 		       origcrtc->x, origcrtc->y,
@@ -1525,6 +2309,22 @@ init_drm(struct drm_backend *b, struct udev_device *device)
 	else
 		b->cursor_height = 64;
 
+#ifdef HAVE_DRM_ATOMIC
+	if (b->atomic_modeset) {
+		ret = drmSetClientCap(fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1);
+		if (ret == 0)
+			ret = drmSetClientCap(fd, DRM_CLIENT_CAP_ATOMIC, 1);
+		if (ret != 0) {
+			drmSetClientCap(fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 0);
+			b->atomic_modeset = 0;
+		}
+	}
+#else
+	b->atomic_modeset = 0;
+#endif
+	weston_log("atomic modesetting: %s\n",
+		   b->atomic_modeset ? "yes" : "no");
+
 	return 0;
 }
 
@@ -2373,6 +3173,11 @@ create_output_for_connector(struct drm_backend *b,
 	output->original_crtc = drmModeGetCrtc(b->drm.fd, output->crtc_id);
 	output->dpms_prop = drm_get_prop(b->drm.fd, connector, "DPMS");
 
+#ifdef HAVE_DRM_ATOMIC
+	if (b->atomic_modeset && drm_output_init_planes(b, output) < 0)
+		goto err_free;
+#endif
+
 	if (connector_get_current_mode(connector, b->drm.fd, &crtc_mode) < 0)
 		goto err_free;
 
@@ -2487,6 +3292,7 @@ create_sprites(struct drm_backend *b)
 	struct drm_sprite *sprite;
 	drmModePlaneRes *plane_res;
 	drmModePlane *plane;
+	uint32_t props[PLANE__COUNT] = { 0 };
 	uint32_t i;
 
 	plane_res = drmModeGetPlaneResources(b->drm.fd);
@@ -2501,6 +3307,16 @@ create_sprites(struct drm_backend *b)
 		if (!plane)
 			continue;
 
+#ifdef HAVE_DRM_ATOMIC
+		/* Primary and cursor planes belong to the outputs */
+		if (b->atomic_modeset &&
+		    drm_plane_get_type(b->drm.fd, plane->plane_id, props) !=
+		    DRM_PLANE_TYPE_OVERLAY) {
+			drmModeFreePlane(plane);
+			continue;
+		}
+#endif
+
 		sprite = zalloc(sizeof(*sprite) + ((sizeof(uint32_t)) *
 						   plane->count_formats));
 		if (!sprite) {
@@ -2518,6 +3334,7 @@ create_sprites(struct drm_backend *b)
 		sprite->count_formats = plane->count_formats;
 		memcpy(sprite->formats, plane->formats,
 		       plane->count_formats * sizeof(plane->formats[0]));
+		memcpy(sprite->props, props, sizeof props);
 		drmModeFreePlane(plane);
 		weston_plane_init(&sprite->plane, b->compositor, 0, 0);
 		weston_compositor_stack_plane(b->compositor, &sprite->plane,
@@ -3091,7 +3908,8 @@ drm_backend_create(struct weston_compositor *compositor,
 	 * to a fraction. For cursors, it's not so bad, so they are
 	 * enabled.
 	 *
-	 * These can be enabled again when nuclear/atomic support lands.
+	 * They are enabled again below when atomic modesetting is
+	 * available.
 	 */
 	b->sprites_are_broken = 1;
 	b->compositor = compositor;
@@ -3102,6 +3920,9 @@ drm_backend_create(struct weston_compositor *compositor,
 					&b->gbm_format) == -1)
 		goto err_base;
 
+	weston_config_section_get_bool(section, "atomic-modeset",
+				       &b->atomic_modeset, 1);
+
 	b->use_pixman = param->use_pixman;
 
 	/* Check if we run drm-backend using weston-launch */
@@ -3134,6 +3955,10 @@ drm_backend_create(struct weston_compositor *compositor,
 		goto err_udev_dev;
 	}
 
+	/* Atomic commits flip all planes of an output at once */
+	if (b->atomic_modeset)
+		b->sprites_are_broken = 0;
+
 	if (b->use_pixman) {
 		if (init_pixman(b) < 0) {
 			weston_log("failed to initialize pixman renderer\n");
@@ -32,6 +32,7 @@
 #include <stdbool.h>
 
 #include "shared/helpers.h"
+#include "shared/timespec-util.h"
 #include "compositor.h"
 #include "pixman-renderer.h"
 #include "presentation-time-server-protocol.h"
@@ -47,6 +48,8 @@ struct headless_output {
 	struct weston_output base;
 	struct weston_mode mode;
 	struct wl_event_source *finish_frame_timer;
+	struct wl_event_source *finish_frame_idle;
+	struct timespec frame_stamp;
 	uint32_t *image_buf;
 	pixman_image_t *image;
 };
@@ -56,42 +59,101 @@ struct headless_parameters {
 	int height;
 	int use_pixman;
 	uint32_t transform;
+	uint32_t refresh;
 };
 
 static void
-headless_output_start_repaint_loop(struct weston_output *output)
+headless_output_start_repaint_loop(struct weston_output *output_base)
 {
+	struct headless_output *output = (struct headless_output *) output_base;
 	struct timespec ts;
 
-	weston_compositor_read_presentation_clock(output->compositor, &ts);
-	weston_output_finish_frame(output, &ts, WP_PRESENTATION_FEEDBACK_INVALID);
+	/* Restart the emulated vblanks from now */
+	weston_compositor_read_presentation_clock(output->base.compositor, &ts);
+	output->frame_stamp = ts;
+
+	weston_output_finish_frame(&output->base, &ts,
+				   WP_PRESENTATION_FEEDBACK_INVALID);
 }
 
 static int
 finish_frame_handler(void *data)
 {
 	struct headless_output *output = data;
-	struct timespec ts;
 
-	weston_compositor_read_presentation_clock(output->base.compositor, &ts);
-	weston_output_finish_frame(&output->base, &ts, 0);
+	weston_output_finish_frame(&output->base, &output->frame_stamp, 0);
 
 	return 1;
 }
 
+static void
+finish_frame_idle_handler(void *data)
+{
+	struct headless_output *output = data;
+
+	output->finish_frame_idle = NULL;
+	finish_frame_handler(output);
+}
+
+/* Present the frame on the first emulated vblank after now. Vblanks
+ * come every refresh period, counted from the last one presented. */
+static void
+headless_output_schedule_vblank(struct headless_output *output)
+{
+	struct timespec now;
+	struct timespec gone;
+	int64_t refresh_nsec;
+	int64_t delay_nsec;
+	int64_t vblanks;
+
+	refresh_nsec = millihz_to_nsec(output->mode.refresh);
+
+	weston_compositor_read_presentation_clock(output->base.compositor,
+						  &now);
+	timespec_sub(&gone, &now, &output->frame_stamp);
+	vblanks = timespec_to_nsec(&gone) / refresh_nsec + 1;
+	if (vblanks < 1)
+		vblanks = 1;
+
+	timespec_add_nsec(&output->frame_stamp, &output->frame_stamp,
+			  vblanks * refresh_nsec);
+	output->base.msc += vblanks;
+
+	timespec_sub(&gone, &output->frame_stamp, &now);
+	delay_nsec = timespec_to_nsec(&gone);
+
+	/* Round up, a zero delay would disarm the timer */
+	wl_event_source_timer_update(output->finish_frame_timer,
+				     (delay_nsec + 999999) / 1000000);
+}
+
 static int
 headless_output_repaint(struct weston_output *output_base,
 		       pixman_region32_t *damage)
 {
 	struct headless_output *output = (struct headless_output *) output_base;
 	struct weston_compositor *ec = output->base.compositor;
+	struct wl_event_loop *loop;
 
 	ec->renderer->repaint_output(&output->base, damage);
 
 	pixman_region32_subtract(&ec->primary_plane.damage,
 				 &ec->primary_plane.damage, damage);
 
-	wl_event_source_timer_update(output->finish_frame_timer, 16);
+	if (output->mode.refresh > 0) {
+		headless_output_schedule_vblank(output);
+		return 0;
+	}
+
+	/* Without a refresh rate, the frame is presented as soon as the
+	 * renderer is done with it. Finish it from an idle callback so
+	 * the next repaint does not start from inside this one. */
+	weston_compositor_read_presentation_clock(ec, &output->frame_stamp);
+	output->base.msc++;
+
+	loop = wl_display_get_event_loop(ec->wl_display);
+	output->finish_frame_idle =
+		wl_event_loop_add_idle(loop, finish_frame_idle_handler, output);
 
 	return 0;
 }
@@ -104,6 +166,8 @@ headless_output_destroy(struct weston_output *output_base)
 			(struct headless_backend *) output->base.compositor->backend;
 
 	wl_event_source_remove(output->finish_frame_timer);
+	if (output->finish_frame_idle)
+		wl_event_source_remove(output->finish_frame_idle);
 
 	if (b->use_pixman) {
 		pixman_renderer_output_destroy(&output->base);
@@ -134,7 +198,7 @@ headless_backend_create_output(struct headless_backend *b,
 		WL_OUTPUT_MODE_CURRENT | WL_OUTPUT_MODE_PREFERRED;
 	output->mode.width = param->width;
 	output->mode.height = param->height;
-	output->mode.refresh = 60000;
+	output->mode.refresh = param->refresh;
 	wl_list_init(&output->base.mode_list);
 	wl_list_insert(&output->base.mode_list, &output->mode.link);
 
@@ -264,6 +328,7 @@ backend_init(struct weston_compositor *compositor,
 	     struct weston_backend_config *config_base)
 {
 	int width = 1024, height = 640;
+	int refresh = 60000;
 	char *display_name = NULL;
 	struct headless_parameters param = { 0, };
 	const char *transform = "normal";
@@ -274,6 +339,7 @@ backend_init(struct weston_compositor *compositor,
 		{ WESTON_OPTION_INTEGER, "height", 0, &height },
 		{ WESTON_OPTION_BOOLEAN, "use-pixman", 0, &param.use_pixman },
 		{ WESTON_OPTION_STRING, "transform", 0, &transform },
+		{ WESTON_OPTION_INTEGER, "refresh", 0, &refresh },
 	};
 
 	parse_options(headless_options,
@@ -282,6 +348,12 @@ backend_init(struct weston_compositor *compositor,
 	param.width = width;
 	param.height = height;
 
+	if (refresh < 0) {
+		weston_log("Invalid refresh rate %d mHz\n", refresh);
+		refresh = 60000;
+	}
+	param.refresh = refresh;
+
 	if (weston_parse_transform(transform, &param.transform) < 0)
 		weston_log("Invalid transform \"%s\"\n", transform);
 
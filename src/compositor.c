@@ -63,6 +63,15 @@
 #include "version.h"
 
 #define DEFAULT_REPAINT_WINDOW 7 /* milliseconds */
+#define DEFAULT_REPAINT_MARGIN 2000 /* microseconds */
+
+/* The adaptive repaint window covers this percentile of the recent
+ * repaint durations. After a missed vblank it stays at the maximum for
+ * REPAINT_WINDOW_HOLD frames, and it shrinks by at most
+ * REPAINT_WINDOW_SHRINK microseconds per frame. */
+#define REPAINT_WINDOW_PERCENTILE 95
+#define REPAINT_WINDOW_HOLD 120
+#define REPAINT_WINDOW_SHRINK 100
 
 static void
 weston_output_transform_scale_init(struct weston_output *output,
@@ -71,6 +80,9 @@ weston_output_transform_scale_init(struct weston_output *output,
 static void
 weston_compositor_build_view_list(struct weston_compositor *compositor);
 
+static void
+view_list_dirty(struct weston_compositor *compositor);
+
 static void weston_mode_switch_finish(struct weston_output *output,
 				      int mode_changed,
 				      int scale_changed)
@@ -1126,6 +1138,10 @@ weston_surface_assign_output(struct weston_surface *es)
 	}
 	pixman_region32_fini(&region);
 
+	/* A sub-surface is only in view_list while mapped */
+	if ((es->output == NULL) != (new_output == NULL))
+		view_list_dirty(es->compositor);
+
 	es->output = new_output;
 	weston_surface_update_output_mask(es, mask);
 }
@@ -1334,6 +1350,239 @@ weston_view_update_transform_enable(struct weston_view *view)
 	return 0;
 }
 
+/* The pick index is a grid over the bounding boxes of all views in
+ * view_list, at most this many cells wide and high. */
+#define PICK_INDEX_MAX_CELLS 32
+#define PICK_INDEX_MIN_CELL_SIZE 64
+
+static bool
+pick_index_has_view(struct weston_compositor *compositor,
+		    struct weston_view *view)
+{
+	return compositor->pick_index.valid &&
+	       view->pick.generation == compositor->pick_index.generation;
+}
+
+static void
+pick_index_invalidate(struct weston_compositor *compositor)
+{
+	compositor->pick_index.valid = false;
+}
+
+static void
+pick_index_release(struct weston_compositor *compositor)
+{
+	int i;
+
+	for (i = 0; i < compositor->pick_index.width *
+			compositor->pick_index.height; i++)
+		wl_array_release(&compositor->pick_index.cells[i]);
+
+	free(compositor->pick_index.cells);
+	compositor->pick_index.cells = NULL;
+	compositor->pick_index.width = 0;
+	compositor->pick_index.height = 0;
+	compositor->pick_index.valid = false;
+}
+
+static struct wl_array *
+pick_index_cell(struct weston_compositor *compositor, int cx, int cy)
+{
+	return &compositor->pick_index.cells[cy * compositor->pick_index.width +
+					     cx];
+}
+
+static void
+pick_index_remove_view(struct weston_compositor *compositor,
+		       struct weston_view *view)
+{
+	struct weston_view **views;
+	struct wl_array *cell;
+	size_t i, n;
+	int cx, cy;
+
+	for (cy = view->pick.cells.y1; cy < view->pick.cells.y2; cy++) {
+		for (cx = view->pick.cells.x1; cx < view->pick.cells.x2; cx++) {
+			cell = pick_index_cell(compositor, cx, cy);
+			views = cell->data;
+			n = cell->size / sizeof *views;
+
+			for (i = 0; i < n && views[i] != view; i++)
+				;
+			if (i == n)
+				continue;
+
+			memmove(&views[i], &views[i + 1],
+				(n - i - 1) * sizeof *views);
+			cell->size -= sizeof *views;
+		}
+	}
+
+	view->pick.cells.x1 = view->pick.cells.x2 = 0;
+	view->pick.cells.y1 = view->pick.cells.y2 = 0;
+}
+
+/* Insert the view into every cell its bounding box overlaps, keeping the
+ * cells in view_list order. Returns false if the bounding box is not
+ * inside the grid or memory ran out, the index must be rebuilt then. */
+static bool
+pick_index_add_view(struct weston_compositor *compositor,
+		    struct weston_view *view)
+{
+	int64_t grid_x2, grid_y2;
+	struct weston_view **views;
+	struct wl_array *cell;
+	pixman_box32_t *box;
+	size_t i;
+	int cell_size = compositor->pick_index.cell_size;
+	int cx, cy;
+
+	view->pick.cells.x1 = view->pick.cells.x2 = 0;
+	view->pick.cells.y1 = view->pick.cells.y2 = 0;
+
+	if (!pixman_region32_not_empty(&view->transform.boundingbox))
+		return true;
+
+	box = pixman_region32_extents(&view->transform.boundingbox);
+	grid_x2 = compositor->pick_index.x +
+		  (int64_t) compositor->pick_index.width * cell_size;
+	grid_y2 = compositor->pick_index.y +
+		  (int64_t) compositor->pick_index.height * cell_size;
+	if (box->x1 < compositor->pick_index.x ||
+	    box->y1 < compositor->pick_index.y ||
+	    box->x2 > grid_x2 || box->y2 > grid_y2)
+		return false;
+
+	for (cy = ((int64_t) box->y1 - compositor->pick_index.y) / cell_size;
+	     cy <= ((int64_t) box->y2 - 1 - compositor->pick_index.y) / cell_size;
+	     cy++) {
+		for (cx = ((int64_t) box->x1 - compositor->pick_index.x) / cell_size;
+		     cx <= ((int64_t) box->x2 - 1 - compositor->pick_index.x) / cell_size;
+		     cx++) {
+			cell = pick_index_cell(compositor, cx, cy);
+			if (!wl_array_add(cell, sizeof *views))
+				return false;
+
+			views = cell->data;
+			i = cell->size / sizeof *views - 1;
+			while (i > 0 && views[i - 1]->pick.order > view->pick.order) {
+				views[i] = views[i - 1];
+				i--;
+			}
+			views[i] = view;
+
+			if (view->pick.cells.x2 == 0) {
+				view->pick.cells.x1 = cx;
+				view->pick.cells.y1 = cy;
+			}
+			view->pick.cells.x2 = cx + 1;
+			view->pick.cells.y2 = cy + 1;
+		}
+	}
+
+	return true;
+}
+
+static void
+pick_index_rebuild(struct weston_compositor *compositor)
+{
+	struct weston_view *view;
+	pixman_box32_t extents = { 0, 0, 0, 0 };
+	pixman_box32_t *box;
+	int64_t width, height, cell_size;
+	int order = 0;
+
+	pick_index_release(compositor);
+	compositor->pick_index.generation++;
+
+	wl_list_for_each(view, &compositor->view_list, link) {
+		view->pick.generation = compositor->pick_index.generation;
+		view->pick.order = order++;
+
+		if (!pixman_region32_not_empty(&view->transform.boundingbox))
+			continue;
+
+		box = pixman_region32_extents(&view->transform.boundingbox);
+		if (extents.x1 == extents.x2) {
+			extents = *box;
+			continue;
+		}
+		extents.x1 = MIN(extents.x1, box->x1);
+		extents.y1 = MIN(extents.y1, box->y1);
+		extents.x2 = MAX(extents.x2, box->x2);
+		extents.y2 = MAX(extents.y2, box->y2);
+	}
+	compositor->pick_index.n_views = order;
+
+	width = (int64_t) extents.x2 - extents.x1;
+	height = (int64_t) extents.y2 - extents.y1;
+	cell_size = MAX(PICK_INDEX_MIN_CELL_SIZE,
+			(MAX(width, height) + PICK_INDEX_MAX_CELLS - 1) /
+			PICK_INDEX_MAX_CELLS);
+
+	compositor->pick_index.x = extents.x1;
+	compositor->pick_index.y = extents.y1;
+	compositor->pick_index.cell_size = cell_size;
+
+	if (width > 0) {
+		width = (width + cell_size - 1) / cell_size;
+		height = (height + cell_size - 1) / cell_size;
+
+		compositor->pick_index.cells =
+			zalloc(width * height *
+			       sizeof *compositor->pick_index.cells);
+		if (!compositor->pick_index.cells)
+			return;
+
+		compositor->pick_index.width = width;
+		compositor->pick_index.height = height;
+	}
+
+	compositor->pick_index.valid = true;
+
+	wl_list_for_each(view, &compositor->view_list, link) {
+		if (!pick_index_add_view(compositor, view)) {
+			pick_index_invalidate(compositor);
+			return;
+		}
+	}
+}
+
+/* Keep the index if rebuilding view_list gave the same order again. */
+static void
+pick_index_check_order(struct weston_compositor *compositor)
+{
+	struct weston_view *view;
+	int order = 0;
+
+	if (!compositor->pick_index.valid)
+		return;
+
+	wl_list_for_each(view, &compositor->view_list, link) {
+		if (!pick_index_has_view(compositor, view) ||
+		    view->pick.order != order) {
+			pick_index_invalidate(compositor);
+			return;
+		}
+		order++;
+	}
+
+	if (order != compositor->pick_index.n_views)
+		pick_index_invalidate(compositor);
+}
+
+static void
+pick_index_update_view(struct weston_compositor *compositor,
+		       struct weston_view *view)
+{
+	if (!pick_index_has_view(compositor, view))
+		return;
+
+	pick_index_remove_view(compositor, view);
+	if (!pick_index_add_view(compositor, view))
+		pick_index_invalidate(compositor);
+}
+
 static struct weston_layer *
 get_view_layer(struct weston_view *view)
 {
@@ -1398,6 +1647,8 @@ weston_view_update_transform(struct weston_view *view)
 
 	weston_view_assign_output(view);
 
+	pick_index_update_view(view->surface->compositor, view);
+
 	wl_signal_emit(&view->surface->compositor->transform_signal,
 		       view->surface);
 }
@@ -1790,40 +2041,72 @@ weston_compositor_get_time(void)
        return tv.tv_sec * 1000 + tv.tv_usec / 1000;
 }
 
-WL_EXPORT struct weston_view *
-weston_compositor_pick_view(struct weston_compositor *compositor,
-			    wl_fixed_t x, wl_fixed_t y,
-			    wl_fixed_t *vx, wl_fixed_t *vy)
+static bool
+view_accepts_input_at(struct weston_view *view,
+		      wl_fixed_t x, wl_fixed_t y,
+		      wl_fixed_t *vx, wl_fixed_t *vy)
 {
-	struct weston_view *view;
 	wl_fixed_t view_x, view_y;
 	int view_ix, view_iy;
 	int ix = wl_fixed_to_int(x);
 	int iy = wl_fixed_to_int(y);
 
-	wl_list_for_each(view, &compositor->view_list, link) {
-		if (!pixman_region32_contains_point(
-				&view->transform.boundingbox, ix, iy, NULL))
-			continue;
+	if (!pixman_region32_contains_point(
+			&view->transform.boundingbox, ix, iy, NULL))
+		return false;
 
-		weston_view_from_global_fixed(view, x, y, &view_x, &view_y);
-		view_ix = wl_fixed_to_int(view_x);
-		view_iy = wl_fixed_to_int(view_y);
+	weston_view_from_global_fixed(view, x, y, &view_x, &view_y);
+	view_ix = wl_fixed_to_int(view_x);
+	view_iy = wl_fixed_to_int(view_y);
 
-		if (!pixman_region32_contains_point(&view->surface->input,
-						    view_ix, view_iy, NULL))
-			continue;
+	if (!pixman_region32_contains_point(&view->surface->input,
+					    view_ix, view_iy, NULL))
+		return false;
 
-		if (view->geometry.scissor_enabled &&
-		    !pixman_region32_contains_point(&view->geometry.scissor,
-						    view_ix, view_iy, NULL))
-			continue;
+	if (view->geometry.scissor_enabled &&
+	    !pixman_region32_contains_point(&view->geometry.scissor,
+					    view_ix, view_iy, NULL))
+		return false;
 
-		*vx = view_x;
-		*vy = view_y;
-		return view;
+	*vx = view_x;
+	*vy = view_y;
+	return true;
+}
+
+WL_EXPORT struct weston_view *
+weston_compositor_pick_view(struct weston_compositor *compositor,
+			    wl_fixed_t x, wl_fixed_t y,
+			    wl_fixed_t *vx, wl_fixed_t *vy)
+{
+	struct weston_view *view, **viewp;
+	int64_t cx, cy;
+
+	if (!compositor->pick_index.valid)
+		pick_index_rebuild(compositor);
+
+	if (!compositor->pick_index.valid) {
+		wl_list_for_each(view, &compositor->view_list, link)
+			if (view_accepts_input_at(view, x, y, vx, vy))
+				return view;
+		goto out;
 	}
 
+	cx = ((int64_t) wl_fixed_to_int(x) - compositor->pick_index.x);
+	cy = ((int64_t) wl_fixed_to_int(y) - compositor->pick_index.y);
+	if (cx < 0 || cy < 0)
+		goto out;
+
+	cx /= compositor->pick_index.cell_size;
+	cy /= compositor->pick_index.cell_size;
+	if (cx >= compositor->pick_index.width ||
+	    cy >= compositor->pick_index.height)
+		goto out;
+
+	wl_array_for_each(viewp, pick_index_cell(compositor, cx, cy))
+		if (view_accepts_input_at(*viewp, x, y, vx, vy))
+			return *viewp;
+
+out:
 	*vx = wl_fixed_from_int(-1000000);
 	*vy = wl_fixed_from_int(-1000000);
 	return NULL;
@@ -1855,6 +2138,8 @@ weston_view_unmap(struct weston_view *view)
 	weston_layer_entry_remove(&view->layer_link);
 	wl_list_remove(&view->link);
 	wl_list_init(&view->link);
+	pick_index_invalidate(view->surface->compositor);
+	view_list_dirty(view->surface->compositor);
 	view->output_mask = 0;
 	weston_surface_assign_output(view->surface);
 
@@ -1883,6 +2168,8 @@ weston_surface_unmap(struct weston_surface *surface)
 
 	wl_list_for_each(view, &surface->views, surface_link)
 		weston_view_unmap(view);
+	if (surface->output)
+		view_list_dirty(surface->compositor);
 	surface->output = NULL;
 }
 
@@ -1908,8 +2195,12 @@ weston_view_destroy(struct weston_view *view)
 		weston_compositor_build_view_list(view->surface->compositor);
 	}
 
+	if (!wl_list_empty(&view->link))
+		view_list_dirty(view->surface->compositor);
 	wl_list_remove(&view->link);
 	weston_layer_entry_remove(&view->layer_link);
+	if (pick_index_has_view(view->surface->compositor, view))
+		pick_index_invalidate(view->surface->compositor);
 
 	pixman_region32_fini(&view->clip);
 	pixman_region32_fini(&view->geometry.scissor);
@@ -2081,6 +2372,57 @@ weston_output_damage(struct weston_output *output)
 	weston_output_schedule_repaint(output);
 }
 
+/** Read back a rectangle of the output, finishing later
+ *
+ * \param output The output to read from.
+ * \param format Pixel format, as for weston_renderer::read_pixels.
+ * \param x X of the rectangle in framebuffer coordinates.
+ * \param y Y of the rectangle in framebuffer coordinates.
+ * \param width Width of the rectangle in pixels.
+ * \param height Height of the rectangle in pixels.
+ * \param done Called once with the pixels.
+ * \param data User data for done.
+ * \return 0 for success, -1 for failure.
+ *
+ * Like weston_renderer::read_pixels, but the renderer may keep the copy
+ * in flight for a frame or two instead of stalling on it. Call it from
+ * the output's frame_signal. The pixels passed to done are laid out as
+ * read_pixels would write them, with a stride of width * 4, and are only
+ * valid during the call. They are NULL if the read back failed.
+ *
+ * Read backs on one output finish in the order they were started. If
+ * the renderer cannot do this asynchronously, done is called before
+ * this function returns. done is not called when -1 is returned.
+ */
+WL_EXPORT int
+weston_output_read_pixels_async(struct weston_output *output,
+				pixman_format_code_t format,
+				uint32_t x, uint32_t y,
+				uint32_t width, uint32_t height,
+				weston_read_pixels_done_func_t done,
+				void *data)
+{
+	struct weston_renderer *renderer = output->compositor->renderer;
+	void *pixels;
+	int ret;
+
+	if (renderer->read_pixels_async &&
+	    renderer->read_pixels_async(output, format, x, y, width, height,
+					done, data) == 0)
+		return 0;
+
+	pixels = malloc(width * height * 4);
+	if (pixels == NULL)
+		return -1;
+
+	ret = renderer->read_pixels(output, format, pixels,
+				    x, y, width, height);
+	done(data, ret < 0 ? NULL : pixels);
+	free(pixels);
+
+	return 0;
+}
+
 static void
 surface_flush_damage(struct weston_surface *surface)
 {
@@ -2124,9 +2466,24 @@ view_accumulate_damage(struct weston_view *view,
 	pixman_region32_union(opaque, opaque, &view->transform.opaque);
 }
 
+/* Surfaces on no output at all are flushed with every output, so their
+ * buffers still get released early. */
+static bool
+surface_repaints_with_output(struct weston_surface *surface,
+			     struct weston_output *output)
+{
+	return surface->output_mask == 0 ||
+	       (surface->output_mask & (1u << output->id));
+}
+
+/* Only views whose surface is on the output being repainted take part.
+ * Damage stays in the surface until an output showing it repaints, and
+ * flushing a surface accumulates the damage of all its views, so views
+ * shown on several outputs do not lose damage for the others. */
 static void
-compositor_accumulate_damage(struct weston_compositor *ec)
+output_accumulate_damage(struct weston_output *output)
 {
+	struct weston_compositor *ec = output->compositor;
 	struct weston_plane *plane;
 	struct weston_view *ev;
 	pixman_region32_t opaque, clip;
@@ -2139,7 +2496,8 @@ compositor_accumulate_damage(struct weston_compositor *ec)
 		pixman_region32_init(&opaque);
 
 		wl_list_for_each(ev, &ec->view_list, link) {
-			if (ev->plane != plane)
+			if (ev->plane != plane ||
+			    !surface_repaints_with_output(ev->surface, output))
 				continue;
 
 			view_accumulate_damage(ev, &opaque);
@@ -2155,7 +2513,8 @@ compositor_accumulate_damage(struct weston_compositor *ec)
 		ev->surface->touched = false;
 
 	wl_list_for_each(ev, &ec->view_list, link) {
-		if (ev->surface->touched)
+		if (ev->surface->touched ||
+		    !surface_repaints_with_output(ev->surface, output))
 			continue;
 		ev->surface->touched = true;
 
@@ -2276,12 +2635,69 @@ view_list_add(struct weston_compositor *compositor,
 	}
 }
 
+static void
+view_list_dirty(struct weston_compositor *compositor)
+{
+	compositor->view_list_dirty = true;
+}
+
+/* Shells link and unlink layers directly, so compare the layer list
+ * against the one view_list was last built from. */
+static bool
+view_list_layers_changed(struct weston_compositor *compositor)
+{
+	struct weston_layer *layer, **layers;
+	size_t i = 0, n;
+
+	layers = compositor->view_list_layers.data;
+	n = compositor->view_list_layers.size / sizeof *layers;
+
+	wl_list_for_each(layer, &compositor->layer_list, link) {
+		if (i >= n || layers[i] != layer)
+			return true;
+		i++;
+	}
+
+	return i != n;
+}
+
+static void
+view_list_save_layers(struct weston_compositor *compositor)
+{
+	struct weston_layer *layer, **p;
+
+	compositor->view_list_layers.size = 0;
+	wl_list_for_each(layer, &compositor->layer_list, link) {
+		p = wl_array_add(&compositor->view_list_layers, sizeof *p);
+		if (!p) {
+			/* An incomplete copy never compares equal */
+			view_list_dirty(compositor);
+			return;
+		}
+		*p = layer;
+	}
+}
+
 static void
 weston_compositor_build_view_list(struct weston_compositor *compositor)
 {
 	struct weston_view *view;
 	struct weston_layer *layer;
 
+	if (!compositor->view_list_dirty &&
+	    !view_list_layers_changed(compositor)) {
+		/* Same views in the same order, only the transforms
+		 * may need updating. */
+		wl_list_for_each(view, &compositor->view_list, link)
+			weston_view_update_transform(view);
+		return;
+	}
+
+	/* Cleared before building, so that changes made while building
+	 * (e.g. a sub-surface getting mapped by an output assignment)
+	 * are picked up by the next build, as they always were. */
+	compositor->view_list_dirty = false;
+
 	wl_list_for_each(layer, &compositor->layer_list, link)
 		wl_list_for_each(view, &layer->view_list.link, layer_link.link)
 			surface_stash_subsurface_views(view->surface);
@@ -2296,6 +2712,9 @@ weston_compositor_build_view_list(struct weston_compositor *compositor)
 	wl_list_for_each(layer, &compositor->layer_list, link)
 		wl_list_for_each(view, &layer->view_list.link, layer_link.link)
 			surface_free_unused_subsurface_views(view->surface);
+
+	view_list_save_layers(compositor);
+	pick_index_check_order(compositor);
 }
 
 static void
@@ -2323,6 +2742,114 @@ weston_output_take_feedback_list(struct weston_output *output,
 	wl_list_init(&surface->feedback_list);
 }
 
+static void
+output_add_repaint_sample(struct weston_output *output, bool posted)
+{
+	struct timespec now, duration;
+	int64_t usec;
+
+	if (!posted) {
+		memset(&output->repaint_window.repaint_start, 0,
+		       sizeof output->repaint_window.repaint_start);
+		return;
+	}
+
+	weston_compositor_read_presentation_clock(output->compositor, &now);
+	timespec_sub(&duration, &now, &output->repaint_window.repaint_start);
+	usec = timespec_to_nsec(&duration) / 1000;
+	if (usec < 0)
+		usec = 0;
+
+	output->repaint_window.samples[output->repaint_window.next_sample] =
+		usec > UINT32_MAX ? UINT32_MAX : usec;
+	output->repaint_window.next_sample =
+		(output->repaint_window.next_sample + 1) %
+		WESTON_REPAINT_WINDOW_SAMPLES;
+	if (output->repaint_window.n_samples < WESTON_REPAINT_WINDOW_SAMPLES)
+		output->repaint_window.n_samples++;
+}
+
+static uint32_t
+output_repaint_duration_percentile(struct weston_output *output)
+{
+	uint32_t sorted[WESTON_REPAINT_WINDOW_SAMPLES], v;
+	int n = output->repaint_window.n_samples;
+	int i, j;
+
+	if (n == 0)
+		return 0;
+
+	for (i = 0; i < n; i++) {
+		v = output->repaint_window.samples[i];
+		for (j = i; j > 0 && sorted[j - 1] > v; j--)
+			sorted[j] = sorted[j - 1];
+		sorted[j] = v;
+	}
+
+	return sorted[(n * REPAINT_WINDOW_PERCENTILE + 99) / 100 - 1];
+}
+
+/** Move the repaint window of output after a frame was presented
+ *
+ * The window is how long before the next vblank the repaint starts.
+ * It is kept as short as the recent repaints allow, plus a margin, to
+ * cut the latency from client commits to the screen. A repaint that
+ * missed its vblank puts it back to the configured maximum for a
+ * while; from there it shrinks gradually.
+ */
+static void
+output_update_repaint_window(struct weston_output *output,
+			     const struct timespec *stamp,
+			     int32_t refresh_nsec)
+{
+	struct weston_compositor *ec = output->compositor;
+	int32_t max_usec = ec->repaint_msec * 1000;
+	int32_t target;
+	struct timespec latency;
+
+	if (timespec_is_zero(&output->repaint_window.repaint_start))
+		return;
+
+	timespec_sub(&latency, stamp, &output->repaint_window.repaint_start);
+	memset(&output->repaint_window.repaint_start, 0,
+	       sizeof output->repaint_window.repaint_start);
+
+	if (output->repaint_window.window_usec == 0)
+		output->repaint_window.window_usec = max_usec;
+
+	if (refresh_nsec > 0 && timespec_to_nsec(&latency) >= refresh_nsec) {
+		output->repaint_window.window_usec = max_usec;
+		output->repaint_window.hold = REPAINT_WINDOW_HOLD;
+		return;
+	}
+
+	if (output->repaint_window.hold > 0) {
+		output->repaint_window.hold--;
+		return;
+	}
+
+	target = output_repaint_duration_percentile(output) +
+		 ec->repaint_margin_usec;
+	if (target > max_usec)
+		target = max_usec;
+
+	if (target < output->repaint_window.window_usec -
+		     REPAINT_WINDOW_SHRINK)
+		target = output->repaint_window.window_usec -
+			 REPAINT_WINDOW_SHRINK;
+
+	output->repaint_window.window_usec = target;
+}
+
+static bool
+output_repaint_window_is_adaptive(struct weston_output *output)
+{
+	struct weston_compositor *ec = output->compositor;
+
+	return ec->repaint_window_adaptive && ec->repaint_msec > 0 &&
+	       output->repaint_window.window_usec != 0;
+}
+
 static int
 weston_output_repaint(struct weston_output *output)
 {
@@ -2332,6 +2859,7 @@ weston_output_repaint(struct weston_output *output)
 	struct weston_frame_callback *cb, *cnext;
 	struct wl_list frame_callback_list;
 	pixman_region32_t output_damage;
+	struct timespec now;
 	int r;
 
 	if (output->destroying)
@@ -2339,6 +2867,10 @@ weston_output_repaint(struct weston_output *output)
 
 	TL_POINT("core_repaint_begin", TLP_OUTPUT(output), TLP_END);
 
+	weston_compositor_read_presentation_clock(ec, &now);
+	weston_repaint_stats_repaint_begin(output, &now);
+	output->repaint_window.repaint_start = now;
+
 	/* Rebuild the surface list and update surface transforms up front. */
 	weston_compositor_build_view_list(ec);
 
@@ -2362,10 +2894,17 @@ weston_output_repaint(struct weston_output *output)
 			wl_list_init(&ev->surface->frame_callback_list);
 
 			weston_output_take_feedback_list(output, ev->surface);
+
+			if (!timespec_is_zero(&ev->surface->damage_commit_time)) {
+				weston_repaint_stats_commit_shown(output,
+					&ev->surface->damage_commit_time, &now);
+				memset(&ev->surface->damage_commit_time, 0,
+				       sizeof ev->surface->damage_commit_time);
+			}
 		}
 	}
 
-	compositor_accumulate_damage(ec);
+	output_accumulate_damage(output);
 
 	pixman_region32_init(&output_damage);
 	pixman_region32_intersect(&output_damage,
@@ -2382,9 +2921,6 @@ weston_output_repaint(struct weston_output *output)
 
 	output->repaint_needed = 0;
 
-	weston_compositor_repick(ec);
-	wl_event_loop_dispatch(ec->input_loop, 0);
-
 	wl_list_for_each_safe(cb, cnext, &frame_callback_list, link) {
 		wl_callback_send_done(cb->resource, output->frame_time);
 		wl_resource_destroy(cb->resource);
@@ -2395,6 +2931,9 @@ weston_output_repaint(struct weston_output *output)
 		animation->frame(animation, output, output->frame_time);
 	}
 
+	weston_repaint_stats_repaint_end(output, r == 0);
+	output_add_repaint_sample(output, r == 0);
+
 	TL_POINT("core_repaint_posted", TLP_OUTPUT(output), TLP_END);
 
 	return r;
@@ -2430,20 +2969,92 @@ weston_output_schedule_repaint_reset(struct weston_output *output)
 				     weston_compositor_read_input, compositor);
 }
 
-static int
-output_repaint_timer_handler(void *data)
+/* Returns whether a repaint was posted; if not, the repaint loop of
+ * the output stops. */
+static bool
+output_repaint_or_reset(struct weston_output *output)
 {
-	struct weston_output *output = data;
 	struct weston_compositor *compositor = output->compositor;
 
+	memset(&output->repaint_due, 0, sizeof output->repaint_due);
+
 	if (output->repaint_needed &&
 	    compositor->state != WESTON_COMPOSITOR_SLEEPING &&
 	    compositor->state != WESTON_COMPOSITOR_OFFSCREEN &&
 	    weston_output_repaint(output) == 0)
-		return 0;
+		return true;
 
 	weston_output_schedule_repaint_reset(output);
 
+	return false;
+}
+
+/** Repaint an output, and the outputs due soon after it
+ *
+ * With a repaint_group_usec window, outputs whose repaint timers would
+ * fire within the window are repainted in the same wakeup, earliest
+ * deadline first. They share one wakeup, and the repick and input
+ * dispatch that follow a repaint, instead of doing them one by one.
+ */
+static int
+output_repaint_timer_handler(void *data)
+{
+	struct weston_output *output = data;
+	struct weston_compositor *compositor = output->compositor;
+	struct weston_output *next, *other;
+	struct timespec limit, until;
+	uint32_t group = 0;
+	bool posted;
+
+	/* Picked before repainting anything, so that a frame finished
+	 * during this wakeup does not get repainted twice */
+	if (compositor->repaint_group_usec > 0) {
+		weston_compositor_read_presentation_clock(compositor, &limit);
+		timespec_add_nsec(&limit, &limit,
+				  compositor->repaint_group_usec * 1000LL);
+
+		wl_list_for_each(other, &compositor->output_list, link) {
+			if (other == output ||
+			    timespec_is_zero(&other->repaint_due))
+				continue;
+
+			timespec_sub(&until, &limit, &other->repaint_due);
+			if (timespec_to_nsec(&until) >= 0)
+				group |= 1u << other->id;
+		}
+	}
+
+	posted = output_repaint_or_reset(output);
+
+	while (group) {
+		next = NULL;
+		wl_list_for_each(other, &compositor->output_list, link) {
+			if (!(group & (1u << other->id)))
+				continue;
+
+			if (next) {
+				timespec_sub(&until, &other->repaint_due,
+					     &next->repaint_due);
+				if (timespec_to_nsec(&until) >= 0)
+					continue;
+			}
+			next = other;
+		}
+
+		if (!next)
+			break;
+
+		group &= ~(1u << next->id);
+		wl_event_source_timer_update(next->repaint_timer, 0);
+		if (output_repaint_or_reset(next))
+			posted = true;
+	}
+
+	if (posted) {
+		weston_compositor_repick(compositor);
+		wl_event_loop_dispatch(compositor->input_loop, 0);
+	}
+
 	return 0;
 }
 
@@ -2461,7 +3072,16 @@ weston_output_finish_frame(struct weston_output *output,
 	TL_POINT("core_repaint_finished", TLP_OUTPUT(output),
 		 TLP_VBLANK(stamp), TLP_END);
 
-	refresh_nsec = millihz_to_nsec(output->current_mode->refresh);
+	/* A zero refresh rate means the output is not paced by any
+	 * vblank, and the next repaint may start right away. */
+	if (output->current_mode->refresh > 0)
+		refresh_nsec = millihz_to_nsec(output->current_mode->refresh);
+	else
+		refresh_nsec = 0;
+
+	weston_repaint_stats_presented(output, stamp, refresh_nsec);
+	output_update_repaint_window(output, stamp, refresh_nsec);
+
 	weston_presentation_feedback_present_list(&output->feedback_list,
 						  output, refresh_nsec, stamp,
 						  output->msc,
@@ -2471,8 +3091,13 @@ weston_output_finish_frame(struct weston_output *output,
 
 	weston_compositor_read_presentation_clock(compositor, &now);
 	timespec_sub(&gone, &now, stamp);
-	msec = (refresh_nsec - timespec_to_nsec(&gone)) / 1000000; /* floor */
-	msec -= compositor->repaint_msec;
+	if (output_repaint_window_is_adaptive(output)) {
+		msec = (refresh_nsec - timespec_to_nsec(&gone) -
+			output->repaint_window.window_usec * 1000LL) / 1000000;
+	} else {
+		msec = (refresh_nsec - timespec_to_nsec(&gone)) / 1000000; /* floor */
+		msec -= compositor->repaint_msec;
+	}
 
 	if (msec < -1000 || msec > 1000) {
 		static bool warned;
@@ -2492,10 +3117,13 @@ weston_output_finish_frame(struct weston_output *output,
 	if (presented_flags == WP_PRESENTATION_FEEDBACK_INVALID && msec < 0)
 		msec += refresh_nsec / 1000000;
 
-	if (msec < 1)
+	if (msec < 1) {
 		output_repaint_timer_handler(output);
-	else
+	} else {
+		timespec_add_nsec(&output->repaint_due, &now,
+				  msec * 1000000LL);
 		wl_event_source_timer_update(output->repaint_timer, msec);
+	}
 }
 
 static void
@@ -2510,13 +3138,22 @@ WL_EXPORT void
 weston_layer_entry_insert(struct weston_layer_entry *list,
 			  struct weston_layer_entry *entry)
 {
+	struct weston_view *view =
+		container_of(entry, struct weston_view, layer_link);
+
 	wl_list_insert(&list->link, &entry->link);
 	entry->layer = list->layer;
+	view_list_dirty(view->surface->compositor);
 }
 
 WL_EXPORT void
 weston_layer_entry_remove(struct weston_layer_entry *entry)
 {
+	struct weston_view *view =
+		container_of(entry, struct weston_view, layer_link);
+
+	if (entry->layer)
+		view_list_dirty(view->surface->compositor);
 	wl_list_remove(&entry->link);
 	wl_list_init(&entry->link);
 	entry->layer = NULL;
@@ -2725,11 +3362,37 @@ surface_set_input_region(struct wl_client *client,
 	}
 }
 
+static bool
+weston_surface_subsurface_order_changed(struct weston_surface *surface)
+{
+	struct wl_list *cur = surface->subsurface_list.next;
+	struct wl_list *pending = surface->subsurface_list_pending.next;
+
+	while (cur != &surface->subsurface_list &&
+	       pending != &surface->subsurface_list_pending) {
+		if (container_of(cur, struct weston_subsurface, parent_link) !=
+		    container_of(pending, struct weston_subsurface,
+				 parent_link_pending))
+			return true;
+
+		cur = cur->next;
+		pending = pending->next;
+	}
+
+	return cur != &surface->subsurface_list ||
+	       pending != &surface->subsurface_list_pending;
+}
+
 static void
 weston_surface_commit_subsurface_order(struct weston_surface *surface)
 {
 	struct weston_subsurface *sub;
 
+	if (!weston_surface_subsurface_order_changed(surface))
+		return;
+
+	view_list_dirty(surface->compositor);
+
 	wl_list_for_each_reverse(sub, &surface->subsurface_list_pending,
 				 parent_link_pending) {
 		wl_list_remove(&sub->parent_link);
@@ -2881,11 +3544,17 @@ weston_surface_commit_state(struct weston_surface *surface,
 	state->buffer_viewport.changed = 0;
 
 	/* wl_surface.damage and wl_surface.damage_buffer */
-	if (weston_timeline_enabled_ &&
-	    (pixman_region32_not_empty(&state->damage_surface) ||
-	     pixman_region32_not_empty(&state->damage_buffer)))
+	if (pixman_region32_not_empty(&state->damage_surface) ||
+	    pixman_region32_not_empty(&state->damage_buffer)) {
 		TL_POINT("core_commit_damage", TLP_SURFACE(surface), TLP_END);
 
+		if (surface->output &&
+		    timespec_is_zero(&surface->damage_commit_time))
+			weston_compositor_read_presentation_clock(
+				surface->compositor,
+				&surface->damage_commit_time);
+	}
+
 	pixman_region32_union(&surface->damage, &surface->damage,
 			      &state->damage_surface);
 
@@ -3308,6 +3977,7 @@ subsurface_configure(struct weston_surface *surface, int32_t dx, int32_t dy)
 
 		surface->output = output;
 		weston_surface_update_output_mask(surface, 1u << output->id);
+		view_list_dirty(compositor);
 	}
 }
 
@@ -3594,6 +4264,7 @@ subsurface_set_desync(struct wl_client *client, struct wl_resource *resource)
 static void
 weston_subsurface_unlink_parent(struct weston_subsurface *sub)
 {
+	view_list_dirty(sub->parent->compositor);
 	wl_list_remove(&sub->parent_link);
 	wl_list_remove(&sub->parent_link_pending);
 	wl_list_remove(&sub->parent_destroy_listener.link);
@@ -3660,6 +4331,7 @@ weston_subsurface_link_parent(struct weston_subsurface *sub,
 	wl_list_insert(&parent->subsurface_list, &sub->parent_link);
 	wl_list_insert(&parent->subsurface_list_pending,
 		       &sub->parent_link_pending);
+	view_list_dirty(parent->compositor);
 }
 
 static void
@@ -4125,6 +4797,7 @@ weston_output_destroy(struct weston_output *output)
 	free(output->name);
 	pixman_region32_fini(&output->region);
 	pixman_region32_fini(&output->previous_damage);
+	weston_repaint_stats_destroy(output->repaint_stats);
 	output->compositor->output_id_pool &= ~(1u << output->id);
 
 	wl_resource_for_each(resource, &output->resource_list) {
@@ -4327,6 +5000,8 @@ weston_output_init(struct weston_output *output, struct weston_compositor *c,
 	wl_list_init(&output->feedback_list);
 	wl_list_init(&output->link);
 
+	output->repaint_stats = weston_repaint_stats_create();
+
 	loop = wl_display_get_event_loop(c->wl_display);
 	output->repaint_timer = wl_event_loop_add_timer(loop,
 					output_repaint_timer_handler, output);
@@ -4701,6 +5376,17 @@ timeline_key_binding_handler(struct weston_keyboard *keyboard, uint32_t time,
 		weston_timeline_open(compositor);
 }
 
+static void
+repaint_stats_key_binding_handler(struct weston_keyboard *keyboard,
+				  uint32_t time, uint32_t key, void *data)
+{
+	struct weston_compositor *compositor = data;
+	struct weston_output *output;
+
+	wl_list_for_each(output, &compositor->output_list, link)
+		weston_repaint_stats_log(output);
+}
+
 /** Create the compositor.
  *
  * This functions creates and initializes a compositor instance.
@@ -4741,6 +5427,7 @@ weston_compositor_create(struct wl_display *display, void *user_data)
 
 	ec->output_id_pool = 0;
 	ec->repaint_msec = DEFAULT_REPAINT_WINDOW;
+	ec->repaint_margin_usec = DEFAULT_REPAINT_MARGIN;
 
 	if (!wl_global_create(ec->wl_display, &wl_compositor_interface, 4,
 			      ec, compositor_bind))
@@ -4759,6 +5446,8 @@ weston_compositor_create(struct wl_display *display, void *user_data)
 		goto fail;
 
 	wl_list_init(&ec->view_list);
+	wl_array_init(&ec->view_list_layers);
+	ec->view_list_dirty = true;
 	wl_list_init(&ec->plane_list);
 	wl_list_init(&ec->layer_list);
 	wl_list_init(&ec->seat_list);
@@ -4787,6 +5476,9 @@ weston_compositor_create(struct wl_display *display, void *user_data)
 
 	weston_compositor_add_debug_binding(ec, KEY_T,
 					    timeline_key_binding_handler, ec);
+	weston_compositor_add_debug_binding(ec, KEY_L,
+					    repaint_stats_key_binding_handler,
+					    ec);
 
 	return ec;
 
@@ -4820,6 +5512,9 @@ weston_compositor_shutdown(struct weston_compositor *ec)
 
 	weston_plane_release(&ec->primary_plane);
 
+	pick_index_release(ec);
+	wl_array_release(&ec->view_list_layers);
+
 	wl_event_loop_destroy(ec->input_loop);
 }
 
@@ -58,6 +58,7 @@ struct weston_output;
 struct input_method;
 struct weston_pointer;
 struct linux_dmabuf_buffer;
+struct weston_repaint_stats;
 
 enum weston_keyboard_modifier {
 	MODIFIER_CTRL = (1 << 0),
@@ -165,6 +166,8 @@ enum dpms_enum {
 	WESTON_DPMS_OFF
 };
 
+#define WESTON_REPAINT_WINDOW_SAMPLES 32
+
 struct weston_output {
 	uint32_t id;
 	char *name;
@@ -192,6 +195,7 @@ struct weston_output {
 	int repaint_needed;
 	int repaint_scheduled;
 	struct wl_event_source *repaint_timer;
+	struct timespec repaint_due;	/* zero unless repaint_timer is armed */
 	struct weston_output_zoom zoom;
 	int dirty;
 	struct wl_signal frame_signal;
@@ -236,6 +240,17 @@ struct weston_output {
 			  uint16_t *b);
 
 	struct weston_timeline_object timeline;
+	struct weston_repaint_stats *repaint_stats;
+
+	/* Adaptive repaint window, see output_update_repaint_window() */
+	struct {
+		struct timespec repaint_start;	/* zero if none in flight */
+		uint32_t samples[WESTON_REPAINT_WINDOW_SAMPLES]; /* usec */
+		int n_samples;
+		int next_sample;
+		int32_t window_usec;	/* zero until the first update */
+		int hold;
+	} repaint_window;
 };
 
 enum weston_pointer_motion_mask {
@@ -617,11 +632,22 @@ struct weston_plane {
 	struct wl_list link;
 };
 
+typedef void (*weston_read_pixels_done_func_t)(void *data,
+					       const void *pixels);
+
 struct weston_renderer {
 	int (*read_pixels)(struct weston_output *output,
 			       pixman_format_code_t format, void *pixels,
 			       uint32_t x, uint32_t y,
 			       uint32_t width, uint32_t height);
+
+	/** See weston_output_read_pixels_async(), optional */
+	int (*read_pixels_async)(struct weston_output *output,
+				 pixman_format_code_t format,
+				 uint32_t x, uint32_t y,
+				 uint32_t width, uint32_t height,
+				 weston_read_pixels_done_func_t done,
+				 void *data);
 	void (*repaint_output)(struct weston_output *output,
 			       pixman_region32_t *output_damage);
 	void (*flush_damage)(struct weston_surface *surface);
@@ -754,6 +780,24 @@ struct weston_compositor {
 
 	const struct weston_pointer_grab_interface *default_pointer_grab;
 
+	/* Grid of view_list by bounding box, for picking. Each cell holds
+	 * the views overlapping it in view_list order. */
+	struct {
+		bool valid;
+		uint32_t generation;
+		int n_views;
+		int32_t x, y;		/* origin of the grid */
+		int cell_size;
+		int width, height;	/* in cells */
+		struct wl_array *cells;	/* struct weston_view * */
+	} pick_index;
+
+	/* view_list is only rebuilt from the layers when something that
+	 * affects its contents or order changed since the last build. */
+	bool view_list_dirty;
+	struct wl_array view_list_layers;	/* struct weston_layer *, as of
+						 * the last build */
+
 	/* Repaint state. */
 	struct weston_plane primary_plane;
 	uint32_t capabilities; /* combination of enum weston_capability */
@@ -780,9 +824,21 @@ struct weston_compositor {
 
 	bool vt_switching;
 
+	/* Whether backends fail to start without any input device */
+	bool require_input;
+
 	clockid_t presentation_clock;
 	int32_t repaint_msec;
 
+	/* Shrink the repaint window down to what repaints take,
+	 * plus repaint_margin_usec; repaint_msec is the maximum. */
+	bool repaint_window_adaptive;
+	int32_t repaint_margin_usec;
+
+	/* Outputs due to repaint within this many usec of the one whose
+	 * timer fired are repainted in the same wakeup; 0 disables it. */
+	int32_t repaint_group_usec;
+
 	int exit_code;
 
 	void *user_data;
@@ -947,6 +1003,14 @@ struct weston_view {
 
 	/* Per-surface Presentation feedback flags, controlled by backend. */
 	uint32_t psf_flags;
+
+	/* Position in weston_compositor::pick_index, valid only if
+	 * generation matches the index. */
+	struct {
+		uint32_t generation;
+		int order;		/* in view_list */
+		pixman_box32_t cells;	/* covered by boundingbox */
+	} pick;
 };
 
 struct weston_surface_state {
@@ -1063,6 +1127,10 @@ struct weston_surface {
 	const char *role_name;
 
 	struct weston_timeline_object timeline;
+
+	/* Presentation clock time of the first commit with damage that
+	 * has not been repainted yet, zero if none. */
+	struct timespec damage_commit_time;
 };
 
 struct weston_subsurface {
@@ -1231,6 +1299,13 @@ void
 weston_output_schedule_repaint(struct weston_output *output);
 void
 weston_output_damage(struct weston_output *output);
+int
+weston_output_read_pixels_async(struct weston_output *output,
+				pixman_format_code_t format,
+				uint32_t x, uint32_t y,
+				uint32_t width, uint32_t height,
+				weston_read_pixels_done_func_t done,
+				void *data);
 void
 weston_compositor_schedule_repaint(struct weston_compositor *compositor);
 void
@@ -1532,6 +1607,8 @@ void
 weston_log_file_open(const char *filename);
 void
 weston_log_file_close(void);
+void
+weston_log_flush_sync(void);
 int
 weston_vlog(const char *fmt, va_list ap);
 int
@@ -1563,6 +1640,29 @@ tty_activate_vt(struct tty *tty, int vt);
 void
 screenshooter_create(struct weston_compositor *ec);
 
+int
+repaint_stats_create(struct weston_compositor *ec);
+
+struct weston_repaint_stats *
+weston_repaint_stats_create(void);
+void
+weston_repaint_stats_destroy(struct weston_repaint_stats *stats);
+void
+weston_repaint_stats_repaint_begin(struct weston_output *output,
+				   const struct timespec *now);
+void
+weston_repaint_stats_repaint_end(struct weston_output *output, bool posted);
+void
+weston_repaint_stats_commit_shown(struct weston_output *output,
+				  const struct timespec *commit_time,
+				  const struct timespec *now);
+void
+weston_repaint_stats_presented(struct weston_output *output,
+			       const struct timespec *stamp,
+			       int32_t refresh_nsec);
+void
+weston_repaint_stats_log(struct weston_output *output);
+
 enum weston_screenshooter_outcome {
 	WESTON_SCREENSHOOTER_SUCCESS,
 	WESTON_SCREENSHOOTER_NO_MEMORY,
@@ -30,11 +30,21 @@
 #include <GLES2/gl2ext.h>
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
 #include <float.h>
+#include <limits.h>
 #include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
 #include <linux/input.h>
 #include <drm_fourcc.h>
 
@@ -53,11 +63,18 @@ struct gl_shader {
 	GLint tex_uniforms[3];
 	GLint alpha_uniform;
 	GLint color_uniform;
+	GLint depth_uniform;
 	const char *vertex_source, *fragment_source;
 };
 
 #define BUFFER_DAMAGE_COUNT 2
 
+/* Read backs are normally mapped when the next frame starts; if no
+ * frame follows, they are mapped after this many milliseconds. */
+#define READBACK_TIMEOUT 20
+/* Idle pixel buffer objects kept for reuse, per output */
+#define READBACK_POOL_SIZE 8
+
 enum gl_border_status {
 	BORDER_STATUS_CLEAN = 0,
 	BORDER_TOP_DIRTY = 1 << GL_RENDERER_BORDER_TOP,
@@ -84,6 +101,23 @@ struct gl_output_state {
 	enum gl_border_status border_status;
 
 	struct weston_matrix output_matrix;
+
+	uint32_t frame_count;
+	struct wl_list readbacks;	/* struct gl_readback, oldest first */
+	struct wl_list free_readbacks;	/* struct gl_readback */
+	int n_free_readbacks;
+	struct wl_event_source *readback_timer;
+};
+
+/* A glReadPixels() into a pixel buffer object, mapped a frame later */
+struct gl_readback {
+	struct wl_list link;
+	GLuint pbo;
+	GLsizeiptr size;	/* of the buffer object */
+	GLsizeiptr length;	/* of the pixels read */
+	uint32_t frame;		/* gl_output_state::frame_count */
+	weston_read_pixels_done_func_t done;
+	void *data;
 };
 
 enum buffer_type {
@@ -133,6 +167,58 @@ struct yuv_format_descriptor {
 	struct yuv_plane_descriptor plane[4];
 };
 
+/* Small wl_shm surfaces share the textures of an atlas, so that their
+ * views can be drawn in one batch. The atlas is divided into shelves
+ * of entries of similar height; an entry is a run of columns of its
+ * shelf and has a one pixel gutter that repeats the surface edges. */
+#define ATLAS_SIZE 1024
+#define ATLAS_MAX_SURFACE 128	/* in both dimensions, in pixels */
+#define ATLAS_COLUMN 8
+#define ATLAS_COLUMNS (ATLAS_SIZE / ATLAS_COLUMN)
+#define ATLAS_SHELF_STEP 16
+
+struct atlas_shelf {
+	struct wl_list link;
+	int y;
+	int height;
+	int n_entries;
+	uint32_t used[ATLAS_COLUMNS / 32];
+};
+
+/* A wl_shm texture update, in buffer coordinates */
+struct shm_upload {
+	GLuint texture;
+	GLenum gl_format;
+	GLenum gl_pixel_type;
+	int pitch; /* in pixels */
+	int height;
+	int stride; /* in bytes */
+	int bpp;
+	int first_row; /* the buffer row the pixels given start at */
+	bool full;
+	pixman_region32_t damage;
+	/* Atlas entries are always uploaded whole, with their gutter */
+	bool atlas;
+	int x, y;
+	int width;
+};
+
+struct gl_renderer;
+struct gl_surface_state;
+
+/* An upload handed to the upload thread. The thread never touches
+ * the wl_shm pool, which a client can resize at any time; the damaged
+ * rows are copied to pixels when the job is queued. */
+struct upload_job {
+	struct wl_list link;
+	struct gl_renderer *gr;
+	struct shm_upload upload;
+	struct gl_surface_state *gs;
+	uint8_t *pixels;
+	EGLSyncKHR fence;
+	bool done;
+};
+
 struct gl_surface_state {
 	GLfloat color[4];
 	struct gl_shader *shader;
@@ -154,6 +240,15 @@ struct gl_surface_state {
 
 	struct weston_buffer_reference buffer_ref;
 	enum buffer_type buffer_type;
+	/* The latest upload of textures[0] on the upload thread */
+	struct upload_job *upload_job;
+
+	/* The atlas entry, used instead of textures[0] if not NULL */
+	struct atlas_shelf *atlas_shelf;
+	int atlas_column, atlas_columns;
+	int atlas_x, atlas_y; /* of the top left pixel */
+	int atlas_width;
+
 	int pitch; /* in pixels */
 	int height; /* in pixels */
 	int y_inverted;
@@ -164,19 +259,40 @@ struct gl_surface_state {
 	struct wl_listener renderer_destroy_listener;
 };
 
+/* The GL state of a draw. Consecutive draws with the same state are
+ * collected and submitted together, see batch_flush(). */
+struct gl_batch_state {
+	struct gl_shader *shader;
+	GLenum target;
+	GLuint textures[3];
+	int num_textures;
+	GLint filter;
+	GLfloat color[4];
+	GLfloat alpha;
+	GLfloat depth;
+	bool blend;
+};
+
 struct gl_renderer {
 	struct weston_renderer base;
 	int fragment_shader_debug;
 	int fan_debug;
+	bool depth_test;
 	struct weston_binding *fragment_binding;
 	struct weston_binding *fan_binding;
+	struct weston_binding *upload_binding;
 
 	EGLDisplay egl_display;
 	EGLContext egl_context;
 	EGLConfig egl_config;
 
+	/* Of the current batch: triangles as position and texcoord
+	 * pairs, and the number of triangles of each polygon. */
 	struct wl_array vertices;
 	struct wl_array vtxcnt;
+	struct gl_batch_state batch;
+	GLuint vbo;
+	GLsizeiptr vbo_size;
 
 	PFNGLEGLIMAGETARGETTEXTURE2DOESPROC image_target_texture_2d;
 	PFNEGLCREATEIMAGEKHRPROC create_image;
@@ -190,6 +306,58 @@ struct gl_renderer {
 
 	int has_unpack_subimage;
 
+	/* Packed copies of damaged rectangles, for drivers without
+	 * GL_EXT_unpack_subimage */
+	void *staging;
+	size_t staging_size;
+
+	/* Uploads wl_shm buffers on a thread with a shared context,
+	 * signaling fences that are waited on before the textures are
+	 * drawn */
+	struct {
+		bool enabled;
+		EGLContext context;
+		pthread_t thread;
+		pthread_mutex_t mutex;
+		pthread_cond_t input_cond;
+		pthread_cond_t done_cond;
+		struct wl_list queue;
+		struct wl_list done;
+		int destroying;
+		int event_fd;
+		struct wl_event_source *event_source;
+		void *staging; /* of the upload thread */
+		size_t staging_size;
+		PFNEGLCREATESYNCKHRPROC create_sync;
+		PFNEGLDESTROYSYNCKHRPROC destroy_sync;
+		PFNEGLWAITSYNCKHRPROC wait_sync;
+	} upload;
+
+	/* Shared texture of the small wl_shm surfaces, see atlas_alloc() */
+	struct {
+		GLuint texture;
+		struct wl_list shelves;
+		int top; /* of the unused part */
+		int n_entries;
+	} atlas;
+
+	/* wl_shm texture uploads, logged by the upload debug binding */
+	struct {
+		uint64_t frame_bytes;	/* since the last repaint */
+		uint64_t total_bytes;
+		uint64_t max_frame_bytes;
+		uint32_t frames;
+		uint32_t full_uploads;
+		uint32_t partial_uploads;
+	} upload_stats;
+
+	int has_pbo_readback;
+	GLenum pbo_usage;
+	void *(GL_APIENTRY *map_buffer_range)(GLenum target, GLintptr offset,
+					      GLsizeiptr length,
+					      GLbitfield access);
+	GLboolean (GL_APIENTRY *unmap_buffer)(GLenum target);
+
 	PFNEGLBINDWAYLANDDISPLAYWL bind_display;
 	PFNEGLUNBINDWAYLANDDISPLAYWL unbind_display;
 	PFNEGLQUERYWAYLANDBUFFERWL query_buffer;
@@ -204,6 +372,14 @@ struct gl_renderer {
 	int has_dmabuf_import;
 	struct wl_list dmabuf_images;
 
+	/* On-disk program binary cache, NULL directory if disabled */
+	PFNGLGETPROGRAMBINARYOESPROC get_program_binary;
+	PFNGLPROGRAMBINARYOESPROC program_binary;
+	char *shader_cache_dir;
+	uint64_t shader_cache_driver;
+	int shader_cache_hits;
+	int shader_cache_lookups;
+
 	struct gl_shader texture_shader_rgba;
 	struct gl_shader texture_shader_rgbx;
 	struct gl_shader texture_shader_egl_external;
@@ -483,7 +659,9 @@ compress_bands(pixman_box32_t *inrects, int nrects,
 	return nout;
 }
 
-static int
+/* Appends the intersection of region and surf_region to the current
+ * batch, as triangles. */
+static void
 texture_region(struct weston_view *ev, pixman_region32_t *region,
 		pixman_region32_t *surf_region)
 {
@@ -491,10 +669,12 @@ texture_region(struct weston_view *ev, pixman_region32_t *region,
 	struct weston_compositor *ec = ev->surface->compositor;
 	struct gl_renderer *gr = get_renderer(ec);
 	GLfloat *v, inv_width, inv_height;
+	GLfloat fan[8][4];
 	unsigned int *vtxcnt, nvtx = 0;
 	pixman_box32_t *rects, *surf_rects;
 	pixman_box32_t *raw_rects;
 	int i, j, k, nrects, nsurf, raw_nrects;
+	size_t vtxcnt_size;
 	bool used_band_compression;
 	raw_rects = pixman_region32_rectangles(region, &raw_nrects);
 	surf_rects = pixman_region32_rectangles(surf_region, &nsurf);
@@ -508,13 +688,19 @@ texture_region(struct weston_view *ev, pixman_region32_t *region,
 		used_band_compression = true;
 	}
 	/* worst case we can have 8 vertices per rect (ie. clipped into
-	 * an octagon):
+	 * an octagon), that is 6 triangles:
 	 */
-	v = wl_array_add(&gr->vertices, nrects * nsurf * 8 * 4 * sizeof *v);
+	vtxcnt_size = gr->vtxcnt.size;
+	v = wl_array_add(&gr->vertices, nrects * nsurf * 6 * 3 * 4 * sizeof *v);
 	vtxcnt = wl_array_add(&gr->vtxcnt, nrects * nsurf * sizeof *vtxcnt);
 
-	inv_width = 1.0 / gs->pitch;
-        inv_height = 1.0 / gs->height;
+	if (gs->atlas_shelf) {
+		inv_width = 1.0 / ATLAS_SIZE;
+		inv_height = 1.0 / ATLAS_SIZE;
+	} else {
+		inv_width = 1.0 / gs->pitch;
+		inv_height = 1.0 / gs->height;
+	}
 
 	for (i = 0; i < nrects; i++) {
 		pixman_box32_t *rect = &rects[i];
@@ -542,43 +728,53 @@ texture_region(struct weston_view *ev, pixman_region32_t *region,
 			if (n < 3)
 				continue;
 
-			/* emit edge points: */
+			/* compute edge points: */
 			for (k = 0; k < n; k++) {
 				weston_view_from_global_float(ev, ex[k], ey[k],
 							      &sx, &sy);
 				/* position: */
-				*(v++) = ex[k];
-				*(v++) = ey[k];
+				fan[k][0] = ex[k];
+				fan[k][1] = ey[k];
 				/* texcoord: */
 				weston_surface_to_buffer_float(ev->surface,
 							       sx, sy,
 							       &bx, &by);
-				*(v++) = bx * inv_width;
+				if (gs->atlas_shelf) {
+					bx += gs->atlas_x;
+					by += gs->atlas_y;
+				}
+				fan[k][2] = bx * inv_width;
 				if (gs->y_inverted) {
-					*(v++) = by * inv_height;
+					fan[k][3] = by * inv_height;
 				} else {
-					*(v++) = (gs->height - by) * inv_height;
+					fan[k][3] = (gs->height - by) * inv_height;
 				}
 			}
 
-			vtxcnt[nvtx++] = n;
+			/* and split the fan into triangles, so that all
+			 * of the batch can be drawn at once: */
+			for (k = 1; k < n - 1; k++) {
+				memcpy(v, fan[0], sizeof fan[0]);
+				memcpy(v + 4, fan[k], sizeof fan[0]);
+				memcpy(v + 8, fan[k + 1], sizeof fan[0]);
+				v += 12;
+			}
+
+			vtxcnt[nvtx++] = n - 2;
 		}
 	}
 
+	gr->vertices.size = (char *) v - (char *) gr->vertices.data;
+	gr->vtxcnt.size = vtxcnt_size + nvtx * sizeof *vtxcnt;
+
 	if (used_band_compression)
 		free(rects);
-	return nvtx;
 }
 
 static void
-triangle_fan_debug(struct weston_view *view, int first, int count)
+triangle_fan_debug(struct gl_renderer *gr, int first, int count)
 {
-	struct weston_compositor *compositor = view->surface->compositor;
-	struct gl_renderer *gr = get_renderer(compositor);
 	int i;
-	GLushort *buffer;
-	GLushort *index;
-	int nelems;
 	static int color_idx = 0;
 	static const GLfloat color[][4] = {
 			{ 1.0, 0.0, 0.0, 1.0 },
@@ -587,74 +783,149 @@ triangle_fan_debug(struct weston_view *view, int first, int count)
 			{ 1.0, 1.0, 1.0, 1.0 },
 	};
 
-	nelems = (count - 1 + count - 2) * 2;
+	glUniform4fv(gr->solid_shader.color_uniform, 1,
+			color[color_idx++ % ARRAY_LENGTH(color)]);
+	for (i = 0; i < count; i++)
+		glDrawArrays(GL_LINE_LOOP, first + i * 3, 3);
+}
 
-	buffer = malloc(sizeof(GLushort) * nelems);
-	index = buffer;
+static bool
+batch_state_equal(const struct gl_batch_state *a,
+		  const struct gl_batch_state *b)
+{
+	int i;
 
-	for (i = 1; i < count; i++) {
-		*index++ = first;
-		*index++ = first + i;
-	}
+	if (a->shader != b->shader ||
+	    a->target != b->target ||
+	    a->num_textures != b->num_textures ||
+	    a->filter != b->filter ||
+	    a->alpha != b->alpha ||
+	    a->depth != b->depth ||
+	    a->blend != b->blend)
+		return false;
 
-	for (i = 2; i < count; i++) {
-		*index++ = first + i - 1;
-		*index++ = first + i;
-	}
+	for (i = 0; i < a->num_textures; i++)
+		if (a->textures[i] != b->textures[i])
+			return false;
 
-	glUseProgram(gr->solid_shader.program);
-	glUniform4fv(gr->solid_shader.color_uniform, 1,
-			color[color_idx++ % ARRAY_LENGTH(color)]);
-	glDrawElements(GL_LINES, nelems, GL_UNSIGNED_SHORT, buffer);
-	glUseProgram(gr->current_shader->program);
-	free(buffer);
+	return memcmp(a->color, b->color, sizeof a->color) == 0;
 }
 
 static void
-repaint_region(struct weston_view *ev, pixman_region32_t *region,
-		pixman_region32_t *surf_region)
+use_shader(struct gl_renderer *gr, struct gl_shader *shader);
+
+/* Draws the current batch with one glDrawArrays() from the vertex
+ * buffer object. */
+static void
+batch_flush(struct gl_renderer *gr, struct weston_output *output)
 {
-	struct weston_compositor *ec = ev->surface->compositor;
-	struct gl_renderer *gr = get_renderer(ec);
-	GLfloat *v;
+	struct gl_batch_state *state = &gr->batch;
+	struct gl_shader *shader = state->shader;
+	struct gl_output_state *go = get_output_state(output);
+	GLsizeiptr size = gr->vertices.size;
 	unsigned int *vtxcnt;
 	int i, first, nfans;
 
-	/* The final region to be painted is the intersection of
-	 * 'region' and 'surf_region'. However, 'region' is in the global
-	 * coordinates, and 'surf_region' is in the surface-local
-	 * coordinates. texture_region() will iterate over all pairs of
-	 * rectangles from both regions, compute the intersection
-	 * polygon for each pair, and store it as a triangle fan if
-	 * it has a non-zero area (at least 3 vertices, actually).
-	 */
-	nfans = texture_region(ev, region, surf_region);
+	if (size == 0)
+		return;
 
-	v = gr->vertices.data;
-	vtxcnt = gr->vtxcnt.data;
+	use_shader(gr, shader);
+	glUniformMatrix4fv(shader->proj_uniform,
+			   1, GL_FALSE, go->output_matrix.d);
+	glUniform4fv(shader->color_uniform, 1, state->color);
+	glUniform1f(shader->alpha_uniform, state->alpha);
+	glUniform1f(shader->depth_uniform, state->depth);
+
+	for (i = 0; i < state->num_textures; i++) {
+		glUniform1i(shader->tex_uniforms[i], i);
+		glActiveTexture(GL_TEXTURE0 + i);
+		glBindTexture(state->target, state->textures[i]);
+		glTexParameteri(state->target, GL_TEXTURE_MIN_FILTER,
+				state->filter);
+		glTexParameteri(state->target, GL_TEXTURE_MAG_FILTER,
+				state->filter);
+	}
+
+	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+	if (state->blend)
+		glEnable(GL_BLEND);
+	else
+		glDisable(GL_BLEND);
+
+	/* Orphan the old contents rather than wait for the draws
+	 * that still read them */
+	glBindBuffer(GL_ARRAY_BUFFER, gr->vbo);
+	if (size > gr->vbo_size) {
+		glBufferData(GL_ARRAY_BUFFER, size, gr->vertices.data,
+			     GL_STREAM_DRAW);
+		gr->vbo_size = size;
+	} else {
+		glBufferData(GL_ARRAY_BUFFER, gr->vbo_size, NULL,
+			     GL_STREAM_DRAW);
+		glBufferSubData(GL_ARRAY_BUFFER, 0, size, gr->vertices.data);
+	}
 
 	/* position: */
-	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 4 * sizeof *v, &v[0]);
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE,
+			      4 * sizeof(GLfloat), (void *) 0);
 	glEnableVertexAttribArray(0);
 
 	/* texcoord: */
-	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 4 * sizeof *v, &v[2]);
+	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE,
+			      4 * sizeof(GLfloat),
+			      (void *) (2 * sizeof(GLfloat)));
 	glEnableVertexAttribArray(1);
 
-	for (i = 0, first = 0; i < nfans; i++) {
-		glDrawArrays(GL_TRIANGLE_FAN, first, vtxcnt[i]);
-		if (gr->fan_debug)
-			triangle_fan_debug(ev, first, vtxcnt[i]);
-		first += vtxcnt[i];
+	glDrawArrays(GL_TRIANGLES, 0, size / (4 * sizeof(GLfloat)));
+
+	if (gr->fan_debug) {
+		use_shader(gr, &gr->solid_shader);
+		glUniformMatrix4fv(gr->solid_shader.proj_uniform,
+				   1, GL_FALSE, go->output_matrix.d);
+		glUniform1f(gr->solid_shader.alpha_uniform, 1.0);
+		glUniform1f(gr->solid_shader.depth_uniform, state->depth);
+
+		vtxcnt = gr->vtxcnt.data;
+		nfans = gr->vtxcnt.size / sizeof *vtxcnt;
+		for (i = 0, first = 0; i < nfans; i++) {
+			triangle_fan_debug(gr, first, vtxcnt[i]);
+			first += vtxcnt[i] * 3;
+		}
 	}
 
 	glDisableVertexAttribArray(1);
 	glDisableVertexAttribArray(0);
 
+	/* The rest of the renderer draws from client memory */
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
 	gr->vertices.size = 0;
 	gr->vtxcnt.size = 0;
 }
 
+static void
+repaint_region(struct weston_view *ev, struct weston_output *output,
+	       const struct gl_batch_state *state,
+	       pixman_region32_t *region, pixman_region32_t *surf_region)
+{
+	struct weston_compositor *ec = ev->surface->compositor;
+	struct gl_renderer *gr = get_renderer(ec);
+
+	if (!batch_state_equal(&gr->batch, state))
+		batch_flush(gr, output);
+	gr->batch = *state;
+
+	/* The final region to be painted is the intersection of
+	 * 'region' and 'surf_region'. However, 'region' is in the global
+	 * coordinates, and 'surf_region' is in the surface-local
+	 * coordinates. texture_region() will iterate over all pairs of
+	 * rectangles from both regions, compute the intersection
+	 * polygon for each pair, and store it as triangles if
+	 * it has a non-zero area (at least 3 vertices, actually).
+	 */
+	texture_region(ev, region, surf_region);
+}
+
 static int
 use_output(struct weston_output *output)
 {
@@ -703,37 +974,34 @@ use_shader(struct gl_renderer *gr, struct gl_shader *shader)
 }
 
 static void
-shader_uniforms(struct gl_shader *shader,
-		struct weston_view *view,
-		struct weston_output *output)
-{
-	int i;
-	struct gl_surface_state *gs = get_surface_state(view->surface);
-	struct gl_output_state *go = get_output_state(output);
-
-	glUniformMatrix4fv(shader->proj_uniform,
-			   1, GL_FALSE, go->output_matrix.d);
-	glUniform4fv(shader->color_uniform, 1, gs->color);
-	glUniform1f(shader->alpha_uniform, view->alpha);
-
-	for (i = 0; i < gs->num_textures; i++)
-		glUniform1i(shader->tex_uniforms[i], i);
-}
+surface_finish_upload(struct gl_renderer *gr, struct gl_surface_state *gs);
+
+/* Which parts of the views repaint_views() is drawing. With depth
+ * testing, the opaque parts are drawn front to back first, so that
+ * the depth test rejects whatever they cover, and everything else
+ * back to front afterwards. */
+enum gl_draw_pass {
+	DRAW_PASS_ALL,
+	DRAW_PASS_OPAQUE,
+	DRAW_PASS_BLEND,
+};
 
 static void
 draw_view(struct weston_view *ev, struct weston_output *output,
-	  pixman_region32_t *damage) /* in global coordinates */
+	  pixman_region32_t *damage, /* in global coordinates */
+	  enum gl_draw_pass pass, GLfloat depth)
 {
 	struct weston_compositor *ec = ev->surface->compositor;
 	struct gl_renderer *gr = get_renderer(ec);
 	struct gl_surface_state *gs = get_surface_state(ev->surface);
+	struct gl_batch_state state;
+	bool draw_opaque, draw_blend;
 	/* repaint bounding region in global coordinates: */
 	pixman_region32_t repaint;
 	/* opaque region in surface coordinates: */
 	pixman_region32_t surface_opaque;
 	/* non-opaque region in surface coordinates: */
 	pixman_region32_t surface_blend;
-	GLint filter;
 	int i;
 
 	/* In case of a runtime switch of renderers, we may not have received
@@ -742,6 +1010,27 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 	if (!gs->shader)
 		return;
 
+	surface_finish_upload(gr, gs);
+
+	/* Opaque regions of translucent views need blending, too */
+	switch (pass) {
+	case DRAW_PASS_OPAQUE:
+		draw_opaque = ev->alpha == 1.0;
+		draw_blend = false;
+		break;
+	case DRAW_PASS_BLEND:
+		draw_opaque = ev->alpha < 1.0;
+		draw_blend = true;
+		break;
+	default:
+		draw_opaque = true;
+		draw_blend = true;
+		break;
+	}
+
+	if (!draw_opaque && !draw_blend)
+		return;
+
 	pixman_region32_init(&repaint);
 	pixman_region32_intersect(&repaint,
 				  &ev->transform.boundingbox, damage);
@@ -750,28 +1039,24 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 	if (!pixman_region32_not_empty(&repaint))
 		goto out;
 
-	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
-
-	if (gr->fan_debug) {
-		use_shader(gr, &gr->solid_shader);
-		shader_uniforms(&gr->solid_shader, ev, output);
+	state.shader = gs->shader;
+	state.target = gs->target;
+	state.num_textures = gs->num_textures;
+	for (i = 0; i < gs->num_textures; i++)
+		state.textures[i] = gs->textures[i];
+	if (gs->atlas_shelf) {
+		state.num_textures = 1;
+		state.textures[0] = gr->atlas.texture;
 	}
-
-	use_shader(gr, gs->shader);
-	shader_uniforms(gs->shader, ev, output);
+	memcpy(state.color, gs->color, sizeof state.color);
+	state.alpha = ev->alpha;
+	state.depth = depth;
 
 	if (ev->transform.enabled || output->zoom.active ||
 	    output->current_scale != ev->surface->buffer_viewport.buffer.scale)
-		filter = GL_LINEAR;
+		state.filter = GL_LINEAR;
 	else
-		filter = GL_NEAREST;
-
-	for (i = 0; i < gs->num_textures; i++) {
-		glActiveTexture(GL_TEXTURE0 + i);
-		glBindTexture(gs->target, gs->textures[i]);
-		glTexParameteri(gs->target, GL_TEXTURE_MIN_FILTER, filter);
-		glTexParameteri(gs->target, GL_TEXTURE_MAG_FILTER, filter);
-	}
+		state.filter = GL_NEAREST;
 
 	/* blended region is whole surface minus opaque region: */
 	pixman_region32_init_rect(&surface_blend, 0, 0,
@@ -791,29 +1076,24 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 	else
 		pixman_region32_copy(&surface_opaque, &ev->surface->opaque);
 
-	if (pixman_region32_not_empty(&surface_opaque)) {
+	if (draw_opaque && pixman_region32_not_empty(&surface_opaque)) {
 		if (gs->shader == &gr->texture_shader_rgba) {
 			/* Special case for RGBA textures with possibly
 			 * bad data in alpha channel: use the shader
 			 * that forces texture alpha = 1.0.
 			 * Xwayland surfaces need this.
 			 */
-			use_shader(gr, &gr->texture_shader_rgbx);
-			shader_uniforms(&gr->texture_shader_rgbx, ev, output);
+			state.shader = &gr->texture_shader_rgbx;
 		}
 
-		if (ev->alpha < 1.0)
-			glEnable(GL_BLEND);
-		else
-			glDisable(GL_BLEND);
-
-		repaint_region(ev, &repaint, &surface_opaque);
+		state.blend = ev->alpha < 1.0;
+		repaint_region(ev, output, &state, &repaint, &surface_opaque);
 	}
 
-	if (pixman_region32_not_empty(&surface_blend)) {
-		use_shader(gr, gs->shader);
-		glEnable(GL_BLEND);
-		repaint_region(ev, &repaint, &surface_blend);
+	if (draw_blend && pixman_region32_not_empty(&surface_blend)) {
+		state.shader = gs->shader;
+		state.blend = true;
+		repaint_region(ev, output, &state, &repaint, &surface_blend);
 	}
 
 	pixman_region32_fini(&surface_blend);
@@ -827,11 +1107,51 @@ static void
 repaint_views(struct weston_output *output, pixman_region32_t *damage)
 {
 	struct weston_compositor *compositor = output->compositor;
+	struct gl_renderer *gr = get_renderer(compositor);
 	struct weston_view *view;
+	GLfloat depth, step;
+
+	if (!gr->depth_test) {
+		wl_list_for_each_reverse(view, &compositor->view_list, link)
+			if (view->plane == &compositor->primary_plane)
+				draw_view(view, output, damage,
+					  DRAW_PASS_ALL, 0.0);
+
+		batch_flush(gr, output);
+		return;
+	}
+
+	/* Give every view its own depth, increasing from the top of
+	 * the stack, between the near and the far plane. */
+	step = 2.0 / (wl_list_length(&compositor->view_list) + 1);
+
+	glDepthMask(GL_TRUE);
+	glClearDepthf(1.0);
+	glClear(GL_DEPTH_BUFFER_BIT);
+	glEnable(GL_DEPTH_TEST);
+	glDepthFunc(GL_LEQUAL);
 
-	wl_list_for_each_reverse(view, &compositor->view_list, link)
+	depth = -1.0;
+	wl_list_for_each(view, &compositor->view_list, link) {
+		depth += step;
 		if (view->plane == &compositor->primary_plane)
-			draw_view(view, output, damage);
+			draw_view(view, output, damage,
+				  DRAW_PASS_OPAQUE, depth);
+	}
+	batch_flush(gr, output);
+
+	glDepthMask(GL_FALSE);
+
+	wl_list_for_each_reverse(view, &compositor->view_list, link) {
+		if (view->plane == &compositor->primary_plane)
+			draw_view(view, output, damage,
+				  DRAW_PASS_BLEND, depth);
+		depth -= step;
+	}
+	batch_flush(gr, output);
+
+	glDepthMask(GL_TRUE);
+	glDisable(GL_DEPTH_TEST);
 }
 
 static void
@@ -1064,6 +1384,9 @@ output_rotate_damage(struct weston_output *output,
 	go->border_damage[go->buffer_damage_index] = border_status;
 }
 
+static void
+gl_output_finish_readbacks(struct weston_output *output, bool all);
+
 /* NOTE: We now allow falling back to ARGB gl visuals when XRGB is
  * unavailable, so we're assuming the background has no transparency
  * and that everything with a blend, like drop shadows, will have something
@@ -1092,6 +1415,17 @@ gl_renderer_repaint_output(struct weston_output *output,
 	if (use_output(output) < 0)
 		return;
 
+	/* Uploads since the last repaint count towards this frame */
+	gr->upload_stats.frames++;
+	gr->upload_stats.total_bytes += gr->upload_stats.frame_bytes;
+	if (gr->upload_stats.frame_bytes > gr->upload_stats.max_frame_bytes)
+		gr->upload_stats.max_frame_bytes = gr->upload_stats.frame_bytes;
+	gr->upload_stats.frame_bytes = 0;
+
+	/* The read backs started in the previous frame are done by now */
+	go->frame_count++;
+	gl_output_finish_readbacks(output, false);
+
 	/* Calculate the viewport */
 	glViewport(go->borders[GL_RENDERER_BORDER_LEFT].width,
 		   go->borders[GL_RENDERER_BORDER_BOTTOM].height,
@@ -1191,6 +1525,21 @@ gl_renderer_repaint_output(struct weston_output *output,
 	go->border_status = BORDER_STATUS_CLEAN;
 }
 
+static int
+read_format_to_gl(pixman_format_code_t format, GLenum *gl_format)
+{
+	switch (format) {
+	case PIXMAN_a8r8g8b8:
+		*gl_format = GL_BGRA_EXT;
+		return 0;
+	case PIXMAN_a8b8g8r8:
+		*gl_format = GL_RGBA;
+		return 0;
+	default:
+		return -1;
+	}
+}
+
 static int
 gl_renderer_read_pixels(struct weston_output *output,
 			       pixman_format_code_t format, void *pixels,
@@ -1203,25 +1552,591 @@ gl_renderer_read_pixels(struct weston_output *output,
 	x += go->borders[GL_RENDERER_BORDER_LEFT].width;
 	y += go->borders[GL_RENDERER_BORDER_BOTTOM].height;
 
-	switch (format) {
-	case PIXMAN_a8r8g8b8:
-		gl_format = GL_BGRA_EXT;
-		break;
-	case PIXMAN_a8b8g8r8:
-		gl_format = GL_RGBA;
-		break;
-	default:
+	if (read_format_to_gl(format, &gl_format) < 0)
+		return -1;
+
+	if (use_output(output) < 0)
+		return -1;
+
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glReadPixels(x, y, width, height, gl_format,
+		     GL_UNSIGNED_BYTE, pixels);
+
+	return 0;
+}
+
+static void
+gl_readback_destroy(struct gl_readback *rb)
+{
+	glDeleteBuffers(1, &rb->pbo);
+	wl_list_remove(&rb->link);
+	free(rb);
+}
+
+static void
+gl_readback_finish(struct weston_output *output, struct gl_readback *rb)
+{
+	struct gl_renderer *gr = get_renderer(output->compositor);
+	struct gl_output_state *go = get_output_state(output);
+	void *pixels;
+
+	wl_list_remove(&rb->link);
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, rb->pbo);
+	pixels = gr->map_buffer_range(GL_PIXEL_PACK_BUFFER, 0, rb->length,
+				      GL_MAP_READ_BIT);
+	rb->done(rb->data, pixels);
+	if (pixels)
+		gr->unmap_buffer(GL_PIXEL_PACK_BUFFER);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	wl_list_insert(&go->free_readbacks, &rb->link);
+	if (++go->n_free_readbacks > READBACK_POOL_SIZE) {
+		rb = container_of(go->free_readbacks.prev,
+				  struct gl_readback, link);
+		gl_readback_destroy(rb);
+		go->n_free_readbacks--;
+	}
+}
+
+/* Map and hand out the read backs started in earlier frames, or all of
+ * them. The output must be current. */
+static void
+gl_output_finish_readbacks(struct weston_output *output, bool all)
+{
+	struct gl_output_state *go = get_output_state(output);
+	struct gl_readback *rb;
+
+	while (!wl_list_empty(&go->readbacks)) {
+		rb = container_of(go->readbacks.next, struct gl_readback, link);
+		if (!all && rb->frame == go->frame_count)
+			break;
+
+		gl_readback_finish(output, rb);
+	}
+
+	if (wl_list_empty(&go->readbacks) && go->readback_timer)
+		wl_event_source_timer_update(go->readback_timer, 0);
+}
+
+static int
+readback_timer_handler(void *data)
+{
+	struct weston_output *output = data;
+	struct gl_output_state *go = get_output_state(output);
+
+	if (use_output(output) < 0) {
+		wl_event_source_timer_update(go->readback_timer,
+					     READBACK_TIMEOUT);
+		return 0;
+	}
+
+	gl_output_finish_readbacks(output, true);
+
+	return 0;
+}
+
+static int
+gl_renderer_read_pixels_async(struct weston_output *output,
+			      pixman_format_code_t format,
+			      uint32_t x, uint32_t y,
+			      uint32_t width, uint32_t height,
+			      weston_read_pixels_done_func_t done,
+			      void *data)
+{
+	struct gl_renderer *gr = get_renderer(output->compositor);
+	struct gl_output_state *go = get_output_state(output);
+	struct gl_readback *rb;
+	GLsizeiptr length = (GLsizeiptr) width * height * 4;
+	GLenum gl_format;
+
+	if (!gr->has_pbo_readback || !go->readback_timer)
+		return -1;
+
+	if (read_format_to_gl(format, &gl_format) < 0)
 		return -1;
+
+	if (use_output(output) < 0)
+		return -1;
+
+	if (!wl_list_empty(&go->free_readbacks)) {
+		rb = container_of(go->free_readbacks.next,
+				  struct gl_readback, link);
+		wl_list_remove(&rb->link);
+		go->n_free_readbacks--;
+	} else {
+		rb = zalloc(sizeof *rb);
+		if (rb == NULL)
+			return -1;
+		glGenBuffers(1, &rb->pbo);
+	}
+
+	x += go->borders[GL_RENDERER_BORDER_LEFT].width;
+	y += go->borders[GL_RENDERER_BORDER_BOTTOM].height;
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, rb->pbo);
+	if (rb->size < length) {
+		glBufferData(GL_PIXEL_PACK_BUFFER, length, NULL,
+			     gr->pbo_usage);
+		rb->size = length;
+	}
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glReadPixels(x, y, width, height, gl_format, GL_UNSIGNED_BYTE, NULL);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	rb->length = length;
+	rb->frame = go->frame_count;
+	rb->done = done;
+	rb->data = data;
+	wl_list_insert(go->readbacks.prev, &rb->link);
+
+	wl_event_source_timer_update(go->readback_timer, READBACK_TIMEOUT);
+
+	return 0;
+}
+
+/* Above this percentage of damaged texture area, a single full upload
+ * replaces the uploads of the damaged rectangles. */
+#define FULL_UPLOAD_THRESHOLD 50
+
+/* Above this percentage of a row damaged, whole rows are uploaded
+ * without going through the staging buffer. */
+#define WHOLE_ROWS_THRESHOLD 50
+
+/* Uploads an atlas entry surrounded by copies of its edge pixels, so
+ * that linear filtering at the edges never samples the neighbours */
+static void
+shm_upload_atlas(struct gl_renderer *gr, struct shm_upload *up,
+		 uint8_t *data, void **staging, size_t *staging_size)
+{
+	int width = up->width + 2, height = up->height + 2;
+	size_t size = (size_t) width * height * 4;
+	uint32_t *dst, *src;
+	int y, sy;
+
+	if (size > *staging_size) {
+		dst = realloc(*staging, size);
+		if (!dst)
+			return;
+		*staging = dst;
+		*staging_size = size;
+	}
+
+	dst = *staging;
+	for (y = 0; y < height; y++) {
+		sy = y == 0 ? 0 : y == height - 1 ? up->height - 1 : y - 1;
+		src = (uint32_t *) (data + sy * up->stride);
+
+		dst[0] = src[0];
+		memcpy(dst + 1, src, up->width * 4);
+		dst[width - 1] = src[up->width - 1];
+		dst += width;
+	}
+
+#ifdef GL_EXT_unpack_subimage
+	if (gr->has_unpack_subimage) {
+		glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, 0);
+		glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, 0);
+		glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, 0);
+	}
+#endif
+
+	glTexSubImage2D(GL_TEXTURE_2D, 0, up->x - 1, up->y - 1,
+			width, height, up->gl_format, up->gl_pixel_type,
+			*staging);
+}
+
+/* Uploads the damaged rectangle r through the staging buffer */
+static void
+shm_upload_staged(struct shm_upload *up, pixman_box32_t *r, uint8_t *data,
+		  void **staging, size_t *staging_size)
+{
+	int y, width, height, row, stride;
+	uint8_t *dst;
+	size_t size;
+
+	width = r->x2 - r->x1;
+	height = r->y2 - r->y1;
+
+	/* rows stay 4-byte aligned for the default
+	 * GL_UNPACK_ALIGNMENT */
+	row = width * up->bpp;
+	stride = (row + 3) & ~3;
+	size = (size_t) stride * height;
+
+	if (size > *staging_size) {
+		dst = realloc(*staging, size);
+		if (!dst)
+			return;
+		*staging = dst;
+		*staging_size = size;
+	}
+
+	dst = *staging;
+	for (y = r->y1; y < r->y2; y++) {
+		memcpy(dst, data + (y - up->first_row) * up->stride +
+		       r->x1 * up->bpp, row);
+		dst += stride;
+	}
+
+	glTexSubImage2D(GL_TEXTURE_2D, 0, r->x1, r->y1, width, height,
+			up->gl_format, up->gl_pixel_type, *staging);
+}
+
+/* Finds the end of the y-band of damage rectangles starting at i, and
+ * whether the band is better uploaded as whole rows straight from the
+ * client memory: a few more bytes go to GL, but there is no copy. */
+static int
+damage_band(struct shm_upload *up, pixman_box32_t *rectangles,
+	    int i, int n, bool *whole)
+{
+	int end, covered = 0;
+
+	for (end = i; end < n && rectangles[end].y1 == rectangles[i].y1;
+	     end++)
+		covered += rectangles[end].x2 - rectangles[end].x1;
+
+	*whole = up->stride % 4 == 0 &&
+		 covered * 100 >= up->pitch * WHOLE_ROWS_THRESHOLD;
+
+	return end;
+}
+
+/* Performs the texture update described by up from the wl_shm pixels
+ * at data, which start at row up->first_row of the buffer. Runs on the
+ * upload thread, if there is one, so it only uses what it is given and
+ * the GL context that is current. */
+static void
+shm_upload_run(struct gl_renderer *gr, struct shm_upload *up,
+	       uint8_t *data, void **staging, size_t *staging_size)
+{
+	pixman_box32_t *rectangles, r;
+	int i, n, end;
+	bool whole;
+
+	glBindTexture(GL_TEXTURE_2D, up->texture);
+
+	if (up->atlas) {
+		shm_upload_atlas(gr, up, data, staging, staging_size);
+		return;
+	}
+
+#ifdef GL_EXT_unpack_subimage
+	if (gr->has_unpack_subimage) {
+		glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, up->pitch);
+		glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, 0);
+		glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, 0);
+	}
+#endif
+
+	if (up->full) {
+		glTexImage2D(GL_TEXTURE_2D, 0, up->gl_format,
+			     up->pitch, up->height, 0,
+			     up->gl_format, up->gl_pixel_type, data);
+		return;
+	}
+
+	rectangles = pixman_region32_rectangles(&up->damage, &n);
+
+#ifdef GL_EXT_unpack_subimage
+	if (gr->has_unpack_subimage) {
+		for (i = 0; i < n; i++) {
+			r = rectangles[i];
+			glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, r.x1);
+			glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT,
+				      r.y1 - up->first_row);
+			glTexSubImage2D(GL_TEXTURE_2D, 0, r.x1, r.y1,
+					r.x2 - r.x1, r.y2 - r.y1,
+					up->gl_format, up->gl_pixel_type,
+					data);
+		}
+		return;
+	}
+#endif
+
+	/* Without GL_EXT_unpack_subimage, GLES2 can only upload tightly
+	 * packed pixels, so damaged rectangles are copied to the staging
+	 * buffer first, unless their band is uploaded as whole rows. */
+	for (i = 0; i < n; i = end) {
+		end = damage_band(up, rectangles, i, n, &whole);
+		if (whole) {
+			r = rectangles[i];
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, r.y1,
+					up->pitch, r.y2 - r.y1,
+					up->gl_format, up->gl_pixel_type,
+					data + (r.y1 - up->first_row) *
+					up->stride);
+			continue;
+		}
+
+		for (; i < end; i++)
+			shm_upload_staged(up, &rectangles[i], data,
+					  staging, staging_size);
+	}
+}
+
+static void
+upload_job_finish(struct gl_renderer *gr, struct upload_job *job)
+{
+	/* Later GL commands of this context wait for the upload */
+	gr->upload.wait_sync(gr->egl_display, job->fence, 0);
+	gr->upload.destroy_sync(gr->egl_display, job->fence);
+
+	if (job->gs && job->gs->upload_job == job)
+		job->gs->upload_job = NULL;
+
+	pixman_region32_fini(&job->upload.damage);
+	free(job->pixels);
+	free(job);
+}
+
+/* Releases the buffers of the uploads that are done, on the
+ * compositor thread */
+static void
+upload_reap(struct gl_renderer *gr)
+{
+	struct upload_job *job, *next;
+	struct wl_list done;
+
+	wl_list_init(&done);
+
+	pthread_mutex_lock(&gr->upload.mutex);
+	wl_list_insert_list(&done, &gr->upload.done);
+	wl_list_init(&gr->upload.done);
+	pthread_mutex_unlock(&gr->upload.mutex);
+
+	wl_list_for_each_safe(job, next, &done, link)
+		upload_job_finish(gr, job);
+}
+
+static void
+upload_job_wait(struct gl_renderer *gr, struct upload_job *job)
+{
+	pthread_mutex_lock(&gr->upload.mutex);
+	while (!job->done)
+		pthread_cond_wait(&gr->upload.done_cond, &gr->upload.mutex);
+	pthread_mutex_unlock(&gr->upload.mutex);
+}
+
+/* Makes sure that the textures of the surface are not written to
+ * any more, and that what this context draws with them waits for the
+ * last upload. Only blocks while that upload has not been submitted
+ * yet. */
+static void
+surface_finish_upload(struct gl_renderer *gr, struct gl_surface_state *gs)
+{
+	if (!gs->upload_job)
+		return;
+
+	upload_job_wait(gr, gs->upload_job);
+	upload_reap(gr);
+}
+
+static int
+upload_event(int fd, uint32_t mask, void *data)
+{
+	struct gl_renderer *gr = data;
+	uint64_t count;
+
+	if (read(fd, &count, sizeof count) != sizeof count)
+		return 0;
+
+	upload_reap(gr);
+
+	return 0;
+}
+
+static void *
+upload_thread_function(void *data)
+{
+	struct gl_renderer *gr = data;
+	struct upload_job *job;
+	EGLSyncKHR fence;
+	uint64_t one = 1;
+
+	eglMakeCurrent(gr->egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+		       gr->upload.context);
+
+	pthread_mutex_lock(&gr->upload.mutex);
+	while (1) {
+		while (wl_list_empty(&gr->upload.queue) &&
+		       !gr->upload.destroying)
+			pthread_cond_wait(&gr->upload.input_cond,
+					  &gr->upload.mutex);
+
+		/* The queue is drained before exiting */
+		if (wl_list_empty(&gr->upload.queue))
+			break;
+
+		job = container_of(gr->upload.queue.next,
+				   struct upload_job, link);
+		wl_list_remove(&job->link);
+		pthread_mutex_unlock(&gr->upload.mutex);
+
+		shm_upload_run(gr, &job->upload, job->pixels,
+			       &gr->upload.staging,
+			       &gr->upload.staging_size);
+
+		fence = gr->upload.create_sync(gr->egl_display,
+					       EGL_SYNC_FENCE_KHR, NULL);
+		glFlush();
+
+		pthread_mutex_lock(&gr->upload.mutex);
+		job->fence = fence;
+		job->done = true;
+		wl_list_insert(gr->upload.done.prev, &job->link);
+		pthread_cond_broadcast(&gr->upload.done_cond);
+
+		if (write(gr->upload.event_fd, &one, sizeof one) < 0)
+			weston_log("failed to signal upload completion\n");
+	}
+	pthread_mutex_unlock(&gr->upload.mutex);
+
+	eglMakeCurrent(gr->egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+		       EGL_NO_CONTEXT);
+	eglReleaseThread();
+
+	return NULL;
+}
+
+static void
+upload_job_queue(struct gl_renderer *gr, struct gl_surface_state *gs,
+		 struct weston_buffer *buffer, struct shm_upload *up)
+{
+	struct upload_job *job;
+	pixman_box32_t *extents;
+	int first_row, last_row;
+	uint8_t *data;
+
+	if (up->full) {
+		first_row = 0;
+		last_row = up->height;
+	} else {
+		extents = pixman_region32_extents(&up->damage);
+		first_row = extents->y1;
+		last_row = extents->y2;
+	}
+
+	job = zalloc(sizeof *job);
+	if (job)
+		job->pixels = malloc((size_t) up->stride *
+				     (last_row - first_row));
+
+	wl_shm_buffer_begin_access(buffer->shm_buffer);
+	data = wl_shm_buffer_get_data(buffer->shm_buffer);
+
+	if (!job || !job->pixels) {
+		/* fall back to uploading right here */
+		shm_upload_run(gr, up, data, &gr->staging, &gr->staging_size);
+		wl_shm_buffer_end_access(buffer->shm_buffer);
+		pixman_region32_fini(&up->damage);
+		free(job);
+		return;
 	}
 
-	if (use_output(output) < 0)
-		return -1;
+	memcpy(job->pixels, data + (size_t) first_row * up->stride,
+	       (size_t) up->stride * (last_row - first_row));
+	wl_shm_buffer_end_access(buffer->shm_buffer);
 
-	glPixelStorei(GL_PACK_ALIGNMENT, 1);
-	glReadPixels(x, y, width, height, gl_format,
-		     GL_UNSIGNED_BYTE, pixels);
+	job->gr = gr;
+	job->upload = *up;
+	job->upload.first_row = first_row;
+	job->gs = gs;
 
-	return 0;
+	gs->upload_job = job;
+
+	/* so that the upload context sees new textures complete */
+	glFlush();
+
+	pthread_mutex_lock(&gr->upload.mutex);
+	wl_list_insert(gr->upload.queue.prev, &job->link);
+	pthread_cond_signal(&gr->upload.input_cond);
+	pthread_mutex_unlock(&gr->upload.mutex);
+}
+
+/* Describes the upload of the surface's texture damage, in buffer
+ * coordinates, and counts it in the upload statistics. */
+static void
+shm_upload_prepare(struct gl_renderer *gr, struct gl_surface_state *gs,
+		   struct weston_surface *surface,
+		   struct weston_buffer *buffer, struct shm_upload *up)
+{
+	pixman_box32_t *rectangles, r;
+	uint64_t area = 0;
+	int i, n, end;
+	bool whole;
+
+	up->texture = gs->textures[0];
+	up->gl_format = gs->gl_format;
+	up->gl_pixel_type = gs->gl_pixel_type;
+	up->pitch = gs->pitch;
+	up->height = buffer->height;
+	up->stride = wl_shm_buffer_get_stride(buffer->shm_buffer);
+	up->bpp = up->stride / gs->pitch;
+	up->first_row = 0;
+	up->atlas = false;
+
+	if (gs->atlas_shelf) {
+		up->texture = gr->atlas.texture;
+		up->atlas = true;
+		up->x = gs->atlas_x;
+		up->y = gs->atlas_y;
+		up->width = buffer->width;
+		up->full = true;
+		pixman_region32_init(&up->damage);
+
+		gr->upload_stats.frame_bytes +=
+			(uint64_t) (up->width + 2) * (up->height + 2) * 4;
+		gr->upload_stats.full_uploads++;
+		return;
+	}
+
+	/* Damage in buffer coordinates, without overlaps */
+	pixman_region32_init(&up->damage);
+	rectangles = pixman_region32_rectangles(&gs->texture_damage, &n);
+	for (i = 0; i < n; i++) {
+		r = weston_surface_to_buffer_rect(surface, rectangles[i]);
+		pixman_region32_union_rect(&up->damage, &up->damage,
+					   r.x1, r.y1,
+					   r.x2 - r.x1, r.y2 - r.y1);
+	}
+	pixman_region32_intersect_rect(&up->damage, &up->damage,
+				       0, 0, buffer->width, buffer->height);
+
+	rectangles = pixman_region32_rectangles(&up->damage, &n);
+	for (i = 0; i < n; i++)
+		area += (uint64_t) (rectangles[i].x2 - rectangles[i].x1) *
+			(rectangles[i].y2 - rectangles[i].y1);
+
+	up->full = gs->needs_full_upload ||
+		   (!gr->has_unpack_subimage &&
+		    area * 100 > (uint64_t) buffer->width * buffer->height *
+				 FULL_UPLOAD_THRESHOLD);
+
+	if (up->full) {
+		gr->upload_stats.frame_bytes +=
+			(uint64_t) up->stride * up->height;
+		gr->upload_stats.full_uploads++;
+	} else if (gr->has_unpack_subimage) {
+		gr->upload_stats.frame_bytes += area * up->bpp;
+		gr->upload_stats.partial_uploads++;
+	} else {
+		for (i = 0; i < n; i = end) {
+			end = damage_band(up, rectangles, i, n, &whole);
+			if (whole) {
+				gr->upload_stats.frame_bytes +=
+					(uint64_t) up->stride *
+					(rectangles[i].y2 - rectangles[i].y1);
+				continue;
+			}
+			for (; i < end; i++)
+				gr->upload_stats.frame_bytes +=
+					(uint64_t) up->bpp *
+					(rectangles[i].x2 - rectangles[i].x1) *
+					(rectangles[i].y2 - rectangles[i].y1);
+		}
+		gr->upload_stats.partial_uploads++;
+	}
 }
 
 static void
@@ -1231,14 +2146,9 @@ gl_renderer_flush_damage(struct weston_surface *surface)
 	struct gl_surface_state *gs = get_surface_state(surface);
 	struct weston_buffer *buffer = gs->buffer_ref.buffer;
 	struct weston_view *view;
+	struct shm_upload up;
 	bool texture_used;
 
-#ifdef GL_EXT_unpack_subimage
-	pixman_box32_t *rectangles;
-	void *data;
-	int i, n;
-#endif
-
 	pixman_region32_union(&gs->texture_damage,
 			      &gs->texture_damage, &surface->damage);
 
@@ -1264,49 +2174,20 @@ gl_renderer_flush_damage(struct weston_surface *surface)
 	    !gs->needs_full_upload)
 		goto done;
 
-	glBindTexture(GL_TEXTURE_2D, gs->textures[0]);
-
-	if (!gr->has_unpack_subimage) {
-		wl_shm_buffer_begin_access(buffer->shm_buffer);
-		glTexImage2D(GL_TEXTURE_2D, 0, gs->gl_format,
-			     gs->pitch, buffer->height, 0,
-			     gs->gl_format, gs->gl_pixel_type,
-			     wl_shm_buffer_get_data(buffer->shm_buffer));
-		wl_shm_buffer_end_access(buffer->shm_buffer);
-
-		goto done;
-	}
-
-#ifdef GL_EXT_unpack_subimage
-	glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, gs->pitch);
-	data = wl_shm_buffer_get_data(buffer->shm_buffer);
+	shm_upload_prepare(gr, gs, surface, buffer, &up);
 
-	if (gs->needs_full_upload) {
-		glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, 0);
-		glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, 0);
-		wl_shm_buffer_begin_access(buffer->shm_buffer);
-		glTexImage2D(GL_TEXTURE_2D, 0, gs->gl_format,
-			     gs->pitch, buffer->height, 0,
-			     gs->gl_format, gs->gl_pixel_type, data);
-		wl_shm_buffer_end_access(buffer->shm_buffer);
+	/* Atlas entries are small, and other entries of the atlas may
+	 * be drawn meanwhile */
+	if (gr->upload.enabled && !up.atlas) {
+		upload_job_queue(gr, gs, buffer, &up);
 		goto done;
 	}
 
-	rectangles = pixman_region32_rectangles(&gs->texture_damage, &n);
 	wl_shm_buffer_begin_access(buffer->shm_buffer);
-	for (i = 0; i < n; i++) {
-		pixman_box32_t r;
-
-		r = weston_surface_to_buffer_rect(surface, rectangles[i]);
-
-		glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, r.x1);
-		glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, r.y1);
-		glTexSubImage2D(GL_TEXTURE_2D, 0, r.x1, r.y1,
-				r.x2 - r.x1, r.y2 - r.y1,
-				gs->gl_format, gs->gl_pixel_type, data);
-	}
+	shm_upload_run(gr, &up, wl_shm_buffer_get_data(buffer->shm_buffer),
+		       &gr->staging, &gr->staging_size);
 	wl_shm_buffer_end_access(buffer->shm_buffer);
-#endif
+	pixman_region32_fini(&up.damage);
 
 done:
 	pixman_region32_fini(&gs->texture_damage);
@@ -1336,6 +2217,127 @@ ensure_textures(struct gl_surface_state *gs, int num_textures)
 	glBindTexture(gs->target, 0);
 }
 
+static bool
+atlas_shelf_find(struct atlas_shelf *shelf, int columns, int *column)
+{
+	int i, run = 0;
+
+	for (i = 0; i < ATLAS_COLUMNS; i++) {
+		if (shelf->used[i / 32] & (1u << (i % 32))) {
+			run = 0;
+			continue;
+		}
+
+		if (++run == columns) {
+			*column = i - columns + 1;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static struct atlas_shelf *
+atlas_get_shelf(struct gl_renderer *gr, int height, int columns, int *column)
+{
+	struct atlas_shelf *shelf;
+
+	/* A shelf of the same height, or an empty one that is high
+	 * enough */
+	wl_list_for_each(shelf, &gr->atlas.shelves, link)
+		if (shelf->height == height &&
+		    atlas_shelf_find(shelf, columns, column))
+			return shelf;
+
+	wl_list_for_each(shelf, &gr->atlas.shelves, link)
+		if (shelf->n_entries == 0 && shelf->height >= height) {
+			*column = 0;
+			return shelf;
+		}
+
+	if (gr->atlas.top + height > ATLAS_SIZE)
+		return NULL;
+
+	shelf = zalloc(sizeof *shelf);
+	if (!shelf)
+		return NULL;
+
+	shelf->y = gr->atlas.top;
+	shelf->height = height;
+	gr->atlas.top += height;
+	wl_list_insert(gr->atlas.shelves.prev, &shelf->link);
+	*column = 0;
+
+	return shelf;
+}
+
+/* Places a surface of the given size in the atlas. Fails for large
+ * surfaces and when the atlas is full. */
+static bool
+atlas_alloc(struct gl_renderer *gr, struct gl_surface_state *gs,
+	    int width, int height)
+{
+	struct atlas_shelf *shelf;
+	int i, columns, column;
+
+	if (width > ATLAS_MAX_SURFACE || height > ATLAS_MAX_SURFACE)
+		return false;
+
+	if (!gr->atlas.texture) {
+		glGenTextures(1, &gr->atlas.texture);
+		glBindTexture(GL_TEXTURE_2D, gr->atlas.texture);
+		glTexParameteri(GL_TEXTURE_2D,
+				GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D,
+				GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_BGRA_EXT,
+			     ATLAS_SIZE, ATLAS_SIZE, 0,
+			     GL_BGRA_EXT, GL_UNSIGNED_BYTE, NULL);
+		glBindTexture(GL_TEXTURE_2D, 0);
+	}
+
+	/* with the gutter on both sides */
+	columns = (width + 2 + ATLAS_COLUMN - 1) / ATLAS_COLUMN;
+	height = (height + 2 + ATLAS_SHELF_STEP - 1) /
+		 ATLAS_SHELF_STEP * ATLAS_SHELF_STEP;
+
+	shelf = atlas_get_shelf(gr, height, columns, &column);
+	if (!shelf)
+		return false;
+
+	for (i = column; i < column + columns; i++)
+		shelf->used[i / 32] |= 1u << (i % 32);
+	shelf->n_entries++;
+	gr->atlas.n_entries++;
+
+	gs->atlas_shelf = shelf;
+	gs->atlas_column = column;
+	gs->atlas_columns = columns;
+	gs->atlas_x = column * ATLAS_COLUMN + 1;
+	gs->atlas_y = shelf->y + 1;
+	gs->atlas_width = width;
+
+	return true;
+}
+
+static void
+atlas_free(struct gl_renderer *gr, struct gl_surface_state *gs)
+{
+	struct atlas_shelf *shelf = gs->atlas_shelf;
+	int i;
+
+	if (!shelf)
+		return;
+
+	for (i = gs->atlas_column;
+	     i < gs->atlas_column + gs->atlas_columns; i++)
+		shelf->used[i / 32] &= ~(1u << (i % 32));
+	shelf->n_entries--;
+	gr->atlas.n_entries--;
+
+	gs->atlas_shelf = NULL;
+}
+
 static void
 gl_renderer_attach_shm(struct weston_surface *es, struct weston_buffer *buffer,
 		       struct wl_shm_buffer *shm_buffer)
@@ -1394,7 +2396,15 @@ gl_renderer_attach_shm(struct weston_surface *es, struct weston_buffer *buffer,
 
 		gs->surface = es;
 
-		ensure_textures(gs, 1);
+		/* Resized surfaces leave their atlas entry */
+		atlas_free(gr, gs);
+		if (gl_format == GL_BGRA_EXT &&
+		    atlas_alloc(gr, gs, buffer->width, buffer->height)) {
+			glDeleteTextures(gs->num_textures, gs->textures);
+			gs->num_textures = 0;
+		} else {
+			ensure_textures(gs, 1);
+		}
 	}
 }
 
@@ -1893,9 +2903,13 @@ gl_renderer_attach(struct weston_surface *es, struct weston_buffer *buffer)
 	EGLint format;
 	int i;
 
+	/* The textures may be respecified below */
+	surface_finish_upload(gr, gs);
+
 	weston_buffer_reference(&gs->buffer_ref, buffer);
 
 	if (!buffer) {
+		atlas_free(gr, gs);
 		for (i = 0; i < gs->num_images; i++) {
 			egl_image_unref(gs->images[i]);
 			gs->images[i] = NULL;
@@ -1909,6 +2923,8 @@ gl_renderer_attach(struct weston_surface *es, struct weston_buffer *buffer)
 	}
 
 	shm_buffer = wl_shm_buffer_get(buffer->resource);
+	if (!shm_buffer)
+		atlas_free(gr, gs);
 
 	if (shm_buffer)
 		gl_renderer_attach_shm(es, buffer, shm_buffer);
@@ -1936,6 +2952,7 @@ gl_renderer_surface_set_color(struct weston_surface *surface,
 	gs->color[1] = green;
 	gs->color[2] = blue;
 	gs->color[3] = alpha;
+	atlas_free(gr, gs);
 	gs->buffer_type = BUFFER_TYPE_SOLID;
 	gs->pitch = 1;
 	gs->height = 1;
@@ -2002,6 +3019,8 @@ gl_renderer_surface_copy_content(struct weston_surface *surface,
 	const pixman_format_code_t format = PIXMAN_a8b8g8r8;
 	const size_t bytespp = 4; /* PIXMAN_a8b8g8r8 */
 	const GLenum gl_format = GL_RGBA; /* PIXMAN_a8b8g8r8 little-endian */
+	const GLfloat *texcoords;
+	GLfloat atlas_texcoords[4 * 2];
 	struct gl_renderer *gr = get_renderer(surface->compositor);
 	struct gl_surface_state *gs = get_surface_state(surface);
 	int cw, ch;
@@ -2021,6 +3040,7 @@ gl_renderer_surface_copy_content(struct weston_surface *surface,
 		return 0;
 	case BUFFER_TYPE_SHM:
 		gl_renderer_flush_damage(surface);
+		surface_finish_upload(gr, gs);
 		/* fall through */
 	case BUFFER_TYPE_EGL:
 		break;
@@ -2065,12 +3085,29 @@ gl_renderer_surface_copy_content(struct weston_surface *surface,
 		glTexParameteri(gs->target, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 	}
 
+	texcoords = verts;
+	if (gs->atlas_shelf) {
+		for (i = 0; i < 4; i++) {
+			atlas_texcoords[i * 2] = (gs->atlas_x +
+				verts[i * 2] * gs->atlas_width) / ATLAS_SIZE;
+			atlas_texcoords[i * 2 + 1] = (gs->atlas_y +
+				verts[i * 2 + 1] * gs->height) / ATLAS_SIZE;
+		}
+		texcoords = atlas_texcoords;
+
+		glUniform1i(gs->shader->tex_uniforms[0], 0);
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, gr->atlas.texture);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	}
+
 	/* position: */
 	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, verts);
 	glEnableVertexAttribArray(0);
 
 	/* texcoord: */
-	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, verts);
+	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, texcoords);
 	glEnableVertexAttribArray(1);
 
 	glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
@@ -2098,6 +3135,8 @@ surface_state_destroy(struct gl_surface_state *gs, struct gl_renderer *gr)
 
 	gs->surface->renderer_state = NULL;
 
+	surface_finish_upload(gr, gs);
+	atlas_free(gr, gs);
 	glDeleteTextures(gs->num_textures, gs->textures);
 
 	for (i = 0; i < gs->num_images; i++)
@@ -2178,12 +3217,13 @@ gl_renderer_create_surface(struct weston_surface *surface)
 
 static const char vertex_shader[] =
 	"uniform mat4 proj;\n"
+	"uniform float depth;\n"
 	"attribute vec2 position;\n"
 	"attribute vec2 texcoord;\n"
 	"varying vec2 v_texcoord;\n"
 	"void main()\n"
 	"{\n"
-	"   gl_Position = proj * vec4(position, 0.0, 1.0);\n"
+	"   gl_Position = proj * vec4(position, depth, 1.0);\n"
 	"   v_texcoord = texcoord;\n"
 	"}\n";
 
@@ -2304,17 +3344,141 @@ compile_shader(GLenum type, int count, const char **sources)
 	return s;
 }
 
+#define SHADER_CACHE_MAGIC 0x43534757	/* "WGSC" */
+#define SHADER_CACHE_VERSION 1
+
+struct shader_cache_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t key;
+	uint32_t format;
+	uint32_t length;
+};
+
+/* 64 bit FNV-1a, including the terminating zero */
+static uint64_t
+shader_cache_hash(uint64_t hash, const char *str)
+{
+	do {
+		hash ^= (unsigned char) *str;
+		hash *= 0x100000001b3ULL;
+	} while (*str++);
+
+	return hash;
+}
+
+static void
+shader_cache_path(struct gl_renderer *gr, uint64_t key,
+		  char *path, size_t size)
+{
+	snprintf(path, size, "%s/shader-%016" PRIx64 ".bin",
+		 gr->shader_cache_dir, key);
+}
+
+/* Loads the program binary for key into program. Fails if there is
+ * none, or if it was made by another driver or does not link any
+ * more, in which case the caller compiles from source and replaces
+ * it. */
+static int
+shader_cache_load(struct gl_renderer *gr, GLuint program, uint64_t key)
+{
+	struct shader_cache_header header;
+	char path[PATH_MAX];
+	void *binary = NULL;
+	GLint status = GL_FALSE;
+	FILE *fp;
+
+	shader_cache_path(gr, key, path, sizeof path);
+	fp = fopen(path, "rb");
+	if (!fp)
+		return -1;
+
+	if (fread(&header, sizeof header, 1, fp) != 1 ||
+	    header.magic != SHADER_CACHE_MAGIC ||
+	    header.version != SHADER_CACHE_VERSION ||
+	    header.key != key || header.length == 0)
+		goto out;
+
+	binary = malloc(header.length);
+	if (!binary || fread(binary, header.length, 1, fp) != 1)
+		goto out;
+
+	gr->program_binary(program, header.format, binary, header.length);
+	glGetProgramiv(program, GL_LINK_STATUS, &status);
+
+out:
+	free(binary);
+	fclose(fp);
+
+	if (status != GL_TRUE) {
+		weston_log("GL shader cache: discarding stale %s\n", path);
+		unlink(path);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void
+shader_cache_store(struct gl_renderer *gr, GLuint program, uint64_t key)
+{
+	struct shader_cache_header header;
+	char path[PATH_MAX], tmp[PATH_MAX + 16];
+	void *binary;
+	GLint length = 0;
+	GLenum format;
+	FILE *fp;
+	int ok;
+
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH_OES, &length);
+	if (length <= 0)
+		return;
+
+	binary = malloc(length);
+	if (!binary)
+		return;
+
+	gr->get_program_binary(program, length, &length, &format, binary);
+
+	header.magic = SHADER_CACHE_MAGIC;
+	header.version = SHADER_CACHE_VERSION;
+	header.key = key;
+	header.format = format;
+	header.length = length;
+
+	/* Write a temporary file and rename it, so that a concurrent
+	 * compositor never reads half a binary */
+	shader_cache_path(gr, key, path, sizeof path);
+	snprintf(tmp, sizeof tmp, "%s.%d", path, (int) getpid());
+
+	fp = fopen(tmp, "wb");
+	if (!fp) {
+		free(binary);
+		return;
+	}
+
+	ok = fwrite(&header, sizeof header, 1, fp) == 1 &&
+	     fwrite(binary, length, 1, fp) == 1;
+	if (fclose(fp) != 0)
+		ok = 0;
+	free(binary);
+
+	if (!ok || rename(tmp, path) < 0) {
+		weston_log("GL shader cache: failed to write %s\n", path);
+		unlink(tmp);
+	}
+}
+
 static int
 shader_init(struct gl_shader *shader, struct gl_renderer *renderer,
 		   const char *vertex_source, const char *fragment_source)
 {
 	char msg[512];
 	GLint status;
-	int count;
+	int count, i;
 	const char *sources[3];
-
-	shader->vertex_shader =
-		compile_shader(GL_VERTEX_SHADER, 1, &vertex_source);
+	uint64_t key = 0;
+	bool cached = false;
 
 	if (renderer->fragment_shader_debug) {
 		sources[0] = fragment_source;
@@ -2327,10 +3491,28 @@ shader_init(struct gl_shader *shader, struct gl_renderer *renderer,
 		count = 2;
 	}
 
+	shader->program = glCreateProgram();
+
+	if (renderer->shader_cache_dir) {
+		key = shader_cache_hash(renderer->shader_cache_driver,
+					vertex_source);
+		for (i = 0; i < count; i++)
+			key = shader_cache_hash(key, sources[i]);
+
+		renderer->shader_cache_lookups++;
+		if (shader_cache_load(renderer, shader->program, key) == 0) {
+			renderer->shader_cache_hits++;
+			cached = true;
+			goto uniforms;
+		}
+	}
+
+	shader->vertex_shader =
+		compile_shader(GL_VERTEX_SHADER, 1, &vertex_source);
+
 	shader->fragment_shader =
 		compile_shader(GL_FRAGMENT_SHADER, count, sources);
 
-	shader->program = glCreateProgram();
 	glAttachShader(shader->program, shader->vertex_shader);
 	glAttachShader(shader->program, shader->fragment_shader);
 	glBindAttribLocation(shader->program, 0, "position");
@@ -2344,12 +3526,24 @@ shader_init(struct gl_shader *shader, struct gl_renderer *renderer,
 		return -1;
 	}
 
+	if (renderer->shader_cache_dir)
+		shader_cache_store(renderer, shader->program, key);
+
+uniforms:
+	if (renderer->shader_cache_dir)
+		weston_log("GL shader cache: %s program %016" PRIx64
+			   ", %d of %d programs from the cache\n",
+			   cached ? "loaded" : "stored", key,
+			   renderer->shader_cache_hits,
+			   renderer->shader_cache_lookups);
+
 	shader->proj_uniform = glGetUniformLocation(shader->program, "proj");
 	shader->tex_uniforms[0] = glGetUniformLocation(shader->program, "tex");
 	shader->tex_uniforms[1] = glGetUniformLocation(shader->program, "tex1");
 	shader->tex_uniforms[2] = glGetUniformLocation(shader->program, "tex2");
 	shader->alpha_uniform = glGetUniformLocation(shader->program, "alpha");
 	shader->color_uniform = glGetUniformLocation(shader->program, "color");
+	shader->depth_uniform = glGetUniformLocation(shader->program, "depth");
 
 	return 0;
 }
@@ -2469,10 +3663,51 @@ match_config_to_visual(EGLDisplay egl_display,
 	return -1;
 }
 
+static int
+egl_choose_config_with_attribs(struct gl_renderer *gr, const EGLint *attribs,
+			       const EGLint *visual_id, const int n_ids,
+			       EGLConfig *config_out);
+
+/* Like egl_choose_config_with_attribs(), but asks for a depth buffer
+ * too when depth testing is enabled. Without a config that has one,
+ * depth testing is turned off again. */
 static int
 egl_choose_config(struct gl_renderer *gr, const EGLint *attribs,
 		  const EGLint *visual_id, const int n_ids,
 		  EGLConfig *config_out)
+{
+	EGLint depth_attribs[64];
+	int i;
+
+	if (!gr->depth_test)
+		return egl_choose_config_with_attribs(gr, attribs, visual_id,
+						      n_ids, config_out);
+
+	for (i = 0; attribs[i] != EGL_NONE &&
+		    i < (int) ARRAY_LENGTH(depth_attribs) - 3; i += 2) {
+		depth_attribs[i] = attribs[i];
+		depth_attribs[i + 1] = attribs[i + 1];
+	}
+	depth_attribs[i++] = EGL_DEPTH_SIZE;
+	depth_attribs[i++] = 16;
+	depth_attribs[i] = EGL_NONE;
+
+	if (egl_choose_config_with_attribs(gr, depth_attribs, visual_id,
+					   n_ids, config_out) == 0)
+		return 0;
+
+	weston_log("No EGL config with a depth buffer, "
+		   "disabling depth testing.\n");
+	gr->depth_test = false;
+
+	return egl_choose_config_with_attribs(gr, attribs, visual_id,
+					      n_ids, config_out);
+}
+
+static int
+egl_choose_config_with_attribs(struct gl_renderer *gr, const EGLint *attribs,
+			       const EGLint *visual_id, const int n_ids,
+			       EGLConfig *config_out)
 {
 	EGLint count = 0;
 	EGLint matched = 0;
@@ -2606,6 +3841,12 @@ gl_renderer_output_create(struct weston_output *output,
 	for (i = 0; i < BUFFER_DAMAGE_COUNT; i++)
 		pixman_region32_init(&go->buffer_damage[i]);
 
+	wl_list_init(&go->readbacks);
+	wl_list_init(&go->free_readbacks);
+	go->readback_timer =
+		wl_event_loop_add_timer(wl_display_get_event_loop(ec->wl_display),
+					readback_timer_handler, output);
+
 	output->renderer_state = go;
 
 	log_egl_config_info(gr->egl_display, egl_config);
@@ -2618,8 +3859,18 @@ gl_renderer_output_destroy(struct weston_output *output)
 {
 	struct gl_renderer *gr = get_renderer(output->compositor);
 	struct gl_output_state *go = get_output_state(output);
+	struct gl_readback *rb, *next;
 	int i;
 
+	if (!wl_list_empty(&go->readbacks) || !wl_list_empty(&go->free_readbacks))
+		use_output(output);
+
+	gl_output_finish_readbacks(output, true);
+	wl_list_for_each_safe(rb, next, &go->free_readbacks, link)
+		gl_readback_destroy(rb);
+	if (go->readback_timer)
+		wl_event_source_remove(go->readback_timer);
+
 	for (i = 0; i < 2; i++)
 		pixman_region32_fini(&go->buffer_damage[i]);
 
@@ -2634,14 +3885,24 @@ gl_renderer_output_surface(struct weston_output *output)
 	return get_output_state(output)->egl_surface;
 }
 
+static void
+upload_thread_destroy(struct gl_renderer *gr);
+
 static void
 gl_renderer_destroy(struct weston_compositor *ec)
 {
 	struct gl_renderer *gr = get_renderer(ec);
 	struct dmabuf_image *image, *next;
+	struct atlas_shelf *shelf, *next_shelf;
 
 	wl_signal_emit(&gr->destroy_signal, gr);
 
+	upload_thread_destroy(gr);
+
+	glDeleteBuffers(1, &gr->vbo);
+	if (gr->atlas.texture)
+		glDeleteTextures(1, &gr->atlas.texture);
+
 	if (gr->has_bind_display)
 		gr->unbind_display(gr->egl_display, ec->wl_display);
 
@@ -2660,10 +3921,18 @@ gl_renderer_destroy(struct weston_compositor *ec)
 	wl_array_release(&gr->vertices);
 	wl_array_release(&gr->vtxcnt);
 
+	free(gr->shader_cache_dir);
+	free(gr->staging);
+
+	wl_list_for_each_safe(shelf, next_shelf, &gr->atlas.shelves, link)
+		free(shelf);
+
 	if (gr->fragment_binding)
 		weston_binding_destroy(gr->fragment_binding);
 	if (gr->fan_binding)
 		weston_binding_destroy(gr->fan_binding);
+	if (gr->upload_binding)
+		weston_binding_destroy(gr->upload_binding);
 
 	free(gr);
 }
@@ -2878,8 +4147,10 @@ gl_renderer_create(struct weston_compositor *ec, EGLenum platform,
 	const EGLint *visual_id, int n_ids)
 {
 	struct gl_renderer *gr;
+	struct weston_config_section *section;
 	EGLint major, minor;
 	int supports = 0;
+	int depth_test;
 
 	if (platform) {
 		supports = gl_renderer_supports(
@@ -2893,6 +4164,7 @@ gl_renderer_create(struct weston_compositor *ec, EGLenum platform,
 		return -1;
 
 	gr->base.read_pixels = gl_renderer_read_pixels;
+	gr->base.read_pixels_async = gl_renderer_read_pixels_async;
 	gr->base.repaint_output = gl_renderer_repaint_output;
 	gr->base.flush_damage = gl_renderer_flush_damage;
 	gr->base.attach = gl_renderer_attach;
@@ -2938,6 +4210,11 @@ gl_renderer_create(struct weston_compositor *ec, EGLenum platform,
 		goto fail_with_error;
 	}
 
+	section = weston_config_get_section(ec->config, "core", NULL, NULL);
+	weston_config_section_get_bool(section, "gl-depth-test",
+				       &depth_test, 0);
+	gr->depth_test = depth_test;
+
 	if (egl_choose_config(gr, attribs, visual_id,
 			      n_ids, &gr->egl_config) < 0) {
 		weston_log("failed to choose EGL config\n");
@@ -2953,6 +4230,7 @@ gl_renderer_create(struct weston_compositor *ec, EGLenum platform,
 		goto fail_with_error;
 
 	wl_list_init(&gr->dmabuf_images);
+	wl_list_init(&gr->atlas.shelves);
 	if (gr->has_dmabuf_import)
 		gr->base.import_dmabuf = gl_renderer_import_dmabuf;
 
@@ -2977,6 +4255,192 @@ gl_renderer_display(struct weston_compositor *ec)
 	return get_renderer(ec)->egl_display;
 }
 
+/* Binaries go to $XDG_CACHE_HOME/weston, and are keyed by the GL
+ * vendor, renderer and version strings and the shader sources. */
+static void
+shader_cache_init(struct weston_compositor *ec, const char *extensions)
+{
+	struct gl_renderer *gr = get_renderer(ec);
+	struct weston_config_section *section;
+	const char *cache_home, *str;
+	char *base = NULL;
+	GLint n_formats = 0;
+	int enabled;
+
+	section = weston_config_get_section(ec->config, "core", NULL, NULL);
+	weston_config_section_get_bool(section, "gl-shader-cache",
+				       &enabled, 1);
+	if (!enabled)
+		return;
+
+	if (!check_extension(extensions, "GL_OES_get_program_binary"))
+		return;
+
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS_OES, &n_formats);
+	if (n_formats < 1)
+		return;
+
+	gr->get_program_binary =
+		(void *) eglGetProcAddress("glGetProgramBinaryOES");
+	gr->program_binary =
+		(void *) eglGetProcAddress("glProgramBinaryOES");
+	if (!gr->get_program_binary || !gr->program_binary)
+		return;
+
+	cache_home = getenv("XDG_CACHE_HOME");
+	if (cache_home) {
+		base = strdup(cache_home);
+	} else {
+		str = getenv("HOME");
+		if (!str || asprintf(&base, "%s/.cache", str) < 0)
+			base = NULL;
+	}
+	if (!base)
+		return;
+
+	if (asprintf(&gr->shader_cache_dir, "%s/weston", base) < 0)
+		gr->shader_cache_dir = NULL;
+
+	if (gr->shader_cache_dir &&
+	    ((mkdir(base, 0700) < 0 && errno != EEXIST) ||
+	     (mkdir(gr->shader_cache_dir, 0700) < 0 && errno != EEXIST))) {
+		weston_log("GL shader cache: cannot create %s: %m\n",
+			   gr->shader_cache_dir);
+		free(gr->shader_cache_dir);
+		gr->shader_cache_dir = NULL;
+	}
+	free(base);
+
+	gr->shader_cache_driver = 0xcbf29ce484222325ULL;
+	str = (const char *) glGetString(GL_VENDOR);
+	gr->shader_cache_driver =
+		shader_cache_hash(gr->shader_cache_driver, str ? str : "");
+	str = (const char *) glGetString(GL_RENDERER);
+	gr->shader_cache_driver =
+		shader_cache_hash(gr->shader_cache_driver, str ? str : "");
+	str = (const char *) glGetString(GL_VERSION);
+	gr->shader_cache_driver =
+		shader_cache_hash(gr->shader_cache_driver, str ? str : "");
+}
+
+static void
+upload_thread_init(struct weston_compositor *ec, EGLConfig context_config,
+		   const EGLint *context_attribs)
+{
+	struct gl_renderer *gr = get_renderer(ec);
+	struct weston_config_section *section;
+	struct wl_event_loop *loop;
+	const char *extensions;
+	sigset_t mask, old_mask;
+	int enabled, ret;
+
+	section = weston_config_get_section(ec->config, "core", NULL, NULL);
+	weston_config_section_get_bool(section, "gl-upload-thread",
+				       &enabled, 0);
+	if (!enabled)
+		return;
+
+	extensions = eglQueryString(gr->egl_display, EGL_EXTENSIONS);
+	if (!extensions ||
+	    !check_extension(extensions, "EGL_KHR_fence_sync") ||
+	    !check_extension(extensions, "EGL_KHR_wait_sync") ||
+	    !check_extension(extensions, "EGL_KHR_surfaceless_context")) {
+		weston_log("GL upload thread needs EGL_KHR_fence_sync, "
+			   "EGL_KHR_wait_sync and "
+			   "EGL_KHR_surfaceless_context\n");
+		return;
+	}
+
+	gr->upload.create_sync =
+		(void *) eglGetProcAddress("eglCreateSyncKHR");
+	gr->upload.destroy_sync =
+		(void *) eglGetProcAddress("eglDestroySyncKHR");
+	gr->upload.wait_sync = (void *) eglGetProcAddress("eglWaitSyncKHR");
+	if (!gr->upload.create_sync || !gr->upload.destroy_sync ||
+	    !gr->upload.wait_sync)
+		return;
+
+	gr->upload.context = eglCreateContext(gr->egl_display,
+					      context_config,
+					      gr->egl_context,
+					      context_attribs);
+	if (gr->upload.context == EGL_NO_CONTEXT) {
+		weston_log("failed to create the upload context\n");
+		gl_renderer_print_egl_error_state();
+		return;
+	}
+
+	gr->upload.event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (gr->upload.event_fd < 0)
+		goto err_context;
+
+	loop = wl_display_get_event_loop(ec->wl_display);
+	gr->upload.event_source =
+		wl_event_loop_add_fd(loop, gr->upload.event_fd,
+				     WL_EVENT_READABLE, upload_event, gr);
+	if (!gr->upload.event_source)
+		goto err_fd;
+
+	pthread_mutex_init(&gr->upload.mutex, NULL);
+	pthread_cond_init(&gr->upload.input_cond, NULL);
+	pthread_cond_init(&gr->upload.done_cond, NULL);
+	wl_list_init(&gr->upload.queue);
+	wl_list_init(&gr->upload.done);
+
+	/* The thread must not receive the signals the compositor blocks
+	 * later on to read them from signalfds, e.g. Xwayland's SIGUSR1 */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+	ret = pthread_create(&gr->upload.thread, NULL,
+			     upload_thread_function, gr);
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+	if (ret != 0) {
+		pthread_mutex_destroy(&gr->upload.mutex);
+		pthread_cond_destroy(&gr->upload.input_cond);
+		pthread_cond_destroy(&gr->upload.done_cond);
+		wl_event_source_remove(gr->upload.event_source);
+		goto err_fd;
+	}
+
+	gr->upload.enabled = true;
+	return;
+
+err_fd:
+	close(gr->upload.event_fd);
+err_context:
+	eglDestroyContext(gr->egl_display, gr->upload.context);
+	weston_log("failed to start the GL upload thread\n");
+}
+
+/* Runs the uploads still queued and releases their buffers. Needs the
+ * renderer context to be current. */
+static void
+upload_thread_destroy(struct gl_renderer *gr)
+{
+	if (!gr->upload.enabled)
+		return;
+
+	pthread_mutex_lock(&gr->upload.mutex);
+	gr->upload.destroying = 1;
+	pthread_cond_signal(&gr->upload.input_cond);
+	pthread_mutex_unlock(&gr->upload.mutex);
+
+	pthread_join(gr->upload.thread, NULL);
+	upload_reap(gr);
+
+	wl_event_source_remove(gr->upload.event_source);
+	close(gr->upload.event_fd);
+	eglDestroyContext(gr->egl_display, gr->upload.context);
+
+	pthread_mutex_destroy(&gr->upload.mutex);
+	pthread_cond_destroy(&gr->upload.input_cond);
+	pthread_cond_destroy(&gr->upload.done_cond);
+	free(gr->upload.staging);
+
+	gr->upload.enabled = false;
+}
+
 static int
 compile_shaders(struct weston_compositor *ec)
 {
@@ -3035,6 +4499,29 @@ fragment_debug_binding(struct weston_keyboard *keyboard, uint32_t time,
 		weston_output_damage(output);
 }
 
+static void
+upload_stats_binding(struct weston_keyboard *keyboard, uint32_t time,
+		     uint32_t key, void *data)
+{
+	struct weston_compositor *ec = data;
+	struct gl_renderer *gr = get_renderer(ec);
+	uint32_t frames = gr->upload_stats.frames;
+
+	weston_log("GL texture uploads over %u repaints: %u full, %u partial\n",
+		   frames, gr->upload_stats.full_uploads,
+		   gr->upload_stats.partial_uploads);
+	weston_log_continue(STAMP_SPACE "%.1f KiB per repaint on average, "
+			    "%.1f KiB at most\n",
+			    frames ? gr->upload_stats.total_bytes /
+				     1024.0 / frames : 0.0,
+			    gr->upload_stats.max_frame_bytes / 1024.0);
+	weston_log_continue(STAMP_SPACE "%d surfaces in the texture atlas, "
+			    "%d of %d rows in use\n",
+			    gr->atlas.n_entries, gr->atlas.top, ATLAS_SIZE);
+
+	memset(&gr->upload_stats, 0, sizeof gr->upload_stats);
+}
+
 static void
 fan_debug_repaint_binding(struct weston_keyboard *keyboard, uint32_t time,
 			  uint32_t key, void *data)
@@ -3050,9 +4537,10 @@ static int
 gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface)
 {
 	struct gl_renderer *gr = get_renderer(ec);
-	const char *extensions;
+	const char *extensions, *version;
 	EGLConfig context_config;
 	EGLBoolean ret;
+	int gl_major;
 
 	static const EGLint context_attribs[] = {
 		EGL_CONTEXT_CLIENT_VERSION, 2,
@@ -3117,8 +4605,34 @@ gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface)
 	if (check_extension(extensions, "GL_OES_EGL_image_external"))
 		gr->has_egl_image_external = 1;
 
+	version = (const char *) glGetString(GL_VERSION);
+	if (version && sscanf(version, "OpenGL ES %d.", &gl_major) == 1 &&
+	    gl_major >= 3) {
+		gr->map_buffer_range =
+			(void *) eglGetProcAddress("glMapBufferRange");
+		gr->unmap_buffer = (void *) eglGetProcAddress("glUnmapBuffer");
+		gr->pbo_usage = GL_STREAM_READ;
+	} else if (check_extension(extensions, "GL_NV_pixel_buffer_object") &&
+		   check_extension(extensions, "GL_EXT_map_buffer_range") &&
+		   check_extension(extensions, "GL_OES_mapbuffer")) {
+		gr->map_buffer_range =
+			(void *) eglGetProcAddress("glMapBufferRangeEXT");
+		gr->unmap_buffer =
+			(void *) eglGetProcAddress("glUnmapBufferOES");
+		/* GLES2 glBufferData() only knows the *_DRAW usages */
+		gr->pbo_usage = GL_STREAM_DRAW;
+	}
+
+	if (gr->map_buffer_range && gr->unmap_buffer)
+		gr->has_pbo_readback = 1;
+
 	glActiveTexture(GL_TEXTURE0);
 
+	glGenBuffers(1, &gr->vbo);
+
+	shader_cache_init(ec, extensions);
+	upload_thread_init(ec, context_config, context_attribs);
+
 	if (compile_shaders(ec))
 		return -1;
 
@@ -3130,15 +4644,30 @@ gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface)
 		weston_compositor_add_debug_binding(ec, KEY_F,
 						    fan_debug_repaint_binding,
 						    ec);
+	gr->upload_binding =
+		weston_compositor_add_debug_binding(ec, KEY_U,
+						    upload_stats_binding,
+						    ec);
 
 	weston_log("GL ES 2 renderer features:\n");
 	weston_log_continue(STAMP_SPACE "read-back format: %s\n",
 		ec->read_format == PIXMAN_a8r8g8b8 ? "BGRA" : "RGBA");
 	weston_log_continue(STAMP_SPACE "wl_shm sub-image to texture: %s\n",
 			    gr->has_unpack_subimage ? "yes" : "no");
+	weston_log_continue(STAMP_SPACE "asynchronous read-back: %s\n",
+			    gr->has_pbo_readback ? "yes" : "no");
 	weston_log_continue(STAMP_SPACE "EGL Wayland extension: %s\n",
 			    gr->has_bind_display ? "yes" : "no");
-
+	weston_log_continue(STAMP_SPACE "depth-tested opaque pass: %s\n",
+			    gr->depth_test ? "yes" : "no");
+	weston_log_continue(STAMP_SPACE "program binary cache: %s\n",
+			    gr->shader_cache_dir ? gr->shader_cache_dir : "no");
+	weston_log_continue(STAMP_SPACE "wl_shm upload thread: %s\n",
+			    gr->upload.enabled ? "yes" : "no");
+	weston_log_continue(STAMP_SPACE "wl_shm texture atlas: %dx%d, "
+			    "for surfaces up to %dx%d\n",
+			    ATLAS_SIZE, ATLAS_SIZE,
+			    ATLAS_MAX_SURFACE, ATLAS_MAX_SURFACE);
 
 	return 0;
 }
@@ -258,6 +258,12 @@ udev_input_enable(struct udev_input *input)
 			devices_found = 1;
 	}
 
+	if (devices_found == 0 && !input->compositor->require_input) {
+		weston_log("warning: no input devices found, but none "
+			   "required by the configuration.\n");
+		return 0;
+	}
+
 	if (devices_found == 0) {
 		weston_log(
 			"warning: no input devices on entering Weston. "
@@ -27,8 +27,13 @@
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
 #include <sys/time.h>
 #include <time.h>
 
@@ -38,40 +43,343 @@
 
 #include "os-compatibility.h"
 
+/* Messages to a log file are queued in a ring buffer and written out
+ * by a thread, so a slow log file cannot stall the compositor.
+ * Messages that do not fit are dropped and counted. stderr is always
+ * written synchronously. */
+#define LOG_RING_SIZE (256 * 1024)	/* power of two */
+#define LOG_LINE_SIZE 1024
+#define LOG_WAKEUP_TIMEOUT 100		/* ms, in case a wakeup is lost */
+
 static FILE *weston_logfile = NULL;
 
 static int cached_tm_mday = -1;
 
-static int weston_log_timestamp(void)
+/* head is only written by producers, tail only by the writer thread;
+ * both only ever grow and are accessed with __atomic builtins. */
+static struct {
+	bool async;
+	char *data;
+	size_t head, tail;
+	unsigned int dropped;
+	int fd;
+
+	/* Serializes producers; the writer thread never takes it */
+	pthread_mutex_t producer_mutex;
+
+	pthread_t writer_thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int writer_sleeping;
+	int destroying;
+} log_ring = {
+	.producer_mutex = PTHREAD_MUTEX_INITIALIZER,
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static int weston_log_timestamp(char *buf, size_t size)
 {
 	struct timeval tv;
 	struct tm *brokendown_time;
 	char string[128];
+	int l = 0;
 
 	gettimeofday(&tv, NULL);
 
 	brokendown_time = localtime(&tv.tv_sec);
 	if (brokendown_time == NULL)
-		return fprintf(weston_logfile, "[(NULL)localtime] ");
+		return snprintf(buf, size, "[(NULL)localtime] ");
 
 	if (brokendown_time->tm_mday != cached_tm_mday) {
 		strftime(string, sizeof string, "%Y-%m-%d %Z", brokendown_time);
-		fprintf(weston_logfile, "Date: %s\n", string);
+		l = snprintf(buf, size, "Date: %s\n", string);
 
 		cached_tm_mday = brokendown_time->tm_mday;
 	}
 
 	strftime(string, sizeof string, "%H:%M:%S", brokendown_time);
 
-	return fprintf(weston_logfile, "[%s.%03li] ", string, tv.tv_usec/1000);
+	return l + snprintf(buf + l, size - l, "[%s.%03li] ",
+			    string, tv.tv_usec/1000);
+}
+
+static bool
+log_async(void)
+{
+	return __atomic_load_n(&log_ring.async, __ATOMIC_ACQUIRE);
+}
+
+static void
+log_ring_copy_in(size_t pos, const char *src, size_t len)
+{
+	size_t offset = pos & (LOG_RING_SIZE - 1);
+	size_t n = LOG_RING_SIZE - offset;
+
+	if (n > len)
+		n = len;
+
+	memcpy(log_ring.data + offset, src, n);
+	memcpy(log_ring.data, src + n, len - n);
+}
+
+/* Queues prefix and msg together, or drops both. Returns false if the
+ * ring is not in use (any more). */
+static bool
+log_ring_push(const char *prefix, size_t prefix_len,
+	      const char *msg, size_t msg_len)
+{
+	char note[64];
+	size_t head, tail, note_len = 0;
+
+	pthread_mutex_lock(&log_ring.producer_mutex);
+
+	if (!log_async()) {
+		pthread_mutex_unlock(&log_ring.producer_mutex);
+		return false;
+	}
+
+	head = log_ring.head;
+	tail = __atomic_load_n(&log_ring.tail, __ATOMIC_ACQUIRE);
+
+	if (log_ring.dropped > 0)
+		note_len = snprintf(note, sizeof note,
+				    "[%u log messages dropped]\n",
+				    log_ring.dropped);
+
+	if (LOG_RING_SIZE - (head - tail) <
+	    note_len + prefix_len + msg_len) {
+		log_ring.dropped++;
+		pthread_mutex_unlock(&log_ring.producer_mutex);
+		return true;
+	}
+
+	log_ring_copy_in(head, note, note_len);
+	head += note_len;
+	log_ring_copy_in(head, prefix, prefix_len);
+	head += prefix_len;
+	log_ring_copy_in(head, msg, msg_len);
+	head += msg_len;
+
+	__atomic_store_n(&log_ring.head, head, __ATOMIC_SEQ_CST);
+	log_ring.dropped = 0;
+
+	pthread_mutex_unlock(&log_ring.producer_mutex);
+
+	if (__atomic_load_n(&log_ring.writer_sleeping, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&log_ring.mutex);
+		pthread_cond_signal(&log_ring.cond);
+		pthread_mutex_unlock(&log_ring.mutex);
+	}
+
+	return true;
+}
+
+/* Writes out what is queued up to head. Safe to call from a signal
+ * handler. */
+static void
+log_ring_write_out(size_t head)
+{
+	size_t tail, offset, n;
+	ssize_t ret;
+
+	tail = __atomic_load_n(&log_ring.tail, __ATOMIC_ACQUIRE);
+	while (tail != head) {
+		offset = tail & (LOG_RING_SIZE - 1);
+		n = LOG_RING_SIZE - offset;
+		if (n > head - tail)
+			n = head - tail;
+
+		ret = write(log_ring.fd, log_ring.data + offset, n);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		/* Nothing sensible to do about a broken log file */
+		if (ret <= 0)
+			ret = n;
+
+		tail += ret;
+		__atomic_store_n(&log_ring.tail, tail, __ATOMIC_RELEASE);
+	}
+}
+
+static void *
+writer_thread_function(void *data)
+{
+	struct timespec deadline;
+	size_t head;
+
+	pthread_mutex_lock(&log_ring.mutex);
+
+	while (1) {
+		head = __atomic_load_n(&log_ring.head, __ATOMIC_SEQ_CST);
+		if (head != __atomic_load_n(&log_ring.tail, __ATOMIC_RELAXED)) {
+			pthread_mutex_unlock(&log_ring.mutex);
+			log_ring_write_out(head);
+			pthread_mutex_lock(&log_ring.mutex);
+			continue;
+		}
+
+		/* weston_log_file_close() waits for the queue to drain */
+		if (log_ring.destroying)
+			break;
+
+		__atomic_store_n(&log_ring.writer_sleeping, 1,
+				 __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&log_ring.head, __ATOMIC_SEQ_CST) == head) {
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_nsec += LOG_WAKEUP_TIMEOUT * 1000000L;
+			if (deadline.tv_nsec >= 1000000000L) {
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000L;
+			}
+			pthread_cond_timedwait(&log_ring.cond,
+					       &log_ring.mutex, &deadline);
+		}
+		__atomic_store_n(&log_ring.writer_sleeping, 0,
+				 __ATOMIC_SEQ_CST);
+	}
+
+	pthread_mutex_unlock(&log_ring.mutex);
+
+	return NULL;
+}
+
+/* A forked child has no writer thread */
+static void
+log_atfork_child(void)
+{
+	log_ring.async = false;
+}
+
+static void
+log_ring_start(void)
+{
+	static bool atfork_registered;
+	sigset_t mask, old_mask;
+	int ret;
+
+	log_ring.data = malloc(LOG_RING_SIZE);
+	if (log_ring.data == NULL)
+		return;
+
+	log_ring.fd = fileno(weston_logfile);
+	log_ring.head = 0;
+	log_ring.tail = 0;
+	log_ring.dropped = 0;
+	log_ring.destroying = 0;
+
+	/* The thread inherits our signal mask; block everything so that
+	 * signals main() and the launchers later block for their
+	 * signalfds are never delivered to it instead. */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+	ret = pthread_create(&log_ring.writer_thread, NULL,
+			     writer_thread_function, NULL);
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+	if (ret != 0) {
+		free(log_ring.data);
+		log_ring.data = NULL;
+		return;
+	}
+
+	if (!atfork_registered) {
+		pthread_atfork(NULL, NULL, log_atfork_child);
+		atfork_registered = true;
+	}
+
+	fflush(weston_logfile);
+	__atomic_store_n(&log_ring.async, true, __ATOMIC_RELEASE);
+}
+
+static void
+log_ring_stop(void)
+{
+	unsigned int dropped;
+
+	if (log_ring.data == NULL)
+		return;
+
+	/* Log synchronously from here on; the writer thread drains
+	 * what was queued before it exits. */
+	pthread_mutex_lock(&log_ring.producer_mutex);
+	__atomic_store_n(&log_ring.async, false, __ATOMIC_RELEASE);
+	dropped = log_ring.dropped;
+	pthread_mutex_unlock(&log_ring.producer_mutex);
+
+	pthread_mutex_lock(&log_ring.mutex);
+	log_ring.destroying = 1;
+	pthread_cond_signal(&log_ring.cond);
+	pthread_mutex_unlock(&log_ring.mutex);
+
+	pthread_join(log_ring.writer_thread, NULL);
+
+	free(log_ring.data);
+	log_ring.data = NULL;
+
+	if (dropped > 0)
+		fprintf(weston_logfile, "[%u log messages dropped]\n",
+			dropped);
+}
+
+/* Formats and logs one message, with an optional timestamp and prefix */
+static int
+log_vprint(bool timestamp, const char *prefix, const char *fmt, va_list ap)
+{
+	char head[256], line[LOG_LINE_SIZE], *msg = line;
+	int head_len = 0, msg_len;
+	va_list aq;
+
+	head[0] = '\0';
+	if (timestamp)
+		head_len = weston_log_timestamp(head, sizeof head);
+	if (prefix && head_len < (int) sizeof head)
+		head_len += snprintf(head + head_len, sizeof head - head_len,
+				     "%s", prefix);
+	if (head_len >= (int) sizeof head)
+		head_len = sizeof head - 1;
+
+	if (!log_async())
+		goto sync;
+
+	va_copy(aq, ap);
+	msg_len = vsnprintf(line, sizeof line, fmt, aq);
+	va_end(aq);
+	if (msg_len < 0)
+		return head_len;
+
+	if (msg_len >= (int) sizeof line) {
+		msg = malloc(msg_len + 1);
+		if (msg == NULL) {
+			msg = line;
+			msg_len = sizeof line - 1;
+		} else {
+			vsnprintf(msg, msg_len + 1, fmt, ap);
+		}
+	}
+
+	if (log_ring_push(head, head_len, msg, msg_len)) {
+		if (msg != line)
+			free(msg);
+		return head_len + msg_len;
+	}
+
+	/* The ring was stopped meanwhile */
+	fputs(head, weston_logfile);
+	fputs(msg, weston_logfile);
+	if (msg != line)
+		free(msg);
+	return head_len + msg_len;
+
+sync:
+	fputs(head, weston_logfile);
+	return head_len + vfprintf(weston_logfile, fmt, ap);
 }
 
 static void
 custom_handler(const char *fmt, va_list arg)
 {
-	weston_log_timestamp();
-	fprintf(weston_logfile, "libwayland: ");
-	vfprintf(weston_logfile, fmt, arg);
+	log_vprint(true, "libwayland: ", fmt, arg);
 }
 
 void
@@ -89,25 +397,41 @@ weston_log_file_open(const char *filename)
 		weston_logfile = stderr;
 	else
 		setvbuf(weston_logfile, NULL, _IOLBF, 256);
+
+	if (weston_logfile != stderr)
+		log_ring_start();
 }
 
 void
 weston_log_file_close()
 {
+	log_ring_stop();
+
 	if ((weston_logfile != stderr) && (weston_logfile != NULL))
 		fclose(weston_logfile);
 	weston_logfile = stderr;
 }
 
-WL_EXPORT int
-weston_vlog(const char *fmt, va_list ap)
+/** Write out the queued log messages and log synchronously from now on
+ *
+ * For crash handlers: it does not wait for the writer thread, and writes
+ * with write() only. Messages logged concurrently may be lost, and
+ * messages the writer thread was writing may appear twice.
+ */
+void
+weston_log_flush_sync(void)
 {
-	int l;
+	if (!log_async())
+		return;
 
-	l = weston_log_timestamp();
-	l += vfprintf(weston_logfile, fmt, ap);
+	__atomic_store_n(&log_ring.async, false, __ATOMIC_RELEASE);
+	log_ring_write_out(__atomic_load_n(&log_ring.head, __ATOMIC_ACQUIRE));
+}
 
-	return l;
+WL_EXPORT int
+weston_vlog(const char *fmt, va_list ap)
+{
+	return log_vprint(true, NULL, fmt, ap);
 }
 
 WL_EXPORT int
@@ -126,7 +450,7 @@ weston_log(const char *fmt, ...)
 WL_EXPORT int
 weston_vlog_continue(const char *fmt, va_list argp)
 {
-	return vfprintf(weston_logfile, fmt, argp);
+	return log_vprint(false, NULL, fmt, argp);
 }
 
 WL_EXPORT int
@@ -284,6 +284,8 @@ usage(int error_code)
 		"  --height=HEIGHT\tHeight of memory surface\n"
 		"  --transform=TR\tThe output transformation, TR is one of:\n"
 		"\tnormal 90 180 270 flipped flipped-90 flipped-180 flipped-270\n"
+		"  --refresh=MHZ\t\tRefresh rate in mHz, 0 to repaint as fast as\n"
+		"\t\t\tpossible (default: 60000)\n"
 		"  --use-pixman\t\tUse the pixman (CPU) renderer (default: no rendering)\n\n");
 #endif
 
@@ -363,6 +365,9 @@ on_caught_signal(int s, siginfo_t *siginfo, void *context)
 	 * will allow weston to switch back to gdb on crash and then
 	 * gdb will catch the crash with SIGTRAP.*/
 
+	/* Get the queued messages out before we may not return */
+	weston_log_flush_sync();
+
 	weston_log("caught signal: %d\n", s);
 
 	print_backtrace();
@@ -500,6 +505,11 @@ weston_compositor_init_config(struct weston_compositor *ec,
 	struct weston_config_section *s;
 	int repaint_msec;
 	int vt_switching;
+	int repaint_stats;
+	int repaint_adaptive;
+	int repaint_margin;
+	int repaint_group;
+	int require_input;
 
 	s = weston_config_get_section(config, "keyboard", NULL, NULL);
 	weston_config_section_get_string(s, "keymap_rules",
@@ -534,8 +544,46 @@ weston_compositor_init_config(struct weston_compositor *ec,
 	} else {
 		ec->repaint_msec = repaint_msec;
 	}
-	weston_log("Output repaint window is %d ms maximum.\n",
-		   ec->repaint_msec);
+	weston_config_section_get_bool(s, "repaint-window-adaptive",
+				       &repaint_adaptive, false);
+	ec->repaint_window_adaptive = repaint_adaptive;
+	weston_config_section_get_int(s, "repaint-window-margin",
+				      &repaint_margin,
+				      ec->repaint_margin_usec / 1000);
+	if (repaint_margin < 0 || repaint_margin > 1000) {
+		weston_log("Invalid repaint-window-margin value in config: "
+			   "%d\n", repaint_margin);
+	} else {
+		ec->repaint_margin_usec = repaint_margin * 1000;
+	}
+	if (ec->repaint_window_adaptive && ec->repaint_msec > 0)
+		weston_log("Output repaint window adapts to the repaint "
+			   "time plus %d ms, %d ms maximum.\n",
+			   ec->repaint_margin_usec / 1000, ec->repaint_msec);
+	else
+		weston_log("Output repaint window is %d ms maximum.\n",
+			   ec->repaint_msec);
+
+	weston_config_section_get_int(s, "repaint-group-window",
+				      &repaint_group, 0);
+	if (repaint_group < 0 || repaint_group > 1000) {
+		weston_log("Invalid repaint-group-window value in config: "
+			   "%d\n", repaint_group);
+	} else {
+		ec->repaint_group_usec = repaint_group * 1000;
+	}
+	if (ec->repaint_group_usec > 0)
+		weston_log("Outputs due within %d ms repaint together.\n",
+			   repaint_group);
+
+	weston_config_section_get_bool(s, "require-input",
+				       &require_input, true);
+	ec->require_input = require_input;
+
+	weston_config_section_get_bool(s, "repaint-stats-protocol",
+				       &repaint_stats, false);
+	if (repaint_stats && repaint_stats_create(ec) < 0)
+		return -1;
 
 	return 0;
 }
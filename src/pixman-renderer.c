@@ -30,6 +30,8 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <pthread.h>
+#include <signal.h>
 
 #include "pixman-renderer.h"
 #include "shared/helpers.h"
@@ -40,6 +42,10 @@ struct pixman_output_state {
 	void *shadow_buffer;
 	pixman_image_t *shadow_image;
 	pixman_image_t *hw_buffer;
+
+	/* Painted straight into the hw buffer, not yet in the shadow,
+	 * in global coordinates */
+	pixman_region32_t shadow_stale;
 };
 
 struct pixman_surface_state {
@@ -48,11 +54,50 @@ struct pixman_surface_state {
 	pixman_image_t *image;
 	struct weston_buffer_reference buffer_ref;
 
+	/* Valid when image is a solid fill, see surface_set_color */
+	bool is_solid;
+	pixman_color_t solid_color;
+
 	struct wl_listener buffer_destroy_listener;
 	struct wl_listener surface_destroy_listener;
 	struct wl_listener renderer_destroy_listener;
 };
 
+/* Bands narrower than this are not worth handing to another thread */
+#define MIN_BAND_HEIGHT 32
+
+/** Destination of one compositing pass
+ *
+ * The serial path paints straight into the destination image, either
+ * the shadow image or the hw buffer, with a NULL clip. When repainting
+ * in parallel, each band gets its own image aliasing the destination
+ * plus a clip confining it to its rows, so that no pixman image is
+ * written by two threads at once.
+ */
+struct pixman_band {
+	pixman_image_t *target;
+	pixman_region32_t *clip; /* in output coordinates */
+	pixman_region32_t clip_region;
+};
+
+struct pixman_worker_pool {
+	int n_threads;
+	pthread_t *threads;
+	pthread_mutex_t mutex;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	int destroying;
+
+	/* The job currently being painted, protected by mutex */
+	uint32_t generation;
+	struct weston_output *output;
+	pixman_region32_t *damage;
+	struct pixman_band *bands;
+	int n_bands;
+	int next_band;
+	int bands_pending;
+};
+
 struct pixman_renderer {
 	struct weston_renderer base;
 
@@ -60,9 +105,15 @@ struct pixman_renderer {
 	pixman_image_t *debug_color;
 	struct weston_binding *debug_binding;
 
+	struct pixman_worker_pool workers;
+
 	struct wl_signal destroy_signal;
 };
 
+static const pixman_color_t debug_red = {
+	0x3fff, 0x0000, 0x0000, 0x3fff
+};
+
 static inline struct pixman_output_state *
 get_output_state(struct weston_output *output)
 {
@@ -315,10 +366,34 @@ composite_clipped(pixman_image_t *src,
 	}
 }
 
+/** Get a source image for painting a surface into a band
+ *
+ * Setting the transform and filter, and validation during compositing,
+ * all write to the source image. Bands painted in parallel therefore
+ * get a private image sharing the surface's pixels.
+ */
+static pixman_image_t *
+band_source_image(struct pixman_band *band, struct pixman_surface_state *ps)
+{
+	if (!band->clip)
+		return pixman_image_ref(ps->image);
+
+	if (ps->is_solid)
+		return pixman_image_create_solid_fill(&ps->solid_color);
+
+	return pixman_image_create_bits_no_clear(
+			pixman_image_get_format(ps->image),
+			pixman_image_get_width(ps->image),
+			pixman_image_get_height(ps->image),
+			pixman_image_get_data(ps->image),
+			pixman_image_get_stride(ps->image));
+}
+
 /** Paint an intersected region
  *
  * \param ev The view to be painted.
  * \param output The output being painted.
+ * \param band The destination image and the area of it to paint.
  * \param repaint_output The region to be painted in output coordinates.
  * \param source_clip The region of the source image to use, in source image
  *                    coordinates. If NULL, use the whole source image.
@@ -326,6 +401,7 @@ composite_clipped(pixman_image_t *src,
  */
 static void
 repaint_region(struct weston_view *ev, struct weston_output *output,
+	       struct pixman_band *band,
 	       pixman_region32_t *repaint_output,
 	       pixman_region32_t *source_clip,
 	       pixman_op_t pixman_op)
@@ -333,15 +409,23 @@ repaint_region(struct weston_view *ev, struct weston_output *output,
 	struct pixman_renderer *pr =
 		(struct pixman_renderer *) output->compositor->renderer;
 	struct pixman_surface_state *ps = get_surface_state(ev->surface);
-	struct pixman_output_state *po = get_output_state(output);
 	struct weston_buffer_viewport *vp = &ev->surface->buffer_viewport;
 	pixman_transform_t transform;
 	pixman_filter_t filter;
+	pixman_image_t *src_image;
 	pixman_image_t *mask_image;
+	pixman_image_t *debug_image;
 	pixman_color_t mask = { 0, };
 
+	if (band->clip) {
+		pixman_region32_intersect(repaint_output, repaint_output,
+					  band->clip);
+		if (!pixman_region32_not_empty(repaint_output))
+			return;
+	}
+
 	/* Clip rendering to the damaged output region */
-	pixman_image_set_clip_region32(po->shadow_image, repaint_output);
+	pixman_image_set_clip_region32(band->target, repaint_output);
 
 	pixman_renderer_compute_transform(&transform, ev, output);
 
@@ -360,12 +444,16 @@ repaint_region(struct weston_view *ev, struct weston_output *output,
 		mask_image = NULL;
 	}
 
+	src_image = band_source_image(band, ps);
+
 	if (source_clip)
-		composite_clipped(ps->image, mask_image, po->shadow_image,
+		composite_clipped(src_image, mask_image, band->target,
 				  &transform, filter, source_clip);
 	else
-		composite_whole(pixman_op, ps->image, mask_image,
-				po->shadow_image, &transform, filter);
+		composite_whole(pixman_op, src_image, mask_image,
+				band->target, &transform, filter);
+
+	pixman_image_unref(src_image);
 
 	if (mask_image)
 		pixman_image_unref(mask_image);
@@ -373,22 +461,31 @@ repaint_region(struct weston_view *ev, struct weston_output *output,
 	if (ps->buffer_ref.buffer)
 		wl_shm_buffer_end_access(ps->buffer_ref.buffer->shm_buffer);
 
-	if (pr->repaint_debug)
+	if (pr->repaint_debug) {
+		if (band->clip)
+			debug_image = pixman_image_create_solid_fill(&debug_red);
+		else
+			debug_image = pixman_image_ref(pr->debug_color);
+
 		pixman_image_composite32(PIXMAN_OP_OVER,
-					 pr->debug_color, /* src */
+					 debug_image, /* src */
 					 NULL /* mask */,
-					 po->shadow_image, /* dest */
+					 band->target, /* dest */
 					 0, 0, /* src_x, src_y */
 					 0, 0, /* mask_x, mask_y */
 					 0, 0, /* dest_x, dest_y */
-					 pixman_image_get_width (po->shadow_image), /* width */
-					 pixman_image_get_height (po->shadow_image) /* height */);
+					 pixman_image_get_width (band->target), /* width */
+					 pixman_image_get_height (band->target) /* height */);
 
-	pixman_image_set_clip_region32 (po->shadow_image, NULL);
+		pixman_image_unref(debug_image);
+	}
+
+	pixman_image_set_clip_region32 (band->target, NULL);
 }
 
 static void
 draw_view_translated(struct weston_view *view, struct weston_output *output,
+		     struct pixman_band *band,
 		     pixman_region32_t *repaint_global)
 {
 	struct weston_surface *surface = view->surface;
@@ -416,8 +513,8 @@ draw_view_translated(struct weston_view *view, struct weston_output *output,
 							  view);
 			region_global_to_output(output, &repaint_output);
 
-			repaint_region(view, output, &repaint_output, NULL,
-				       PIXMAN_OP_SRC);
+			repaint_region(view, output, band, &repaint_output,
+				       NULL, PIXMAN_OP_SRC);
 		}
 	}
 
@@ -427,7 +524,7 @@ draw_view_translated(struct weston_view *view, struct weston_output *output,
 						  &surface_blend, view);
 		region_global_to_output(output, &repaint_output);
 
-		repaint_region(view, output, &repaint_output, NULL,
+		repaint_region(view, output, band, &repaint_output, NULL,
 			       PIXMAN_OP_OVER);
 	}
 
@@ -438,6 +535,7 @@ draw_view_translated(struct weston_view *view, struct weston_output *output,
 static void
 draw_view_source_clipped(struct weston_view *view,
 			 struct weston_output *output,
+			 struct pixman_band *band,
 			 pixman_region32_t *repaint_global)
 {
 	struct weston_surface *surface = view->surface;
@@ -463,7 +561,7 @@ draw_view_source_clipped(struct weston_view *view,
 	pixman_region32_copy(&repaint_output, repaint_global);
 	region_global_to_output(output, &repaint_output);
 
-	repaint_region(view, output, &repaint_output, &buffer_region,
+	repaint_region(view, output, band, &repaint_output, &buffer_region,
 		       PIXMAN_OP_OVER);
 
 	pixman_region32_fini(&repaint_output);
@@ -473,6 +571,7 @@ draw_view_source_clipped(struct weston_view *view,
 
 static void
 draw_view(struct weston_view *ev, struct weston_output *output,
+	  struct pixman_band *band,
 	  pixman_region32_t *damage) /* in global coordinates */
 {
 	struct pixman_surface_state *ps = get_surface_state(ev->surface);
@@ -499,7 +598,7 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 		 * Also the boundingbox is accurate rather than an
 		 * approximation.
 		 */
-		draw_view_translated(ev, output, &repaint);
+		draw_view_translated(ev, output, band, &repaint);
 	} else {
 		/* The complex case: the view transformation does not allow
 		 * converting opaque etc. regions into global coordinate space.
@@ -508,21 +607,317 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 		 * to be used whole. Source clipping does not work with
 		 * PIXMAN_OP_SRC.
 		 */
-		draw_view_source_clipped(ev, output, &repaint);
+		draw_view_source_clipped(ev, output, band, &repaint);
 	}
 
 out:
 	pixman_region32_fini(&repaint);
 }
 static void
-repaint_surfaces(struct weston_output *output, pixman_region32_t *damage)
+repaint_surfaces(struct weston_output *output, struct pixman_band *band,
+		 pixman_region32_t *damage)
 {
 	struct weston_compositor *compositor = output->compositor;
 	struct weston_view *view;
 
 	wl_list_for_each_reverse(view, &compositor->view_list, link)
 		if (view->plane == &compositor->primary_plane)
-			draw_view(view, output, damage);
+			draw_view(view, output, band, damage);
+}
+
+/* Called with the pool mutex held, which is dropped while painting. */
+static void
+worker_pool_run_bands(struct pixman_worker_pool *pool)
+{
+	struct weston_output *output = pool->output;
+	pixman_region32_t *damage = pool->damage;
+	struct pixman_band *band;
+
+	while (pool->next_band < pool->n_bands) {
+		band = &pool->bands[pool->next_band++];
+
+		pthread_mutex_unlock(&pool->mutex);
+		repaint_surfaces(output, band, damage);
+		pthread_mutex_lock(&pool->mutex);
+
+		if (--pool->bands_pending == 0)
+			pthread_cond_signal(&pool->done_cond);
+	}
+}
+
+static void *
+worker_thread_function(void *data)
+{
+	struct pixman_worker_pool *pool = data;
+	uint32_t generation = 0;
+
+	pthread_mutex_lock(&pool->mutex);
+	while (!pool->destroying) {
+		if (generation == pool->generation) {
+			pthread_cond_wait(&pool->work_cond, &pool->mutex);
+			continue;
+		}
+
+		generation = pool->generation;
+		worker_pool_run_bands(pool);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	return NULL;
+}
+
+static void
+bands_destroy(struct pixman_band *bands, int n_bands)
+{
+	int i;
+
+	for (i = 0; i < n_bands; i++) {
+		if (bands[i].target)
+			pixman_image_unref(bands[i].target);
+		pixman_region32_fini(&bands[i].clip_region);
+	}
+
+	free(bands);
+}
+
+/** Split the damaged rows of the destination into horizontal bands
+ *
+ * Every band covers the full width of the output, and together the
+ * bands cover the vertical extent of the damage exactly once. Returns
+ * the number of bands, or 0 if the damage is too small to be worth
+ * splitting.
+ */
+static int
+bands_create(struct weston_output *output, pixman_image_t *target,
+	     pixman_region32_t *damage,
+	     int max_bands, struct pixman_band **bands_out)
+{
+	struct pixman_band *bands;
+	pixman_region32_t output_damage;
+	pixman_box32_t *extents;
+	int width, height, stride;
+	int y1, y2, top, bottom;
+	int n_bands, i;
+
+	width = pixman_image_get_width(target);
+	height = pixman_image_get_height(target);
+	stride = pixman_image_get_stride(target);
+
+	pixman_region32_init(&output_damage);
+	pixman_region32_copy(&output_damage, damage);
+	region_global_to_output(output, &output_damage);
+	extents = pixman_region32_extents(&output_damage);
+	y1 = extents->y1 < 0 ? 0 : extents->y1;
+	y2 = extents->y2 > height ? height : extents->y2;
+	pixman_region32_fini(&output_damage);
+
+	n_bands = MIN(max_bands, (y2 - y1) / MIN_BAND_HEIGHT);
+	if (n_bands < 2)
+		return 0;
+
+	bands = zalloc(n_bands * sizeof *bands);
+	if (!bands)
+		return 0;
+
+	for (i = 0; i < n_bands; i++) {
+		top = y1 + (y2 - y1) * i / n_bands;
+		bottom = y1 + (y2 - y1) * (i + 1) / n_bands;
+
+		pixman_region32_init_rect(&bands[i].clip_region,
+					  0, top, width, bottom - top);
+		bands[i].clip = &bands[i].clip_region;
+		bands[i].target = pixman_image_create_bits_no_clear(
+				pixman_image_get_format(target),
+				width, height,
+				pixman_image_get_data(target), stride);
+		if (!bands[i].target) {
+			bands_destroy(bands, i + 1);
+			return 0;
+		}
+	}
+
+	*bands_out = bands;
+
+	return n_bands;
+}
+
+/** Composite the damage in horizontal bands on the worker pool
+ *
+ * The compositor thread paints bands alongside the workers and returns
+ * only once all of them are done, so the destination is complete when
+ * this returns true. Returns false, having painted nothing, if the
+ * damage was not split.
+ */
+static bool
+repaint_surfaces_parallel(struct weston_output *output,
+			  pixman_image_t *target,
+			  pixman_region32_t *damage)
+{
+	struct weston_compositor *compositor = output->compositor;
+	struct pixman_worker_pool *pool = &get_renderer(compositor)->workers;
+	struct pixman_band *bands;
+	struct weston_view *view;
+	int n_bands;
+
+	n_bands = bands_create(output, target, damage,
+			       pool->n_threads + 1, &bands);
+	if (n_bands == 0)
+		return false;
+
+	/* Surface state is created on first use, which must not happen
+	 * from several threads at once. */
+	wl_list_for_each(view, &compositor->view_list, link)
+		if (view->plane == &compositor->primary_plane)
+			get_surface_state(view->surface);
+
+	pthread_mutex_lock(&pool->mutex);
+
+	pool->output = output;
+	pool->damage = damage;
+	pool->bands = bands;
+	pool->n_bands = n_bands;
+	pool->next_band = 0;
+	pool->bands_pending = n_bands;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->work_cond);
+
+	worker_pool_run_bands(pool);
+	while (pool->bands_pending > 0)
+		pthread_cond_wait(&pool->done_cond, &pool->mutex);
+
+	pool->bands = NULL;
+	pool->n_bands = 0;
+	pool->next_band = 0;
+
+	pthread_mutex_unlock(&pool->mutex);
+
+	bands_destroy(bands, n_bands);
+
+	return true;
+}
+
+static void
+repaint_surfaces_into(struct weston_output *output, pixman_image_t *target,
+		      pixman_region32_t *damage)
+{
+	struct pixman_renderer *pr = get_renderer(output->compositor);
+	struct pixman_band band;
+
+	if (pr->workers.n_threads > 0 &&
+	    repaint_surfaces_parallel(output, target, damage))
+		return;
+
+	band.target = target;
+	band.clip = NULL;
+	repaint_surfaces(output, &band, damage);
+}
+
+static bool
+view_is_painted_opaque(struct weston_view *view, pixman_region32_t *damage)
+{
+	struct weston_surface *surface = view->surface;
+	struct pixman_surface_state *ps = get_surface_state(surface);
+	pixman_region32_t repaint;
+	pixman_region32_t opaque;
+	bool painted_opaque = true;
+
+	/* No buffer attached, nothing gets painted */
+	if (!ps->image)
+		return true;
+
+	pixman_region32_init(&repaint);
+	pixman_region32_intersect(&repaint,
+				  &view->transform.boundingbox, damage);
+	pixman_region32_subtract(&repaint, &repaint, &view->clip);
+
+	if (pixman_region32_not_empty(&repaint)) {
+		if (!view_transformation_is_translation(view) ||
+		    view->alpha < 1.0) {
+			painted_opaque = false;
+		} else {
+			pixman_region32_init(&opaque);
+			region_intersect_only_translation(&opaque, &repaint,
+							  &surface->opaque,
+							  view);
+			pixman_region32_subtract(&repaint, &repaint, &opaque);
+			painted_opaque = !pixman_region32_not_empty(&repaint);
+			pixman_region32_fini(&opaque);
+		}
+	}
+
+	pixman_region32_fini(&repaint);
+
+	return painted_opaque;
+}
+
+/** Check whether the damage can be painted straight into the hw buffer
+ *
+ * Compositing happens in the shadow image because blending reads the
+ * destination back, and the hw buffer is often uncached framebuffer
+ * memory. If every view in the damage is painted from its opaque
+ * region with PIXMAN_OP_SRC, nothing is read back, and the copy from
+ * the shadow image is a second pass over the same pixels for nothing.
+ */
+static bool
+can_repaint_direct(struct weston_output *output, pixman_region32_t *damage)
+{
+	struct weston_compositor *compositor = output->compositor;
+	struct pixman_renderer *pr = get_renderer(compositor);
+	struct pixman_output_state *po = get_output_state(output);
+	struct weston_view *view;
+
+	if (pr->repaint_debug)
+		return false;
+
+	if (pixman_image_get_format(po->hw_buffer) !=
+	    pixman_image_get_format(po->shadow_image) ||
+	    pixman_image_get_width(po->hw_buffer) !=
+	    pixman_image_get_width(po->shadow_image) ||
+	    pixman_image_get_height(po->hw_buffer) !=
+	    pixman_image_get_height(po->shadow_image))
+		return false;
+
+	wl_list_for_each(view, &compositor->view_list, link)
+		if (view->plane == &compositor->primary_plane &&
+		    !view_is_painted_opaque(view, damage))
+			return false;
+
+	return true;
+}
+
+/** Bring the shadow image up to date outside of the damage
+ *
+ * Frames painted straight into the hw buffer left the shadow image
+ * behind. Whatever is damaged now gets repainted anyway, the rest is
+ * copied back once before the shadow image is used again.
+ */
+static void
+copy_stale_from_hw_buffer(struct weston_output *output,
+			  pixman_region32_t *damage)
+{
+	struct pixman_output_state *po = get_output_state(output);
+	pixman_region32_t output_region;
+
+	pixman_region32_init(&output_region);
+	pixman_region32_subtract(&output_region, &po->shadow_stale, damage);
+	region_global_to_output(output, &output_region);
+
+	pixman_image_set_clip_region32 (po->shadow_image, &output_region);
+	pixman_region32_fini(&output_region);
+
+	pixman_image_composite32(PIXMAN_OP_SRC,
+				 po->hw_buffer, /* src */
+				 NULL /* mask */,
+				 po->shadow_image, /* dest */
+				 0, 0, /* src_x, src_y */
+				 0, 0, /* mask_x, mask_y */
+				 0, 0, /* dest_x, dest_y */
+				 pixman_image_get_width (po->shadow_image), /* width */
+				 pixman_image_get_height (po->shadow_image) /* height */);
+
+	pixman_image_set_clip_region32 (po->shadow_image, NULL);
+
+	pixman_region32_clear(&po->shadow_stale);
 }
 
 static void
@@ -561,8 +956,17 @@ pixman_renderer_repaint_output(struct weston_output *output,
 	if (!po->hw_buffer)
 		return;
 
-	repaint_surfaces(output, output_damage);
-	copy_to_hw_buffer(output, output_damage);
+	if (can_repaint_direct(output, output_damage)) {
+		repaint_surfaces_into(output, po->hw_buffer, output_damage);
+		pixman_region32_union(&po->shadow_stale, &po->shadow_stale,
+				      output_damage);
+	} else {
+		if (pixman_region32_not_empty(&po->shadow_stale))
+			copy_stale_from_hw_buffer(output, output_damage);
+
+		repaint_surfaces_into(output, po->shadow_image, output_damage);
+		copy_to_hw_buffer(output, output_damage);
+	}
 
 	pixman_region32_copy(&output->previous_damage, output_damage);
 	wl_signal_emit(&output->frame_signal, output);
@@ -610,6 +1014,7 @@ pixman_renderer_attach(struct weston_surface *es, struct weston_buffer *buffer)
 		pixman_image_unref(ps->image);
 		ps->image = NULL;
 	}
+	ps->is_solid = false;
 
 	if (!buffer)
 		return;
@@ -741,6 +1146,70 @@ pixman_renderer_surface_set_color(struct weston_surface *es,
 	}
 
 	ps->image = pixman_image_create_solid_fill(&color);
+	ps->is_solid = true;
+	ps->solid_color = color;
+}
+
+static void
+worker_pool_destroy(struct pixman_worker_pool *pool)
+{
+	int i;
+
+	if (!pool->threads)
+		return;
+
+	pthread_mutex_lock(&pool->mutex);
+
+	/* Make sure the worker threads finish */
+	pool->destroying = 1;
+	pthread_cond_broadcast(&pool->work_cond);
+
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (i = 0; i < pool->n_threads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_mutex_destroy(&pool->mutex);
+	pthread_cond_destroy(&pool->work_cond);
+	pthread_cond_destroy(&pool->done_cond);
+
+	free(pool->threads);
+	pool->threads = NULL;
+	pool->n_threads = 0;
+}
+
+static int
+worker_pool_init(struct pixman_worker_pool *pool, int n_threads)
+{
+	sigset_t mask, old_mask;
+	int i;
+
+	pool->threads = zalloc(n_threads * sizeof *pool->threads);
+	if (!pool->threads)
+		return -1;
+
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->work_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+
+	/* Workers must not receive the signals the compositor blocks
+	 * later on to read them from signalfds, e.g. Xwayland's SIGUSR1 */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+	for (i = 0; i < n_threads; i++) {
+		if (pthread_create(&pool->threads[i], NULL,
+				   worker_thread_function, pool) != 0)
+			break;
+		pool->n_threads++;
+	}
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+	if (pool->n_threads == 0) {
+		worker_pool_destroy(pool);
+		return -1;
+	}
+
+	return 0;
 }
 
 static void
@@ -750,6 +1219,7 @@ pixman_renderer_destroy(struct weston_compositor *ec)
 
 	wl_signal_emit(&pr->destroy_signal, pr);
 	weston_binding_destroy(pr->debug_binding);
+	worker_pool_destroy(&pr->workers);
 	free(pr);
 
 	ec->renderer = NULL;
@@ -812,11 +1282,7 @@ debug_binding(struct weston_keyboard *keyboard, uint32_t time, uint32_t key,
 	pr->repaint_debug ^= 1;
 
 	if (pr->repaint_debug) {
-		pixman_color_t red = {
-			0x3fff, 0x0000, 0x0000, 0x3fff
-		};
-
-		pr->debug_color = pixman_image_create_solid_fill(&red);
+		pr->debug_color = pixman_image_create_solid_fill(&debug_red);
 	} else {
 		pixman_image_unref(pr->debug_color);
 		weston_compositor_damage_all(ec);
@@ -827,6 +1293,8 @@ WL_EXPORT int
 pixman_renderer_init(struct weston_compositor *ec)
 {
 	struct pixman_renderer *renderer;
+	struct weston_config_section *section;
+	int n_threads;
 
 	renderer = zalloc(sizeof *renderer);
 	if (renderer == NULL)
@@ -857,6 +1325,22 @@ pixman_renderer_init(struct weston_compositor *ec)
 
 	wl_signal_init(&renderer->destroy_signal);
 
+	section = weston_config_get_section(ec->config, "core", NULL, NULL);
+	weston_config_section_get_int(section, "pixman-render-threads",
+				      &n_threads, 0);
+	if (n_threads < 0 || n_threads > 64) {
+		weston_log("Invalid pixman-render-threads value in config: %d\n",
+			   n_threads);
+	} else if (n_threads > 0) {
+		if (worker_pool_init(&renderer->workers, n_threads) < 0)
+			weston_log("Pixman renderer: failed to start render "
+				   "threads, repainting serially\n");
+		else
+			weston_log("Pixman renderer: repainting with %d "
+				   "additional render threads\n",
+				   renderer->workers.n_threads);
+	}
+
 	return 0;
 }
 
@@ -906,6 +1390,8 @@ pixman_renderer_output_create(struct weston_output *output)
 		return -1;
 	}
 
+	pixman_region32_init(&po->shadow_stale);
+
 	output->renderer_state = po;
 
 	return 0;
@@ -922,6 +1408,7 @@ pixman_renderer_output_destroy(struct weston_output *output)
 		pixman_image_unref(po->hw_buffer);
 
 	free(po->shadow_buffer);
+	pixman_region32_fini(&po->shadow_stale);
 
 	po->shadow_buffer = NULL;
 	po->shadow_image = NULL;
@@ -0,0 +1,415 @@
+/*
+ * Copyright © 2026 agent <agent@local>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "compositor.h"
+#include "weston-repaint-stats-server-protocol.h"
+#include "shared/timespec-util.h"
+
+/* Log-linear histograms of microseconds: exact below 32, then 16
+ * buckets per power of two, so every bucket is within 1/16 of its
+ * values. The last bucket also takes everything above 2^27 us. */
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_SHIFT 22
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_SHIFT + 2) * HISTOGRAM_SUB_BUCKETS)
+
+#define METRIC_COUNT (WESTON_REPAINT_STATS_METRIC_REPAINT_TO_PRESENT + 1)
+
+struct histogram {
+	uint32_t count;
+	uint32_t min, max;
+	uint64_t sum;
+	uint32_t buckets[HISTOGRAM_BUCKETS];
+};
+
+struct weston_repaint_stats {
+	struct histogram histograms[METRIC_COUNT];
+
+	/* Of the repaint in flight, zero if none */
+	struct timespec repaint_begin;
+	struct timespec cpu_begin;
+
+	uint32_t presented;
+	uint32_t missed;
+	uint32_t missed_vblanks;
+};
+
+static const char *metric_names[METRIC_COUNT] = {
+	[WESTON_REPAINT_STATS_METRIC_COMMIT_TO_REPAINT] = "commit-to-repaint",
+	[WESTON_REPAINT_STATS_METRIC_REPAINT_CPU] = "repaint CPU",
+	[WESTON_REPAINT_STATS_METRIC_REPAINT_TO_PRESENT] = "repaint-to-present",
+};
+
+static int
+histogram_bucket(uint32_t value)
+{
+	int shift;
+
+	if (value < 2 * HISTOGRAM_SUB_BUCKETS)
+		return value;
+
+	shift = 31 - __builtin_clz(value) - HISTOGRAM_SUB_BITS;
+	if (shift > HISTOGRAM_MAX_SHIFT)
+		return HISTOGRAM_BUCKETS - 1;
+
+	return (shift + 1) * HISTOGRAM_SUB_BUCKETS +
+	       (value >> shift) - HISTOGRAM_SUB_BUCKETS;
+}
+
+static uint32_t
+histogram_bucket_lower(int i)
+{
+	int shift = i / HISTOGRAM_SUB_BUCKETS - 1;
+
+	if (i < 2 * HISTOGRAM_SUB_BUCKETS)
+		return i;
+
+	return (uint32_t) (i % HISTOGRAM_SUB_BUCKETS +
+			   HISTOGRAM_SUB_BUCKETS) << shift;
+}
+
+static uint32_t
+histogram_bucket_upper(int i)
+{
+	int shift = i / HISTOGRAM_SUB_BUCKETS - 1;
+
+	if (i < 2 * HISTOGRAM_SUB_BUCKETS)
+		return i;
+	if (i == HISTOGRAM_BUCKETS - 1)
+		return UINT32_MAX;
+
+	return ((uint32_t) (i % HISTOGRAM_SUB_BUCKETS +
+			    HISTOGRAM_SUB_BUCKETS + 1) << shift) - 1;
+}
+
+static void
+histogram_add(struct histogram *h, uint32_t value)
+{
+	if (h->count == 0 || value < h->min)
+		h->min = value;
+	if (value > h->max)
+		h->max = value;
+
+	h->count++;
+	h->sum += value;
+	h->buckets[histogram_bucket(value)]++;
+}
+
+/* The value that num/den of the samples are at or below */
+static uint32_t
+histogram_percentile(const struct histogram *h, uint64_t num, uint64_t den)
+{
+	uint64_t target, seen = 0;
+	uint32_t upper;
+	int i;
+
+	if (h->count == 0)
+		return 0;
+
+	target = (h->count * num + den - 1) / den;
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= target)
+			break;
+	}
+
+	upper = histogram_bucket_upper(i);
+
+	return upper < h->max ? upper : h->max;
+}
+
+static uint32_t
+histogram_mean(const struct histogram *h)
+{
+	return h->count ? h->sum / h->count : 0;
+}
+
+static void
+stats_add(struct weston_output *output, int metric, int64_t nsec)
+{
+	if (nsec < 0)
+		return;
+
+	histogram_add(&output->repaint_stats->histograms[metric],
+		      nsec / 1000 > UINT32_MAX ? UINT32_MAX : nsec / 1000);
+}
+
+struct weston_repaint_stats *
+weston_repaint_stats_create(void)
+{
+	return zalloc(sizeof(struct weston_repaint_stats));
+}
+
+void
+weston_repaint_stats_destroy(struct weston_repaint_stats *stats)
+{
+	free(stats);
+}
+
+static void
+weston_repaint_stats_reset(struct weston_repaint_stats *stats)
+{
+	struct timespec repaint_begin = stats->repaint_begin;
+	struct timespec cpu_begin = stats->cpu_begin;
+
+	/* keep tracking the repaint in flight */
+	memset(stats, 0, sizeof *stats);
+	stats->repaint_begin = repaint_begin;
+	stats->cpu_begin = cpu_begin;
+}
+
+/** Record that output starts a repaint at now, on the presentation clock */
+void
+weston_repaint_stats_repaint_begin(struct weston_output *output,
+				   const struct timespec *now)
+{
+	struct weston_repaint_stats *stats = output->repaint_stats;
+
+	if (!stats)
+		return;
+
+	stats->repaint_begin = *now;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &stats->cpu_begin);
+}
+
+/** Record the end of the repaint, and whether it was posted */
+void
+weston_repaint_stats_repaint_end(struct weston_output *output, bool posted)
+{
+	struct weston_repaint_stats *stats = output->repaint_stats;
+	struct timespec now, cpu_time;
+
+	if (!stats)
+		return;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+	timespec_sub(&cpu_time, &now, &stats->cpu_begin);
+	stats_add(output, WESTON_REPAINT_STATS_METRIC_REPAINT_CPU,
+		  timespec_to_nsec(&cpu_time));
+
+	/* Nothing will be presented */
+	if (!posted)
+		memset(&stats->repaint_begin, 0, sizeof stats->repaint_begin);
+}
+
+/** Record that the repaint of output starting at now shows a commit
+ * made at commit_time */
+void
+weston_repaint_stats_commit_shown(struct weston_output *output,
+				  const struct timespec *commit_time,
+				  const struct timespec *now)
+{
+	struct timespec latency;
+
+	if (!output->repaint_stats)
+		return;
+
+	timespec_sub(&latency, now, commit_time);
+	stats_add(output, WESTON_REPAINT_STATS_METRIC_COMMIT_TO_REPAINT,
+		  timespec_to_nsec(&latency));
+}
+
+/** Record the presentation of the repaint in flight
+ *
+ * A repaint that is presented a whole refresh period or more after it
+ * started missed the vblank it was aimed at.
+ */
+void
+weston_repaint_stats_presented(struct weston_output *output,
+			       const struct timespec *stamp,
+			       int32_t refresh_nsec)
+{
+	struct weston_repaint_stats *stats = output->repaint_stats;
+	struct timespec latency;
+	int64_t nsec, vblanks;
+
+	if (!stats)
+		return;
+
+	/* Also called when the repaint loop starts */
+	if (timespec_is_zero(&stats->repaint_begin))
+		return;
+
+	timespec_sub(&latency, stamp, &stats->repaint_begin);
+	memset(&stats->repaint_begin, 0, sizeof stats->repaint_begin);
+
+	nsec = timespec_to_nsec(&latency);
+	stats_add(output, WESTON_REPAINT_STATS_METRIC_REPAINT_TO_PRESENT,
+		  nsec);
+	stats->presented++;
+
+	if (refresh_nsec <= 0 || nsec < refresh_nsec)
+		return;
+
+	vblanks = nsec / refresh_nsec;
+	stats->missed++;
+	stats->missed_vblanks += vblanks > UINT32_MAX ? UINT32_MAX : vblanks;
+}
+
+/** Write the statistics of output to the log */
+void
+weston_repaint_stats_log(struct weston_output *output)
+{
+	struct weston_repaint_stats *stats = output->repaint_stats;
+	struct histogram *h;
+	int i;
+
+	if (!stats)
+		return;
+
+	weston_log("Repaint statistics of output %s: %u frames presented, "
+		   "%u late by %u vblanks in total\n", output->name,
+		   stats->presented, stats->missed, stats->missed_vblanks);
+
+	for (i = 0; i < METRIC_COUNT; i++) {
+		h = &stats->histograms[i];
+		if (h->count == 0) {
+			weston_log_continue(STAMP_SPACE "%s: no samples\n",
+					    metric_names[i]);
+			continue;
+		}
+
+		weston_log_continue(STAMP_SPACE "%s: %u samples, min %u, "
+				    "mean %u, p50 %u, p90 %u, p99 %u, "
+				    "p99.9 %u, max %u us\n",
+				    metric_names[i], h->count, h->min,
+				    histogram_mean(h),
+				    histogram_percentile(h, 50, 100),
+				    histogram_percentile(h, 90, 100),
+				    histogram_percentile(h, 99, 100),
+				    histogram_percentile(h, 999, 1000),
+				    h->max);
+	}
+}
+
+static void
+repaint_stats_destroy(struct wl_client *client, struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+static void
+repaint_stats_get_report(struct wl_client *client,
+			 struct wl_resource *resource, uint32_t id,
+			 struct wl_resource *output_resource)
+{
+	struct weston_output *output =
+		wl_resource_get_user_data(output_resource);
+	struct weston_repaint_stats *stats = output->repaint_stats;
+	struct wl_resource *report;
+	struct histogram *h;
+	int i, j;
+
+	if (!stats) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	report = wl_resource_create(client, &weston_repaint_report_interface,
+				    1, id);
+	if (report == NULL) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	for (i = 0; i < METRIC_COUNT; i++) {
+		h = &stats->histograms[i];
+		weston_repaint_report_send_histogram(report, i, h->count,
+						     h->min, h->max,
+						     histogram_mean(h),
+						     histogram_percentile(h, 50, 100),
+						     histogram_percentile(h, 90, 100),
+						     histogram_percentile(h, 99, 100),
+						     histogram_percentile(h, 999, 1000));
+
+		for (j = 0; j < HISTOGRAM_BUCKETS; j++) {
+			if (h->buckets[j] == 0)
+				continue;
+			weston_repaint_report_send_bucket(report, i,
+							  histogram_bucket_lower(j),
+							  histogram_bucket_upper(j),
+							  h->buckets[j]);
+		}
+	}
+
+	weston_repaint_report_send_frames(report, stats->presented,
+					  stats->missed,
+					  stats->missed_vblanks);
+	weston_repaint_report_send_done(report);
+	wl_resource_destroy(report);
+}
+
+static void
+repaint_stats_reset(struct wl_client *client, struct wl_resource *resource,
+		    struct wl_resource *output_resource)
+{
+	struct weston_output *output =
+		wl_resource_get_user_data(output_resource);
+
+	if (output->repaint_stats)
+		weston_repaint_stats_reset(output->repaint_stats);
+}
+
+static const struct weston_repaint_stats_interface repaint_stats_implementation = {
+	repaint_stats_destroy,
+	repaint_stats_get_report,
+	repaint_stats_reset,
+};
+
+static void
+bind_repaint_stats(struct wl_client *client,
+		   void *data, uint32_t version, uint32_t id)
+{
+	struct wl_resource *resource;
+
+	resource = wl_resource_create(client, &weston_repaint_stats_interface,
+				      1, id);
+	if (resource == NULL) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	wl_resource_set_implementation(resource, &repaint_stats_implementation,
+				       data, NULL);
+}
+
+/** Advertise the weston_repaint_stats debugging interface */
+int
+repaint_stats_create(struct weston_compositor *ec)
+{
+	if (!wl_global_create(ec->wl_display,
+			      &weston_repaint_stats_interface, 1,
+			      ec, bind_repaint_stats))
+		return -1;
+
+	return 0;
+}
@@ -32,12 +32,15 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/uio.h>
+#include <pthread.h>
+#include <signal.h>
 
 #include "compositor.h"
 #include "weston-screenshooter-server-protocol.h"
 #include "shared/helpers.h"
 
 #include "wcap/wcap-decode.h"
+#include "wcap/wcap-codec.h"
 
 struct screenshooter {
 	struct weston_compositor *ec;
@@ -50,35 +53,50 @@ struct screenshooter {
 struct screenshooter_frame_listener {
 	struct wl_listener listener;
 	struct weston_buffer *buffer;
+	struct wl_listener buffer_destroy_listener;
+	struct weston_output *output;
 	weston_screenshooter_done_func_t done;
 	void *data;
 };
 
 static void
-copy_bgra_yflip(uint8_t *dst, uint8_t *src, int height, int stride)
+copy_bgra_yflip(uint8_t *dst, const uint8_t *src, int height,
+		int dst_stride, int src_stride)
 {
 	uint8_t *end;
 
-	end = dst + height * stride;
+	end = dst + height * dst_stride;
 	while (dst < end) {
-		memcpy(dst, src, stride);
-		dst += stride;
-		src -= stride;
+		memcpy(dst, src, src_stride);
+		dst += dst_stride;
+		src -= src_stride;
 	}
 }
 
 static void
-copy_bgra(uint8_t *dst, uint8_t *src, int height, int stride)
+copy_bgra(uint8_t *dst, const uint8_t *src, int height,
+	  int dst_stride, int src_stride)
 {
-	/* TODO: optimize this out */
-	memcpy(dst, src, height * stride);
+	uint8_t *end;
+
+	if (dst_stride == src_stride) {
+		memcpy(dst, src, height * dst_stride);
+		return;
+	}
+
+	end = dst + height * dst_stride;
+	while (dst < end) {
+		memcpy(dst, src, src_stride);
+		dst += dst_stride;
+		src += src_stride;
+	}
 }
 
 static void
-copy_row_swap_RB(void *vdst, void *vsrc, int bytes)
+copy_row_swap_RB(void *vdst, const void *vsrc, int bytes)
 {
 	uint32_t *dst = vdst;
-	uint32_t *src = vsrc;
+	const uint32_t *src = vsrc;
 	uint32_t *end = dst + bytes / 4;
 
 	while (dst < end) {
@@ -92,62 +110,80 @@ copy_row_swap_RB(void *vdst, void *vsrc, int bytes)
 }
 
 static void
-copy_rgba_yflip(uint8_t *dst, uint8_t *src, int height, int stride)
+copy_rgba_yflip(uint8_t *dst, const uint8_t *src, int height,
+		int dst_stride, int src_stride)
 {
 	uint8_t *end;
 
-	end = dst + height * stride;
+	end = dst + height * dst_stride;
 	while (dst < end) {
-		copy_row_swap_RB(dst, src, stride);
-		dst += stride;
-		src -= stride;
+		copy_row_swap_RB(dst, src, src_stride);
+		dst += dst_stride;
+		src -= src_stride;
 	}
 }
 
 static void
-copy_rgba(uint8_t *dst, uint8_t *src, int height, int stride)
+copy_rgba(uint8_t *dst, const uint8_t *src, int height,
+	  int dst_stride, int src_stride)
 {
 	uint8_t *end;
 
-	end = dst + height * stride;
+	end = dst + height * dst_stride;
 	while (dst < end) {
-		copy_row_swap_RB(dst, src, stride);
-		dst += stride;
-		src += stride;
+		copy_row_swap_RB(dst, src, src_stride);
+		dst += dst_stride;
+		src += src_stride;
 	}
 }
 
 static void
-screenshooter_frame_notify(struct wl_listener *listener, void *data)
+screenshooter_frame_listener_destroy(struct screenshooter_frame_listener *l)
+{
+	if (l->buffer)
+		wl_list_remove(&l->buffer_destroy_listener.link);
+	free(l);
+}
+
+static void
+screenshooter_buffer_destroy(struct wl_listener *listener, void *data)
 {
 	struct screenshooter_frame_listener *l =
-		container_of(listener,
-			     struct screenshooter_frame_listener, listener);
-	struct weston_output *output = data;
+		container_of(listener, struct screenshooter_frame_listener,
+			     buffer_destroy_listener);
+
+	l->buffer = NULL;
+}
+
+static void
+screenshooter_read_pixels_done(void *data, const void *pixels)
+{
+	struct screenshooter_frame_listener *l = data;
+	struct weston_output *output = l->output;
 	struct weston_compositor *compositor = output->compositor;
-	int32_t stride;
-	uint8_t *pixels, *d, *s;
+	int32_t src_stride, dst_stride, height;
+	const uint8_t *s;
+	uint8_t *d;
 
-	output->disable_planes--;
-	wl_list_remove(&listener->link);
-	stride = l->buffer->width * (PIXMAN_FORMAT_BPP(compositor->read_format) / 8);
-	pixels = malloc(stride * l->buffer->height);
+	/* The client went away while the read back was in flight */
+	if (l->buffer == NULL) {
+		screenshooter_frame_listener_destroy(l);
+		return;
+	}
 
 	if (pixels == NULL) {
 		l->done(l->data, WESTON_SCREENSHOOTER_NO_MEMORY);
-		free(l);
+		screenshooter_frame_listener_destroy(l);
 		return;
 	}
 
-	compositor->renderer->read_pixels(output,
-			     compositor->read_format, pixels,
-			     0, 0, output->current_mode->width,
-			     output->current_mode->height);
-
-	stride = wl_shm_buffer_get_stride(l->buffer->shm_buffer);
+	height = output->current_mode->height;
+	src_stride = output->current_mode->width *
+		     (PIXMAN_FORMAT_BPP(compositor->read_format) / 8);
+	dst_stride = wl_shm_buffer_get_stride(l->buffer->shm_buffer);
 
 	d = wl_shm_buffer_get_data(l->buffer->shm_buffer);
-	s = pixels + stride * (l->buffer->height - 1);
+	s = (const uint8_t *) pixels + src_stride * (height - 1);
 
 	wl_shm_buffer_begin_access(l->buffer->shm_buffer);
 
@@ -155,16 +191,16 @@ screenshooter_frame_notify(struct wl_listener *listener, void *data)
 	case PIXMAN_a8r8g8b8:
 	case PIXMAN_x8r8g8b8:
 		if (compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP)
-			copy_bgra_yflip(d, s, output->current_mode->height, stride);
+			copy_bgra_yflip(d, s, height, dst_stride, src_stride);
 		else
-			copy_bgra(d, pixels, output->current_mode->height, stride);
+			copy_bgra(d, pixels, height, dst_stride, src_stride);
 		break;
 	case PIXMAN_x8b8g8r8:
 	case PIXMAN_a8b8g8r8:
 		if (compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP)
-			copy_rgba_yflip(d, s, output->current_mode->height, stride);
+			copy_rgba_yflip(d, s, height, dst_stride, src_stride);
 		else
-			copy_rgba(d, pixels, output->current_mode->height, stride);
+			copy_rgba(d, pixels, height, dst_stride, src_stride);
 		break;
 	default:
 		break;
@@ -173,8 +209,29 @@ screenshooter_frame_notify(struct wl_listener *listener, void *data)
 	wl_shm_buffer_end_access(l->buffer->shm_buffer);
 
 	l->done(l->data, WESTON_SCREENSHOOTER_SUCCESS);
-	free(pixels);
-	free(l);
+	screenshooter_frame_listener_destroy(l);
+}
+
+static void
+screenshooter_frame_notify(struct wl_listener *listener, void *data)
+{
+	struct screenshooter_frame_listener *l =
+		container_of(listener,
+			     struct screenshooter_frame_listener, listener);
+	struct weston_output *output = data;
+	struct weston_compositor *compositor = output->compositor;
+
+	output->disable_planes--;
+	wl_list_remove(&listener->link);
+
+	if (weston_output_read_pixels_async(output, compositor->read_format,
+					    0, 0, output->current_mode->width,
+					    output->current_mode->height,
+					    screenshooter_read_pixels_done,
+					    l) < 0) {
+		l->done(l->data, WESTON_SCREENSHOOTER_NO_MEMORY);
+		screenshooter_frame_listener_destroy(l);
+	}
 }
 
 WL_EXPORT int
@@ -206,6 +263,9 @@ weston_screenshooter_shoot(struct weston_output *output,
 	}
 
 	l->buffer = buffer;
+	l->buffer_destroy_listener.notify = screenshooter_buffer_destroy;
+	wl_signal_add(&buffer->destroy_signal, &l->buffer_destroy_listener);
+	l->output = output;
 	l->done = done;
 	l->data = data;
 	l->listener.notify = screenshooter_frame_notify;
@@ -308,49 +368,212 @@ screenshooter_binding(struct weston_keyboard *keyboard, uint32_t time,
 	free(screenshooter_exe);
 }
 
+/* Frames queued for the writer thread are limited to this many times
+ * the size of the output; frames beyond that are dropped. */
+#define RECORDER_QUEUE_FRAMES 4
+
 struct weston_recorder {
 	struct weston_output *output;
-	uint32_t *frame, *rect;
-	uint32_t *tmpbuf;
-	uint32_t total;
+	uint32_t *frame;	/* only used by the worker thread */
+	uint32_t *tmpbuf;	/* only used by the worker thread */
+	uint32_t *deltas;	/* only used by the worker thread */
+	const struct wcap_codec *codec;
+	uint32_t total;		/* only used by the worker thread */
+	int stride;		/* of frame, in pixels */
 	int fd;
 	struct wl_listener frame_listener;
-	int count, destroying;
+	int count, destroying, stopped;
+	int pending;		/* read backs in flight */
+	pixman_region32_t missed;	/* damage of dropped frames */
+	int dropped;
+
+	pthread_t worker_thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t queue_cond;
+	struct wl_list queue;	/* struct weston_recorder_frame */
+	size_t queued_size;	/* pixel bytes of frames not yet written */
+	size_t max_queued_size;
+	int draining;
+};
+
+/* One recorded frame. The main loop collects the pixels of all its
+ * rectangles, then queues it for the worker thread to encode and
+ * write. */
+struct weston_recorder_frame {
+	struct wl_list link;
+	struct weston_recorder *recorder;
+	uint32_t msecs;
+	int do_yflip;
+	uint32_t *pixels;	/* of all rectangles, one after another */
+	size_t size, offset;	/* in bytes */
+	int nrects, next;
+	uint8_t *failed;	/* per rectangle, read back failed */
+	pixman_box32_t rects[];
 };
 
-static uint32_t *
-output_run(uint32_t *p, uint32_t delta, int run)
+static void
+weston_recorder_release(struct weston_recorder *recorder);
+
+static void
+weston_recorder_destroy(struct weston_recorder *recorder);
+
+static void
+weston_recorder_write_frame(struct weston_recorder *recorder,
+			    struct weston_recorder_frame *frame)
 {
-	int i;
+	struct wcap_encoder encoder;
+	pixman_box32_t *r;
+	int i, j, width, height, stride, y_orig;
+	uint32_t *d, *p;
+	const uint32_t *s, *pixels;
+	struct {
+		uint32_t msecs;
+		uint32_t nrects;
+	} header;
+	struct iovec v[2];
 
-	while (run > 0) {
-		if (run <= 0xe0) {
-			*p++ = delta | ((run - 1) << 24);
-			break;
+	header.msecs = frame->msecs;
+	header.nrects = frame->nrects;
+	v[0].iov_base = &header;
+	v[0].iov_len = sizeof header;
+	v[1].iov_base = frame->rects;
+	v[1].iov_len = frame->nrects * sizeof *frame->rects;
+	recorder->total += writev(recorder->fd, v, 2);
+	stride = recorder->stride;
+
+	encoder.codec = recorder->codec;
+	encoder.deltas = recorder->deltas;
+
+	pixels = frame->pixels;
+	for (i = 0; i < frame->nrects; i++) {
+		r = &frame->rects[i];
+		width = r->x2 - r->x1;
+		height = r->y2 - r->y1;
+
+		wcap_encoder_begin(&encoder, recorder->tmpbuf);
+		for (j = 0; j < height; j++) {
+			y_orig = r->y2 - j - 1;
+			d = recorder->frame + stride * y_orig + r->x1;
+
+			/* A failed read back is recorded as unchanged, so
+			 * the stream stays consistent. */
+			if (frame->failed[i])
+				s = d;
+			else if (frame->do_yflip)
+				s = pixels + width * j;
+			else
+				s = pixels + width * (height - j - 1);
+
+			wcap_encoder_add_row(&encoder, s, d, width);
 		}
+		p = wcap_encoder_end(&encoder);
 
-		i = 24 - __builtin_clz(run);
-		*p++ = delta | ((i + 0xe0) << 24);
-		run -= 1 << (7 + i);
+		recorder->total += write(recorder->fd,
+					 recorder->tmpbuf,
+					 (p - recorder->tmpbuf) * 4);
+
+#if 0
+		fprintf(stderr,
+			"%dx%d at %d,%d rle from %d to %d bytes (%f) total %dM\n",
+			width, height, r->x1, r->y1,
+			width * height * 4, (int) (p - recorder->tmpbuf) * 4,
+			(float) (p - recorder->tmpbuf) / (width * height),
+			recorder->total / 1024 / 1024);
+#endif
+
+		pixels += width * height;
 	}
 
-	return p;
+	recorder->count++;
+}
+
+static void
+weston_recorder_frame_free(struct weston_recorder_frame *frame)
+{
+	free(frame->pixels);
+	free(frame);
 }
 
-static uint32_t
-component_delta(uint32_t next, uint32_t prev)
+static void *
+worker_thread_function(void *data)
 {
-	unsigned char dr, dg, db;
+	struct weston_recorder *recorder = data;
+	struct weston_recorder_frame *frame;
+
+	pthread_mutex_lock(&recorder->mutex);
+
+	while (1) {
+		while (wl_list_empty(&recorder->queue) && !recorder->draining)
+			pthread_cond_wait(&recorder->queue_cond,
+					  &recorder->mutex);
+
+		/* weston_recorder_release() waits for the queue to be
+		 * written out. */
+		if (wl_list_empty(&recorder->queue))
+			break;
 
-	dr = (next >> 16) - (prev >> 16);
-	dg = (next >>  8) - (prev >>  8);
-	db = (next >>  0) - (prev >>  0);
+		frame = container_of(recorder->queue.next,
+				     struct weston_recorder_frame, link);
+		wl_list_remove(&frame->link);
+		pthread_mutex_unlock(&recorder->mutex);
 
-	return (dr << 16) | (dg << 8) | (db << 0);
+		weston_recorder_write_frame(recorder, frame);
+
+		pthread_mutex_lock(&recorder->mutex);
+		recorder->queued_size -= frame->size;
+		weston_recorder_frame_free(frame);
+	}
+
+	pthread_mutex_unlock(&recorder->mutex);
+
+	return NULL;
 }
 
 static void
-weston_recorder_destroy(struct weston_recorder *recorder);
+weston_recorder_read_pixels_done(void *data, const void *pixels)
+{
+	struct weston_recorder_frame *frame = data;
+	struct weston_recorder *recorder = frame->recorder;
+	pixman_box32_t *r = &frame->rects[frame->next];
+	size_t size;
+
+	size = (r->x2 - r->x1) * (r->y2 - r->y1) * 4;
+	if (pixels)
+		memcpy((uint8_t *) frame->pixels + frame->offset,
+		       pixels, size);
+	else
+		frame->failed[frame->next] = 1;
+	frame->offset += size;
+
+	if (++frame->next == frame->nrects) {
+		pthread_mutex_lock(&recorder->mutex);
+		wl_list_insert(recorder->queue.prev, &frame->link);
+		pthread_cond_signal(&recorder->queue_cond);
+		pthread_mutex_unlock(&recorder->mutex);
+	}
+
+	recorder->pending--;
+	if (recorder->stopped && recorder->pending == 0)
+		weston_recorder_release(recorder);
+}
+
+/* Reserves queue space for a frame of the given size, or returns false
+ * if the writer thread is too far behind. */
+static bool
+weston_recorder_reserve(struct weston_recorder *recorder, size_t size)
+{
+	bool ret = true;
+
+	pthread_mutex_lock(&recorder->mutex);
+	if (recorder->queued_size > 0 &&
+	    recorder->queued_size + size > recorder->max_queued_size)
+		ret = false;
+	else
+		recorder->queued_size += size;
+	pthread_mutex_unlock(&recorder->mutex);
+
+	return ret;
+}
 
 static void
 weston_recorder_frame_notify(struct wl_listener *listener, void *data)
@@ -359,25 +582,11 @@ weston_recorder_frame_notify(struct wl_listener *listener, void *data)
 		container_of(listener, struct weston_recorder, frame_listener);
 	struct weston_output *output = data;
 	struct weston_compositor *compositor = output->compositor;
-	uint32_t msecs = output->frame_time;
+	struct weston_recorder_frame *frame;
 	pixman_box32_t *r;
 	pixman_region32_t damage, transformed_damage;
-	int i, j, k, n, width, height, run, stride;
-	uint32_t delta, prev, *d, *s, *p, next;
-	struct {
-		uint32_t msecs;
-		uint32_t nrects;
-	} header;
-	struct iovec v[2];
-	int do_yflip;
-	int y_orig;
-	uint32_t *outbuf;
-
-	do_yflip = !!(compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
-	if (do_yflip)
-		outbuf = recorder->rect;
-	else
-		outbuf = recorder->tmpbuf;
+	int i, n, y_orig;
+	size_t size;
 
 	pixman_region32_init(&damage);
 	pixman_region32_init(&transformed_damage);
@@ -389,75 +598,74 @@ weston_recorder_frame_notify(struct wl_listener *listener, void *data)
 				 &damage, &transformed_damage);
 	pixman_region32_fini(&damage);
 
+	/* Whatever the dropped frames changed is recorded now */
+	pixman_region32_union(&transformed_damage, &transformed_damage,
+			      &recorder->missed);
+
 	r = pixman_region32_rectangles(&transformed_damage, &n);
-	if (n == 0) {
-		pixman_region32_fini(&transformed_damage);
-		return;
+	if (n == 0)
+		goto out;
+
+	size = 0;
+	for (i = 0; i < n; i++)
+		size += (r[i].x2 - r[i].x1) * (r[i].y2 - r[i].y1) * 4;
+
+	if (!weston_recorder_reserve(recorder, size)) {
+		if (recorder->dropped++ == 0)
+			weston_log("recorder: writing falls behind, "
+				   "dropping frames\n");
+		pixman_region32_copy(&recorder->missed, &transformed_damage);
+		goto out;
 	}
 
-	header.msecs = msecs;
-	header.nrects = n;
-	v[0].iov_base = &header;
-	v[0].iov_len = sizeof header;
-	v[1].iov_base = r;
-	v[1].iov_len = n * sizeof *r;
-	recorder->total += writev(recorder->fd, v, 2);
-	stride = output->current_mode->width;
+	frame = malloc(sizeof *frame + n * (sizeof *r + 1));
+	if (frame)
+		frame->pixels = malloc(size);
+	if (frame == NULL || frame->pixels == NULL) {
+		weston_log("%s: out of memory, dropping frame\n", __func__);
+		free(frame);
+		pthread_mutex_lock(&recorder->mutex);
+		recorder->queued_size -= size;
+		pthread_mutex_unlock(&recorder->mutex);
+		recorder->dropped++;
+		pixman_region32_copy(&recorder->missed, &transformed_damage);
+		goto out;
+	}
 
+	pixman_region32_clear(&recorder->missed);
+
+	frame->recorder = recorder;
+	frame->msecs = output->frame_time;
+	frame->do_yflip =
+		!!(compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
+	frame->size = size;
+	frame->offset = 0;
+	frame->nrects = n;
+	frame->next = 0;
+	frame->failed = (uint8_t *) (frame->rects + n);
+	memcpy(frame->rects, r, n * sizeof *r);
+	memset(frame->failed, 0, n);
+
+	/* The read backs finish in order, possibly only in a later frame.
+	 * The last one queues the frame for writing. */
+	recorder->pending += n;
 	for (i = 0; i < n; i++) {
-		width = r[i].x2 - r[i].x1;
-		height = r[i].y2 - r[i].y1;
-
-		if (do_yflip)
+		if (frame->do_yflip)
 			y_orig = output->current_mode->height - r[i].y2;
 		else
 			y_orig = r[i].y1;
 
-		compositor->renderer->read_pixels(output,
-				compositor->read_format, recorder->rect,
-				r[i].x1, y_orig, width, height);
-
-		p = outbuf;
-		run = prev = 0; /* quiet gcc */
-		for (j = 0; j < height; j++) {
-			if (do_yflip)
-				s = recorder->rect + width * j;
-			else
-				s = recorder->rect + width * (height - j - 1);
-			y_orig = r[i].y2 - j - 1;
-			d = recorder->frame + stride * y_orig + r[i].x1;
-
-			for (k = 0; k < width; k++) {
-				next = *s++;
-				delta = component_delta(next, *d);
-				*d++ = next;
-				if (run == 0 || delta == prev) {
-					run++;
-				} else {
-					p = output_run(p, prev, run);
-					run = 1;
-				}
-				prev = delta;
-			}
-		}
-
-		p = output_run(p, prev, run);
-
-		recorder->total += write(recorder->fd,
-					 outbuf, (p - outbuf) * 4);
-
-#if 0
-		fprintf(stderr,
-			"%dx%d at %d,%d rle from %d to %d bytes (%f) total %dM\n",
-			width, height, r[i].x1, r[i].y1,
-			width * height * 4, (int) (p - outbuf) * 4,
-			(float) (p - outbuf) / (width * height),
-			recorder->total / 1024 / 1024);
-#endif
+		if (weston_output_read_pixels_async(output,
+					compositor->read_format,
+					r[i].x1, y_orig,
+					r[i].x2 - r[i].x1, r[i].y2 - r[i].y1,
+					weston_recorder_read_pixels_done,
+					frame) < 0)
+			weston_recorder_read_pixels_done(frame, NULL);
 	}
 
+out:
 	pixman_region32_fini(&transformed_damage);
-	recorder->count++;
 
 	if (recorder->destroying)
 		weston_recorder_destroy(recorder);
@@ -469,8 +677,9 @@ weston_recorder_free(struct weston_recorder *recorder)
 	if (recorder == NULL)
 		return;
 
+	pixman_region32_fini(&recorder->missed);
+	free(recorder->deltas);
 	free(recorder->tmpbuf);
-	free(recorder->rect);
 	free(recorder->frame);
 	free(recorder);
 }
@@ -480,11 +689,9 @@ weston_recorder_create(struct weston_output *output, const char *filename)
 {
 	struct weston_compositor *compositor = output->compositor;
 	struct weston_recorder *recorder;
-	int stride, size;
+	int stride, size, ret;
+	sigset_t mask, old_mask;
 	struct { uint32_t magic, format, width, height; } header;
-	int do_yflip;
-
-	do_yflip = !!(compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
 
 	recorder = zalloc(sizeof *recorder);
 	if (recorder == NULL) {
@@ -495,22 +702,21 @@ weston_recorder_create(struct weston_output *output, const char *filename)
 	stride = output->current_mode->width;
 	size = stride * 4 * output->current_mode->height;
 	recorder->frame = zalloc(size);
-	recorder->rect = malloc(size);
+	recorder->tmpbuf = malloc(size);
+	recorder->deltas = malloc(stride * 4);
+	recorder->codec = wcap_codec_get();
 	recorder->output = output;
+	recorder->stride = stride;
+	recorder->max_queued_size = (size_t) size * RECORDER_QUEUE_FRAMES;
+	pixman_region32_init(&recorder->missed);
+	wl_list_init(&recorder->queue);
 
-	if ((recorder->frame == NULL) || (recorder->rect == NULL)) {
+	if ((recorder->frame == NULL) || (recorder->tmpbuf == NULL) ||
+	    (recorder->deltas == NULL)) {
 		weston_log("%s: out of memory\n", __func__);
 		goto err_recorder;
 	}
 
-	if (!do_yflip) {
-		recorder->tmpbuf = malloc(size);
-		if (recorder->tmpbuf == NULL) {
-			weston_log("%s: out of memory\n", __func__);
-			goto err_recorder;
-		}
-	}
-
 	header.magic = WCAP_HEADER_MAGIC;
 
 	switch (compositor->read_format) {
@@ -538,6 +744,24 @@ weston_recorder_create(struct weston_output *output, const char *filename)
 	header.height = output->current_mode->height;
 	recorder->total += write(recorder->fd, &header, sizeof header);
 
+	pthread_mutex_init(&recorder->mutex, NULL);
+	pthread_cond_init(&recorder->queue_cond, NULL);
+
+	/* Keep every signal on the main thread's signalfds. */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+	ret = pthread_create(&recorder->worker_thread, NULL,
+			     worker_thread_function, recorder);
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+	if (ret != 0) {
+		weston_log("failed to start recorder thread\n");
+		pthread_mutex_destroy(&recorder->mutex);
+		pthread_cond_destroy(&recorder->queue_cond);
+		close(recorder->fd);
+		goto err_recorder;
+	}
+
 	recorder->frame_listener.notify = weston_recorder_frame_notify;
 	wl_signal_add(&output->frame_signal, &recorder->frame_listener);
 	output->disable_planes++;
@@ -550,13 +774,38 @@ err_recorder:
 	return;
 }
 
+static void
+weston_recorder_release(struct weston_recorder *recorder)
+{
+	pthread_mutex_lock(&recorder->mutex);
+	recorder->draining = 1;
+	pthread_cond_signal(&recorder->queue_cond);
+	pthread_mutex_unlock(&recorder->mutex);
+
+	pthread_join(recorder->worker_thread, NULL);
+
+	pthread_mutex_destroy(&recorder->mutex);
+	pthread_cond_destroy(&recorder->queue_cond);
+
+	weston_log("recorder stopped, total file size %dM, %d frames, "
+		   "%d dropped\n", recorder->total / (1024 * 1024),
+		   recorder->count, recorder->dropped);
+
+	close(recorder->fd);
+	weston_recorder_free(recorder);
+}
+
+/* Stops recording; the file is closed once the read backs in flight
+ * have been written out. */
 static void
 weston_recorder_destroy(struct weston_recorder *recorder)
 {
 	wl_list_remove(&recorder->frame_listener.link);
-	close(recorder->fd);
 	recorder->output->disable_planes--;
-	weston_recorder_free(recorder);
+	recorder->stopped = 1;
+
+	if (recorder->pending == 0)
+		weston_recorder_release(recorder);
 }
 
 static void
@@ -580,9 +829,8 @@ recorder_binding(struct weston_keyboard *keyboard, uint32_t time,
 		recorder = container_of(listener, struct weston_recorder,
 					frame_listener);
 
-		weston_log(
-			"stopping recorder, total file size %dM, %d frames\n",
-			recorder->total / (1024 * 1024), recorder->count);
+		weston_log("stopping recorder for output %s\n",
+			   recorder->output->name);
 
 		recorder->destroying = 1;
 		weston_output_schedule_repaint(recorder->output);
@@ -0,0 +1,455 @@
+/*
+ * Copyright © 2014 Pekka Paalanen <pq@iki.fi>
+ * Copyright © 2014 Collabora, Ltd.
+ * Copyright © 2026 agent <agent@local>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Converts a binary weston timeline log to the JSON stream the
+ * timeline used to write, or to the Chrome trace event format that
+ * chrome://tracing and Perfetto load. */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+
+#include "timeline.h"
+#include "timeline-format.h"
+
+enum output_format {
+	FORMAT_JSON,
+	FORMAT_CHROME,
+};
+
+struct object {
+	int type;		/* TLR_OUTPUT_DESC or TLR_SURFACE_DESC */
+	uint32_t main_surface;
+	char *str;
+};
+
+struct converter {
+	enum output_format format;
+	FILE *out;
+
+	struct object *objects;	/* indexed by id */
+	uint32_t n_objects;
+
+	int n_events;
+	uint64_t dropped;
+};
+
+static void
+usage(int error_code)
+{
+	fprintf(stderr, "Usage: weston-timeline-convert [OPTIONS] FILE\n\n"
+		"Converts a weston timeline log to JSON on stdout.\n\n"
+		"Options:\n"
+		"  --json\t\tthe JSON stream for Wesgr (default)\n"
+		"  --chrome\t\tChrome trace event format, for\n"
+		"\t\t\tchrome://tracing or Perfetto\n"
+		"  --help\t\tthis help text\n\n");
+
+	exit(error_code);
+}
+
+static void
+print_string(FILE *fp, const char *str)
+{
+	const char *p;
+
+	if (!str) {
+		fprintf(fp, "null");
+		return;
+	}
+
+	fputc('"', fp);
+	for (p = str; *p; p++) {
+		if (*p == '"' || *p == '\\')
+			fprintf(fp, "\\%c", *p);
+		else if ((unsigned char) *p < 0x20)
+			fprintf(fp, "\\u%04x", *p);
+		else
+			fputc(*p, fp);
+	}
+	fputc('"', fp);
+}
+
+static char *
+copy_string(const char *src, uint32_t len)
+{
+	char *str;
+
+	if (len == TIMELINE_NO_STRING)
+		return NULL;
+
+	str = malloc(len + 1);
+	if (!str) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(str, src, len);
+	str[len] = '\0';
+
+	return str;
+}
+
+static struct object *
+get_object(struct converter *conv, uint32_t id)
+{
+	struct object *objects;
+	uint32_t n;
+
+	if (id < conv->n_objects)
+		return &conv->objects[id];
+
+	n = id + 1 > conv->n_objects * 2 ? id + 1 : conv->n_objects * 2;
+	objects = realloc(conv->objects, n * sizeof *objects);
+	if (!objects) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	memset(objects + conv->n_objects, 0,
+	       (n - conv->n_objects) * sizeof *objects);
+	conv->objects = objects;
+	conv->n_objects = n;
+
+	return &conv->objects[id];
+}
+
+static void
+begin_event(struct converter *conv)
+{
+	if (conv->format == FORMAT_CHROME && conv->n_events > 0)
+		fprintf(conv->out, ",");
+	conv->n_events++;
+}
+
+static int
+convert_description(struct converter *conv,
+		    const struct timeline_record *rec, size_t size)
+{
+	const struct timeline_desc *desc = (const void *) (rec + 1);
+	struct object *obj;
+
+	if (size < sizeof *rec + sizeof *desc ||
+	    (desc->len != TIMELINE_NO_STRING &&
+	     desc->len > size - sizeof *rec - sizeof *desc))
+		return -1;
+
+	obj = get_object(conv, rec->n);
+	free(obj->str);
+	obj->type = rec->type;
+	obj->main_surface = desc->main_surface;
+	obj->str = copy_string((const char *) (desc + 1), desc->len);
+
+	if (conv->format != FORMAT_JSON)
+		return 0;
+
+	if (rec->type == TLR_OUTPUT_DESC) {
+		fprintf(conv->out, "{ \"id\":%u, "
+			"\"type\":\"weston_output\", \"name\":", rec->n);
+		print_string(conv->out, obj->str);
+		fprintf(conv->out, " }\n");
+	} else {
+		fprintf(conv->out, "{ \"id\":%u, "
+			"\"type\":\"weston_surface\", \"desc\":", rec->n);
+		print_string(conv->out, obj->str);
+		if (obj->main_surface)
+			fprintf(conv->out, ", \"main_surface\":%u",
+				obj->main_surface);
+		fprintf(conv->out, " }\n");
+	}
+
+	return 0;
+}
+
+static void
+print_chrome_object(struct converter *conv, const char *sep,
+		    const char *key, uint32_t id)
+{
+	struct object *obj = get_object(conv, id);
+
+	fprintf(conv->out, "%s\"%s\":", sep, key);
+	if (obj->str)
+		print_string(conv->out, obj->str);
+	else
+		fprintf(conv->out, "\"%s %u\"", key, id);
+}
+
+static int
+convert_point(struct converter *conv, uint32_t tid,
+	      const struct timeline_record *rec, size_t size,
+	      int64_t *last_usec)
+{
+	const struct timeline_point *point = (const void *) (rec + 1);
+	const char *p = (const char *) (point + 1);
+	const char *end = (const char *) rec + size;
+	const struct timeline_arg *arg;
+	const struct timeline_vblank_arg *vblank;
+	const char *sep = "";
+	uint32_t i;
+
+	if (size < sizeof *rec + sizeof *point)
+		return -1;
+
+	begin_event(conv);
+	*last_usec = point->sec * 1000000 + point->nsec / 1000;
+
+	if (conv->format == FORMAT_JSON) {
+		fprintf(conv->out, "{ \"T\":[%" PRId64 ", %u], \"N\":",
+			point->sec, point->nsec);
+	} else {
+		fprintf(conv->out, "\n{\"ph\":\"i\", \"s\":\"t\", "
+			"\"pid\":1, \"tid\":%u, \"ts\":%" PRId64 ".%03u, "
+			"\"name\":", tid, *last_usec, point->nsec % 1000);
+	}
+
+	/* the name follows the arguments */
+	for (i = 0; i < rec->n; i++) {
+		arg = (const void *) p;
+		if (end - p < (int) sizeof *arg)
+			return -1;
+		p += sizeof *arg;
+		if (arg->type == TLT_VBLANK)
+			p += sizeof *vblank;
+	}
+	if (end - p < (int) point->name_len)
+		return -1;
+	fprintf(conv->out, "\"%.*s\"", (int) point->name_len, p);
+
+	if (conv->format == FORMAT_CHROME)
+		fprintf(conv->out, ", \"args\":{");
+
+	p = (const char *) (point + 1);
+	for (i = 0; i < rec->n; i++) {
+		arg = (const void *) p;
+		p += sizeof *arg;
+
+		switch (arg->type) {
+		case TLT_OUTPUT:
+			if (conv->format == FORMAT_JSON)
+				fprintf(conv->out, ", \"wo\":%u", arg->value);
+			else
+				print_chrome_object(conv, sep, "output",
+						    arg->value);
+			break;
+		case TLT_SURFACE:
+			if (conv->format == FORMAT_JSON)
+				fprintf(conv->out, ", \"ws\":%u", arg->value);
+			else
+				print_chrome_object(conv, sep, "surface",
+						    arg->value);
+			break;
+		case TLT_VBLANK:
+			vblank = (const void *) p;
+			p += sizeof *vblank;
+			if (conv->format == FORMAT_JSON)
+				fprintf(conv->out,
+					", \"vblank\":[%" PRId64 ", %u]",
+					vblank->sec, arg->value);
+			else
+				fprintf(conv->out,
+					"%s\"vblank\":%" PRId64 ".%06u",
+					sep, vblank->sec, arg->value / 1000);
+			break;
+		default:
+			break;
+		}
+
+		if (conv->format == FORMAT_CHROME)
+			sep = ", ";
+	}
+
+	if (conv->format == FORMAT_JSON)
+		fprintf(conv->out, " }\n");
+	else
+		fprintf(conv->out, "}}");
+
+	return 0;
+}
+
+static void
+convert_dropped(struct converter *conv, uint32_t tid,
+		const struct timeline_record *rec, int64_t last_usec)
+{
+	conv->dropped += rec->n;
+
+	if (conv->format != FORMAT_CHROME)
+		return;
+
+	begin_event(conv);
+	fprintf(conv->out, "\n{\"ph\":\"i\", \"s\":\"t\", \"pid\":1, "
+		"\"tid\":%u, \"ts\":%" PRId64 ", "
+		"\"name\":\"timeline_dropped\", \"args\":{\"count\":%u}}",
+		tid, last_usec, rec->n);
+}
+
+static int
+convert_chunk(struct converter *conv, uint32_t tid,
+	      const char *p, size_t size)
+{
+	const struct timeline_record *rec;
+	int64_t last_usec = 0;
+	int ret = 0;
+
+	while (size > 0 && ret == 0) {
+		rec = (const void *) p;
+		if (size < sizeof *rec || rec->size < sizeof *rec ||
+		    rec->size > size ||
+		    rec->size % TIMELINE_RECORD_ALIGN != 0)
+			return -1;
+
+		switch (rec->type) {
+		case TLR_POINT:
+			ret = convert_point(conv, tid, rec, rec->size,
+					    &last_usec);
+			break;
+		case TLR_OUTPUT_DESC:
+		case TLR_SURFACE_DESC:
+			ret = convert_description(conv, rec, rec->size);
+			break;
+		case TLR_DROPPED:
+			convert_dropped(conv, tid, rec, last_usec);
+			break;
+		default:
+			/* skip records from the future */
+			break;
+		}
+
+		p += rec->size;
+		size -= rec->size;
+	}
+
+	return ret;
+}
+
+static int
+convert_file(struct converter *conv, FILE *fp)
+{
+	struct timeline_file_header header;
+	struct timeline_chunk chunk;
+	char *data = NULL;
+	size_t alloc = 0;
+	int ret = 0;
+
+	if (fread(&header, sizeof header, 1, fp) != 1 ||
+	    header.magic != TIMELINE_MAGIC) {
+		fprintf(stderr, "not a weston timeline log\n");
+		return -1;
+	}
+
+	if (header.version != TIMELINE_VERSION) {
+		fprintf(stderr, "unsupported timeline version %u\n",
+			header.version);
+		return -1;
+	}
+
+	if (conv->format == FORMAT_CHROME)
+		fprintf(conv->out, "{\"displayTimeUnit\":\"ms\", "
+			"\"traceEvents\":[");
+
+	while (fread(&chunk, sizeof chunk, 1, fp) == 1) {
+		if (chunk.size > alloc) {
+			free(data);
+			alloc = chunk.size;
+			data = malloc(alloc);
+			if (!data) {
+				fprintf(stderr, "out of memory\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		if (fread(data, 1, chunk.size, fp) != chunk.size) {
+			fprintf(stderr, "warning: the log is truncated\n");
+			break;
+		}
+
+		if (convert_chunk(conv, chunk.tid, data, chunk.size) < 0) {
+			fprintf(stderr, "corrupt record, stopping\n");
+			ret = -1;
+			break;
+		}
+	}
+
+	if (conv->format == FORMAT_CHROME)
+		fprintf(conv->out, "\n]}\n");
+
+	if (conv->dropped > 0)
+		fprintf(stderr, "warning: %" PRIu64 " records were dropped "
+			"while logging\n", conv->dropped);
+
+	free(data);
+
+	return ret;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct converter conv = { FORMAT_JSON, stdout, NULL, 0, 0, 0 };
+	const char *filename = NULL;
+	FILE *fp;
+	uint32_t i;
+	int ret;
+
+	for (i = 1; i < (uint32_t) argc; i++) {
+		if (strcmp(argv[i], "--json") == 0) {
+			conv.format = FORMAT_JSON;
+		} else if (strcmp(argv[i], "--chrome") == 0) {
+			conv.format = FORMAT_CHROME;
+		} else if (strcmp(argv[i], "--help") == 0) {
+			usage(EXIT_SUCCESS);
+		} else if (argv[i][0] == '-' || filename) {
+			fprintf(stderr,
+				"unknown option or invalid argument: %s\n",
+				argv[i]);
+			usage(EXIT_FAILURE);
+		} else {
+			filename = argv[i];
+		}
+	}
+
+	if (!filename)
+		usage(EXIT_FAILURE);
+
+	fp = fopen(filename, "r");
+	if (!fp) {
+		fprintf(stderr, "cannot open %s: %s\n",
+			filename, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	ret = convert_file(&conv, fp);
+	fclose(fp);
+
+	for (i = 0; i < conv.n_objects; i++)
+		free(conv.objects[i].str);
+	free(conv.objects);
+
+	return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
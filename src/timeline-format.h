@@ -0,0 +1,102 @@
+/*
+ * Copyright © 2014 Pekka Paalanen <pq@iki.fi>
+ * Copyright © 2014 Collabora, Ltd.
+ * Copyright © 2026 agent <agent@local>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef WESTON_TIMELINE_FORMAT_H
+#define WESTON_TIMELINE_FORMAT_H
+
+#include <stdint.h>
+
+/*
+ * Binary timeline log, in host byte order.
+ *
+ * The file starts with a struct timeline_file_header. It is followed by
+ * chunks: a struct timeline_chunk and then size bytes of records, all
+ * from the thread tid, in the order they were logged. Chunks of one
+ * thread are in order, chunks of different threads are interleaved.
+ *
+ * Every record starts with a struct timeline_record and is padded to a
+ * multiple of TIMELINE_RECORD_ALIGN bytes, size includes both.
+ */
+
+#define TIMELINE_MAGIC		0x4c545754	/* "TWTL" */
+#define TIMELINE_VERSION	1
+#define TIMELINE_RECORD_ALIGN	8
+
+#define TIMELINE_NO_STRING	UINT32_MAX
+
+struct timeline_file_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t clock_id;
+	uint32_t pad;
+};
+
+struct timeline_chunk {
+	uint32_t tid;
+	uint32_t size;
+};
+
+enum timeline_record_type {
+	/* struct timeline_point, n arguments, then the name */
+	TLR_POINT = 1,
+	/* struct timeline_desc, then the output name; n is the id */
+	TLR_OUTPUT_DESC,
+	/* struct timeline_desc, then the surface label; n is the id */
+	TLR_SURFACE_DESC,
+	/* n records were dropped here because the ring was full */
+	TLR_DROPPED,
+};
+
+struct timeline_record {
+	uint16_t type;
+	uint16_t size;
+	uint32_t n;
+};
+
+struct timeline_point {
+	int64_t sec;
+	uint32_t nsec;
+	uint32_t name_len;
+};
+
+/* enum timeline_type, and the id of an output or a surface, or the
+ * nsec of a vblank followed by a struct timeline_vblank_arg. */
+struct timeline_arg {
+	uint32_t type;
+	uint32_t value;
+};
+
+struct timeline_vblank_arg {
+	int64_t sec;
+};
+
+struct timeline_desc {
+	uint32_t main_surface;	/* 0 if none */
+	uint32_t len;		/* or TIMELINE_NO_STRING */
+};
+
+#endif /* WESTON_TIMELINE_FORMAT_H */
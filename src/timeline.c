@@ -27,31 +27,241 @@
 #include "config.h"
 
 #include <stdio.h>
+#include <stdint.h>
 #include <errno.h>
 #include <string.h>
 #include <time.h>
 #include <assert.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/syscall.h>
 
 #include "timeline.h"
+#include "timeline-format.h"
 #include "compositor.h"
 #include "file-util.h"
 
+/* Every thread that logs timeline points gets a ring of its own, so
+ * logging a point takes no lock and makes no system call. A writer
+ * thread moves the records from the rings to the file. */
+#define TIMELINE_RING_SIZE (64 * 1024)	/* power of two */
+#define TIMELINE_RECORD_MAX 1024
+#define TIMELINE_FLUSH_INTERVAL 50	/* ms */
+
+#define RECORD_ALIGN(x) \
+	(((x) + TIMELINE_RECORD_ALIGN - 1) & ~(size_t)(TIMELINE_RECORD_ALIGN - 1))
+
+struct timeline_ring {
+	struct wl_list link;
+	uint32_t tid;
+
+	/* head is only written by the owning thread, tail only by the
+	 * writer thread; both only ever grow. */
+	size_t head, tail;
+	unsigned int dropped;
+	int dead;
+
+	char data[TIMELINE_RING_SIZE];
+};
+
 struct timeline_log {
 	clock_t clk_id;
 	FILE *file;
 	unsigned series;
 	struct wl_listener compositor_destroy_listener;
+
+	struct wl_list ring_list;
+	pthread_t writer_thread;
+	pthread_mutex_t mutex;	/* protects ring_list and destroying */
+	pthread_cond_t cond;
+	int destroying;
+	int write_failed;
 };
 
 WL_EXPORT int weston_timeline_enabled_;
-static struct timeline_log timeline_ = { CLOCK_MONOTONIC, NULL, 0 };
+static struct timeline_log timeline_ = {
+	.clk_id = CLOCK_MONOTONIC,
+	.ring_list = { &timeline_.ring_list, &timeline_.ring_list },
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static void
+timeline_ring_release(void *data)
+{
+	struct timeline_ring *ring = data;
+
+	/* The writer thread frees it once it is drained */
+	__atomic_store_n(&ring->dead, 1, __ATOMIC_RELEASE);
+}
+
+static void
+timeline_ring_key_create(void)
+{
+	pthread_key_create(&ring_key, timeline_ring_release);
+}
+
+static struct timeline_ring *
+timeline_get_ring(void)
+{
+	struct timeline_ring *ring;
+
+	ring = pthread_getspecific(ring_key);
+	if (ring)
+		return ring;
+
+	ring = zalloc(sizeof *ring);
+	if (!ring)
+		return NULL;
+
+	ring->tid = syscall(SYS_gettid);
+	pthread_setspecific(ring_key, ring);
+
+	pthread_mutex_lock(&timeline_.mutex);
+	wl_list_insert(timeline_.ring_list.prev, &ring->link);
+	pthread_mutex_unlock(&timeline_.mutex);
+
+	return ring;
+}
+
+static void
+timeline_ring_copy_in(struct timeline_ring *ring, size_t pos,
+		      const void *src, size_t len)
+{
+	size_t offset = pos & (TIMELINE_RING_SIZE - 1);
+	size_t n = TIMELINE_RING_SIZE - offset;
+
+	if (n > len)
+		n = len;
+
+	memcpy(ring->data + offset, src, n);
+	memcpy(ring->data, (const char *) src + n, len - n);
+}
+
+/* Queues one record, or drops it if the ring is full */
+static void
+timeline_ring_push(struct timeline_ring *ring, const void *record,
+		   size_t size)
+{
+	struct timeline_record dropped;
+	size_t head, tail, needed = size;
+
+	head = ring->head;
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+	if (ring->dropped > 0)
+		needed += sizeof dropped;
+
+	if (TIMELINE_RING_SIZE - (head - tail) < needed) {
+		ring->dropped++;
+		return;
+	}
+
+	if (ring->dropped > 0) {
+		dropped.type = TLR_DROPPED;
+		dropped.size = sizeof dropped;
+		dropped.n = ring->dropped;
+		timeline_ring_copy_in(ring, head, &dropped, sizeof dropped);
+		head += sizeof dropped;
+		ring->dropped = 0;
+	}
+
+	timeline_ring_copy_in(ring, head, record, size);
+	head += size;
+
+	__atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+
+	/* Otherwise the writer thread comes around on its own */
+	if (head - tail > TIMELINE_RING_SIZE / 2)
+		pthread_cond_signal(&timeline_.cond);
+}
+
+static void
+timeline_ring_write_out(struct timeline_ring *ring, FILE *fp)
+{
+	struct timeline_chunk chunk;
+	size_t head, tail, offset, n;
+
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	tail = ring->tail;
+	if (head == tail)
+		return;
+
+	chunk.tid = ring->tid;
+	chunk.size = head - tail;
+
+	offset = tail & (TIMELINE_RING_SIZE - 1);
+	n = TIMELINE_RING_SIZE - offset;
+	if (n > chunk.size)
+		n = chunk.size;
+
+	fwrite(&chunk, sizeof chunk, 1, fp);
+	fwrite(ring->data + offset, 1, n, fp);
+	fwrite(ring->data, 1, chunk.size - n, fp);
+
+	__atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+}
+
+static void *
+writer_thread_function(void *data)
+{
+	struct timeline_ring *ring, *next;
+	struct timespec deadline;
+
+	pthread_mutex_lock(&timeline_.mutex);
+
+	while (1) {
+		wl_list_for_each_safe(ring, next, &timeline_.ring_list, link) {
+			timeline_ring_write_out(ring, timeline_.file);
+
+			if (__atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE) &&
+			    __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) ==
+			    ring->tail) {
+				wl_list_remove(&ring->link);
+				free(ring);
+			}
+		}
+
+		fflush(timeline_.file);
+		if (ferror(timeline_.file) && !timeline_.write_failed) {
+			weston_log("Timeline error writing the log file.\n");
+			timeline_.write_failed = 1;
+		}
+
+		/* weston_timeline_close() waits for the rings to drain */
+		if (timeline_.destroying)
+			break;
+
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += TIMELINE_FLUSH_INTERVAL * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&timeline_.cond, &timeline_.mutex,
+				       &deadline);
+	}
+
+	pthread_mutex_unlock(&timeline_.mutex);
+
+	return NULL;
+}
 
 static int
 weston_timeline_do_open(void)
 {
 	const char *prefix = "weston-timeline-";
-	const char *suffix = ".log";
+	const char *suffix = ".bin";
 	char fname[1000];
+	struct timeline_file_header header = {
+		.magic = TIMELINE_MAGIC,
+		.version = TIMELINE_VERSION,
+		.clock_id = timeline_.clk_id,
+	};
 
 	timeline_.file = file_create_dated(prefix, suffix,
 					   fname, sizeof(fname));
@@ -71,6 +281,14 @@ weston_timeline_do_open(void)
 		return -1;
 	}
 
+	if (fwrite(&header, sizeof header, 1, timeline_.file) != 1) {
+		weston_log("Cannot write to '%s': %s\n",
+			   fname, strerror(errno));
+		fclose(timeline_.file);
+		timeline_.file = NULL;
+		return -1;
+	}
+
 	weston_log("Opened timeline file '%s'\n", fname);
 
 	return 0;
@@ -85,12 +303,40 @@ timeline_notify_destroy(struct wl_listener *listener, void *data)
 void
 weston_timeline_open(struct weston_compositor *compositor)
 {
+	struct timeline_ring *ring;
+	sigset_t mask, old_mask;
+	int ret;
+
 	if (weston_timeline_enabled_)
 		return;
 
+	pthread_once(&ring_key_once, timeline_ring_key_create);
+
 	if (weston_timeline_do_open() < 0)
 		return;
 
+	/* Forget what was logged while the timeline was closed */
+	pthread_mutex_lock(&timeline_.mutex);
+	wl_list_for_each(ring, &timeline_.ring_list, link)
+		ring->tail = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	timeline_.destroying = 0;
+	timeline_.write_failed = 0;
+	pthread_mutex_unlock(&timeline_.mutex);
+
+	/* Keep every signal on the main thread's signalfds. */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+	ret = pthread_create(&timeline_.writer_thread, NULL,
+			     writer_thread_function, NULL);
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+	if (ret != 0) {
+		weston_log("Cannot start the timeline writer thread.\n");
+		fclose(timeline_.file);
+		timeline_.file = NULL;
+		return;
+	}
+
 	timeline_.compositor_destroy_listener.notify = timeline_notify_destroy;
 	wl_signal_add(&compositor->destroy_signal,
 		      &timeline_.compositor_destroy_listener);
@@ -111,15 +357,23 @@ weston_timeline_close(void)
 
 	wl_list_remove(&timeline_.compositor_destroy_listener.link);
 
+	pthread_mutex_lock(&timeline_.mutex);
+	timeline_.destroying = 1;
+	pthread_cond_signal(&timeline_.cond);
+	pthread_mutex_unlock(&timeline_.mutex);
+
+	pthread_join(timeline_.writer_thread, NULL);
+
 	fclose(timeline_.file);
 	timeline_.file = NULL;
 	weston_log("Timeline log file closed.\n");
 }
 
 struct timeline_emit_context {
-	FILE *cur;
-	FILE *out;
+	struct timeline_ring *ring;
 	unsigned series;
+	char *p;	/* next free byte of the point record */
+	char *end;
 };
 
 static unsigned
@@ -151,15 +405,56 @@ check_series(struct timeline_emit_context *ctx,
 	return 0;
 }
 
+/* Pads the record that starts at buf and ends at p, and returns its size */
+static size_t
+finish_record(char *buf, char *p)
+{
+	size_t size = RECORD_ALIGN(p - buf);
+
+	memset(p, 0, buf + size - p);
+	((struct timeline_record *) buf)->size = size;
+
+	return size;
+}
+
+/* Queues an object description ahead of the point that refers to it */
 static void
-fprint_quoted_string(FILE *fp, const char *str)
+emit_description(struct timeline_emit_context *ctx, uint16_t type,
+		 uint32_t id, uint32_t main_surface, const char *str)
 {
-	if (!str) {
-		fprintf(fp, "null");
-		return;
-	}
+	char buf[TIMELINE_RECORD_MAX];
+	struct timeline_record *rec = (void *) buf;
+	struct timeline_desc *desc = (void *) (rec + 1);
+	char *p = (char *) (desc + 1);
+	size_t len = 0;
+
+	if (str)
+		len = strnlen(str, buf + sizeof buf - p -
+				   TIMELINE_RECORD_ALIGN);
+
+	rec->type = type;
+	rec->n = id;
+	desc->main_surface = main_surface;
+	desc->len = str ? len : TIMELINE_NO_STRING;
+	memcpy(p, str, len);
+
+	timeline_ring_push(ctx->ring, buf, finish_record(buf, p + len));
+}
+
+static int
+emit_arg(struct timeline_emit_context *ctx, enum timeline_type type,
+	 uint32_t value)
+{
+	struct timeline_arg *arg = (void *) ctx->p;
+
+	if (ctx->end - ctx->p < (int) sizeof *arg)
+		return 0;
+
+	arg->type = type;
+	arg->value = value;
+	ctx->p += sizeof *arg;
 
-	fprintf(fp, "\"%s\"", str);
+	return 1;
 }
 
 static int
@@ -167,17 +462,11 @@ emit_weston_output(struct timeline_emit_context *ctx, void *obj)
 {
 	struct weston_output *o = obj;
 
-	if (check_series(ctx, &o->timeline)) {
-		fprintf(ctx->out, "{ \"id\":%u, "
-			"\"type\":\"weston_output\", \"name\":",
-			o->timeline.id);
-		fprint_quoted_string(ctx->out, o->name);
-		fprintf(ctx->out, " }\n");
-	}
-
-	fprintf(ctx->cur, "\"wo\":%u", o->timeline.id);
+	if (check_series(ctx, &o->timeline))
+		emit_description(ctx, TLR_OUTPUT_DESC, o->timeline.id, 0,
+				 o->name);
 
-	return 1;
+	return emit_arg(ctx, TLT_OUTPUT, o->timeline.id);
 }
 
 static void
@@ -186,7 +475,7 @@ check_weston_surface_description(struct timeline_emit_context *ctx,
 {
 	struct weston_surface *mains;
 	char d[512];
-	char mainstr[32];
+	uint32_t main_id = 0;
 
 	if (!check_series(ctx, &s->timeline))
 		return;
@@ -194,20 +483,14 @@ check_weston_surface_description(struct timeline_emit_context *ctx,
 	mains = weston_surface_get_main_surface(s);
 	if (mains != s) {
 		check_weston_surface_description(ctx, mains);
-		if (snprintf(mainstr, sizeof(mainstr),
-			     ", \"main_surface\":%u", mains->timeline.id) < 0)
-			mainstr[0] = '\0';
-	} else {
-		mainstr[0] = '\0';
+		main_id = mains->timeline.id;
 	}
 
 	if (!s->get_label || s->get_label(s, d, sizeof(d)) < 0)
 		d[0] = '\0';
 
-	fprintf(ctx->out, "{ \"id\":%u, "
-		"\"type\":\"weston_surface\", \"desc\":", s->timeline.id);
-	fprint_quoted_string(ctx->out, d[0] ? d : NULL);
-	fprintf(ctx->out, "%s }\n", mainstr);
+	emit_description(ctx, TLR_SURFACE_DESC, s->timeline.id, main_id,
+			 d[0] ? d : NULL);
 }
 
 static int
@@ -216,18 +499,24 @@ emit_weston_surface(struct timeline_emit_context *ctx, void *obj)
 	struct weston_surface *s = obj;
 
 	check_weston_surface_description(ctx, s);
-	fprintf(ctx->cur, "\"ws\":%u", s->timeline.id);
 
-	return 1;
+	return emit_arg(ctx, TLT_SURFACE, s->timeline.id);
 }
 
 static int
 emit_vblank_timestamp(struct timeline_emit_context *ctx, void *obj)
 {
 	struct timespec *ts = obj;
+	struct timeline_vblank_arg *arg;
+
+	if (ctx->end - ctx->p < (int) (sizeof(struct timeline_arg) +
+				       sizeof *arg))
+		return 0;
 
-	fprintf(ctx->cur, "\"vblank\":[%" PRId64 ", %ld]",
-		(int64_t)ts->tv_sec, ts->tv_nsec);
+	emit_arg(ctx, TLT_VBLANK, ts->tv_nsec);
+	arg = (void *) ctx->p;
+	arg->sec = ts->tv_sec;
+	ctx->p += sizeof *arg;
 
 	return 1;
 }
@@ -247,23 +536,30 @@ weston_timeline_point(const char *name, ...)
 	struct timespec ts;
 	enum timeline_type otype;
 	void *obj;
-	char buf[512];
+	char buf[TIMELINE_RECORD_MAX];
+	struct timeline_record *rec = (void *) buf;
+	struct timeline_point *point = (void *) (rec + 1);
 	struct timeline_emit_context ctx;
+	size_t name_len;
 
 	clock_gettime(timeline_.clk_id, &ts);
 
-	ctx.out = timeline_.file;
-	ctx.cur = fmemopen(buf, sizeof(buf), "w");
+	ctx.ring = timeline_get_ring();
 	ctx.series = timeline_.series;
+	ctx.p = (char *) (point + 1);
+	/* leave room for the name */
+	ctx.end = buf + sizeof buf / 2;
 
-	if (!ctx.cur) {
-		weston_log("Timeline error in fmemopen, closing.\n");
+	if (!ctx.ring) {
+		weston_log("Timeline error allocating a ring, closing.\n");
 		weston_timeline_close();
 		return;
 	}
 
-	fprintf(ctx.cur, "{ \"T\":[%" PRId64 ", %ld], \"N\":\"%s\"",
-		(int64_t)ts.tv_sec, ts.tv_nsec, name);
+	rec->type = TLR_POINT;
+	rec->n = 0;
+	point->sec = ts.tv_sec;
+	point->nsec = ts.tv_nsec;
 
 	va_start(argp, name);
 	while (1) {
@@ -272,21 +568,16 @@ weston_timeline_point(const char *name, ...)
 			break;
 
 		obj = va_arg(argp, void *);
-		if (type_dispatch[otype]) {
-			fprintf(ctx.cur, ", ");
-			type_dispatch[otype](&ctx, obj);
-		}
+		if (type_dispatch[otype] && type_dispatch[otype](&ctx, obj))
+			rec->n++;
 	}
 	va_end(argp);
 
-	fprintf(ctx.cur, " }\n");
-	fflush(ctx.cur);
-	if (ferror(ctx.cur)) {
-		weston_log("Timeline error in constructing entry, closing.\n");
-		weston_timeline_close();
-	} else {
-		fprintf(ctx.out, "%s", buf);
-	}
+	name_len = strnlen(name, buf + sizeof buf - ctx.p -
+				 TIMELINE_RECORD_ALIGN);
+	point->name_len = name_len;
+	memcpy(ctx.p, name, name_len);
 
-	fclose(ctx.cur);
+	timeline_ring_push(ctx.ring, buf,
+			   finish_record(buf, ctx.p + name_len));
 }
@@ -116,5 +116,23 @@ typedef struct wl_buffer * (EGLAPIENTRYP PFNEGLCREATEWAYLANDBUFFERFROMIMAGEWL) (
 #define EGL_DMA_BUF_PLANE2_PITCH_EXT				0x327A
 #endif
 
+/* Tokens for reading back into pixel buffer objects, from GLES 3.0 or
+ * GL_NV_pixel_buffer_object and GL_EXT_map_buffer_range. GL_STREAM_READ
+ * is only valid with a GLES 3.0 context. */
+#ifndef GL_PIXEL_PACK_BUFFER
+#define GL_PIXEL_PACK_BUFFER					0x88EB
+#endif
+#ifndef GL_STREAM_READ
+#define GL_STREAM_READ						0x88E1
+#endif
+#ifndef GL_MAP_READ_BIT
+#define GL_MAP_READ_BIT						0x0001
+#endif
+
+/* Server side waits on fence syncs, for the texture upload thread */
+#ifndef EGL_KHR_wait_sync
+#define EGL_KHR_wait_sync 1
+typedef EGLint (EGLAPIENTRYP PFNEGLWAITSYNCKHRPROC) (EGLDisplay dpy, EGLSyncKHR sync, EGLint flags);
+#endif
 
 #endif
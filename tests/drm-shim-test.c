@@ -0,0 +1,208 @@
+/*
+ * Copyright © 2026 agent <agent@local>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Runs against the DRM backend on the emulated device of
+ * tests/drm-shim.c, with the shim's stand-in for the GL renderer. The
+ * client shows a dmabuf on an overlay plane, then with a cursor on
+ * top, then covering the output for scanout; the shim counts the
+ * planes of every flipped frame, and weston-tests-env checks each
+ * kind was used once weston has exited. */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "shared/os-compatibility.h"
+#include "weston-test-client-helper.h"
+#include "linux-dmabuf-unstable-v1-client-protocol.h"
+
+/* From drm_fourcc.h */
+#define DRM_FORMAT_XRGB8888 0x34325258
+
+#define FRAMES_PER_STEP 60
+
+static struct zwp_linux_dmabuf_v1 *
+get_dmabuf(struct client *client)
+{
+	struct global *g;
+	struct global *global_dmabuf = NULL;
+	static struct zwp_linux_dmabuf_v1 *dmabuf;
+
+	if (dmabuf)
+		return dmabuf;
+
+	wl_list_for_each(g, &client->global_list, link) {
+		if (strcmp(g->interface, zwp_linux_dmabuf_v1_interface.name))
+			continue;
+
+		if (global_dmabuf)
+			assert(0 && "multiple linux_dmabuf objects");
+
+		global_dmabuf = g;
+	}
+
+	assert(global_dmabuf && "no linux_dmabuf, is pixman-dmabuf set?");
+
+	dmabuf = wl_registry_bind(client->wl_registry, global_dmabuf->name,
+				  &zwp_linux_dmabuf_v1_interface, 1);
+	assert(dmabuf);
+
+	return dmabuf;
+}
+
+static void
+params_created(void *data, struct zwp_linux_buffer_params_v1 *params,
+	       struct wl_buffer *new_buffer)
+{
+	struct wl_buffer **buffer = data;
+
+	*buffer = new_buffer;
+	zwp_linux_buffer_params_v1_destroy(params);
+}
+
+static void
+params_failed(void *data, struct zwp_linux_buffer_params_v1 *params)
+{
+	assert(0 && "dmabuf import failed");
+}
+
+static const struct zwp_linux_buffer_params_v1_listener params_listener = {
+	params_created,
+	params_failed
+};
+
+/* The shim does not care where a dmabuf comes from, and its renderer
+ * never reads it */
+static struct wl_buffer *
+create_dmabuf_buffer(struct client *client, int width, int height,
+		     uint32_t color)
+{
+	struct zwp_linux_buffer_params_v1 *params;
+	struct wl_buffer *buffer = NULL;
+	int stride = width * 4;
+	int size = stride * height;
+	uint32_t *pixels;
+	int fd, i, ret;
+
+	fd = os_create_anonymous_file(size);
+	assert(fd >= 0);
+
+	pixels = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	assert(pixels != MAP_FAILED);
+	for (i = 0; i < width * height; i++)
+		pixels[i] = color;
+	munmap(pixels, size);
+
+	params = zwp_linux_dmabuf_v1_create_params(get_dmabuf(client));
+	zwp_linux_buffer_params_v1_add(params, fd, 0, 0, stride, 0, 0);
+	zwp_linux_buffer_params_v1_add_listener(params, &params_listener,
+						&buffer);
+	zwp_linux_buffer_params_v1_create(params, width, height,
+					  DRM_FORMAT_XRGB8888, 0);
+
+	while (!buffer) {
+		ret = wl_display_dispatch(client->wl_display);
+		assert(ret >= 0);
+	}
+
+	close(fd);
+
+	return buffer;
+}
+
+/* Every commit damages the surface, so that each frame is flipped */
+static void
+show_buffer(struct client *client, struct wl_buffer *buffer,
+	    int x, int y, int width, int height)
+{
+	struct surface *surface = client->surface;
+	int i;
+
+	surface->wl_buffer = buffer;
+	surface->width = width;
+	surface->height = height;
+
+	for (i = 0; i < FRAMES_PER_STEP; i++)
+		move_client(client, x, y);
+}
+
+static void
+set_cursor(struct client *client)
+{
+	struct pointer *pointer = client->input->pointer;
+	struct wl_surface *cursor;
+	struct wl_buffer *buffer;
+	uint32_t *pixels;
+	int i;
+
+	weston_test_move_pointer(client->test->weston_test,
+				 client->surface->x + 10,
+				 client->surface->y + 10);
+	client_roundtrip(client);
+	assert(pointer->focus == client->surface);
+
+	buffer = create_shm_buffer(client, 32, 32, (void **) &pixels);
+	for (i = 0; i < 32 * 32; i++)
+		pixels[i] = 0xffffffff;
+
+	cursor = wl_compositor_create_surface(client->wl_compositor);
+	wl_surface_attach(cursor, buffer, 0, 0);
+	wl_surface_damage(cursor, 0, 0, 32, 32);
+	wl_surface_commit(cursor);
+
+	wl_pointer_set_cursor(pointer->wl_pointer, pointer->enter_serial,
+			      cursor, 0, 0);
+	client_roundtrip(client);
+}
+
+TEST(drm_shim_planes)
+{
+	struct client *client;
+	struct output *output;
+	struct wl_buffer *buffer;
+
+	client = create_client_and_test_surface(100, 100, 256, 256);
+	assert(client);
+	output = client->output;
+
+	/* An opaque dmabuf with nothing on top goes to an overlay */
+	buffer = create_dmabuf_buffer(client, 256, 256, 0xff0000ff);
+	show_buffer(client, buffer, 100, 100, 256, 256);
+
+	/* An ARGB8888 shm cursor goes to the cursor plane */
+	set_cursor(client);
+	show_buffer(client, buffer, 100, 100, 256, 256);
+
+	/* A buffer of the size of the mode at the output origin is
+	 * scanned out directly */
+	buffer = create_dmabuf_buffer(client, output->width, output->height,
+				      0xff00ff00);
+	show_buffer(client, buffer, output->x, output->y,
+		    output->width, output->height);
+}
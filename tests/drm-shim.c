@@ -0,0 +1,3960 @@
+/*
+ * Copyright © 2026 agent <agent@local>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* An emulated KMS device for running the DRM backend on machines
+ * without a GPU, e.g. to measure page flip latency and plane use in
+ * CI. Preload it into weston, as any user:
+ *
+ *	LD_PRELOAD=.libs/drm-shim.so ./weston --backend=drm-backend.so \
+ *		--tty=1 --config=shim.ini
+ *
+ * with require-input=false in the [core] section of shim.ini, as the
+ * emulated system has no input devices. tests/drm-shim-test.c drives
+ * it from make check.
+ *
+ * The shim replaces libdrm, libudev and GBM in the whole process:
+ * udev only knows /dev/dri/card0, the tty and the card are fakes the
+ * direct launcher accepts, and it passes the launcher's root check.
+ * GBM buffers are dumb buffers of the card and imported dmabufs
+ * wrap the client's fd. Loading gl-renderer.so gets a stand-in that
+ * draws with the pixman renderer into GBM surfaces and accepts client
+ * dmabufs without drawing them, so the backend assigns planes as it
+ * does on a GPU. --use-pixman works too, but then every view stays
+ * on the primary plane.
+ *
+ * Each output has a CRTC, a primary and a cursor plane, and
+ * DRM_SHIM_OVERLAYS overlay planes. Vertical blanks tick at the
+ * refresh rate of the mode on the monotonic clock, and page flip and
+ * vblank events are delivered through the device fd on time.
+ * Environment variables:
+ *
+ *	DRM_SHIM_OUTPUTS	comma separated WxH[@Hz][+phase_us] list,
+ *				1024x768@60 by default
+ *	DRM_SHIM_OVERLAYS	overlay planes per CRTC, 2 by default
+ *	DRM_SHIM_MAX_PLANES	atomic commits enabling more planes on a
+ *				CRTC fail; 0 (default) has no limit
+ *	DRM_SHIM_SCALING	0 makes scaled overlay planes fail
+ *	DRM_SHIM_FLIP_LATENCY	us a flip needs before the vblank that
+ *				latches it, 0 by default
+ *	DRM_SHIM_EVENT_DELAY	us from a vblank to its event, 0 by default
+ *	DRM_SHIM_ATOMIC		0 refuses the atomic client cap
+ *	DRM_SHIM_STATS		file the statistics are appended to at
+ *				exit instead of stderr
+ *
+ * The statistics count flips, their latency from the commit to the
+ * delivered event, flips that missed their first vblank, the planes
+ * in use per flipped frame, frames scanning out a client buffer, and
+ * the test-only commits and why they failed. */
+
+#include "config.h"
+
+#include <ctype.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/timerfd.h>
+#include <linux/kd.h>
+#include <linux/major.h>
+#include <linux/vt.h>
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <drm_fourcc.h>
+#include <gbm.h>
+#include <libudev.h>
+
+#include "compositor.h"
+#include "gl-renderer.h"
+#include "linux-dmabuf.h"
+#include "linux-dmabuf-unstable-v1-server-protocol.h"
+#include "shared/helpers.h"
+#include "shared/os-compatibility.h"
+#include "shared/zalloc.h"
+
+#define SHIM_EXPORT __attribute__ ((visibility("default")))
+
+#ifndef DRM_CLIENT_CAP_UNIVERSAL_PLANES
+#define DRM_CLIENT_CAP_UNIVERSAL_PLANES 2
+#endif
+
+#ifndef DRM_CLIENT_CAP_ATOMIC
+#define DRM_CLIENT_CAP_ATOMIC 3
+#endif
+
+#ifndef DRM_CAP_CURSOR_WIDTH
+#define DRM_CAP_CURSOR_WIDTH 0x8
+#endif
+
+#ifndef DRM_CAP_CURSOR_HEIGHT
+#define DRM_CAP_CURSOR_HEIGHT 0x9
+#endif
+
+#ifndef DRM_MODE_PROP_OBJECT
+#define DRM_MODE_PROP_OBJECT 0x40
+#endif
+
+#ifndef DRM_MODE_PROP_SIGNED_RANGE
+#define DRM_MODE_PROP_SIGNED_RANGE 0x80
+#endif
+
+#ifndef DRM_PLANE_TYPE_OVERLAY
+#define DRM_PLANE_TYPE_OVERLAY 0
+#define DRM_PLANE_TYPE_PRIMARY 1
+#define DRM_PLANE_TYPE_CURSOR 2
+#endif
+
+#define SHIM_DEVNODE "/dev/dri/card0"
+#define SHIM_SYSPATH "/sys/devices/platform/drm-shim/drm/card0"
+#define SHIM_DRM_MAJOR 226
+
+#define MAX_CRTCS 8
+#define MAX_OVERLAYS 8
+#define MAX_PLANES (MAX_CRTCS * (MAX_OVERLAYS + 2))
+#define MAX_OBJECT_PROPS 16
+#define CURSOR_SIZE 64
+
+/* The backend keeps CRTC and connector ids in 32 bit masks */
+#define CRTC_ID_BASE 8
+#define ENCODER_ID_BASE 16
+#define CONNECTOR_ID_BASE 24
+#define PLANE_ID_BASE 40
+#define PROP_ID_BASE 200
+#define FIRST_DYNAMIC_ID 1000
+
+enum shim_prop {
+	PROP_TYPE,
+	PROP_FB_ID,
+	PROP_CRTC_ID,
+	PROP_SRC_X,
+	PROP_SRC_Y,
+	PROP_SRC_W,
+	PROP_SRC_H,
+	PROP_CRTC_X,
+	PROP_CRTC_Y,
+	PROP_CRTC_W,
+	PROP_CRTC_H,
+	PROP_MODE_ID,
+	PROP_ACTIVE,
+	PROP_DPMS,
+	PROP__COUNT
+};
+
+static const struct {
+	const char *name;
+	uint32_t flags;
+} prop_info[] = {
+	[PROP_TYPE] = { "type", DRM_MODE_PROP_ENUM | DRM_MODE_PROP_IMMUTABLE },
+	[PROP_FB_ID] = { "FB_ID", DRM_MODE_PROP_OBJECT },
+	[PROP_CRTC_ID] = { "CRTC_ID", DRM_MODE_PROP_OBJECT },
+	[PROP_SRC_X] = { "SRC_X", DRM_MODE_PROP_RANGE },
+	[PROP_SRC_Y] = { "SRC_Y", DRM_MODE_PROP_RANGE },
+	[PROP_SRC_W] = { "SRC_W", DRM_MODE_PROP_RANGE },
+	[PROP_SRC_H] = { "SRC_H", DRM_MODE_PROP_RANGE },
+	[PROP_CRTC_X] = { "CRTC_X", DRM_MODE_PROP_SIGNED_RANGE },
+	[PROP_CRTC_Y] = { "CRTC_Y", DRM_MODE_PROP_SIGNED_RANGE },
+	[PROP_CRTC_W] = { "CRTC_W", DRM_MODE_PROP_RANGE },
+	[PROP_CRTC_H] = { "CRTC_H", DRM_MODE_PROP_RANGE },
+	[PROP_MODE_ID] = { "MODE_ID", DRM_MODE_PROP_BLOB },
+	[PROP_ACTIVE] = { "ACTIVE", DRM_MODE_PROP_RANGE },
+	[PROP_DPMS] = { "DPMS", DRM_MODE_PROP_ENUM },
+};
+
+static const char * const plane_type_names[] = {
+	[DRM_PLANE_TYPE_OVERLAY] = "Overlay",
+	[DRM_PLANE_TYPE_PRIMARY] = "Primary",
+	[DRM_PLANE_TYPE_CURSOR] = "Cursor",
+};
+
+static const char * const dpms_names[] = {
+	[DRM_MODE_DPMS_ON] = "On",
+	[DRM_MODE_DPMS_STANDBY] = "Standby",
+	[DRM_MODE_DPMS_SUSPEND] = "Suspend",
+	[DRM_MODE_DPMS_OFF] = "Off",
+};
+
+static const uint32_t primary_formats[] = {
+	DRM_FORMAT_XRGB8888,
+	DRM_FORMAT_ARGB8888,
+	DRM_FORMAT_RGB565,
+	DRM_FORMAT_XRGB2101010,
+};
+
+static const uint32_t cursor_formats[] = {
+	DRM_FORMAT_ARGB8888,
+};
+
+static const uint32_t overlay_formats[] = {
+	DRM_FORMAT_XRGB8888,
+	DRM_FORMAT_ARGB8888,
+	DRM_FORMAT_XBGR8888,
+	DRM_FORMAT_ABGR8888,
+	DRM_FORMAT_YUYV,
+	DRM_FORMAT_NV12,
+};
+
+enum reject_reason {
+	REJECT_PLANE_LIMIT,
+	REJECT_FORMAT,
+	REJECT_SCALING,
+	REJECT_OTHER,
+	REJECT__COUNT
+};
+
+struct plane_state {
+	uint32_t fb_id;
+	uint32_t crtc_id;
+	uint32_t src_x, src_y, src_w, src_h;
+	int32_t crtc_x, crtc_y;
+	uint32_t crtc_w, crtc_h;
+};
+
+struct crtc_state {
+	int active;
+	uint32_t mode_id;
+	drmModeModeInfo mode;
+};
+
+/* Everything an atomic commit can change */
+struct shim_state {
+	struct plane_state planes[MAX_PLANES];
+	struct crtc_state crtcs[MAX_CRTCS];
+	uint32_t connector_crtc[MAX_CRTCS];
+};
+
+struct shim_plane {
+	int type;
+	int crtc;
+	const uint32_t *formats;
+	int count_formats;
+};
+
+struct shim_event {
+	struct shim_event *next;
+	int crtc;
+	bool flip;
+	bool notify;
+	unsigned int sequence;
+	int64_t vblank_ns;
+	int64_t deliver_ns;
+	int64_t submit_ns;
+	unsigned int missed;
+	uint32_t fb_id;
+	void *user_data;
+};
+
+struct shim_crtc {
+	drmModeModeInfo preferred;
+	int64_t phase_ns;
+	int64_t origin_ns;
+	int64_t period_ns;
+	int primary;
+	int cursor;
+	uint32_t cursor_handle;
+	int32_t cursor_x, cursor_y;
+	uint64_t dpms;
+	struct shim_event *flip;
+
+	unsigned int flips;
+	unsigned int missed;
+	int64_t latency_sum, latency_min, latency_max;
+	int64_t delay_sum, delay_max;
+	unsigned int overlay_frames[MAX_OVERLAYS + 1];
+	unsigned int cursor_frames;
+	unsigned int scanout_frames;
+};
+
+struct shim_bo {
+	struct shim_bo *next;
+	uint32_t handle;
+	int fd;
+	uint64_t size;
+	bool imported;
+};
+
+struct shim_fb {
+	struct shim_fb *next;
+	uint32_t id;
+	uint32_t width, height;
+	uint32_t format;
+	uint32_t handle;
+};
+
+struct shim_blob {
+	struct shim_blob *next;
+	uint32_t id;
+	uint32_t length;
+	void *data;
+};
+
+static struct {
+	bool initialized;
+	bool opened;
+	int fd;
+	int tty_fd;
+	int tty_minor;
+	int kd_mode;
+
+	bool universal_planes;
+	bool atomic;
+	bool allow_atomic;
+	bool scaling;
+	int max_planes;
+	int64_t flip_latency_ns;
+	int64_t event_delay_ns;
+
+	int num_crtcs;
+	int num_planes;
+	struct shim_crtc crtcs[MAX_CRTCS];
+	struct shim_plane planes[MAX_PLANES];
+	struct shim_state state;
+
+	struct shim_bo *bos;
+	struct shim_fb *fbs;
+	struct shim_blob *blobs;
+	struct shim_event *events;
+	struct gbm_surface *surfaces;
+	uint32_t next_id;
+	uint32_t next_handle;
+
+	unsigned int commits;
+	unsigned int test_commits;
+	unsigned int rejected[REJECT__COUNT];
+} dev = {
+	.fd = -1,
+	.tty_fd = -1,
+};
+
+static int64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int
+fail(int err)
+{
+	errno = err;
+
+	return -err;
+}
+
+static int
+env_int(const char *name, int default_value)
+{
+	const char *s = getenv(name);
+	char *end;
+	long value;
+
+	if (!s || !*s)
+		return default_value;
+
+	errno = 0;
+	value = strtol(s, &end, 10);
+	if (errno || *end || value < 0 || value > 1000000) {
+		fprintf(stderr, "drm-shim: invalid %s=%s\n", name, s);
+		return default_value;
+	}
+
+	return value;
+}
+
+static void
+make_mode(drmModeModeInfo *mode, int width, int height, double refresh)
+{
+	memset(mode, 0, sizeof *mode);
+	mode->hdisplay = width;
+	mode->hsync_start = width + 48;
+	mode->hsync_end = width + 80;
+	mode->htotal = width + 160;
+	mode->vdisplay = height;
+	mode->vsync_start = height + 3;
+	mode->vsync_end = height + 8;
+	mode->vtotal = height + 30;
+	mode->clock = mode->htotal * mode->vtotal * refresh / 1000.0 + 0.5;
+	mode->vrefresh = refresh + 0.5;
+	mode->flags = DRM_MODE_FLAG_PHSYNC | DRM_MODE_FLAG_NVSYNC;
+	mode->type = DRM_MODE_TYPE_PREFERRED | DRM_MODE_TYPE_DRIVER;
+	snprintf(mode->name, sizeof mode->name, "%dx%d", width, height);
+}
+
+/* Parses one WxH[@Hz][+phase_us] output description */
+static int
+parse_output(const char *s, struct shim_crtc *crtc)
+{
+	double refresh = 60.0;
+	long phase = 0;
+	int width, height;
+	char *end;
+
+	width = strtol(s, &end, 10);
+	if (*end != 'x')
+		return -1;
+	height = strtol(end + 1, &end, 10);
+	if (*end == '@')
+		refresh = strtod(end + 1, &end);
+	if (*end == '+')
+		phase = strtol(end + 1, &end, 10);
+	if ((*end && *end != ',') ||
+	    width < 1 || width > 8192 || height < 1 || height > 8192 ||
+	    refresh < 1.0 || refresh > 1000.0 || phase < 0)
+		return -1;
+
+	make_mode(&crtc->preferred, width, height, refresh);
+	crtc->phase_ns = phase * 1000LL;
+
+	return 0;
+}
+
+static void
+add_plane(int crtc, int type, const uint32_t *formats, int count_formats)
+{
+	struct shim_plane *plane = &dev.planes[dev.num_planes];
+
+	plane->type = type;
+	plane->crtc = crtc;
+	plane->formats = formats;
+	plane->count_formats = count_formats;
+
+	if (type == DRM_PLANE_TYPE_PRIMARY)
+		dev.crtcs[crtc].primary = dev.num_planes;
+	else if (type == DRM_PLANE_TYPE_CURSOR)
+		dev.crtcs[crtc].cursor = dev.num_planes;
+
+	dev.num_planes++;
+}
+
+static void
+crtc_set_timing(int index, const drmModeModeInfo *mode)
+{
+	struct shim_crtc *crtc = &dev.crtcs[index];
+	int64_t period, last, seq;
+
+	if (mode->clock == 0 || mode->htotal == 0 || mode->vtotal == 0)
+		return;
+
+	period = (int64_t) mode->htotal * mode->vtotal * 1000000 /
+		mode->clock;
+	if (period == crtc->period_ns)
+		return;
+
+	/* Keep the sequence numbers going from the last vblank */
+	seq = (now_ns() - crtc->origin_ns) / crtc->period_ns;
+	last = crtc->origin_ns + seq * crtc->period_ns;
+	crtc->origin_ns = last - seq * period;
+	crtc->period_ns = period;
+}
+
+static void
+shim_init(void)
+{
+	const char *outputs;
+	int64_t now = now_ns();
+	int i, overlays;
+
+	if (dev.initialized)
+		return;
+
+	dev.initialized = true;
+	dev.next_id = FIRST_DYNAMIC_ID;
+	dev.next_handle = 1;
+	dev.kd_mode = KD_TEXT;
+
+	dev.allow_atomic = env_int("DRM_SHIM_ATOMIC", 1);
+	dev.scaling = env_int("DRM_SHIM_SCALING", 1);
+	dev.max_planes = env_int("DRM_SHIM_MAX_PLANES", 0);
+	dev.flip_latency_ns = env_int("DRM_SHIM_FLIP_LATENCY", 0) * 1000LL;
+	dev.event_delay_ns = env_int("DRM_SHIM_EVENT_DELAY", 0) * 1000LL;
+	overlays = MIN(env_int("DRM_SHIM_OVERLAYS", 2), MAX_OVERLAYS);
+
+	outputs = getenv("DRM_SHIM_OUTPUTS");
+	if (!outputs || !*outputs)
+		outputs = "1024x768@60";
+
+	while (outputs && dev.num_crtcs < MAX_CRTCS) {
+		if (parse_output(outputs, &dev.crtcs[dev.num_crtcs]) < 0) {
+			fprintf(stderr, "drm-shim: invalid output \"%s\"\n",
+				outputs);
+			break;
+		}
+		dev.num_crtcs++;
+
+		outputs = strchr(outputs, ',');
+		if (outputs)
+			outputs++;
+	}
+
+	if (dev.num_crtcs == 0) {
+		parse_output("1024x768@60", &dev.crtcs[0]);
+		dev.num_crtcs = 1;
+	}
+
+	for (i = 0; i < dev.num_crtcs; i++) {
+		struct shim_crtc *crtc = &dev.crtcs[i];
+		int j;
+
+		/* Start a second in, so sequence numbers are not 0 */
+		crtc->period_ns = 1000000000LL / 60;
+		crtc->origin_ns = now - 1000000000LL + crtc->phase_ns;
+		crtc_set_timing(i, &crtc->preferred);
+		crtc->origin_ns = now - 1000000000LL + crtc->phase_ns;
+		crtc->dpms = DRM_MODE_DPMS_ON;
+		crtc->latency_min = INT64_MAX;
+
+		add_plane(i, DRM_PLANE_TYPE_PRIMARY, primary_formats,
+			  ARRAY_LENGTH(primary_formats));
+		add_plane(i, DRM_PLANE_TYPE_CURSOR, cursor_formats,
+			  ARRAY_LENGTH(cursor_formats));
+		for (j = 0; j < overlays; j++)
+			add_plane(i, DRM_PLANE_TYPE_OVERLAY, overlay_formats,
+				  ARRAY_LENGTH(overlay_formats));
+	}
+}
+
+static int
+crtc_index(uint32_t id)
+{
+	if (id < CRTC_ID_BASE || id >= CRTC_ID_BASE + (uint32_t) dev.num_crtcs)
+		return -1;
+
+	return id - CRTC_ID_BASE;
+}
+
+static int
+encoder_index(uint32_t id)
+{
+	if (id < ENCODER_ID_BASE ||
+	    id >= ENCODER_ID_BASE + (uint32_t) dev.num_crtcs)
+		return -1;
+
+	return id - ENCODER_ID_BASE;
+}
+
+static int
+connector_index(uint32_t id)
+{
+	if (id < CONNECTOR_ID_BASE ||
+	    id >= CONNECTOR_ID_BASE + (uint32_t) dev.num_crtcs)
+		return -1;
+
+	return id - CONNECTOR_ID_BASE;
+}
+
+static int
+plane_index(uint32_t id)
+{
+	if (id < PLANE_ID_BASE ||
+	    id >= PLANE_ID_BASE + (uint32_t) dev.num_planes)
+		return -1;
+
+	return id - PLANE_ID_BASE;
+}
+
+static uint32_t
+crtc_mask(uint32_t crtc_id)
+{
+	int index = crtc_index(crtc_id);
+
+	return index < 0 ? 0 : 1u << index;
+}
+
+static struct shim_bo *
+find_bo(uint32_t handle)
+{
+	struct shim_bo *bo;
+
+	for (bo = dev.bos; bo; bo = bo->next)
+		if (bo->handle == handle)
+			return bo;
+
+	return NULL;
+}
+
+static struct shim_fb *
+find_fb(uint32_t id)
+{
+	struct shim_fb *fb;
+
+	for (fb = dev.fbs; fb; fb = fb->next)
+		if (fb->id == id)
+			return fb;
+
+	return NULL;
+}
+
+static struct shim_blob *
+find_blob(uint32_t id)
+{
+	struct shim_blob *blob;
+
+	for (blob = dev.blobs; blob; blob = blob->next)
+		if (blob->id == id)
+			return blob;
+
+	return NULL;
+}
+
+static bool
+is_shim_fd(int fd)
+{
+	return fd >= 0 && fd == dev.fd;
+}
+
+/*
+ * Vertical blanks and events
+ */
+
+static unsigned int
+crtc_sequence(int index, int64_t t)
+{
+	struct shim_crtc *crtc = &dev.crtcs[index];
+
+	if (t < crtc->origin_ns)
+		return 0;
+
+	return (t - crtc->origin_ns) / crtc->period_ns;
+}
+
+static int64_t
+crtc_vblank_time(int index, unsigned int sequence)
+{
+	struct shim_crtc *crtc = &dev.crtcs[index];
+
+	return crtc->origin_ns + (int64_t) sequence * crtc->period_ns;
+}
+
+static void
+rearm_timer(void)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof its);
+	if (dev.events) {
+		its.it_value.tv_sec = dev.events->deliver_ns / 1000000000LL;
+		its.it_value.tv_nsec = dev.events->deliver_ns % 1000000000LL;
+	}
+
+	timerfd_settime(dev.fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static struct shim_event *
+queue_event(int crtc, unsigned int sequence, void *user_data)
+{
+	struct shim_event *ev, **link;
+
+	ev = zalloc(sizeof *ev);
+	if (!ev)
+		return NULL;
+
+	ev->crtc = crtc;
+	ev->sequence = sequence;
+	ev->user_data = user_data;
+	ev->submit_ns = now_ns();
+	ev->vblank_ns = crtc_vblank_time(crtc, sequence);
+	ev->deliver_ns = MAX(ev->vblank_ns, ev->submit_ns) +
+		dev.event_delay_ns;
+
+	for (link = &dev.events; *link; link = &(*link)->next)
+		if ((*link)->deliver_ns > ev->deliver_ns)
+			break;
+	ev->next = *link;
+	*link = ev;
+
+	rearm_timer();
+
+	return ev;
+}
+
+/* Queues the completion of a flip on a CRTC: it takes effect at the
+ * first vblank at least the flip latency away. */
+static struct shim_event *
+queue_flip(int crtc, uint32_t fb_id, bool notify, void *user_data)
+{
+	int64_t now = now_ns();
+	unsigned int first, sequence;
+	struct shim_event *ev;
+
+	first = crtc_sequence(crtc, now) + 1;
+	sequence = crtc_sequence(crtc, now + dev.flip_latency_ns) + 1;
+
+	ev = queue_event(crtc, sequence, user_data);
+	if (!ev)
+		return NULL;
+
+	ev->flip = true;
+	ev->notify = notify;
+	ev->fb_id = fb_id;
+	ev->missed = sequence - first;
+	dev.crtcs[crtc].flip = ev;
+
+	return ev;
+}
+
+static void
+record_flip(struct shim_event *ev, int64_t now)
+{
+	struct shim_crtc *crtc = &dev.crtcs[ev->crtc];
+	uint32_t crtc_id = CRTC_ID_BASE + ev->crtc;
+	int64_t latency = now - ev->submit_ns;
+	int64_t delay = now - ev->vblank_ns;
+	struct plane_state *ps;
+	struct shim_fb *fb;
+	struct shim_bo *bo;
+	int i, overlays = 0;
+	bool cursor = crtc->cursor_handle != 0;
+	bool scanout = false;
+
+	crtc->flips++;
+	crtc->missed += ev->missed;
+	crtc->latency_sum += latency;
+	crtc->latency_min = MIN(crtc->latency_min, latency);
+	crtc->latency_max = MAX(crtc->latency_max, latency);
+	crtc->delay_sum += delay;
+	crtc->delay_max = MAX(crtc->delay_max, delay);
+
+	for (i = 0; i < dev.num_planes; i++) {
+		ps = &dev.state.planes[i];
+		if (!ps->fb_id || ps->crtc_id != crtc_id)
+			continue;
+
+		if (dev.planes[i].type == DRM_PLANE_TYPE_OVERLAY) {
+			overlays++;
+		} else if (dev.planes[i].type == DRM_PLANE_TYPE_CURSOR) {
+			cursor = true;
+		} else {
+			/* A client buffer instead of the renderer's */
+			fb = find_fb(ps->fb_id);
+			bo = fb ? find_bo(fb->handle) : NULL;
+			scanout = bo && bo->imported;
+		}
+	}
+
+	crtc->overlay_frames[overlays]++;
+	if (cursor)
+		crtc->cursor_frames++;
+	if (scanout)
+		crtc->scanout_frames++;
+}
+
+SHIM_EXPORT int
+drmHandleEvent(int fd, drmEventContextPtr evctx)
+{
+	struct shim_event *ev;
+	uint64_t expirations;
+	int64_t now;
+
+	if (!is_shim_fd(fd))
+		return fail(EBADF);
+
+	if (read(fd, &expirations, sizeof expirations) < 0 &&
+	    errno != EAGAIN)
+		return -1;
+
+	now = now_ns();
+	while (dev.events && dev.events->deliver_ns <= now) {
+		ev = dev.events;
+		dev.events = ev->next;
+
+		if (ev->flip) {
+			struct shim_crtc *crtc = &dev.crtcs[ev->crtc];
+
+			crtc->flip = NULL;
+			if (ev->fb_id)
+				dev.state.planes[crtc->primary].fb_id =
+					ev->fb_id;
+			record_flip(ev, now);
+
+			if (ev->notify && evctx->page_flip_handler)
+				evctx->page_flip_handler(fd, ev->sequence,
+					ev->vblank_ns / 1000000000LL,
+					ev->vblank_ns % 1000000000LL / 1000,
+					ev->user_data);
+		} else if (evctx->vblank_handler) {
+			evctx->vblank_handler(fd, ev->sequence,
+					      ev->vblank_ns / 1000000000LL,
+					      ev->vblank_ns % 1000000000LL / 1000,
+					      ev->user_data);
+		}
+
+		free(ev);
+	}
+
+	if (dev.fd >= 0)
+		rearm_timer();
+
+	return 0;
+}
+
+SHIM_EXPORT int
+drmWaitVBlank(int fd, drmVBlankPtr vbl)
+{
+	unsigned int type = vbl->request.type;
+	unsigned int current, target;
+	struct shim_event *ev;
+	struct timespec ts;
+	int64_t t;
+	int index;
+
+	if (!is_shim_fd(fd))
+		return fail(EBADF);
+
+	if (type & DRM_VBLANK_SECONDARY)
+		index = 1;
+	else
+		index = (type & DRM_VBLANK_HIGH_CRTC_MASK) >>
+			DRM_VBLANK_HIGH_CRTC_SHIFT;
+	if (index >= dev.num_crtcs || !dev.state.crtcs[index].active)
+		return fail(EINVAL);
+
+	current = crtc_sequence(index, now_ns());
+	target = vbl->request.sequence;
+	if (type & DRM_VBLANK_RELATIVE)
+		target += current;
+	if ((type & DRM_VBLANK_NEXTONMISS) && target <= current)
+		target = current + 1;
+
+	if (type & DRM_VBLANK_EVENT) {
+		ev = queue_event(index, MAX(target, current),
+				 (void *) vbl->request.signal);
+		if (!ev)
+			return fail(ENOMEM);
+		vbl->reply.sequence = ev->sequence;
+		return 0;
+	}
+
+	if (target > current) {
+		t = crtc_vblank_time(index, target);
+		ts.tv_sec = t / 1000000000LL;
+		ts.tv_nsec = t % 1000000000LL;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+				       &ts, NULL) == EINTR)
+			;
+		current = target;
+	}
+
+	t = crtc_vblank_time(index, current);
+	vbl->reply.sequence = current;
+	vbl->reply.tval_sec = t / 1000000000LL;
+	vbl->reply.tval_usec = t % 1000000000LL / 1000;
+
+	return 0;
+}
+
+/*
+ * Plane validation, shared by the legacy and atomic paths
+ */
+
+static bool
+plane_supports_format(const struct shim_plane *plane, uint32_t format)
+{
+	int i;
+
+	for (i = 0; i < plane->count_formats; i++)
+		if (plane->formats[i] == format)
+			return true;
+
+	return false;
+}
+
+static int
+check_plane(const struct shim_state *state, int index,
+	    enum reject_reason *reason)
+{
+	const struct plane_state *ps = &state->planes[index];
+	const struct shim_plane *plane = &dev.planes[index];
+	struct shim_fb *fb;
+	int crtc;
+
+	*reason = REJECT_OTHER;
+
+	if (!ps->fb_id)
+		return ps->crtc_id == 0 ? 0 : -1;
+
+	crtc = crtc_index(ps->crtc_id);
+	if (crtc != plane->crtc || !state->crtcs[crtc].active)
+		return -1;
+
+	fb = find_fb(ps->fb_id);
+	if (!fb || ps->crtc_w == 0 || ps->crtc_h == 0)
+		return -1;
+
+	if ((uint64_t) ps->src_x + ps->src_w > (uint64_t) fb->width << 16 ||
+	    (uint64_t) ps->src_y + ps->src_h > (uint64_t) fb->height << 16)
+		return -1;
+
+	if (plane->type == DRM_PLANE_TYPE_CURSOR &&
+	    (ps->crtc_w > CURSOR_SIZE || ps->crtc_h > CURSOR_SIZE))
+		return -1;
+
+	if (!plane_supports_format(plane, fb->format)) {
+		*reason = REJECT_FORMAT;
+		return -1;
+	}
+
+	if ((ps->src_w >> 16) != ps->crtc_w ||
+	    (ps->src_h >> 16) != ps->crtc_h) {
+		if (plane->type != DRM_PLANE_TYPE_OVERLAY || !dev.scaling) {
+			*reason = REJECT_SCALING;
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int
+check_crtc(const struct shim_state *state, int index,
+	   enum reject_reason *reason)
+{
+	uint32_t crtc_id = CRTC_ID_BASE + index;
+	int i, planes = 0;
+
+	*reason = REJECT_OTHER;
+
+	if (state->crtcs[index].active && !state->crtcs[index].mode.clock)
+		return -1;
+
+	for (i = 0; i < dev.num_planes; i++) {
+		if (state->planes[i].crtc_id != crtc_id)
+			continue;
+		if (check_plane(state, i, reason) < 0)
+			return -1;
+		if (state->planes[i].fb_id)
+			planes++;
+	}
+
+	if (dev.max_planes > 0 && planes > dev.max_planes) {
+		*reason = REJECT_PLANE_LIMIT;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Legacy KMS
+ */
+
+SHIM_EXPORT int
+drmModeSetCrtc(int fd, uint32_t crtcId, uint32_t bufferId,
+	       uint32_t x, uint32_t y, uint32_t *connectors, int count,
+	       drmModeModeInfoPtr mode)
+{
+	struct crtc_state *cs;
+	struct plane_state *ps;
+	struct shim_fb *fb;
+	int index, i, c;
+
+	if (!is_shim_fd(fd))
+		return fail(EBADF);
+
+	index = crtc_index(crtcId);
+	if (index < 0)
+		return fail(ENOENT);
+
+	cs = &dev.state.crtcs[index];
+	ps = &dev.state.planes[dev.crtcs[index].primary];
+
+	if (!mode) {
+		memset(cs, 0, sizeof *cs);
+		memset(ps, 0, sizeof *ps);
+		for (i = 0; i < dev.num_crtcs; i++)
+			if (dev.state.connector_crtc[i] == crtcId)
+				dev.state.connector_crtc[i] = 0;
+		return 0;
+	}
+
+	fb = find_fb(bufferId);
+	if (!fb)
+		return fail(ENOENT);
+	if (x + mode->hdisplay > fb->width || y + mode->vdisplay > fb->height)
+		return fail(ENOSPC);
+
+	for (i = 0; i < count; i++) {
+		c = connector_index(connectors[i]);
+		if (c < 0)
+			return fail(ENOENT);
+		dev.state.connector_crtc[c] = crtcId;
+	}
+
+	cs->active = 1;
+	cs->mode_id = 0;
+	cs->mode = *mode;
+	crtc_set_timing(index, mode);
+
+	ps->fb_id = bufferId;
+	ps->crtc_id = crtcId;
+	ps->src_x = x << 16;
+	ps->src_y = y << 16;
+	ps->src_w = mode->hdisplay << 16;
+	ps->src_h = mode->vdisplay << 16;
+	ps->crtc_x = 0;
+	ps->crtc_y = 0;
+	ps->crtc_w = mode->hdisplay;
+	ps->crtc_h = mode->vdisplay;
+
+	return 0;
+}
+
+SHIM_EXPORT int
+drmModePageFlip(int fd, uint32_t crtc_id, uint32_t fb_id,
+		uint32_t flags, void *user_data)
+{
+	int index;
+
+	if (!is_shim_fd(fd))
+		return fail(EBADF);
+
+	index = crtc_index(crtc_id);
+	if (index < 0 || !find_fb(fb_id))
+		return fail(ENOENT);
+	if (!dev.state.crtcs[index].active)
+		return fail(EINVAL);
+	if (dev.crtcs[index].flip)
+		return fail(EBUSY);
+
+	if (!queue_flip(index, fb_id, flags & DRM_MODE_PAGE_FLIP_EVENT,
+			user_data))
+		return fail(ENOMEM);
+
+	return 0;
+}
+
+SHIM_EXPORT int
+drmModeSetPlane(int fd, uint32_t plane_id, uint32_t crtc_id,
+		uint32_t fb_id, uint32_t flags,
+		int32_t crtc_x, int32_t crtc_y,
+		uint32_t crtc_w, uint32_t crtc_h,
+		uint32_t src_x, uint32_t src_y,
+		uint32_t src_w, uint32_t src_h)
+{
+	struct shim_state state;
+	struct plane_state *ps;
+	enum reject_reason reason;
+	int index;
+
+	if (!is_shim_fd(fd))
+		return fail(EBADF);
+
+	index = plane_index(plane_id);
+	if (index < 0)
+		return fail(ENOENT);
+
+	state = dev.state;
+	ps = &state.planes[index];
+	memset(ps, 0, sizeof *ps);
+	if (fb_id) {
+		ps->fb_id = fb_id;
+		ps->crtc_id = crtc_id;
+		ps->src_x = src_x;
+		ps->src_y = src_y;
+		ps->src_w = src_w;
+		ps->src_h = src_h;
+		ps->crtc_x = crtc_x;
+		ps->crtc_y = crtc_y;
+		ps->crtc_w = crtc_w;
+		ps->crtc_h = crtc_h;
+	}
+
+	if (check_plane(&state, index, &reason) < 0)
+		return fail(EINVAL);
+
+	dev.state.planes[index] = *ps;
+
+	return 0;
+}
+
+SHIM_EXPORT int
+drmModeSetCursor(int fd, uint32_t crtcId, uint32_t bo_handle,
+		 uint32_t width, uint32_t height)
+{
+	int index;
+
+	if (!is_shim_fd(fd))
+		return fail(EBADF);
+
+	index = crtc_index(crtcId);
+	if (index < 0)
+		return fail(ENOENT);
+	if (bo_handle && (!find_bo(bo_handle) ||
+			  width > CURSOR_SIZE || height > CURSOR_SIZE))
+		return fail(EINVAL);
+
+	dev.crtcs[index].cursor_handle = bo_handle;
+
+	return 0;
+}
+
+SHIM_EXPORT int
+drmModeMoveCursor(int fd, uint32_t crtcId, int x, int y)
+{
+	int index;
+
+	if (!is_shim_fd(fd))
+		return fail(EBADF);
+
+	index = crtc_index(crtcId);
+	if (index < 0)
+		return fail(ENOENT);
+
+	dev.crtcs[index].cursor_x = x;
+	dev.crtcs[index].cursor_y = y;
+
+	return 0;
+}
+
+SHIM_EXPORT int
+drmModeCrtcSetGamma(int fd, uint32_t crtc_id, uint32_t size,
+		    uint16_t *red, uint16_t *green, uint16_t *blue)
+{
+	if (!is_shim_fd(fd))
+		return fail(EBADF);
+
+	return crtc_index(crtc_id) < 0 ? fail(ENOENT) : 0;
+}
+
+SHIM_EXPORT int
+drmModeConnectorSetProperty(int fd, uint32_t connector_id,
+			    uint32_t property_id, uint64_t value)
+{
+	int index;
+
+	if (!is_shim_fd(fd))
+		return fail(EBADF);
+
+	index = connector_index(connector_id);
+	if (index < 0)
+		return fail(ENOENT);
+	if (property_id != PROP_ID_BASE + PROP_DPMS ||
+	    value > DRM_MODE_DPMS_OFF)
+		return fail(EINVAL);
+
+	dev.crtcs[index].dpms = value;
+
+	return 0;
+}
+
+/*
+ * Resources and properties
+ */
+
+SHIM_EXPORT drmModeResPtr
+drmModeGetResources(int fd)
+{
+	drmModeResPtr res;
+	int i;
+
+	if (!is_shim_fd(fd)) {
+		errno = EBADF;
+		return NULL;
+	}
+
+	res = zalloc(sizeof *res);
+	if (!res)
+		return NULL;
+
+	res->count_crtcs = dev.num_crtcs;
+	res->count_encoders = dev.num_crtcs;
+	res->count_connectors = dev.num_crtcs;
+	res->crtcs = calloc(dev.num_crtcs, sizeof(uint32_t));
+	res->encoders = calloc(dev.num_crtcs, sizeof(uint32_t));
+	res->connectors = calloc(dev.num_crtcs, sizeof(uint32_t));
+	if (!res->crtcs || !res->encoders || !res->connectors) {
+		drmModeFreeResources(res);
+		return NULL;
+	}
+
+	for (i = 0; i < dev.num_crtcs; i++) {
+		res->crtcs[i] = CRTC_ID_BASE + i;
+		res->encoders[i] = ENCODER_ID_BASE + i;
+		res->connectors[i] = CONNECTOR_ID_BASE + i;
+	}
+
+	res->min_width = 1;
+	res->min_height = 1;
+	res->max_width = 8192;
+	res->max_height = 8192;
+
+	return res;
+}
+
+SHIM_EXPORT void
+drmModeFreeResources(drmModeResPtr ptr)
+{
+	if (!ptr)
+		return;
+
+	free(ptr->fbs);
+	free(ptr->crtcs);
+	free(ptr->encoders);
+	free(ptr->connectors);
+	free(ptr);
+}
+
+/* Fills in the properties a KMS object exposes to this client and
+ * returns their number, or -1 if there is no such object. */
+static int
+object_properties(uint32_t id, uint32_t type, uint32_t *props,
+		  uint64_t *values)
+{
+	struct plane_state *ps;
+	int index, n = 0;
+
+#define ADD_PROP(prop, value) \
+	do { props[n] = PROP_ID_BASE + (prop); values[n] = (value); n++; } \
+	while (0)
+
+	index = plane_index(id);
+	if (index >= 0 && (type == DRM_MODE_OBJECT_PLANE ||
+			   type == DRM_MODE_OBJECT_ANY)) {
+		ps = &dev.state.planes[index];
+		if (dev.universal_planes)
+			ADD_PROP(PROP_TYPE, dev.planes[index].type);
+		if (dev.atomic) {
+			ADD_PROP(PROP_FB_ID, ps->fb_id);
+			ADD_PROP(PROP_CRTC_ID, ps->crtc_id);
+			ADD_PROP(PROP_SRC_X, ps->src_x);
+			ADD_PROP(PROP_SRC_Y, ps->src_y);
+			ADD_PROP(PROP_SRC_W, ps->src_w);
+			ADD_PROP(PROP_SRC_H, ps->src_h);
+			ADD_PROP(PROP_CRTC_X, (int64_t) ps->crtc_x);
+			ADD_PROP(PROP_CRTC_Y, (int64_t) ps->crtc_y);
+			ADD_PROP(PROP_CRTC_W, ps->crtc_w);
+			ADD_PROP(PROP_CRTC_H, ps->crtc_h);
+		}
+		return n;
+	}
+
+	index = crtc_index(id);
+	if (index >= 0 && (type == DRM_MODE_OBJECT_CRTC ||
+			   type == DRM_MODE_OBJECT_ANY)) {
+		if (dev.atomic) {
+			ADD_PROP(PROP_MODE_ID,
+				 dev.state.crtcs[index].mode_id);
+			ADD_PROP(PROP_ACTIVE, dev.state.crtcs[index].active);
+		}
+		return n;
+	}
+
+	index = connector_index(id);
+	if (index >= 0 && (type == DRM_MODE_OBJECT_CONNECTOR ||
+			   type == DRM_MODE_OBJECT_ANY)) {
+		ADD_PROP(PROP_DPMS, dev.crtcs[index].dpms);
+		if (dev.atomic)
+			ADD_PROP(PROP_CRTC_ID,
+				 dev.state.connector_crtc[index]);
+		return n;
+	}
+
+	if (encoder_index(id) >= 0 && (type == DRM_MODE_OBJECT_ENCODER ||
+				       type == DRM_MODE_OBJECT_ANY))
+		return 0;
+
+#undef ADD_PROP
+
+	return -1;
+}
+
+SHIM_EXPORT drmModeConnectorPtr
+drmModeGetConnector(int fd, uint32_t connectorId)
+{
+	uint32_t props[MAX_OBJECT_PROPS];
+	uint64_t values[MAX_OBJECT_PROPS];
+	drmModeConnectorPtr connector;
+	drmModeModeInfo *mode;
+	int index, n;
+
+	if (!is_shim_fd(fd)) {
+		errno = EBADF;
+		return NULL;
+	}
+
+	index = connector_index(connectorId);
+	if (index < 0) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	n = object_properties(connectorId, DRM_MODE_OBJECT_CONNECTOR,
+			      props, values);
+	mode = &dev.crtcs[index].preferred;
+
+	connector = zalloc(sizeof *connector);
+	if (!connector)
+		return NULL;
+
+	connector->connector_id = connectorId;
+	if (dev.state.connector_crtc[index])
+		connector->encoder_id = ENCODER_ID_BASE + index;
+	connector->connector_type = DRM_MODE_CONNECTOR_VIRTUAL;
+	connector->connector_type_id = index + 1;
+	connector->connection = DRM_MODE_CONNECTED;
+	/* 96 dpi */
+	connector->mmWidth = mode->hdisplay * 254 / 960;
+	connector->mmHeight = mode->vdisplay * 254 / 960;
+	connector->subpixel = DRM_MODE_SUBPIXEL_UNKNOWN;
+
+	connector->count_modes = 1;
+	connector->modes = malloc(sizeof *mode);
+	connector->count_props = n;
+	connector->props = calloc(n, sizeof props[0]);
+	connector->prop_values = calloc(n, sizeof values[0]);
+	connector->count_encoders = 1;
+	connector->encoders = malloc(sizeof(uint32_t));
+	if (!connector->modes || !connector->props ||
+	    !connector->prop_values || !connector->encoders) {
+		drmModeFreeConnector(connector);
+		return NULL;
+	}
+
+	*connector->modes = *mode;
+	memcpy(connector->props, props, n * sizeof props[0]);
+	memcpy(connector->prop_values, values, n * sizeof values[0]);
+	connector->encoders[0] = ENCODER_ID_BASE + index;
+
+	return connector;
+}
+
+SHIM_EXPORT void
+drmModeFreeConnector(drmModeConnectorPtr ptr)
+{
+	if (!ptr)
+		return;
+
+	free(ptr->modes);
+	free(ptr->props);
+	free(ptr->prop_values);
+	free(ptr->encoders);
+	free(ptr);
+}
+
+SHIM_EXPORT drmModeEncoderPtr
+drmModeGetEncoder(int fd, uint32_t encoder_id)
+{
+	drmModeEncoderPtr encoder;
+	int index;
+
+	if (!is_shim_fd(fd)) {
+		errno = EBADF;
+		return NULL;
+	}
+
+	index = encoder_index(encoder_id);
+	if (index < 0) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	encoder = zalloc(sizeof *encoder);
+	if (!encoder)
+		return NULL;
+
+	encoder->encoder_id = encoder_id;
+	encoder->encoder_type = DRM_MODE_ENCODER_VIRTUAL;
+	encoder->crtc_id = dev.state.connector_crtc[index];
+	encoder->possible_crtcs = 1 << index;
+
+	return encoder;
+}
+
+SHIM_EXPORT void
+drmModeFreeEncoder(drmModeEncoderPtr ptr)
+{
+	free(ptr);
+}
+
+SHIM_EXPORT drmModeCrtcPtr
+drmModeGetCrtc(int fd, uint32_t crtcId)
+{
+	struct crtc_state *cs;
+	struct plane_state *ps;
+	drmModeCrtcPtr crtc;
+	int index;
+
+	if (!is_shim_fd(fd)) {
+		errno = EBADF;
+		return NULL;
+	}
+
+	index = crtc_index(crtcId);
+	if (index < 0) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	crtc = zalloc(sizeof *crtc);
+	if (!crtc)
+		return NULL;
+
+	cs = &dev.state.crtcs[index];
+	ps = &dev.state.planes[dev.crtcs[index].primary];
+
+	crtc->crtc_id = crtcId;
+	crtc->buffer_id = ps->fb_id;
+	crtc->x = ps->src_x >> 16;
+	crtc->y = ps->src_y >> 16;
+	crtc->mode_valid = cs->active;
+	if (cs->active) {
+		crtc->mode = cs->mode;
+		crtc->width = cs->mode.hdisplay;
+		crtc->height = cs->mode.vdisplay;
+	}
+	crtc->gamma_size = 256;
+
+	return crtc;
+}
+
+SHIM_EXPORT void
+drmModeFreeCrtc(drmModeCrtcPtr ptr)
+{
+	free(ptr);
+}
+
+SHIM_EXPORT drmModePlaneResPtr
+drmModeGetPlaneResources(int fd)
+{
+	drmModePlaneResPtr res;
+	int i;
+
+	if (!is_shim_fd(fd)) {
+		errno = EBADF;
+		return NULL;
+	}
+
+	res = zalloc(sizeof *res);
+	if (!res)
+		return NULL;
+
+	res->planes = calloc(dev.num_planes, sizeof(uint32_t));
+	if (!res->planes) {
+		free(res);
+		return NULL;
+	}
+
+	/* Without universal planes only the overlays are planes */
+	for (i = 0; i < dev.num_planes; i++)
+		if (dev.universal_planes ||
+		    dev.planes[i].type == DRM_PLANE_TYPE_OVERLAY)
+			res->planes[res->count_planes++] = PLANE_ID_BASE + i;
+
+	return res;
+}
+
+SHIM_EXPORT void
+drmModeFreePlaneResources(drmModePlaneResPtr ptr)
+{
+	if (!ptr)
+		return;
+
+	free(ptr->planes);
+	free(ptr);
+}
+
+SHIM_EXPORT drmModePlanePtr
+drmModeGetPlane(int fd, uint32_t plane_id)
+{
+	struct shim_plane *plane;
+	struct plane_state *ps;
+	drmModePlanePtr p;
+	int index;
+
+	if (!is_shim_fd(fd)) {
+		errno = EBADF;
+		return NULL;
+	}
+
+	index = plane_index(plane_id);
+	if (index < 0) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	plane = &dev.planes[index];
+	ps = &dev.state.planes[index];
+
+	p = zalloc(sizeof *p);
+	if (!p)
+		return NULL;
+
+	p->formats = calloc(plane->count_formats, sizeof(uint32_t));
+	if (!p->formats) {
+		free(p);
+		return NULL;
+	}
+
+	p->count_formats = plane->count_formats;
+	memcpy(p->formats, plane->formats,
+	       plane->count_formats * sizeof(uint32_t));
+	p->plane_id = plane_id;
+	p->crtc_id = ps->crtc_id;
+	p->fb_id = ps->fb_id;
+	p->crtc_x = ps->crtc_x;
+	p->crtc_y = ps->crtc_y;
+	p->x = ps->src_x >> 16;
+	p->y = ps->src_y >> 16;
+	p->possible_crtcs = 1 << plane->crtc;
+
+	return p;
+}
+
+SHIM_EXPORT void
+drmModeFreePlane(drmModePlanePtr ptr)
+{
+	if (!ptr)
+		return;
+
+	free(ptr->formats);
+	free(ptr);
+}
+
+SHIM_EXPORT drmModeObjectPropertiesPtr
+drmModeObjectGetProperties(int fd, uint32_t object_id, uint32_t object_type)
+{
+	uint32_t props[MAX_OBJECT_PROPS];
+	uint64_t values[MAX_OBJECT_PROPS];
+	drmModeObjectPropertiesPtr p;
+	int n;
+
+	if (!is_shim_fd(fd)) {
+		errno = EBADF;
+		return NULL;
+	}
+
+	n = object_properties(object_id, object_type, props, values);
+	if (n < 0) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	p = zalloc(sizeof *p);
+	if (!p)
+		return NULL;
+
+	p->count_props = n;
+	p->props = calloc(MAX(n, 1), sizeof props[0]);
+	p->prop_values = calloc(MAX(n, 1), sizeof values[0]);
+	if (!p->props || !p->prop_values) {
+		drmModeFreeObjectProperties(p);
+		return NULL;
+	}
+
+	memcpy(p->props, props, n * sizeof props[0]);
+	memcpy(p->prop_values, values, n * sizeof values[0]);
+
+	return p;
+}
+
+SHIM_EXPORT void
+drmModeFreeObjectProperties(drmModeObjectPropertiesPtr ptr)
+{
+	if (!ptr)
+		return;
+
+	free(ptr->props);
+	free(ptr->prop_values);
+	free(ptr);
+}
+
+static int
+set_enums(drmModePropertyPtr prop, const char * const *names, int count)
+{
+	int i;
+
+	prop->enums = calloc(count, sizeof *prop->enums);
+	prop->values = calloc(count, sizeof *prop->values);
+	if (!prop->enums || !prop->values)
+		return -1;
+
+	prop->count_enums = count;
+	prop->count_values = count;
+	for (i = 0; i < count; i++) {
+		prop->enums[i].value = i;
+		prop->values[i] = i;
+		snprintf(prop->enums[i].name, sizeof prop->enums[i].name,
+			 "%s", names[i]);
+	}
+
+	return 0;
+}
+
+static int
+set_values(drmModePropertyPtr prop, uint64_t a, uint64_t b)
+{
+	prop->values = calloc(2, sizeof *prop->values);
+	if (!prop->values)
+		return -1;
+
+	prop->count_values = 2;
+	prop->values[0] = a;
+	prop->values[1] = b;
+
+	return 0;
+}
+
+SHIM_EXPORT drmModePropertyPtr
+drmModeGetProperty(int fd, uint32_t propertyId)
+{
+	drmModePropertyPtr prop;
+	uint32_t index;
+	int ret = 0;
+
+	if (!is_shim_fd(fd)) {
+		errno = EBADF;
+		return NULL;
+	}
+
+	index = propertyId - PROP_ID_BASE;
+	if (propertyId < PROP_ID_BASE || index >= PROP__COUNT) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	prop = zalloc(sizeof *prop);
+	if (!prop)
+		return NULL;
+
+	prop->prop_id = propertyId;
+	prop->flags = prop_info[index].flags;
+	snprintf(prop->name, sizeof prop->name, "%s", prop_info[index].name);
+
+	switch (index) {
+	case PROP_TYPE:
+		ret = set_enums(prop, plane_type_names,
+				ARRAY_LENGTH(plane_type_names));
+		break;
+	case PROP_DPMS:
+		ret = set_enums(prop, dpms_names, ARRAY_LENGTH(dpms_names));
+		break;
+	case PROP_FB_ID:
+		prop->values = calloc(1, sizeof *prop->values);
+		ret = prop->values ? 0 : -1;
+		if (prop->values) {
+			prop->count_values = 1;
+			prop->values[0] = DRM_MODE_OBJECT_FB;
+		}
+		break;
+	case PROP_CRTC_ID:
+		prop->values = calloc(1, sizeof *prop->values);
+		ret = prop->values ? 0 : -1;
+		if (prop->values) {
+			prop->count_values = 1;
+			prop->values[0] = DRM_MODE_OBJECT_CRTC;
+		}
+		break;
+	case PROP_CRTC_X:
+	case PROP_CRTC_Y:
+		ret = set_values(prop, INT32_MIN, INT32_MAX);
+		break;
+	case PROP_ACTIVE:
+		ret = set_values(prop, 0, 1);
+		break;
+	case PROP_MODE_ID:
+		break;
+	default:
+		ret = set_values(prop, 0, UINT32_MAX);
+		break;
+	}
+
+	if (ret < 0) {
+		drmModeFreeProperty(prop);
+		return NULL;
+	}
+
+	return prop;
+}
+
+SHIM_EXPORT void
+drmModeFreeProperty(drmModePropertyPtr ptr)
+{
+	if (!ptr)
+		return;
+
+	free(ptr->values);
+	free(ptr->enums);
+	free(ptr->blob_ids);
+	free(ptr);
+}
+
+SHIM_EXPORT drmModePropertyBlobPtr
+drmModeGetPropertyBlob(int fd, uint32_t blob_id)
+{
+	drmModePropertyBlobPtr p;
+	struct shim_blob *blob;
+
+	if (!is_shim_fd(fd)) {
+		errno = EBADF;
+		return NULL;
+	}
+
+	blob = find_blob(blob_id);
+	if (!blob) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	p = zalloc(sizeof *p);
+	if (!p)
+		return NULL;
+
+	p->data = malloc(blob->length);
+	if (!p->data) {
+		free(p);
+		return NULL;
+	}
+
+	p->id = blob->id;
+	p->length = blob->length;
+	memcpy(p->data, blob->data, blob->length);
+
+	return p;
+}
+
+SHIM_EXPORT void
+drmModeFreePropertyBlob(drmModePropertyBlobPtr ptr)
+{
+	if (!ptr)
+		return;
+
+	free(ptr->data);
+	free(ptr);
+}
+
+/*
+ * Buffers
+ */
+
+static uint32_t
+format_from_depth(uint8_t depth, uint8_t bpp)
+{
+	if (depth == 24 && bpp == 32)
+		return DRM_FORMAT_XRGB8888;
+	if (depth == 32 && bpp == 32)
+		return DRM_FORMAT_ARGB8888;
+	if (depth == 30 && bpp == 32)
+		return DRM_FORMAT_XRGB2101010;
+	if (depth == 16 && bpp == 16)
+		return DRM_FORMAT_RGB565;
+
+	return 0;
+}
+
+static int
+add_fb(uint32_t width, uint32_t height, uint32_t format, uint32_t handle,
+       uint32_t *buf_id)
+{
+	struct shim_fb *fb;
+
+	if (!format || width == 0 || height == 0)
+		return fail(EINVAL);
+	if (!find_bo(handle))
+		return fail(ENOENT);
+
+	fb = zalloc(sizeof *fb);
+	if (!fb)
+		return fail(ENOMEM);
+
+	fb->id = dev.next_id++;
+	fb->width = width;
+	fb->height = height;
+	fb->format = format;
+	fb->handle = handle;
+	fb->next = dev.fbs;
+	dev.fbs = fb;
+
+	*buf_id = fb->id;
+
+	return 0;
+}
+
+SHIM_EXPORT int
+drmModeAddFB(int fd, uint32_t width, uint32_t height, uint8_t depth,
+	     uint8_t bpp, uint32_t pitch, uint32_t bo_handle,
+	     uint32_t *buf_id)
+{
+	if (!is_shim_fd(fd))
+		return fail(EBADF);
+
+	return add_fb(width, height, format_from_depth(depth, bpp),
+		      bo_handle, buf_id);
+}
+
+SHIM_EXPORT int
+drmModeAddFB2(int fd, uint32_t width, uint32_t height,
+	      uint32_t pixel_format, const uint32_t bo_handles[4],
+	      const uint32_t pitches[4], const uint32_t offsets[4],
+	      uint32_t *buf_id, uint32_t flags)
+{
+	if (!is_shim_fd(fd))
+		return fail(EBADF);
+
+	return add_fb(width, height, pixel_format, bo_handles[0], buf_id);
+}
+
+SHIM_EXPORT int
+drmModeRmFB(int fd, uint32_t bufferId)
+{
+	struct shim_fb **link, *fb;
+	int i;
+
+	if (!is_shim_fd(fd))
+		return fail(EBADF);
+
+	for (link = &dev.fbs; *link; link = &(*link)->next)
+		if ((*link)->id == bufferId)
+			break;
+	if (!*link)
+		return fail(ENOENT);
+
+	fb = *link;
+	*link = fb->next;
+	free(fb);
+
+	/* Planes still showing the framebuffer are turned off */
+	for (i = 0; i < dev.num_planes; i++)
+		if (dev.state.planes[i].fb_id == bufferId)
+			memset(&dev.state.planes[i], 0,
+			       sizeof dev.state.planes[i]);
+
+	return 0;
+}
+
+static int
+create_dumb(struct drm_mode_create_dumb *args)
+{
+	struct shim_bo *bo;
+
+	if (args->width == 0 || args->height == 0 || args->bpp == 0 ||
+	    args->width > 8192 || args->height > 8192)
+		return fail(EINVAL);
+
+	bo = zalloc(sizeof *bo);
+	if (!bo)
+		return fail(ENOMEM);
+
+	args->pitch = (args->width * ((args->bpp + 7) / 8) + 63) & ~63u;
+	args->size = (uint64_t) args->pitch * args->height;
+
+	bo->fd = os_create_anonymous_file(args->size);
+	if (bo->fd < 0) {
+		free(bo);
+		return -1;
+	}
+
+	bo->handle = dev.next_handle++;
+	bo->size = args->size;
+	bo->next = dev.bos;
+	dev.bos = bo;
+
+	args->handle = bo->handle;
+
+	return 0;
+}
+
+static int
+destroy_bo(uint32_t handle)
+{
+	struct shim_bo **link, *bo;
+
+	for (link = &dev.bos; *link; link = &(*link)->next)
+		if ((*link)->handle == handle)
+			break;
+	if (!*link)
+		return fail(ENOENT);
+
+	bo = *link;
+	*link = bo->next;
+	close(bo->fd);
+	free(bo);
+
+	return 0;
+}
+
+SHIM_EXPORT int
+drmIoctl(int fd, unsigned long request, void *arg)
+{
+	struct drm_mode_map_dumb *map;
+	struct shim_bo *bo;
+
+	if (!is_shim_fd(fd))
+		return ioctl(fd, request, arg);
+
+	switch (request) {
+	case DRM_IOCTL_MODE_CREATE_DUMB:
+		return create_dumb(arg) < 0 ? -1 : 0;
+	case DRM_IOCTL_MODE_MAP_DUMB:
+		map = arg;
+		bo = find_bo(map->handle);
+		if (!bo) {
+			errno = ENOENT;
+			return -1;
+		}
+		/* Recognized by the mmap() wrapper */
+		map->offset = (uint64_t) map->handle << 32;
+		return 0;
+	case DRM_IOCTL_MODE_DESTROY_DUMB:
+		return destroy_bo(((struct drm_mode_destroy_dumb *) arg)->handle)
+			< 0 ? -1 : 0;
+	case DRM_IOCTL_GEM_CLOSE:
+		return destroy_bo(((struct drm_gem_close *) arg)->handle)
+			< 0 ? -1 : 0;
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+}
+
+SHIM_EXPORT int
+drmPrimeHandleToFD(int fd, uint32_t handle, uint32_t flags, int *prime_fd)
+{
+	struct shim_bo *bo;
+
+	if (!is_shim_fd(fd))
+		return fail(EBADF);
+
+	bo = find_bo(handle);
+	if (!bo)
+		return fail(ENOENT);
+
+	*prime_fd = fcntl(bo->fd, F_DUPFD_CLOEXEC, 0);
+
+	return *prime_fd < 0 ? -errno : 0;
+}
+
+/*
+ * GBM: just enough for the backend to put client buffers on planes
+ * and to write the cursor. Surfaces are a few dumb buffers the
+ * stand-in renderer below draws into.
+ */
+
+struct gbm_device {
+	int fd;
+};
+
+struct gbm_bo {
+	struct gbm_device *gbm;
+	uint32_t handle;
+	uint32_t width, height;
+	uint32_t stride;
+	uint32_t format;
+	void *user_data;
+	void (*destroy_user_data)(struct gbm_bo *, void *);
+};
+
+#define SURFACE_BUFFERS 3
+
+struct surface_buffer {
+	struct gbm_bo *bo;
+	void *map;
+	size_t size;
+	pixman_image_t *image;
+	bool locked;
+};
+
+struct gbm_surface {
+	struct gbm_surface *next;
+	struct gbm_device *gbm;
+	uint32_t width, height;
+	uint32_t format;
+	struct weston_output *output;
+	struct surface_buffer buffers[SURFACE_BUFFERS];
+	int back; /* drawn and not locked yet, or -1 */
+};
+
+static pixman_format_code_t
+pixman_format(uint32_t format)
+{
+	switch (format) {
+	case DRM_FORMAT_XRGB8888:
+		return PIXMAN_x8r8g8b8;
+	case DRM_FORMAT_ARGB8888:
+		return PIXMAN_a8r8g8b8;
+	case DRM_FORMAT_RGB565:
+		return PIXMAN_r5g6b5;
+	default:
+		return 0;
+	}
+}
+
+static int
+format_cpp(uint32_t format)
+{
+	switch (format) {
+	case DRM_FORMAT_RGB565:
+		return 2;
+	case DRM_FORMAT_XRGB8888:
+	case DRM_FORMAT_ARGB8888:
+	case DRM_FORMAT_XBGR8888:
+	case DRM_FORMAT_ABGR8888:
+	case DRM_FORMAT_XRGB2101010:
+	case DRM_FORMAT_ARGB2101010:
+		return 4;
+	default:
+		return 0;
+	}
+}
+
+static struct gbm_bo *
+wrap_bo(struct gbm_device *gbm, uint32_t handle, uint32_t width,
+	uint32_t height, uint32_t stride, uint32_t format)
+{
+	struct gbm_bo *bo;
+
+	bo = zalloc(sizeof *bo);
+	if (!bo) {
+		destroy_bo(handle);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	bo->gbm = gbm;
+	bo->handle = handle;
+	bo->width = width;
+	bo->height = height;
+	bo->stride = stride;
+	bo->format = format;
+
+	return bo;
+}
+
+/* Like a PRIME import: the handle shares the client's memory */
+static struct gbm_bo *
+import_fd(struct gbm_device *gbm, int fd, uint32_t width, uint32_t height,
+	  uint32_t stride, uint32_t format)
+{
+	struct shim_bo *bo;
+
+	if (width == 0 || height == 0 || stride < width * format_cpp(format)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	bo = zalloc(sizeof *bo);
+	if (!bo) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	bo->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (bo->fd < 0) {
+		free(bo);
+		return NULL;
+	}
+
+	bo->handle = dev.next_handle++;
+	bo->size = (uint64_t) stride * height;
+	bo->imported = true;
+	bo->next = dev.bos;
+	dev.bos = bo;
+
+	return wrap_bo(gbm, bo->handle, width, height, stride, format);
+}
+
+/* Mesa resolves wl_drm buffers here, which need EGL; look up the
+ * linux-dmabuf buffers weston exports instead, so that the scanout
+ * path sees client dmabufs */
+static struct gbm_bo *
+import_wl_buffer(struct gbm_device *gbm, struct wl_resource *resource)
+{
+	static struct linux_dmabuf_buffer *(*buffer_get)(struct wl_resource *);
+	struct linux_dmabuf_buffer *dmabuf;
+	struct dmabuf_attributes *attributes;
+
+	if (!buffer_get)
+		buffer_get = dlsym(RTLD_DEFAULT, "linux_dmabuf_buffer_get");
+
+	dmabuf = buffer_get ? buffer_get(resource) : NULL;
+	if (!dmabuf) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	attributes = &dmabuf->attributes;
+	if (attributes->n_planes != 1 || attributes->offset[0] != 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return import_fd(gbm, attributes->fd[0], attributes->width,
+			 attributes->height, attributes->stride[0],
+			 attributes->format);
+}
+
+SHIM_EXPORT struct gbm_device *
+gbm_create_device(int fd)
+{
+	struct gbm_device *gbm;
+
+	if (!is_shim_fd(fd)) {
+		errno = ENODEV;
+		return NULL;
+	}
+
+	gbm = zalloc(sizeof *gbm);
+	if (!gbm) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	gbm->fd = fd;
+
+	return gbm;
+}
+
+SHIM_EXPORT void
+gbm_device_destroy(struct gbm_device *gbm)
+{
+	free(gbm);
+}
+
+SHIM_EXPORT int
+gbm_device_get_fd(struct gbm_device *gbm)
+{
+	return gbm->fd;
+}
+
+SHIM_EXPORT const char *
+gbm_device_get_backend_name(struct gbm_device *gbm)
+{
+	return "drm-shim";
+}
+
+SHIM_EXPORT int
+gbm_device_is_format_supported(struct gbm_device *gbm, uint32_t format,
+			       uint32_t usage)
+{
+	return format_cpp(format) != 0;
+}
+
+SHIM_EXPORT struct gbm_bo *
+gbm_bo_create(struct gbm_device *gbm, uint32_t width, uint32_t height,
+	      uint32_t format, uint32_t flags)
+{
+	struct drm_mode_create_dumb args = { 0 };
+	int cpp = format_cpp(format);
+
+	if (cpp == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	args.width = width;
+	args.height = height;
+	args.bpp = cpp * 8;
+	if (create_dumb(&args) < 0)
+		return NULL;
+
+	return wrap_bo(gbm, args.handle, width, height, args.pitch, format);
+}
+
+SHIM_EXPORT struct gbm_bo *
+gbm_bo_import(struct gbm_device *gbm, uint32_t type, void *buffer,
+	      uint32_t usage)
+{
+#ifdef HAVE_GBM_FD_IMPORT
+	struct gbm_import_fd_data *data;
+#endif
+
+	switch (type) {
+	case GBM_BO_IMPORT_WL_BUFFER:
+		return import_wl_buffer(gbm, buffer);
+#ifdef HAVE_GBM_FD_IMPORT
+	case GBM_BO_IMPORT_FD:
+		data = buffer;
+		return import_fd(gbm, data->fd, data->width, data->height,
+				 data->stride, data->format);
+#endif
+	default:
+		errno = EINVAL;
+		return NULL;
+	}
+}
+
+SHIM_EXPORT void
+gbm_bo_destroy(struct gbm_bo *bo)
+{
+	if (bo->destroy_user_data)
+		bo->destroy_user_data(bo, bo->user_data);
+
+	destroy_bo(bo->handle);
+	free(bo);
+}
+
+SHIM_EXPORT uint32_t
+gbm_bo_get_width(struct gbm_bo *bo)
+{
+	return bo->width;
+}
+
+SHIM_EXPORT uint32_t
+gbm_bo_get_height(struct gbm_bo *bo)
+{
+	return bo->height;
+}
+
+SHIM_EXPORT uint32_t
+gbm_bo_get_stride(struct gbm_bo *bo)
+{
+	return bo->stride;
+}
+
+SHIM_EXPORT uint32_t
+gbm_bo_get_format(struct gbm_bo *bo)
+{
+	return bo->format;
+}
+
+SHIM_EXPORT struct gbm_device *
+gbm_bo_get_device(struct gbm_bo *bo)
+{
+	return bo->gbm;
+}
+
+SHIM_EXPORT union gbm_bo_handle
+gbm_bo_get_handle(struct gbm_bo *bo)
+{
+	union gbm_bo_handle handle;
+
+	handle.u64 = 0;
+	handle.u32 = bo->handle;
+
+	return handle;
+}
+
+SHIM_EXPORT int
+gbm_bo_get_fd(struct gbm_bo *bo)
+{
+	int fd;
+
+	if (drmPrimeHandleToFD(bo->gbm->fd, bo->handle, DRM_CLOEXEC, &fd) < 0)
+		return -1;
+
+	return fd;
+}
+
+SHIM_EXPORT void
+gbm_bo_set_user_data(struct gbm_bo *bo, void *data,
+		     void (*destroy_user_data)(struct gbm_bo *, void *))
+{
+	bo->user_data = data;
+	bo->destroy_user_data = destroy_user_data;
+}
+
+SHIM_EXPORT void *
+gbm_bo_get_user_data(struct gbm_bo *bo)
+{
+	return bo->user_data;
+}
+
+SHIM_EXPORT int
+gbm_bo_write(struct gbm_bo *bo, const void *buf, size_t count)
+{
+	struct shim_bo *shim_bo = find_bo(bo->handle);
+
+	if (!shim_bo || count > shim_bo->size)
+		return fail(EINVAL);
+
+	if (pwrite(shim_bo->fd, buf, count, 0) != (ssize_t) count)
+		return -1;
+
+	return 0;
+}
+
+SHIM_EXPORT struct gbm_surface *
+gbm_surface_create(struct gbm_device *gbm, uint32_t width, uint32_t height,
+		   uint32_t format, uint32_t flags)
+{
+	struct gbm_surface *surface;
+
+	if (pixman_format(format) == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	surface = zalloc(sizeof *surface);
+	if (!surface) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	surface->gbm = gbm;
+	surface->width = width;
+	surface->height = height;
+	surface->format = format;
+	surface->back = -1;
+	surface->next = dev.surfaces;
+	dev.surfaces = surface;
+
+	return surface;
+}
+
+SHIM_EXPORT void
+gbm_surface_destroy(struct gbm_surface *surface)
+{
+	struct gbm_surface **link;
+	struct surface_buffer *buffer;
+	int i;
+
+	for (link = &dev.surfaces; *link; link = &(*link)->next)
+		if (*link == surface) {
+			*link = surface->next;
+			break;
+		}
+
+	for (i = 0; i < SURFACE_BUFFERS; i++) {
+		buffer = &surface->buffers[i];
+		if (!buffer->bo)
+			continue;
+
+		pixman_image_unref(buffer->image);
+		munmap(buffer->map, buffer->size);
+		gbm_bo_destroy(buffer->bo);
+	}
+
+	free(surface);
+}
+
+/* Hands out the buffer the renderer last drew into */
+SHIM_EXPORT struct gbm_bo *
+gbm_surface_lock_front_buffer(struct gbm_surface *surface)
+{
+	struct surface_buffer *buffer;
+
+	if (surface->back < 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	buffer = &surface->buffers[surface->back];
+	buffer->locked = true;
+	surface->back = -1;
+
+	return buffer->bo;
+}
+
+SHIM_EXPORT void
+gbm_surface_release_buffer(struct gbm_surface *surface, struct gbm_bo *bo)
+{
+	int i;
+
+	for (i = 0; i < SURFACE_BUFFERS; i++)
+		if (surface->buffers[i].bo == bo)
+			surface->buffers[i].locked = false;
+}
+
+/*
+ * Renderer: the backend only opens a GBM device, and so only assigns
+ * planes, with the GL renderer. The shim stands in for gl-renderer.so
+ * with weston's pixman renderer drawing into the buffers of the GBM
+ * surfaces. Client dmabufs are accepted without ever being mapped, so
+ * they are not drawn while on the primary plane; what the shim
+ * measures is where the backend puts them.
+ */
+
+static struct {
+	int (*init)(struct weston_compositor *ec);
+	int (*output_create)(struct weston_output *output);
+	void (*output_set_buffer)(struct weston_output *output,
+				  pixman_image_t *buffer);
+	void (*output_destroy)(struct weston_output *output);
+	void (*repaint_output)(struct weston_output *output,
+			       pixman_region32_t *output_damage);
+	void (*attach)(struct weston_surface *es,
+		       struct weston_buffer *buffer);
+	struct linux_dmabuf_buffer *(*dmabuf_get)(struct wl_resource *);
+} pixman;
+
+static const EGLint renderer_attribs[] = {
+	0
+};
+
+static void *
+real_function(const char *name);
+
+/* weston's own functions, the shim is not linked against it */
+static void *
+weston_function(const char *name)
+{
+	void *func = dlsym(RTLD_DEFAULT, name);
+
+	if (!func) {
+		fprintf(stderr, "drm-shim: %s not found\n", name);
+		abort();
+	}
+
+	return func;
+}
+
+static struct gbm_surface *
+output_surface(struct weston_output *output)
+{
+	struct gbm_surface *surface;
+
+	for (surface = dev.surfaces; surface; surface = surface->next)
+		if (surface->output == output)
+			return surface;
+
+	return NULL;
+}
+
+/* Finds a buffer the backend does not hold, and allocates it the
+ * first time; the renderer then draws into it */
+static struct surface_buffer *
+surface_get_back(struct gbm_surface *surface)
+{
+	struct surface_buffer *buffer;
+	struct shim_bo *bo;
+	int i;
+
+	for (i = 0; i < SURFACE_BUFFERS; i++)
+		if (!surface->buffers[i].locked)
+			break;
+	if (i == SURFACE_BUFFERS)
+		return NULL;
+
+	buffer = &surface->buffers[i];
+	surface->back = i;
+	if (buffer->bo)
+		return buffer;
+
+	buffer->bo = gbm_bo_create(surface->gbm, surface->width,
+				   surface->height, surface->format, 0);
+	if (!buffer->bo)
+		goto err;
+
+	bo = find_bo(buffer->bo->handle);
+	buffer->size = bo->size;
+	buffer->map = mmap(NULL, buffer->size, PROT_READ | PROT_WRITE,
+			   MAP_SHARED, bo->fd, 0);
+	if (buffer->map == MAP_FAILED)
+		goto err_bo;
+
+	buffer->image = pixman_image_create_bits(pixman_format(surface->format),
+						 surface->width,
+						 surface->height,
+						 buffer->map,
+						 buffer->bo->stride);
+	if (!buffer->image)
+		goto err_map;
+
+	return buffer;
+
+err_map:
+	munmap(buffer->map, buffer->size);
+err_bo:
+	gbm_bo_destroy(buffer->bo);
+err:
+	memset(buffer, 0, sizeof *buffer);
+	surface->back = -1;
+
+	return NULL;
+}
+
+static void
+renderer_repaint_output(struct weston_output *output,
+			pixman_region32_t *output_damage)
+{
+	struct gbm_surface *surface = output_surface(output);
+	struct surface_buffer *buffer;
+
+	buffer = surface ? surface_get_back(surface) : NULL;
+	if (!buffer)
+		return;
+
+	pixman.output_set_buffer(output, buffer->image);
+	pixman.repaint_output(output, output_damage);
+}
+
+/* The dmabuf is only checked; it keeps the size the client gave it */
+static void
+renderer_attach(struct weston_surface *es, struct weston_buffer *buffer)
+{
+	struct linux_dmabuf_buffer *dmabuf;
+
+	dmabuf = buffer ? pixman.dmabuf_get(buffer->resource) : NULL;
+	if (!dmabuf) {
+		pixman.attach(es, buffer);
+		return;
+	}
+
+	pixman.attach(es, NULL);
+	buffer->width = dmabuf->attributes.width;
+	buffer->height = dmabuf->attributes.height;
+	buffer->y_inverted =
+		!!(dmabuf->attributes.flags &
+		   ZWP_LINUX_BUFFER_PARAMS_V1_FLAGS_Y_INVERT);
+}
+
+static bool
+renderer_import_dmabuf(struct weston_compositor *ec,
+		       struct linux_dmabuf_buffer *dmabuf)
+{
+	struct dmabuf_attributes *attributes = &dmabuf->attributes;
+
+	return attributes->n_planes == 1 && attributes->offset[0] == 0 &&
+	       format_cpp(attributes->format) != 0 &&
+	       attributes->stride[0] >=
+			attributes->width * format_cpp(attributes->format);
+}
+
+static int
+renderer_create(struct weston_compositor *ec, EGLenum platform,
+		void *native_window, const EGLint *attribs,
+		const EGLint *visual_id, const int n_ids)
+{
+	struct weston_renderer *renderer;
+
+	pixman.init = weston_function("pixman_renderer_init");
+	pixman.output_create =
+		weston_function("pixman_renderer_output_create");
+	pixman.output_set_buffer =
+		weston_function("pixman_renderer_output_set_buffer");
+	pixman.output_destroy =
+		weston_function("pixman_renderer_output_destroy");
+	pixman.dmabuf_get = weston_function("linux_dmabuf_buffer_get");
+
+	if (pixman.init(ec) < 0)
+		return -1;
+
+	renderer = ec->renderer;
+	pixman.repaint_output = renderer->repaint_output;
+	pixman.attach = renderer->attach;
+	renderer->repaint_output = renderer_repaint_output;
+	renderer->attach = renderer_attach;
+	renderer->import_dmabuf = renderer_import_dmabuf;
+
+	return 0;
+}
+
+static EGLDisplay
+renderer_display(struct weston_compositor *ec)
+{
+	return NULL;
+}
+
+static int
+renderer_output_create(struct weston_output *output,
+		       EGLNativeWindowType window_for_legacy,
+		       void *window_for_platform, const EGLint *attribs,
+		       const EGLint *visual_id, const int n_ids)
+{
+	struct gbm_surface *surface = window_for_platform;
+
+	if (pixman.output_create(output) < 0)
+		return -1;
+
+	surface->output = output;
+
+	return 0;
+}
+
+static void
+renderer_output_destroy(struct weston_output *output)
+{
+	struct gbm_surface *surface = output_surface(output);
+
+	if (surface)
+		surface->output = NULL;
+
+	pixman.output_destroy(output);
+}
+
+static EGLSurface
+renderer_output_surface(struct weston_output *output)
+{
+	return NULL;
+}
+
+static void
+renderer_output_set_border(struct weston_output *output,
+			   enum gl_renderer_border_side side,
+			   int32_t width, int32_t height,
+			   int32_t tex_width, unsigned char *data)
+{
+}
+
+static void
+renderer_print_egl_error_state(void)
+{
+}
+
+SHIM_EXPORT const struct gl_renderer_interface gl_renderer_interface = {
+	.opaque_attribs = renderer_attribs,
+	.alpha_attribs = renderer_attribs,
+	.create = renderer_create,
+	.display = renderer_display,
+	.output_create = renderer_output_create,
+	.output_destroy = renderer_output_destroy,
+	.output_surface = renderer_output_surface,
+	.output_set_border = renderer_output_set_border,
+	.print_egl_error_state = renderer_print_egl_error_state,
+};
+
+/* weston_load_module() opens the shim instead of gl-renderer.so, and
+ * finds gl_renderer_interface in it */
+SHIM_EXPORT void *
+dlopen(const char *filename, int flags)
+{
+	static void *(*real_dlopen)(const char *, int);
+	static bool renderer_loaded;
+	const char *base;
+	Dl_info info;
+
+	if (!real_dlopen)
+		real_dlopen = real_function("dlopen");
+
+	base = filename ? strrchr(filename, '/') : NULL;
+	if (!base || strcmp(base, "/gl-renderer.so") != 0)
+		return real_dlopen(filename, flags);
+
+	if ((flags & RTLD_NOLOAD) && !renderer_loaded)
+		return NULL;
+
+	if (!dladdr(&gl_renderer_interface, &info))
+		return NULL;
+
+	renderer_loaded = true;
+
+	return real_dlopen(info.dli_fname, flags);
+}
+
+/*
+ * Device
+ */
+
+SHIM_EXPORT int
+drmGetCap(int fd, uint64_t capability, uint64_t *value)
+{
+	if (!is_shim_fd(fd))
+		return fail(EBADF);
+
+	switch (capability) {
+	case DRM_CAP_DUMB_BUFFER:
+	case DRM_CAP_TIMESTAMP_MONOTONIC:
+		*value = 1;
+		return 0;
+	case DRM_CAP_PRIME:
+		*value = DRM_PRIME_CAP_EXPORT;
+		return 0;
+	case DRM_CAP_CURSOR_WIDTH:
+	case DRM_CAP_CURSOR_HEIGHT:
+		*value = CURSOR_SIZE;
+		return 0;
+	default:
+		return fail(EINVAL);
+	}
+}
+
+SHIM_EXPORT int
+drmSetClientCap(int fd, uint64_t capability, uint64_t value)
+{
+	if (!is_shim_fd(fd))
+		return fail(EBADF);
+
+	switch (capability) {
+	case DRM_CLIENT_CAP_UNIVERSAL_PLANES:
+		dev.universal_planes = value;
+		return 0;
+	case DRM_CLIENT_CAP_ATOMIC:
+		if (!dev.allow_atomic)
+			return fail(EINVAL);
+		dev.atomic = value;
+		if (value)
+			dev.universal_planes = true;
+		return 0;
+	default:
+		return fail(EINVAL);
+	}
+}
+
+SHIM_EXPORT int
+drmGetMagic(int fd, drm_magic_t *magic)
+{
+	if (!is_shim_fd(fd))
+		return fail(EBADF);
+
+	*magic = 1;
+
+	return 0;
+}
+
+SHIM_EXPORT int
+drmAuthMagic(int fd, drm_magic_t magic)
+{
+	return is_shim_fd(fd) ? 0 : fail(EBADF);
+}
+
+SHIM_EXPORT int
+drmSetMaster(int fd)
+{
+	return is_shim_fd(fd) ? 0 : fail(EBADF);
+}
+
+SHIM_EXPORT int
+drmDropMaster(int fd)
+{
+	return is_shim_fd(fd) ? 0 : fail(EBADF);
+}
+
+#ifdef HAVE_DRM_ATOMIC
+
+/*
+ * Atomic modesetting
+ */
+
+struct _drmModeAtomicReq {
+	uint32_t count;
+	uint32_t size;
+	struct {
+		uint32_t object_id;
+		uint32_t property_id;
+		uint64_t value;
+	} *items;
+};
+
+SHIM_EXPORT drmModeAtomicReqPtr
+drmModeAtomicAlloc(void)
+{
+	return zalloc(sizeof(struct _drmModeAtomicReq));
+}
+
+SHIM_EXPORT void
+drmModeAtomicFree(drmModeAtomicReqPtr req)
+{
+	if (!req)
+		return;
+
+	free(req->items);
+	free(req);
+}
+
+SHIM_EXPORT int
+drmModeAtomicGetCursor(drmModeAtomicReqPtr req)
+{
+	return req ? (int) req->count : -EINVAL;
+}
+
+SHIM_EXPORT void
+drmModeAtomicSetCursor(drmModeAtomicReqPtr req, int cursor)
+{
+	if (req && cursor >= 0 && (uint32_t) cursor <= req->count)
+		req->count = cursor;
+}
+
+SHIM_EXPORT int
+drmModeAtomicAddProperty(drmModeAtomicReqPtr req, uint32_t object_id,
+			 uint32_t property_id, uint64_t value)
+{
+	uint32_t size;
+	void *items;
+
+	if (!req)
+		return -EINVAL;
+
+	if (req->count == req->size) {
+		size = req->size ? req->size * 2 : 32;
+		items = realloc(req->items, size * sizeof req->items[0]);
+		if (!items)
+			return -ENOMEM;
+		req->items = items;
+		req->size = size;
+	}
+
+	req->items[req->count].object_id = object_id;
+	req->items[req->count].property_id = property_id;
+	req->items[req->count].value = value;
+	req->count++;
+
+	return req->count;
+}
+
+static int
+set_plane_property(struct plane_state *ps, int prop, uint64_t value)
+{
+	switch (prop) {
+	case PROP_FB_ID:
+		if (value && !find_fb(value))
+			return -1;
+		ps->fb_id = value;
+		break;
+	case PROP_CRTC_ID:
+		if (value && crtc_index(value) < 0)
+			return -1;
+		ps->crtc_id = value;
+		break;
+	case PROP_SRC_X:
+		ps->src_x = value;
+		break;
+	case PROP_SRC_Y:
+		ps->src_y = value;
+		break;
+	case PROP_SRC_W:
+		ps->src_w = value;
+		break;
+	case PROP_SRC_H:
+		ps->src_h = value;
+		break;
+	case PROP_CRTC_X:
+		ps->crtc_x = (int32_t) value;
+		break;
+	case PROP_CRTC_Y:
+		ps->crtc_y = (int32_t) value;
+		break;
+	case PROP_CRTC_W:
+		ps->crtc_w = value;
+		break;
+	case PROP_CRTC_H:
+		ps->crtc_h = value;
+		break;
+	default:
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+set_crtc_property(struct crtc_state *cs, int prop, uint64_t value)
+{
+	struct shim_blob *blob;
+
+	switch (prop) {
+	case PROP_MODE_ID:
+		if (value == 0) {
+			memset(&cs->mode, 0, sizeof cs->mode);
+		} else {
+			blob = find_blob(value);
+			if (!blob || blob->length != sizeof cs->mode)
+				return -1;
+			memcpy(&cs->mode, blob->data, sizeof cs->mode);
+		}
+		cs->mode_id = value;
+		break;
+	case PROP_ACTIVE:
+		if (value > 1)
+			return -1;
+		cs->active = value;
+		break;
+	default:
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Applies the properties of req to state, and returns the CRTCs it
+ * touches, or -1 if a property cannot be set. */
+static int64_t
+apply_atomic(struct shim_state *state, drmModeAtomicReqPtr req)
+{
+	uint32_t affected = 0, object_id;
+	bool touched[MAX_PLANES] = { false };
+	int index, prop;
+	uint32_t i;
+
+	for (i = 0; i < req->count; i++) {
+		object_id = req->items[i].object_id;
+		prop = req->items[i].property_id - PROP_ID_BASE;
+		if (req->items[i].property_id < PROP_ID_BASE ||
+		    prop >= PROP__COUNT)
+			return -1;
+
+		if ((index = plane_index(object_id)) >= 0) {
+			if (set_plane_property(&state->planes[index], prop,
+					       req->items[i].value) < 0)
+				return -1;
+			touched[index] = true;
+		} else if ((index = crtc_index(object_id)) >= 0) {
+			if (set_crtc_property(&state->crtcs[index], prop,
+					      req->items[i].value) < 0)
+				return -1;
+			affected |= 1u << index;
+		} else if ((index = connector_index(object_id)) >= 0) {
+			if (prop != PROP_CRTC_ID ||
+			    (req->items[i].value &&
+			     crtc_index(req->items[i].value) < 0))
+				return -1;
+			state->connector_crtc[index] = req->items[i].value;
+			affected |= crtc_mask(dev.state.connector_crtc[index]);
+			affected |= crtc_mask(req->items[i].value);
+		} else {
+			return -1;
+		}
+	}
+
+	for (index = 0; index < dev.num_planes; index++) {
+		if (!touched[index])
+			continue;
+		affected |= crtc_mask(dev.state.planes[index].crtc_id);
+		affected |= crtc_mask(state->planes[index].crtc_id);
+	}
+
+	return affected;
+}
+
+static bool
+needs_modeset(const struct shim_state *state)
+{
+	int i;
+
+	for (i = 0; i < dev.num_crtcs; i++) {
+		if (state->crtcs[i].active != dev.state.crtcs[i].active ||
+		    memcmp(&state->crtcs[i].mode, &dev.state.crtcs[i].mode,
+			   sizeof state->crtcs[i].mode) != 0 ||
+		    state->connector_crtc[i] != dev.state.connector_crtc[i])
+			return true;
+	}
+
+	return false;
+}
+
+SHIM_EXPORT int
+drmModeAtomicCommit(int fd, drmModeAtomicReqPtr req, uint32_t flags,
+		    void *user_data)
+{
+	const uint32_t valid_flags = DRM_MODE_PAGE_FLIP_EVENT |
+		DRM_MODE_ATOMIC_TEST_ONLY | DRM_MODE_ATOMIC_NONBLOCK |
+		DRM_MODE_ATOMIC_ALLOW_MODESET;
+	bool test_only = flags & DRM_MODE_ATOMIC_TEST_ONLY;
+	enum reject_reason reason = REJECT_OTHER;
+	struct shim_state state;
+	int64_t affected;
+	int i, ret = 0;
+
+	if (!is_shim_fd(fd))
+		return fail(EBADF);
+
+	if (!dev.atomic || !req || (flags & ~valid_flags) ||
+	    (test_only && (flags & DRM_MODE_PAGE_FLIP_EVENT)))
+		return fail(EINVAL);
+
+	if (test_only)
+		dev.test_commits++;
+
+	state = dev.state;
+	affected = apply_atomic(&state, req);
+	if (affected < 0 ||
+	    (needs_modeset(&state) && !(flags & DRM_MODE_ATOMIC_ALLOW_MODESET)))
+		ret = -1;
+
+	for (i = 0; ret == 0 && i < dev.num_crtcs; i++) {
+		if (!(affected & (1u << i)))
+			continue;
+		if (check_crtc(&state, i, &reason) < 0)
+			ret = -1;
+		else if ((flags & DRM_MODE_PAGE_FLIP_EVENT) &&
+			 !state.crtcs[i].active)
+			ret = -1;
+	}
+
+	if (ret < 0) {
+		dev.rejected[reason]++;
+		return fail(EINVAL);
+	}
+
+	if (test_only)
+		return 0;
+
+	for (i = 0; i < dev.num_crtcs; i++)
+		if ((affected & (1u << i)) && dev.crtcs[i].flip)
+			return fail(EBUSY);
+
+	dev.commits++;
+	dev.state = state;
+
+	for (i = 0; i < dev.num_crtcs; i++) {
+		if (!(affected & (1u << i)) || !state.crtcs[i].active)
+			continue;
+
+		crtc_set_timing(i, &state.crtcs[i].mode);
+		if (!queue_flip(i, 0, flags & DRM_MODE_PAGE_FLIP_EVENT,
+				user_data))
+			return fail(ENOMEM);
+	}
+
+	return 0;
+}
+
+SHIM_EXPORT int
+drmModeCreatePropertyBlob(int fd, const void *data, size_t size,
+			  uint32_t *id)
+{
+	struct shim_blob *blob;
+
+	if (!is_shim_fd(fd))
+		return fail(EBADF);
+	if (size == 0 || size > UINT32_MAX)
+		return fail(EINVAL);
+
+	blob = zalloc(sizeof *blob);
+	if (!blob)
+		return fail(ENOMEM);
+
+	blob->data = malloc(size);
+	if (!blob->data) {
+		free(blob);
+		return fail(ENOMEM);
+	}
+
+	memcpy(blob->data, data, size);
+	blob->length = size;
+	blob->id = dev.next_id++;
+	blob->next = dev.blobs;
+	dev.blobs = blob;
+
+	*id = blob->id;
+
+	return 0;
+}
+
+SHIM_EXPORT int
+drmModeDestroyPropertyBlob(int fd, uint32_t id)
+{
+	struct shim_blob **link, *blob;
+
+	if (!is_shim_fd(fd))
+		return fail(EBADF);
+
+	for (link = &dev.blobs; *link; link = &(*link)->next)
+		if ((*link)->id == id)
+			break;
+	if (!*link)
+		return fail(ENOENT);
+
+	blob = *link;
+	*link = blob->next;
+	free(blob->data);
+	free(blob);
+
+	return 0;
+}
+
+#endif /* HAVE_DRM_ATOMIC */
+
+/*
+ * Device nodes: the card is a timerfd that becomes readable when an
+ * event is due, the tty is /dev/null; fstat() and ioctl() make both
+ * look like the real thing to the direct launcher.
+ */
+
+static void *
+real_function(const char *name)
+{
+	void *func = dlsym(RTLD_NEXT, name);
+
+	if (!func) {
+		fprintf(stderr, "drm-shim: %s not found\n", name);
+		abort();
+	}
+
+	return func;
+}
+
+/* The direct launcher insists on root, which the fake nodes do not
+ * need, and logind would be asked for the real card */
+SHIM_EXPORT uid_t
+geteuid(void)
+{
+	return 0;
+}
+
+SHIM_EXPORT int
+sd_pid_get_session(pid_t pid, char **session)
+{
+	return -ENODATA;
+}
+
+static int
+open_card(int flags)
+{
+	shim_init();
+
+	if (dev.fd >= 0) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	dev.opened = true;
+	dev.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK |
+				((flags & O_CLOEXEC) ? TFD_CLOEXEC : 0));
+
+	return dev.fd;
+}
+
+static int
+shim_open_path(const char *path, int flags, mode_t mode,
+	       const char *real_name)
+{
+	static int (*real_open)(const char *, int, ...);
+	static int (*real_open64)(const char *, int, ...);
+	int (**real)(const char *, int, ...);
+
+	if (strcmp(path, SHIM_DEVNODE) == 0)
+		return open_card(flags);
+
+	if (strncmp(path, "/dev/tty", 8) == 0 && isdigit(path[8]) &&
+	    dev.tty_fd < 0) {
+		real = &real_open;
+		if (!*real)
+			*real = real_function("open");
+		dev.tty_fd = (*real)("/dev/null", O_RDWR |
+				     (flags & O_CLOEXEC));
+		dev.tty_minor = atoi(path + 8);
+		return dev.tty_fd;
+	}
+
+	real = strcmp(real_name, "open64") == 0 ? &real_open64 : &real_open;
+	if (!*real)
+		*real = real_function(real_name);
+
+	return (*real)(path, flags, mode);
+}
+
+SHIM_EXPORT int shim_open(const char *path, int flags, ...)
+	__asm__("open");
+SHIM_EXPORT int shim_open64(const char *path, int flags, ...)
+	__asm__("open64");
+SHIM_EXPORT int shim_open_2(const char *path, int flags)
+	__asm__("__open_2");
+SHIM_EXPORT int shim_open64_2(const char *path, int flags)
+	__asm__("__open64_2");
+
+SHIM_EXPORT int
+shim_open(const char *path, int flags, ...)
+{
+	mode_t mode = 0;
+	va_list ap;
+
+	if (flags & (O_CREAT | O_TMPFILE)) {
+		va_start(ap, flags);
+		mode = va_arg(ap, mode_t);
+		va_end(ap);
+	}
+
+	return shim_open_path(path, flags, mode, "open");
+}
+
+SHIM_EXPORT int
+shim_open64(const char *path, int flags, ...)
+{
+	mode_t mode = 0;
+	va_list ap;
+
+	if (flags & (O_CREAT | O_TMPFILE)) {
+		va_start(ap, flags);
+		mode = va_arg(ap, mode_t);
+		va_end(ap);
+	}
+
+	return shim_open_path(path, flags, mode, "open64");
+}
+
+SHIM_EXPORT int
+shim_open_2(const char *path, int flags)
+{
+	return shim_open_path(path, flags, 0, "open");
+}
+
+SHIM_EXPORT int
+shim_open64_2(const char *path, int flags)
+{
+	return shim_open_path(path, flags, 0, "open64");
+}
+
+SHIM_EXPORT int shim_close(int fd) __asm__("close");
+
+SHIM_EXPORT int
+shim_close(int fd)
+{
+	static int (*real_close)(int);
+	struct shim_event *ev;
+
+	if (!real_close)
+		real_close = real_function("close");
+
+	if (fd >= 0 && fd == dev.fd) {
+		while (dev.events) {
+			ev = dev.events;
+			dev.events = ev->next;
+			if (ev->flip)
+				dev.crtcs[ev->crtc].flip = NULL;
+			free(ev);
+		}
+		dev.fd = -1;
+	} else if (fd >= 0 && fd == dev.tty_fd) {
+		dev.tty_fd = -1;
+	}
+
+	return real_close(fd);
+}
+
+/* Linux only, and stat and stat64 only agree on 64 bit */
+static int
+shim_stat_fd(int fd, struct stat *buf)
+{
+	if (fd < 0 || (fd != dev.fd && fd != dev.tty_fd))
+		return fstatat(fd, "", buf, AT_EMPTY_PATH);
+
+	memset(buf, 0, sizeof *buf);
+	buf->st_mode = S_IFCHR | 0660;
+	if (fd == dev.fd)
+		buf->st_rdev = makedev(SHIM_DRM_MAJOR, 0);
+	else
+		buf->st_rdev = makedev(TTY_MAJOR, dev.tty_minor);
+
+	return 0;
+}
+
+SHIM_EXPORT int shim_fstat(int fd, struct stat *buf) __asm__("fstat");
+SHIM_EXPORT int shim_fstat64(int fd, struct stat *buf) __asm__("fstat64");
+SHIM_EXPORT int shim_fxstat(int ver, int fd, struct stat *buf)
+	__asm__("__fxstat");
+SHIM_EXPORT int shim_fxstat64(int ver, int fd, struct stat *buf)
+	__asm__("__fxstat64");
+
+SHIM_EXPORT int
+shim_fstat(int fd, struct stat *buf)
+{
+	return shim_stat_fd(fd, buf);
+}
+
+SHIM_EXPORT int
+shim_fstat64(int fd, struct stat *buf)
+{
+	return shim_stat_fd(fd, buf);
+}
+
+SHIM_EXPORT int
+shim_fxstat(int ver, int fd, struct stat *buf)
+{
+	return shim_stat_fd(fd, buf);
+}
+
+SHIM_EXPORT int
+shim_fxstat64(int ver, int fd, struct stat *buf)
+{
+	return shim_stat_fd(fd, buf);
+}
+
+static int
+tty_ioctl(unsigned long request, void *arg)
+{
+	switch (request) {
+	case KDGETMODE:
+		*(int *) arg = dev.kd_mode;
+		return 0;
+	case KDSETMODE:
+		dev.kd_mode = (long) arg;
+		return 0;
+	case KDGKBMODE:
+		*(int *) arg = K_UNICODE;
+		return 0;
+	default:
+		/* VT switching, keyboard mode and mute */
+		return 0;
+	}
+}
+
+SHIM_EXPORT int shim_ioctl(int fd, unsigned long request, ...)
+	__asm__("ioctl");
+
+SHIM_EXPORT int
+shim_ioctl(int fd, unsigned long request, ...)
+{
+	static int (*real_ioctl)(int, unsigned long, ...);
+	va_list ap;
+	void *arg;
+
+	va_start(ap, request);
+	arg = va_arg(ap, void *);
+	va_end(ap);
+
+	if (fd >= 0 && fd == dev.tty_fd)
+		return tty_ioctl(request, arg);
+
+	/* Only the libdrm entry points above drive the card */
+	if (fd >= 0 && fd == dev.fd) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!real_ioctl)
+		real_ioctl = real_function("ioctl");
+
+	return real_ioctl(fd, request, arg);
+}
+
+static void *
+shim_map(void *addr, size_t length, int prot, int flags, int fd,
+	 uint64_t offset, const char *real_name)
+{
+	static void *(*real_mmap)(void *, size_t, int, int, int, long);
+	static void *(*real_mmap64)(void *, size_t, int, int, int, int64_t);
+	struct shim_bo *bo;
+
+	if (fd >= 0 && fd == dev.fd) {
+		bo = find_bo(offset >> 32);
+		if (!bo || length > bo->size) {
+			errno = EINVAL;
+			return MAP_FAILED;
+		}
+		fd = bo->fd;
+		offset = 0;
+	}
+
+	if (strcmp(real_name, "mmap64") == 0) {
+		if (!real_mmap64)
+			real_mmap64 = real_function("mmap64");
+		return real_mmap64(addr, length, prot, flags, fd, offset);
+	}
+
+	if (!real_mmap)
+		real_mmap = real_function("mmap");
+
+	return real_mmap(addr, length, prot, flags, fd, offset);
+}
+
+SHIM_EXPORT void *shim_mmap(void *addr, size_t length, int prot, int flags,
+			    int fd, long offset) __asm__("mmap");
+SHIM_EXPORT void *shim_mmap64(void *addr, size_t length, int prot,
+			      int flags, int fd, int64_t offset)
+	__asm__("mmap64");
+
+SHIM_EXPORT void *
+shim_mmap(void *addr, size_t length, int prot, int flags, int fd,
+	  long offset)
+{
+	return shim_map(addr, length, prot, flags, fd, offset, "mmap");
+}
+
+SHIM_EXPORT void *
+shim_mmap64(void *addr, size_t length, int prot, int flags, int fd,
+	    int64_t offset)
+{
+	return shim_map(addr, length, prot, flags, fd, offset, "mmap64");
+}
+
+/*
+ * udev: a seat with the card and nothing else
+ */
+
+struct udev {
+	int refcount;
+	void *userdata;
+};
+
+struct udev_list_entry {
+	const char *name;
+	const char *value;
+	struct udev_list_entry *next;
+};
+
+struct udev_device {
+	int refcount;
+	struct udev *udev;
+};
+
+struct udev_enumerate {
+	int refcount;
+	struct udev *udev;
+	bool subsystem_match, subsystem_matched;
+	bool sysname_match, sysname_matched;
+	bool scanned;
+	struct udev_list_entry entry;
+};
+
+struct udev_monitor {
+	int refcount;
+	struct udev *udev;
+	int fd;
+};
+
+SHIM_EXPORT struct udev *
+udev_new(void)
+{
+	struct udev *udev;
+
+	shim_init();
+
+	udev = zalloc(sizeof *udev);
+	if (udev)
+		udev->refcount = 1;
+
+	return udev;
+}
+
+SHIM_EXPORT struct udev *
+udev_ref(struct udev *udev)
+{
+	if (udev)
+		udev->refcount++;
+
+	return udev;
+}
+
+SHIM_EXPORT struct udev *
+udev_unref(struct udev *udev)
+{
+	if (udev && --udev->refcount == 0)
+		free(udev);
+
+	return NULL;
+}
+
+SHIM_EXPORT void *
+udev_get_userdata(struct udev *udev)
+{
+	return udev ? udev->userdata : NULL;
+}
+
+SHIM_EXPORT void
+udev_set_userdata(struct udev *udev, void *userdata)
+{
+	if (udev)
+		udev->userdata = userdata;
+}
+
+SHIM_EXPORT struct udev_list_entry *
+udev_list_entry_get_next(struct udev_list_entry *list_entry)
+{
+	return list_entry ? list_entry->next : NULL;
+}
+
+SHIM_EXPORT struct udev_list_entry *
+udev_list_entry_get_by_name(struct udev_list_entry *list_entry,
+			    const char *name)
+{
+	for (; list_entry; list_entry = list_entry->next)
+		if (strcmp(list_entry->name, name) == 0)
+			return list_entry;
+
+	return NULL;
+}
+
+SHIM_EXPORT const char *
+udev_list_entry_get_name(struct udev_list_entry *list_entry)
+{
+	return list_entry ? list_entry->name : NULL;
+}
+
+SHIM_EXPORT const char *
+udev_list_entry_get_value(struct udev_list_entry *list_entry)
+{
+	return list_entry ? list_entry->value : NULL;
+}
+
+static struct udev_device *
+card_device(struct udev *udev)
+{
+	struct udev_device *device;
+
+	device = zalloc(sizeof *device);
+	if (!device) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	device->refcount = 1;
+	device->udev = udev_ref(udev);
+
+	return device;
+}
+
+SHIM_EXPORT struct udev_device *
+udev_device_ref(struct udev_device *udev_device)
+{
+	if (udev_device)
+		udev_device->refcount++;
+
+	return udev_device;
+}
+
+SHIM_EXPORT struct udev_device *
+udev_device_unref(struct udev_device *udev_device)
+{
+	if (udev_device && --udev_device->refcount == 0) {
+		udev_unref(udev_device->udev);
+		free(udev_device);
+	}
+
+	return NULL;
+}
+
+SHIM_EXPORT struct udev *
+udev_device_get_udev(struct udev_device *udev_device)
+{
+	return udev_device ? udev_device->udev : NULL;
+}
+
+SHIM_EXPORT struct udev_device *
+udev_device_new_from_syspath(struct udev *udev, const char *syspath)
+{
+	if (!syspath || strcmp(syspath, SHIM_SYSPATH) != 0) {
+		errno = ENODEV;
+		return NULL;
+	}
+
+	return card_device(udev);
+}
+
+SHIM_EXPORT struct udev_device *
+udev_device_new_from_devnum(struct udev *udev, char type, dev_t devnum)
+{
+	if (type != 'c' || devnum != makedev(SHIM_DRM_MAJOR, 0)) {
+		errno = ENODEV;
+		return NULL;
+	}
+
+	return card_device(udev);
+}
+
+SHIM_EXPORT struct udev_device *
+udev_device_new_from_subsystem_sysname(struct udev *udev,
+				       const char *subsystem,
+				       const char *sysname)
+{
+	if (!subsystem || !sysname || strcmp(subsystem, "drm") != 0 ||
+	    strcmp(sysname, "card0") != 0) {
+		errno = ENODEV;
+		return NULL;
+	}
+
+	return card_device(udev);
+}
+
+SHIM_EXPORT struct udev_device *
+udev_device_get_parent(struct udev_device *udev_device)
+{
+	errno = ENOENT;
+
+	return NULL;
+}
+
+SHIM_EXPORT struct udev_device *
+udev_device_get_parent_with_subsystem_devtype(struct udev_device *udev_device,
+					      const char *subsystem,
+					      const char *devtype)
+{
+	errno = ENOENT;
+
+	return NULL;
+}
+
+SHIM_EXPORT const char *
+udev_device_get_devpath(struct udev_device *udev_device)
+{
+	return udev_device ? SHIM_SYSPATH + strlen("/sys") : NULL;
+}
+
+SHIM_EXPORT const char *
+udev_device_get_subsystem(struct udev_device *udev_device)
+{
+	return udev_device ? "drm" : NULL;
+}
+
+SHIM_EXPORT const char *
+udev_device_get_devtype(struct udev_device *udev_device)
+{
+	return udev_device ? "drm_minor" : NULL;
+}
+
+SHIM_EXPORT const char *
+udev_device_get_syspath(struct udev_device *udev_device)
+{
+	return udev_device ? SHIM_SYSPATH : NULL;
+}
+
+SHIM_EXPORT const char *
+udev_device_get_sysname(struct udev_device *udev_device)
+{
+	return udev_device ? "card0" : NULL;
+}
+
+SHIM_EXPORT const char *
+udev_device_get_sysnum(struct udev_device *udev_device)
+{
+	return udev_device ? "0" : NULL;
+}
+
+SHIM_EXPORT const char *
+udev_device_get_devnode(struct udev_device *udev_device)
+{
+	return udev_device ? SHIM_DEVNODE : NULL;
+}
+
+SHIM_EXPORT int
+udev_device_get_is_initialized(struct udev_device *udev_device)
+{
+	return udev_device != NULL;
+}
+
+SHIM_EXPORT struct udev_list_entry *
+udev_device_get_properties_list_entry(struct udev_device *udev_device)
+{
+	return NULL;
+}
+
+SHIM_EXPORT const char *
+udev_device_get_property_value(struct udev_device *udev_device,
+			       const char *key)
+{
+	if (!udev_device || !key)
+		return NULL;
+
+	if (strcmp(key, "DEVNAME") == 0)
+		return SHIM_DEVNODE;
+	if (strcmp(key, "SUBSYSTEM") == 0)
+		return "drm";
+
+	return NULL;
+}
+
+SHIM_EXPORT const char *
+udev_device_get_driver(struct udev_device *udev_device)
+{
+	return NULL;
+}
+
+SHIM_EXPORT dev_t
+udev_device_get_devnum(struct udev_device *udev_device)
+{
+	return udev_device ? makedev(SHIM_DRM_MAJOR, 0) : makedev(0, 0);
+}
+
+SHIM_EXPORT const char *
+udev_device_get_action(struct udev_device *udev_device)
+{
+	return NULL;
+}
+
+SHIM_EXPORT const char *
+udev_device_get_sysattr_value(struct udev_device *udev_device,
+			      const char *sysattr)
+{
+	return NULL;
+}
+
+SHIM_EXPORT struct udev_monitor *
+udev_monitor_ref(struct udev_monitor *udev_monitor)
+{
+	if (udev_monitor)
+		udev_monitor->refcount++;
+
+	return udev_monitor;
+}
+
+SHIM_EXPORT struct udev_monitor *
+udev_monitor_unref(struct udev_monitor *udev_monitor)
+{
+	if (udev_monitor && --udev_monitor->refcount == 0) {
+		close(udev_monitor->fd);
+		udev_unref(udev_monitor->udev);
+		free(udev_monitor);
+	}
+
+	return NULL;
+}
+
+SHIM_EXPORT struct udev *
+udev_monitor_get_udev(struct udev_monitor *udev_monitor)
+{
+	return udev_monitor ? udev_monitor->udev : NULL;
+}
+
+/* Nothing is ever hotplugged; the fd never becomes readable */
+SHIM_EXPORT struct udev_monitor *
+udev_monitor_new_from_netlink(struct udev *udev, const char *name)
+{
+	struct udev_monitor *monitor;
+
+	monitor = zalloc(sizeof *monitor);
+	if (!monitor)
+		return NULL;
+
+	monitor->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (monitor->fd < 0) {
+		free(monitor);
+		return NULL;
+	}
+
+	monitor->refcount = 1;
+	monitor->udev = udev_ref(udev);
+
+	return monitor;
+}
+
+SHIM_EXPORT int
+udev_monitor_enable_receiving(struct udev_monitor *udev_monitor)
+{
+	return 0;
+}
+
+SHIM_EXPORT int
+udev_monitor_set_receive_buffer_size(struct udev_monitor *udev_monitor,
+				     int size)
+{
+	return 0;
+}
+
+SHIM_EXPORT int
+udev_monitor_get_fd(struct udev_monitor *udev_monitor)
+{
+	return udev_monitor ? udev_monitor->fd : -EINVAL;
+}
+
+SHIM_EXPORT struct udev_device *
+udev_monitor_receive_device(struct udev_monitor *udev_monitor)
+{
+	errno = EAGAIN;
+
+	return NULL;
+}
+
+SHIM_EXPORT int
+udev_monitor_filter_add_match_subsystem_devtype(struct udev_monitor *udev_monitor,
+						const char *subsystem,
+						const char *devtype)
+{
+	return 0;
+}
+
+SHIM_EXPORT int
+udev_monitor_filter_add_match_tag(struct udev_monitor *udev_monitor,
+				  const char *tag)
+{
+	return 0;
+}
+
+SHIM_EXPORT int
+udev_monitor_filter_update(struct udev_monitor *udev_monitor)
+{
+	return 0;
+}
+
+SHIM_EXPORT int
+udev_monitor_filter_remove(struct udev_monitor *udev_monitor)
+{
+	return 0;
+}
+
+SHIM_EXPORT struct udev_enumerate *
+udev_enumerate_ref(struct udev_enumerate *udev_enumerate)
+{
+	if (udev_enumerate)
+		udev_enumerate->refcount++;
+
+	return udev_enumerate;
+}
+
+SHIM_EXPORT struct udev_enumerate *
+udev_enumerate_unref(struct udev_enumerate *udev_enumerate)
+{
+	if (udev_enumerate && --udev_enumerate->refcount == 0) {
+		udev_unref(udev_enumerate->udev);
+		free(udev_enumerate);
+	}
+
+	return NULL;
+}
+
+SHIM_EXPORT struct udev *
+udev_enumerate_get_udev(struct udev_enumerate *udev_enumerate)
+{
+	return udev_enumerate ? udev_enumerate->udev : NULL;
+}
+
+SHIM_EXPORT struct udev_enumerate *
+udev_enumerate_new(struct udev *udev)
+{
+	struct udev_enumerate *e;
+
+	e = zalloc(sizeof *e);
+	if (!e)
+		return NULL;
+
+	e->refcount = 1;
+	e->udev = udev_ref(udev);
+	e->entry.name = SHIM_SYSPATH;
+
+	return e;
+}
+
+SHIM_EXPORT int
+udev_enumerate_add_match_subsystem(struct udev_enumerate *udev_enumerate,
+				   const char *subsystem)
+{
+	udev_enumerate->subsystem_match = true;
+	if (subsystem && strcmp(subsystem, "drm") == 0)
+		udev_enumerate->subsystem_matched = true;
+
+	return 0;
+}
+
+SHIM_EXPORT int
+udev_enumerate_add_nomatch_subsystem(struct udev_enumerate *udev_enumerate,
+				     const char *subsystem)
+{
+	return 0;
+}
+
+SHIM_EXPORT int
+udev_enumerate_add_match_sysname(struct udev_enumerate *udev_enumerate,
+				 const char *sysname)
+{
+	udev_enumerate->sysname_match = true;
+	if (sysname && fnmatch(sysname, "card0", 0) == 0)
+		udev_enumerate->sysname_matched = true;
+
+	return 0;
+}
+
+SHIM_EXPORT int
+udev_enumerate_add_match_sysattr(struct udev_enumerate *udev_enumerate,
+				 const char *sysattr, const char *value)
+{
+	return 0;
+}
+
+SHIM_EXPORT int
+udev_enumerate_add_match_property(struct udev_enumerate *udev_enumerate,
+				  const char *property, const char *value)
+{
+	return 0;
+}
+
+SHIM_EXPORT int
+udev_enumerate_add_match_tag(struct udev_enumerate *udev_enumerate,
+			     const char *tag)
+{
+	return 0;
+}
+
+SHIM_EXPORT int
+udev_enumerate_add_match_is_initialized(struct udev_enumerate *udev_enumerate)
+{
+	return 0;
+}
+
+SHIM_EXPORT int
+udev_enumerate_scan_devices(struct udev_enumerate *udev_enumerate)
+{
+	udev_enumerate->scanned = true;
+
+	return 0;
+}
+
+SHIM_EXPORT struct udev_list_entry *
+udev_enumerate_get_list_entry(struct udev_enumerate *udev_enumerate)
+{
+	struct udev_enumerate *e = udev_enumerate;
+
+	if (!e || !e->scanned ||
+	    (e->subsystem_match && !e->subsystem_matched) ||
+	    (e->sysname_match && !e->sysname_matched))
+		return NULL;
+
+	return &e->entry;
+}
+
+/*
+ * Statistics
+ */
+
+static double
+ms(int64_t ns)
+{
+	return ns / 1000000.0;
+}
+
+static void __attribute__ ((destructor))
+shim_report(void)
+{
+	const char *path = getenv("DRM_SHIM_STATS");
+	struct shim_crtc *crtc;
+	FILE *fp = stderr;
+	int i, j, overlays;
+
+	/* Clients inherit the preload too; only report for weston */
+	if (!dev.opened)
+		return;
+
+	if (path && *path) {
+		fp = fopen(path, "a");
+		if (!fp)
+			return;
+	}
+
+	overlays = (dev.num_planes / dev.num_crtcs) - 2;
+
+	for (i = 0; i < dev.num_crtcs; i++) {
+		crtc = &dev.crtcs[i];
+		if (crtc->flips == 0)
+			continue;
+
+		fprintf(fp, "drm-shim: crtc %d %s@%.3f: %u flips, %u missed "
+			"vblanks, latency %.3f/%.3f/%.3f ms min/avg/max, "
+			"event delivery %.3f/%.3f ms avg/max\n",
+			CRTC_ID_BASE + i, crtc->preferred.name,
+			1000000000.0 / crtc->period_ns,
+			crtc->flips, crtc->missed,
+			ms(crtc->latency_min),
+			ms(crtc->latency_sum / crtc->flips),
+			ms(crtc->latency_max),
+			ms(crtc->delay_sum / crtc->flips),
+			ms(crtc->delay_max));
+
+		fprintf(fp, "drm-shim: crtc %d: frames by overlay planes "
+			"in use:", CRTC_ID_BASE + i);
+		for (j = 0; j <= overlays; j++)
+			fprintf(fp, " %d:%u", j, crtc->overlay_frames[j]);
+		fprintf(fp, ", with cursor plane: %u, client scanout: %u\n",
+			crtc->cursor_frames, crtc->scanout_frames);
+	}
+
+	fprintf(fp, "drm-shim: %u atomic commits, %u test-only commits, "
+		"rejected: %u plane limit, %u format, %u scaling, %u other\n",
+		dev.commits, dev.test_commits,
+		dev.rejected[REJECT_PLANE_LIMIT], dev.rejected[REJECT_FORMAT],
+		dev.rejected[REJECT_SCALING], dev.rejected[REJECT_OTHER]);
+
+	if (fp != stderr)
+		fclose(fp);
+}
@@ -0,0 +1,439 @@
+/*
+ * Copyright © 2026 agent <agent@local>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* A stand-alone model of the GL renderer's [core] gl-depth-test
+ * option: it does not call gl-renderer. It paints a stack of rotated
+ * windows with its own copy of the two-pass scheme of repaint_views()
+ * and draw_view() in src/gl-renderer.c, once back to front and once
+ * with the depth-tested opaque pass, and compares the time and the
+ * resulting pixels. Rotated views keep their whole bounding box in the
+ * CPU side clip, so this is the overdraw that only the depth test can
+ * remove.
+ *
+ * The numbers are the fill rate of the scheme on the GL driver. They
+ * leave out what the renderer adds around it (damage, batching,
+ * shader switches, the EGL surface), so they are no measurement of
+ * weston itself, and the model has to follow changes to the renderer
+ * by hand. Run it on llvmpipe with LIBGL_ALWAYS_SOFTWARE=1. */
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <GLES2/gl2.h>
+
+#include "shared/helpers.h"
+
+#ifndef EGL_PLATFORM_SURFACELESS_MESA
+#define EGL_PLATFORM_SURFACELESS_MESA 0x31DD
+#endif
+
+#define WIDTH 1920
+#define HEIGHT 1080
+#define TEX_SIZE 256
+#define MAX_WINDOWS 64
+#define ITERATIONS 50
+
+static const char vertex_shader[] =
+	"uniform mat4 proj;\n"
+	"uniform float depth;\n"
+	"attribute vec2 position;\n"
+	"attribute vec2 texcoord;\n"
+	"varying vec2 v_texcoord;\n"
+	"void main()\n"
+	"{\n"
+	"   gl_Position = proj * vec4(position, depth, 1.0);\n"
+	"   v_texcoord = texcoord;\n"
+	"}\n";
+
+static const char texture_fragment_shader[] =
+	"precision mediump float;\n"
+	"varying vec2 v_texcoord;\n"
+	"uniform sampler2D tex;\n"
+	"uniform float alpha;\n"
+	"void main()\n"
+	"{\n"
+	"   gl_FragColor = alpha * texture2D(tex, v_texcoord);\n"
+	"}\n";
+
+struct window {
+	GLfloat vertices[6][4];
+	GLfloat alpha;
+};
+
+struct bench {
+	GLuint program;
+	GLint proj_uniform;
+	GLint depth_uniform;
+	GLint alpha_uniform;
+	GLuint texture;
+	struct window windows[MAX_WINDOWS];
+	int n_windows;
+};
+
+static struct timespec begin_time;
+
+static void
+reset_timer(void)
+{
+	clock_gettime(CLOCK_MONOTONIC, &begin_time);
+}
+
+static double
+read_timer(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (double)(t.tv_sec - begin_time.tv_sec) +
+	       1e-9 * (t.tv_nsec - begin_time.tv_nsec);
+}
+
+static GLuint
+compile_shader(GLenum type, const char *source)
+{
+	GLuint s;
+	char msg[512];
+	GLint status;
+
+	s = glCreateShader(type);
+	glShaderSource(s, 1, &source, NULL);
+	glCompileShader(s);
+	glGetShaderiv(s, GL_COMPILE_STATUS, &status);
+	if (!status) {
+		glGetShaderInfoLog(s, sizeof msg, NULL, msg);
+		fprintf(stderr, "shader info: %s\n", msg);
+		exit(EXIT_FAILURE);
+	}
+
+	return s;
+}
+
+static void
+setup_program(struct bench *b)
+{
+	GLint status;
+
+	b->program = glCreateProgram();
+	glAttachShader(b->program,
+		       compile_shader(GL_VERTEX_SHADER, vertex_shader));
+	glAttachShader(b->program,
+		       compile_shader(GL_FRAGMENT_SHADER,
+				      texture_fragment_shader));
+	glBindAttribLocation(b->program, 0, "position");
+	glBindAttribLocation(b->program, 1, "texcoord");
+	glLinkProgram(b->program);
+	glGetProgramiv(b->program, GL_LINK_STATUS, &status);
+	if (!status) {
+		fprintf(stderr, "failed to link program\n");
+		exit(EXIT_FAILURE);
+	}
+
+	b->proj_uniform = glGetUniformLocation(b->program, "proj");
+	b->depth_uniform = glGetUniformLocation(b->program, "depth");
+	b->alpha_uniform = glGetUniformLocation(b->program, "alpha");
+	glUniform1i(glGetUniformLocation(b->program, "tex"), 0);
+}
+
+static void
+setup_texture(struct bench *b)
+{
+	static uint32_t pixels[TEX_SIZE * TEX_SIZE];
+	int x, y;
+
+	for (y = 0; y < TEX_SIZE; y++)
+		for (x = 0; x < TEX_SIZE; x++)
+			pixels[y * TEX_SIZE + x] = 0xff000000 |
+				(x << 16) | (y << 8) | ((x ^ y) & 0xff);
+
+	glGenTextures(1, &b->texture);
+	glBindTexture(GL_TEXTURE_2D, b->texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, TEX_SIZE, TEX_SIZE, 0,
+		     GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+}
+
+/* Windows of 60% of the screen, each rotated a little further and
+ * moved towards the bottom right; every fourth one is translucent. */
+static void
+setup_windows(struct bench *b, int n)
+{
+	static const GLfloat corners[4][2] = {
+		{ -0.5, -0.5 }, { 0.5, -0.5 }, { 0.5, 0.5 }, { -0.5, 0.5 }
+	};
+	static const int fan[6] = { 0, 1, 2, 0, 2, 3 };
+	GLfloat w = WIDTH * 0.6, h = HEIGHT * 0.6;
+	GLfloat cx, cy, angle, c, s;
+	struct window *win;
+	int i, k;
+
+	b->n_windows = n;
+	for (i = 0; i < n; i++) {
+		win = &b->windows[i];
+		cx = WIDTH * (0.35 + 0.3 * i / n);
+		cy = HEIGHT * (0.35 + 0.3 * i / n);
+		angle = 0.05 + 0.5 * i / n;
+		c = cos(angle);
+		s = sin(angle);
+
+		for (k = 0; k < 6; k++) {
+			GLfloat x = corners[fan[k]][0] * w;
+			GLfloat y = corners[fan[k]][1] * h;
+
+			win->vertices[k][0] = cx + x * c - y * s;
+			win->vertices[k][1] = cy + x * s + y * c;
+			win->vertices[k][2] = corners[fan[k]][0] + 0.5;
+			win->vertices[k][3] = corners[fan[k]][1] + 0.5;
+		}
+
+		win->alpha = (i % 4 == 3) ? 0.5 : 1.0;
+	}
+}
+
+static void
+draw_window(struct bench *b, struct window *win, GLfloat depth)
+{
+	glUniform1f(b->depth_uniform, depth);
+	glUniform1f(b->alpha_uniform, win->alpha);
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE,
+			      4 * sizeof(GLfloat), &win->vertices[0][0]);
+	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE,
+			      4 * sizeof(GLfloat), &win->vertices[0][2]);
+	glDrawArrays(GL_TRIANGLES, 0, 6);
+}
+
+/* windows[0] is the topmost one, like the compositor's view list */
+static void
+paint_back_to_front(struct bench *b)
+{
+	int i;
+
+	glClear(GL_COLOR_BUFFER_BIT);
+	for (i = b->n_windows - 1; i >= 0; i--) {
+		if (b->windows[i].alpha < 1.0)
+			glEnable(GL_BLEND);
+		else
+			glDisable(GL_BLEND);
+		draw_window(b, &b->windows[i], 0.0);
+	}
+}
+
+static void
+paint_depth_tested(struct bench *b)
+{
+	GLfloat step = 2.0 / (b->n_windows + 1);
+	int i;
+
+	glDepthMask(GL_TRUE);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	glEnable(GL_DEPTH_TEST);
+	glDepthFunc(GL_LEQUAL);
+
+	glDisable(GL_BLEND);
+	for (i = 0; i < b->n_windows; i++)
+		if (b->windows[i].alpha == 1.0)
+			draw_window(b, &b->windows[i], -1.0 + (i + 1) * step);
+
+	glDepthMask(GL_FALSE);
+	glEnable(GL_BLEND);
+	for (i = b->n_windows - 1; i >= 0; i--)
+		if (b->windows[i].alpha < 1.0)
+			draw_window(b, &b->windows[i], -1.0 + (i + 1) * step);
+
+	glDisable(GL_DEPTH_TEST);
+}
+
+static double
+run(struct bench *b, void (*paint)(struct bench *b), uint32_t *pixels)
+{
+	double t;
+	int i;
+
+	paint(b);
+	glFinish();
+
+	reset_timer();
+	for (i = 0; i < ITERATIONS; i++)
+		paint(b);
+	glFinish();
+	t = read_timer();
+
+	glReadPixels(0, 0, WIDTH, HEIGHT, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+
+	return t / ITERATIONS;
+}
+
+static int
+max_difference(const uint32_t *a, const uint32_t *b, int n)
+{
+	int i, c, d, max = 0;
+
+	for (i = 0; i < n; i++) {
+		for (c = 0; c < 32; c += 8) {
+			d = abs((int) ((a[i] >> c) & 0xff) -
+				(int) ((b[i] >> c) & 0xff));
+			if (d > max)
+				max = d;
+		}
+	}
+
+	return max;
+}
+
+static void
+setup_context(void)
+{
+	static const EGLint config_attribs[] = {
+		EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+		EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
+		EGL_NONE
+	};
+	static const EGLint context_attribs[] = {
+		EGL_CONTEXT_CLIENT_VERSION, 2,
+		EGL_NONE
+	};
+	PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display;
+	EGLDisplay dpy = EGL_NO_DISPLAY;
+	EGLConfig config;
+	EGLContext ctx;
+	EGLint n;
+	GLuint fbo, rb[2];
+
+	get_platform_display = (void *)
+		eglGetProcAddress("eglGetPlatformDisplayEXT");
+	if (get_platform_display)
+		dpy = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA,
+					   EGL_DEFAULT_DISPLAY, NULL);
+	if (dpy == EGL_NO_DISPLAY)
+		dpy = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+	if (!eglInitialize(dpy, NULL, NULL) ||
+	    !eglBindAPI(EGL_OPENGL_ES_API) ||
+	    !eglChooseConfig(dpy, config_attribs, &config, 1, &n) || n < 1) {
+		fprintf(stderr, "failed to set up EGL\n");
+		exit(EXIT_FAILURE);
+	}
+
+	ctx = eglCreateContext(dpy, config, EGL_NO_CONTEXT, context_attribs);
+	if (ctx == EGL_NO_CONTEXT ||
+	    !eglMakeCurrent(dpy, EGL_NO_SURFACE, EGL_NO_SURFACE, ctx)) {
+		fprintf(stderr, "failed to make a surfaceless context current\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* stands in for an output with a 16 bit depth buffer */
+	glGenFramebuffers(1, &fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	glGenRenderbuffers(2, rb);
+	glBindRenderbuffer(GL_RENDERBUFFER, rb[0]);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGB565, WIDTH, HEIGHT);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+				  GL_RENDERBUFFER, rb[0]);
+	glBindRenderbuffer(GL_RENDERBUFFER, rb[1]);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT16,
+			      WIDTH, HEIGHT);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+				  GL_RENDERBUFFER, rb[1]);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) !=
+	    GL_FRAMEBUFFER_COMPLETE) {
+		fprintf(stderr, "incomplete framebuffer\n");
+		exit(EXIT_FAILURE);
+	}
+
+	printf("GL renderer: %s\n", glGetString(GL_RENDERER));
+	printf("model of the gl-renderer depth pass, not weston's renderer\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const int window_counts[] = { 2, 8, 32 };
+	struct bench b;
+	uint32_t *painter, *depth;
+	double t_painter, t_depth;
+	int i, diff, ret = EXIT_SUCCESS;
+
+	setup_context();
+
+	memset(&b, 0, sizeof b);
+	setup_program(&b);
+	setup_texture(&b);
+
+	glUseProgram(b.program);
+	glViewport(0, 0, WIDTH, HEIGHT);
+	glClearColor(0.0, 0.0, 0.0, 1.0);
+	glClearDepthf(1.0);
+	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+	glEnableVertexAttribArray(0);
+	glEnableVertexAttribArray(1);
+
+	/* pixels to clip space, y down */
+	{
+		GLfloat proj[16] = {
+			2.0 / WIDTH, 0, 0, 0,
+			0, -2.0 / HEIGHT, 0, 0,
+			0, 0, 1, 0,
+			-1, 1, 0, 1
+		};
+		glUniformMatrix4fv(b.proj_uniform, 1, GL_FALSE, proj);
+	}
+
+	painter = malloc(WIDTH * HEIGHT * 4);
+	depth = malloc(WIDTH * HEIGHT * 4);
+	if (!painter || !depth)
+		return EXIT_FAILURE;
+
+	printf("%-8s %14s %14s %8s\n",
+	       "windows", "back-to-front", "depth-tested", "speedup");
+	for (i = 0; i < (int) ARRAY_LENGTH(window_counts); i++) {
+		setup_windows(&b, window_counts[i]);
+		t_painter = run(&b, paint_back_to_front, painter);
+		t_depth = run(&b, paint_depth_tested, depth);
+
+		printf("%-8d %11.3f ms %11.3f ms %7.2fx\n", b.n_windows,
+		       t_painter * 1e3, t_depth * 1e3, t_painter / t_depth);
+
+		/* only rounding of the blended pixels may differ */
+		diff = max_difference(painter, depth, WIDTH * HEIGHT);
+		if (diff > 1) {
+			fprintf(stderr, "results differ by up to %d\n", diff);
+			ret = EXIT_FAILURE;
+		}
+	}
+
+	free(painter);
+	free(depth);
+
+	return ret;
+}
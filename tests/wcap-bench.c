@@ -0,0 +1,241 @@
+/*
+ * Copyright © 2026 agent <agent@local>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Compares the wcap codecs on whole 1080p and 4K frames, and checks
+ * that they all encode and decode to the same bits. */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "wcap/wcap-decode.h"
+#include "wcap/wcap-codec.h"
+
+#define MAX_CODECS 8
+#define ITERATIONS 20
+
+static struct timespec begin_time;
+
+static void
+reset_timer(void)
+{
+	clock_gettime(CLOCK_MONOTONIC, &begin_time);
+}
+
+static double
+read_timer(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (double)(t.tv_sec - begin_time.tv_sec) +
+	       1e-9 * (t.tv_nsec - begin_time.tv_nsec);
+}
+
+/* Desktop-like content: a flat background, a gradient window, a block
+ * of noise standing in for video, and text-like stripes. The second
+ * frame moves the window and replaces the noise. */
+static void
+fill_frame(uint32_t *frame, int width, int height, int seed)
+{
+	int x, y;
+
+	srand(seed);
+	for (y = 0; y < height; y++) {
+		for (x = 0; x < width; x++) {
+			uint32_t v = 0xff336699;
+
+			if (x > width / 8 + seed * 16 && x < width / 2 &&
+			    y > height / 8 && y < height / 2)
+				v = 0xff000000 | (x * 255 / width) << 16 |
+				    (y * 255 / height) << 8 | seed;
+			else if (x > width / 2 && y > height / 2 &&
+				 x < width * 3 / 4 && y < height * 3 / 4)
+				v = 0xff000000 | (rand() & 0xffffff);
+			else if (y % 16 < 2 && x % 7 < 4)
+				v = 0xffeeeeee;
+
+			frame[y * width + x] = v;
+		}
+	}
+}
+
+static size_t
+encode(const struct wcap_codec *codec, uint32_t *out, uint32_t *deltas,
+       const uint32_t *next, uint32_t *frame, int width, int height)
+{
+	struct wcap_encoder encoder;
+	int y;
+
+	encoder.codec = codec;
+	encoder.deltas = deltas;
+	wcap_encoder_begin(&encoder, out);
+	for (y = height - 1; y >= 0; y--)
+		wcap_encoder_add_row(&encoder, next + y * width,
+				     frame + y * width, width);
+
+	return wcap_encoder_end(&encoder) - out;
+}
+
+/* Writes a frame header and rectangle in front of the runs at out */
+static uint32_t *
+frame_header(uint32_t *out, int width, int height)
+{
+	struct wcap_frame_header *header = (void *) out;
+	struct wcap_rectangle *rect = (void *) (header + 1);
+
+	header->msecs = 0;
+	header->nrects = 1;
+	rect->x1 = 0;
+	rect->y1 = 0;
+	rect->x2 = width;
+	rect->y2 = height;
+
+	return (uint32_t *) (rect + 1);
+}
+
+static int
+bench_size(int width, int height,
+	   const struct wcap_codec **codecs, int n_codecs)
+{
+	size_t size = (size_t) width * height;
+	size_t offset = (sizeof(struct wcap_frame_header) +
+			 sizeof(struct wcap_rectangle)) / 4;
+	uint32_t *prev, *next, *frame, *deltas, *out, *ref_out, *ref_frame;
+	struct wcap_decoder decoder;
+	size_t len, ref_len = 0;
+	double t_enc, t_dec;
+	int i, j, ret = 0;
+
+	prev = malloc(size * 4);
+	next = malloc(size * 4);
+	frame = malloc(size * 4);
+	ref_frame = malloc(size * 4);
+	deltas = malloc(width * 4);
+	out = malloc((size + offset) * 4);
+	ref_out = malloc(size * 4);
+	if (!prev || !next || !frame || !ref_frame ||
+	    !deltas || !out || !ref_out) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	fill_frame(prev, width, height, 1);
+	fill_frame(next, width, height, 2);
+
+	printf("%dx%d:\n", width, height);
+	for (i = 0; i < n_codecs; i++) {
+		t_enc = 0;
+		for (j = 0; j < ITERATIONS; j++) {
+			memcpy(frame, prev, size * 4);
+			reset_timer();
+			len = encode(codecs[i], frame_header(out, width, height),
+				     deltas, next, frame, width, height);
+			t_enc += read_timer();
+		}
+
+		if (i == 0) {
+			ref_len = len;
+			memcpy(ref_out, out + offset, len * 4);
+		} else if (len != ref_len ||
+			   memcmp(ref_out, out + offset, len * 4) != 0) {
+			printf("  %s: encoding differs from %s\n",
+			       codecs[i]->name, codecs[0]->name);
+			ret = -1;
+		}
+
+		memset(&decoder, 0, sizeof decoder);
+		decoder.codec = codecs[i];
+		decoder.width = width;
+		decoder.height = height;
+		decoder.frame = frame;
+
+		t_dec = 0;
+		for (j = 0; j < ITERATIONS; j++) {
+			memcpy(frame, prev, size * 4);
+			decoder.p = out;
+			reset_timer();
+			wcap_decoder_get_frame(&decoder);
+			t_dec += read_timer();
+		}
+
+		if (i == 0) {
+			memcpy(ref_frame, frame, size * 4);
+		} else if (memcmp(ref_frame, frame, size * 4) != 0) {
+			printf("  %s: decoding differs from %s\n",
+			       codecs[i]->name, codecs[0]->name);
+			ret = -1;
+		}
+
+		printf("  %-8s encode %7.3f ms  decode %7.3f ms  "
+		       "(%zu words)\n", codecs[i]->name,
+		       t_enc * 1e3 / ITERATIONS, t_dec * 1e3 / ITERATIONS,
+		       len);
+	}
+
+	for (j = 0; j < (int) size; j++) {
+		if (ref_frame[j] != (next[j] | 0xff000000)) {
+			printf("  decoded frame does not match the input\n");
+			ret = -1;
+			break;
+		}
+	}
+
+	free(prev);
+	free(next);
+	free(frame);
+	free(ref_frame);
+	free(deltas);
+	free(out);
+	free(ref_out);
+
+	return ret;
+}
+
+int
+main(int argc, char *argv[])
+{
+	const struct wcap_codec *supported[MAX_CODECS];
+	const struct wcap_codec *codecs[MAX_CODECS];
+	int i, n, ret = 0;
+
+	n = wcap_codec_get_supported(supported, MAX_CODECS);
+
+	/* The scalar codec is the reference, run it first */
+	codecs[0] = supported[n - 1];
+	for (i = 0; i < n - 1; i++)
+		codecs[i + 1] = supported[i];
+
+	if (bench_size(1920, 1080, codecs, n) < 0)
+		ret = 1;
+	if (bench_size(3840, 2160, codecs, n) < 0)
+		ret = 1;
+
+	return ret;
+}
@@ -133,6 +133,7 @@ pointer_handle_enter(void *data, struct wl_pointer *wl_pointer,
 	struct pointer *pointer = data;
 
 	pointer->focus = wl_surface_get_user_data(wl_surface);
+	pointer->enter_serial = serial;
 	pointer->x = wl_fixed_to_int(x);
 	pointer->y = wl_fixed_to_int(y);
 
@@ -0,0 +1,402 @@
+/*
+ * Copyright © 2012 Intel Corporation
+ * Copyright © 2026 agent <agent@local>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+
+#include "wcap-codec.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define WCAP_CODEC_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define WCAP_CODEC_NEON 1
+#include <arm_neon.h>
+#endif
+
+#define COLOR_MASK 0x00ffffff
+#define ALPHA_MASK 0xff000000
+
+static uint32_t
+component_delta(uint32_t next, uint32_t prev)
+{
+	unsigned char dr, dg, db;
+
+	dr = (next >> 16) - (prev >> 16);
+	dg = (next >>  8) - (prev >>  8);
+	db = (next >>  0) - (prev >>  0);
+
+	return (dr << 16) | (dg << 8) | (db << 0);
+}
+
+static uint32_t
+component_add(uint32_t pixel, uint32_t delta)
+{
+	unsigned char r, g, b;
+
+	r = (pixel >> 16) + (delta >> 16);
+	g = (pixel >>  8) + (delta >>  8);
+	b = (pixel >>  0) + (delta >>  0);
+
+	return ALPHA_MASK | (r << 16) | (g << 8) | b;
+}
+
+static void
+delta_c(uint32_t *delta, const uint32_t *next, uint32_t *frame, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		delta[i] = component_delta(next[i], frame[i]);
+		frame[i] = next[i];
+	}
+}
+
+static int
+run_length_c(const uint32_t *p, int n, uint32_t v)
+{
+	int i;
+
+	for (i = 0; i < n && p[i] == v; i++)
+		;
+
+	return i;
+}
+
+static void
+apply_delta_c(uint32_t *frame, uint32_t delta, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		frame[i] = component_add(frame[i], delta);
+}
+
+static const struct wcap_codec codec_c = {
+	"scalar", delta_c, run_length_c, apply_delta_c
+};
+
+/* Subtracting or adding bytewise gives the same per-channel wrap around
+ * as the scalar code; the alpha byte is masked afterwards. */
+
+#ifdef WCAP_CODEC_X86
+
+__attribute__((target("sse2"))) static void
+delta_sse2(uint32_t *delta, const uint32_t *next, uint32_t *frame, int n)
+{
+	const __m128i mask = _mm_set1_epi32(COLOR_MASK);
+	__m128i a, b;
+	int i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		a = _mm_loadu_si128((const __m128i *) (next + i));
+		b = _mm_loadu_si128((const __m128i *) (frame + i));
+		_mm_storeu_si128((__m128i *) (delta + i),
+				 _mm_and_si128(_mm_sub_epi8(a, b), mask));
+		_mm_storeu_si128((__m128i *) (frame + i), a);
+	}
+
+	delta_c(delta + i, next + i, frame + i, n - i);
+}
+
+__attribute__((target("sse2"))) static int
+run_length_sse2(const uint32_t *p, int n, uint32_t v)
+{
+	const __m128i vv = _mm_set1_epi32(v);
+	__m128i a;
+	int i, m;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		a = _mm_loadu_si128((const __m128i *) (p + i));
+		m = _mm_movemask_epi8(_mm_cmpeq_epi32(a, vv));
+		if (m != 0xffff)
+			return i + __builtin_ctz(~m) / 4;
+	}
+
+	return i + run_length_c(p + i, n - i, v);
+}
+
+__attribute__((target("sse2"))) static void
+apply_delta_sse2(uint32_t *frame, uint32_t delta, int n)
+{
+	const __m128i alpha = _mm_set1_epi32(ALPHA_MASK);
+	const __m128i vd = _mm_set1_epi32(delta & COLOR_MASK);
+	__m128i a;
+	int i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		a = _mm_loadu_si128((const __m128i *) (frame + i));
+		a = _mm_or_si128(_mm_add_epi8(a, vd), alpha);
+		_mm_storeu_si128((__m128i *) (frame + i), a);
+	}
+
+	apply_delta_c(frame + i, delta, n - i);
+}
+
+static const struct wcap_codec codec_sse2 = {
+	"sse2", delta_sse2, run_length_sse2, apply_delta_sse2
+};
+
+__attribute__((target("avx2"))) static void
+delta_avx2(uint32_t *delta, const uint32_t *next, uint32_t *frame, int n)
+{
+	const __m256i mask = _mm256_set1_epi32(COLOR_MASK);
+	__m256i a, b;
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		a = _mm256_loadu_si256((const __m256i *) (next + i));
+		b = _mm256_loadu_si256((const __m256i *) (frame + i));
+		_mm256_storeu_si256((__m256i *) (delta + i),
+				    _mm256_and_si256(_mm256_sub_epi8(a, b),
+						     mask));
+		_mm256_storeu_si256((__m256i *) (frame + i), a);
+	}
+
+	delta_c(delta + i, next + i, frame + i, n - i);
+}
+
+__attribute__((target("avx2"))) static int
+run_length_avx2(const uint32_t *p, int n, uint32_t v)
+{
+	const __m256i vv = _mm256_set1_epi32(v);
+	__m256i a;
+	uint32_t m;
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		a = _mm256_loadu_si256((const __m256i *) (p + i));
+		m = _mm256_movemask_epi8(_mm256_cmpeq_epi32(a, vv));
+		if (m != 0xffffffff)
+			return i + __builtin_ctz(~m) / 4;
+	}
+
+	return i + run_length_c(p + i, n - i, v);
+}
+
+__attribute__((target("avx2"))) static void
+apply_delta_avx2(uint32_t *frame, uint32_t delta, int n)
+{
+	const __m256i alpha = _mm256_set1_epi32(ALPHA_MASK);
+	const __m256i vd = _mm256_set1_epi32(delta & COLOR_MASK);
+	__m256i a;
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		a = _mm256_loadu_si256((const __m256i *) (frame + i));
+		a = _mm256_or_si256(_mm256_add_epi8(a, vd), alpha);
+		_mm256_storeu_si256((__m256i *) (frame + i), a);
+	}
+
+	apply_delta_c(frame + i, delta, n - i);
+}
+
+static const struct wcap_codec codec_avx2 = {
+	"avx2", delta_avx2, run_length_avx2, apply_delta_avx2
+};
+
+#endif /* WCAP_CODEC_X86 */
+
+#ifdef WCAP_CODEC_NEON
+
+static void
+delta_neon(uint32_t *delta, const uint32_t *next, uint32_t *frame, int n)
+{
+	const uint32x4_t mask = vdupq_n_u32(COLOR_MASK);
+	uint8x16_t a, b;
+	int i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		a = vreinterpretq_u8_u32(vld1q_u32(next + i));
+		b = vreinterpretq_u8_u32(vld1q_u32(frame + i));
+		vst1q_u32(delta + i,
+			  vandq_u32(vreinterpretq_u32_u8(vsubq_u8(a, b)),
+				    mask));
+		vst1q_u32(frame + i, vreinterpretq_u32_u8(a));
+	}
+
+	delta_c(delta + i, next + i, frame + i, n - i);
+}
+
+static int
+run_length_neon(const uint32_t *p, int n, uint32_t v)
+{
+	const uint32x4_t vv = vdupq_n_u32(v);
+	uint64x2_t eq;
+	int i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		eq = vreinterpretq_u64_u32(vceqq_u32(vld1q_u32(p + i), vv));
+		if ((vgetq_lane_u64(eq, 0) & vgetq_lane_u64(eq, 1)) !=
+		    UINT64_MAX)
+			break;
+	}
+
+	return i + run_length_c(p + i, n - i, v);
+}
+
+static void
+apply_delta_neon(uint32_t *frame, uint32_t delta, int n)
+{
+	const uint32x4_t alpha = vdupq_n_u32(ALPHA_MASK);
+	const uint8x16_t vd =
+		vreinterpretq_u8_u32(vdupq_n_u32(delta & COLOR_MASK));
+	uint8x16_t a;
+	int i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		a = vaddq_u8(vreinterpretq_u8_u32(vld1q_u32(frame + i)), vd);
+		vst1q_u32(frame + i,
+			  vorrq_u32(vreinterpretq_u32_u8(a), alpha));
+	}
+
+	apply_delta_c(frame + i, delta, n - i);
+}
+
+static const struct wcap_codec codec_neon = {
+	"neon", delta_neon, run_length_neon, apply_delta_neon
+};
+
+#endif /* WCAP_CODEC_NEON */
+
+/** Get the codecs this CPU supports, fastest first
+ *
+ * \param codecs Array to fill.
+ * \param max Size of the array.
+ * \return The number of codecs stored, at least 1 if max > 0.
+ *
+ * The scalar codec is always last.
+ */
+int
+wcap_codec_get_supported(const struct wcap_codec **codecs, int max)
+{
+	int n = 0;
+
+#ifdef WCAP_CODEC_X86
+	__builtin_cpu_init();
+	if (n < max && __builtin_cpu_supports("avx2"))
+		codecs[n++] = &codec_avx2;
+	if (n < max && __builtin_cpu_supports("sse2"))
+		codecs[n++] = &codec_sse2;
+#endif
+#ifdef WCAP_CODEC_NEON
+	if (n < max)
+		codecs[n++] = &codec_neon;
+#endif
+	if (n < max)
+		codecs[n++] = &codec_c;
+
+	return n;
+}
+
+const struct wcap_codec *
+wcap_codec_get(void)
+{
+	const struct wcap_codec *codec;
+
+	wcap_codec_get_supported(&codec, 1);
+
+	return codec;
+}
+
+static uint32_t *
+output_run(uint32_t *p, uint32_t delta, int run)
+{
+	int i;
+
+	while (run > 0) {
+		if (run <= 0xe0) {
+			*p++ = delta | ((run - 1) << 24);
+			break;
+		}
+
+		i = 24 - __builtin_clz(run);
+		*p++ = delta | ((i + 0xe0) << 24);
+		run -= 1 << (7 + i);
+	}
+
+	return p;
+}
+
+void
+wcap_encoder_begin(struct wcap_encoder *encoder, uint32_t *out)
+{
+	encoder->p = out;
+	encoder->prev = 0;
+	encoder->run = 0;
+}
+
+/** Encode one row of a rectangle
+ *
+ * \param encoder The encoder.
+ * \param next The new pixels of the row.
+ * \param frame The previous pixels of the row, updated to next.
+ * \param width Pixels in the row, at most the size of encoder->deltas.
+ *
+ * Runs continue from one row to the next.
+ */
+void
+wcap_encoder_add_row(struct wcap_encoder *encoder,
+		     const uint32_t *next, uint32_t *frame, int width)
+{
+	const struct wcap_codec *codec = encoder->codec;
+	uint32_t *deltas = encoder->deltas;
+	int i = 0, k;
+
+	codec->delta(deltas, next, frame, width);
+
+	if (encoder->run == 0 && width > 0) {
+		encoder->prev = deltas[0];
+		encoder->run = 1;
+		i = 1;
+	}
+
+	while (i < width) {
+		k = codec->run_length(deltas + i, width - i, encoder->prev);
+		encoder->run += k;
+		i += k;
+		if (i == width)
+			break;
+
+		encoder->p = output_run(encoder->p, encoder->prev,
+					encoder->run);
+		encoder->prev = deltas[i++];
+		encoder->run = 1;
+	}
+}
+
+/* Flushes the last run, returns the end of the output. */
+uint32_t *
+wcap_encoder_end(struct wcap_encoder *encoder)
+{
+	encoder->p = output_run(encoder->p, encoder->prev, encoder->run);
+	encoder->run = 0;
+
+	return encoder->p;
+}
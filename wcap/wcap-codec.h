@@ -0,0 +1,74 @@
+/*
+ * Copyright © 2012 Intel Corporation
+ * Copyright © 2026 agent <agent@local>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef _WCAP_CODEC_
+#define _WCAP_CODEC_
+
+#include <stdint.h>
+
+/* Pixel kernels of the wcap delta/RLE coding. All of them produce the
+ * same results; wcap_codec_get() picks the fastest one the CPU runs. */
+struct wcap_codec {
+	const char *name;
+
+	/* delta[i] = next[i] - frame[i] per color channel, alpha 0,
+	 * then frame[i] = next[i] */
+	void (*delta)(uint32_t *delta, const uint32_t *next,
+		      uint32_t *frame, int n);
+
+	/* Number of leading values in p[0..n) equal to v */
+	int (*run_length)(const uint32_t *p, int n, uint32_t v);
+
+	/* frame[i] += delta per color channel, alpha set to 0xff */
+	void (*apply_delta)(uint32_t *frame, uint32_t delta, int n);
+};
+
+const struct wcap_codec *
+wcap_codec_get(void);
+
+int
+wcap_codec_get_supported(const struct wcap_codec **codecs, int max);
+
+/* Encodes the rows of one rectangle into runs. */
+struct wcap_encoder {
+	const struct wcap_codec *codec;
+	uint32_t *deltas;	/* scratch, one row */
+	uint32_t *p;		/* next output word */
+	uint32_t prev;
+	int run;
+};
+
+void
+wcap_encoder_begin(struct wcap_encoder *encoder, uint32_t *out);
+
+void
+wcap_encoder_add_row(struct wcap_encoder *encoder,
+		     const uint32_t *next, uint32_t *frame, int width);
+
+uint32_t *
+wcap_encoder_end(struct wcap_encoder *encoder);
+
+#endif
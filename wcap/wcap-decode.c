@@ -39,15 +39,16 @@
 #include <cairo.h>
 
 #include "wcap-decode.h"
+#include "wcap-codec.h"
 
 static void
 wcap_decoder_decode_rectangle(struct wcap_decoder *decoder,
 			      struct wcap_rectangle *rect)
 {
+	const struct wcap_codec *codec = decoder->codec;
 	uint32_t v, *p = decoder->p, *d;
 	int width = rect->x2 - rect->x1, height = rect->y2 - rect->y1;
-	int x, i, j, k, l, count = width * height;
-	unsigned char r, g, b, dr, dg, db;
+	int x, i, j, k, l, n, count = width * height;
 
 	d = decoder->frame + (rect->y2 - 1) * decoder->width;
 	x = rect->x1;
@@ -61,15 +62,14 @@ wcap_decoder_decode_rectangle(struct wcap_decoder *decoder,
 			j = 1 << (l - 0xe0 + 7);
 		}
 
-		dr = (v >> 16);
-		dg = (v >>  8);
-		db = (v >>  0);
-		for (k = 0; k < j; k++) {
-			r = (d[x] >> 16) + dr;
-			g = (d[x] >>  8) + dg;
-			b = (d[x] >>  0) + db;
-			d[x] = 0xff000000 | (r << 16) | (g << 8) | b;
-			x++;
+		/* A run may span rows; apply it a row piece at a time */
+		for (k = 0; k < j; k += n) {
+			n = rect->x2 - x;
+			if (n > j - k)
+				n = j - k;
+
+			codec->apply_delta(d + x, v, n);
+			x += n;
 			if (x == rect->x2) {
 				x = rect->x1;
 				d -= decoder->width;
@@ -140,6 +140,7 @@ wcap_decoder_create(const char *filename)
 	decoder->count = 0;
 	decoder->width = header->width;
 	decoder->height = header->height;
+	decoder->codec = wcap_codec_get();
 	decoder->p = header + 1;
 	decoder->end = decoder->map + decoder->size;
 
@@ -48,7 +48,10 @@ struct wcap_rectangle {
 	int32_t x1, y1, x2, y2;
 };
 
+struct wcap_codec;
+
 struct wcap_decoder {
+	const struct wcap_codec *codec;
 	int fd;
 	size_t size;
 	void *map, *p, *end;
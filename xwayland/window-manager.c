@@ -34,7 +34,9 @@
 #include <errno.h>
 #include <unistd.h>
 #include <signal.h>
+#include <assert.h>
 #include <X11/Xcursor/Xcursor.h>
+#include <xcb/xcbext.h>
 #include <linux/input.h>
 
 #include "xwayland.h"
@@ -123,6 +125,14 @@ struct motif_wm_hints {
 #define _NET_WM_MOVERESIZE_MOVE_KEYBOARD    10   /* move via keyboard */
 #define _NET_WM_MOVERESIZE_CANCEL           11   /* cancel operation */
 
+#define WM_WINDOW_PROPERTY_COUNT 11
+
+struct wm_window_property {
+	xcb_atom_t atom;
+	xcb_atom_t type;
+	int offset;
+};
+
 struct weston_wm_window {
 	struct weston_wm *wm;
 	xcb_window_t id;
@@ -136,6 +146,16 @@ struct weston_wm_window {
 	struct wl_event_source *repaint_source;
 	struct wl_event_source *configure_source;
 	int properties_dirty;
+	/* Requests sent but not yet answered, in request order; the
+	 * window is on wm->fetch_list while any are outstanding. */
+	bool fetch_pending;
+	bool geometry_pending;
+	xcb_get_geometry_cookie_t geometry_cookie;
+	xcb_get_property_cookie_t property_cookie[WM_WINDOW_PROPERTY_COUNT];
+	xcb_get_property_reply_t *property_reply[WM_WINDOW_PROPERTY_COUNT];
+	uint32_t properties_received;
+	struct wl_list fetch_link;
+	bool map_pending;
 	int pid;
 	char *machine;
 	char *class;
@@ -368,6 +388,7 @@ dump_property(struct weston_wm *wm,
 	}
 }
 
+#ifdef WM_DEBUG
 static void
 read_and_dump_property(struct weston_wm *wm,
 		       xcb_window_t window, xcb_atom_t property)
@@ -383,6 +404,7 @@ read_and_dump_property(struct weston_wm *wm,
 
 	free(reply);
 }
+#endif
 
 /* We reuse some predefined, but otherwise useles atoms */
 #define TYPE_WM_PROTOCOLS	XCB_ATOM_CUT_BUFFER0
@@ -391,18 +413,11 @@ read_and_dump_property(struct weston_wm *wm,
 #define TYPE_WM_NORMAL_HINTS	XCB_ATOM_CUT_BUFFER3
 
 static void
-weston_wm_window_read_properties(struct weston_wm_window *window)
+wm_window_properties(struct weston_wm *wm,
+		     struct wm_window_property props[WM_WINDOW_PROPERTY_COUNT])
 {
-	struct weston_wm *wm = window->wm;
-	struct weston_shell_interface *shell_interface =
-		&wm->server->compositor->shell_interface;
-
 #define F(field) offsetof(struct weston_wm_window, field)
-	const struct {
-		xcb_atom_t atom;
-		xcb_atom_t type;
-		int offset;
-	} props[] = {
+	const struct wm_window_property table[] = {
 		{ XCB_ATOM_WM_CLASS, XCB_ATOM_STRING, F(class) },
 		{ XCB_ATOM_WM_NAME, XCB_ATOM_STRING, F(name) },
 		{ XCB_ATOM_WM_TRANSIENT_FOR, XCB_ATOM_WINDOW, F(transient_for) },
@@ -417,24 +432,67 @@ weston_wm_window_read_properties(struct weston_wm_window *window)
 	};
 #undef F
 
-	xcb_get_property_cookie_t cookie[ARRAY_LENGTH(props)];
-	xcb_get_property_reply_t *reply;
-	void *p;
-	uint32_t *xid;
-	xcb_atom_t *atom;
+	assert(ARRAY_LENGTH(table) == WM_WINDOW_PROPERTY_COUNT);
+	memcpy(props, table, sizeof table);
+}
+
+static bool
+wm_is_window_property(struct weston_wm *wm, xcb_atom_t atom)
+{
+	struct wm_window_property props[WM_WINDOW_PROPERTY_COUNT];
 	uint32_t i;
-	char name[1024];
 
-	if (!window->properties_dirty)
+	wm_window_properties(wm, props);
+	for (i = 0; i < ARRAY_LENGTH(props); i++)
+		if (props[i].atom == atom)
+			return true;
+
+	return false;
+}
+
+/* Sends the property requests for a window whose properties changed.
+ * The replies are picked up by weston_wm_handle_replies() as they
+ * arrive, so nothing here waits on the X server. */
+static void
+weston_wm_window_fetch_properties(struct weston_wm_window *window)
+{
+	struct weston_wm *wm = window->wm;
+	struct wm_window_property props[WM_WINDOW_PROPERTY_COUNT];
+	uint32_t i;
+
+	if (!window->properties_dirty || window->fetch_pending)
 		return;
 	window->properties_dirty = 0;
 
+	wm_window_properties(wm, props);
 	for (i = 0; i < ARRAY_LENGTH(props); i++)
-		cookie[i] = xcb_get_property(wm->conn,
-					     0, /* delete */
-					     window->id,
-					     props[i].atom,
-					     XCB_ATOM_ANY, 0, 2048);
+		window->property_cookie[i] =
+			xcb_get_property(wm->conn,
+					 0, /* delete */
+					 window->id,
+					 props[i].atom,
+					 XCB_ATOM_ANY, 0, 2048);
+
+	window->properties_received = 0;
+	window->fetch_pending = true;
+	wl_list_insert(wm->fetch_list.prev, &window->fetch_link);
+}
+
+static void
+weston_wm_window_apply_properties(struct weston_wm_window *window)
+{
+	struct weston_wm *wm = window->wm;
+	struct weston_shell_interface *shell_interface =
+		&wm->server->compositor->shell_interface;
+	struct wm_window_property props[WM_WINDOW_PROPERTY_COUNT];
+	xcb_get_property_reply_t *reply;
+	void *p;
+	uint32_t *xid;
+	xcb_atom_t *atom;
+	uint32_t i, j;
+	char name[1024];
+
+	wm_window_properties(wm, props);
 
 	window->decorate = window->override_redirect ? 0 : MWM_DECOR_EVERYTHING;
 	window->size_hints.flags = 0;
@@ -442,7 +500,8 @@ weston_wm_window_read_properties(struct weston_wm_window *window)
 	window->delete_window = 0;
 
 	for (i = 0; i < ARRAY_LENGTH(props); i++)  {
-		reply = xcb_get_property_reply(wm->conn, cookie[i], NULL);
+		reply = window->property_reply[i];
+		window->property_reply[i] = NULL;
 		if (!reply)
 			/* Bad window, typically */
 			continue;
@@ -479,8 +538,8 @@ weston_wm_window_read_properties(struct weston_wm_window *window)
 			break;
 		case TYPE_WM_PROTOCOLS:
 			atom = xcb_get_property_value(reply);
-			for (i = 0; i < reply->value_len; i++)
-				if (atom[i] == wm->atom.wm_delete_window) {
+			for (j = 0; j < reply->value_len; j++)
+				if (atom[j] == wm->atom.wm_delete_window) {
 					window->delete_window = 1;
 					break;
 				}
@@ -493,12 +552,12 @@ weston_wm_window_read_properties(struct weston_wm_window *window)
 		case TYPE_NET_WM_STATE:
 			window->fullscreen = 0;
 			atom = xcb_get_property_value(reply);
-			for (i = 0; i < reply->value_len; i++) {
-				if (atom[i] == wm->atom.net_wm_state_fullscreen)
+			for (j = 0; j < reply->value_len; j++) {
+				if (atom[j] == wm->atom.net_wm_state_fullscreen)
 					window->fullscreen = 1;
-				if (atom[i] == wm->atom.net_wm_state_maximized_vert)
+				if (atom[j] == wm->atom.net_wm_state_maximized_vert)
 					window->maximized_vert = 1;
-				if (atom[i] == wm->atom.net_wm_state_maximized_horz)
+				if (atom[j] == wm->atom.net_wm_state_maximized_horz)
 					window->maximized_horz = 1;
 			}
 			break;
@@ -546,6 +605,75 @@ weston_wm_window_read_properties(struct weston_wm_window *window)
 		shell_interface->set_pid(window->shsurf, window->pid);
 }
 
+/* Collects the replies to the window's outstanding requests that have
+ * arrived, without blocking. Returns true once all of them are in.
+ * Replies arrive in request order, so there is no point in looking
+ * past the first missing one. */
+static bool
+weston_wm_window_poll_replies(struct weston_wm_window *window)
+{
+	struct weston_wm *wm = window->wm;
+	xcb_get_geometry_reply_t *geometry_reply;
+	xcb_generic_error_t *error;
+	void *reply;
+	uint32_t i;
+
+	if (window->geometry_pending) {
+		if (!xcb_poll_for_reply(wm->conn,
+					window->geometry_cookie.sequence,
+					&reply, &error))
+			return false;
+
+		/* technically we should use XRender and check the visual
+		 * format's alpha_mask, but checking depth is simpler and
+		 * works in all known cases */
+		geometry_reply = reply;
+		if (geometry_reply != NULL)
+			window->has_alpha = geometry_reply->depth == 32;
+		free(geometry_reply);
+		free(error);
+		window->geometry_pending = false;
+	}
+
+	while (window->properties_received < WM_WINDOW_PROPERTY_COUNT) {
+		i = window->properties_received;
+		if (!xcb_poll_for_reply(wm->conn,
+					window->property_cookie[i].sequence,
+					&reply, &error))
+			return false;
+
+		/* A NULL reply, typically for a bad window, is skipped
+		 * when the properties are applied. */
+		window->property_reply[i] = reply;
+		free(error);
+		window->properties_received++;
+	}
+
+	return true;
+}
+
+static void
+weston_wm_window_discard_replies(struct weston_wm_window *window)
+{
+	struct weston_wm *wm = window->wm;
+	uint32_t i;
+
+	if (window->geometry_pending)
+		xcb_discard_reply(wm->conn, window->geometry_cookie.sequence);
+
+	for (i = 0; i < WM_WINDOW_PROPERTY_COUNT; i++) {
+		if (i >= window->properties_received)
+			xcb_discard_reply(wm->conn,
+					  window->property_cookie[i].sequence);
+		free(window->property_reply[i]);
+		window->property_reply[i] = NULL;
+	}
+
+	window->geometry_pending = false;
+	window->fetch_pending = false;
+	wl_list_remove(&window->fetch_link);
+}
+
 static void
 weston_wm_window_get_frame_size(struct weston_wm_window *window,
 				int *width, int *height)
@@ -730,7 +858,8 @@ weston_wm_create_surface(struct wl_listener *listener, void *data)
 
 	wl_list_for_each(window, &wm->unpaired_window_list, link)
 		if (window->surface_id ==
-		    wl_resource_get_id(surface->resource)) {
+		    wl_resource_get_id(surface->resource) &&
+		    !window->fetch_pending) {
 			xserver_map_shell_surface(window, surface);
 			window->surface_id = 0;
 			wl_list_remove(&window->link);
@@ -942,6 +1071,27 @@ weston_wm_window_set_virtual_desktop(struct weston_wm_window *window,
 	}
 }
 
+static void
+weston_wm_window_map(struct weston_wm_window *window)
+{
+	struct weston_wm *wm = window->wm;
+
+	window->map_pending = false;
+
+	if (window->frame_id == XCB_WINDOW_NONE)
+		weston_wm_window_create_frame(window);
+
+	wm_log("XCB_MAP_REQUEST (window %d, %p, frame %d)\n",
+	       window->id, window, window->frame_id);
+
+	weston_wm_window_set_wm_state(window, ICCCM_NORMAL_STATE);
+	weston_wm_window_set_net_wm_state(window);
+	weston_wm_window_set_virtual_desktop(window, 0);
+
+	xcb_map_window(wm->conn, window->id);
+	xcb_map_window(wm->conn, window->frame_id);
+}
+
 static void
 weston_wm_handle_map_request(struct weston_wm *wm, xcb_generic_event_t *event)
 {
@@ -958,20 +1108,17 @@ weston_wm_handle_map_request(struct weston_wm *wm, xcb_generic_event_t *event)
 	if (!wm_lookup_window(wm, map_request->window, &window))
 		return;
 
-	weston_wm_window_read_properties(window);
-
-	if (window->frame_id == XCB_WINDOW_NONE)
-		weston_wm_window_create_frame(window);
-
-	wm_log("XCB_MAP_REQUEST (window %d, %p, frame %d)\n",
-	       window->id, window, window->frame_id);
-
-	weston_wm_window_set_wm_state(window, ICCCM_NORMAL_STATE);
-	weston_wm_window_set_net_wm_state(window);
-	weston_wm_window_set_virtual_desktop(window, 0);
+	/* The frame and the window state depend on the properties, so
+	 * finish mapping when their replies are in. */
+	weston_wm_window_fetch_properties(window);
+	if (window->fetch_pending) {
+		wm_log("XCB_MAP_REQUEST (window %d, waiting for properties)\n",
+		       window->id);
+		window->map_pending = true;
+		return;
+	}
 
-	xcb_map_window(wm->conn, map_request->window);
-	xcb_map_window(wm->conn, window->frame_id);
+	weston_wm_window_map(window);
 }
 
 static void
@@ -1046,8 +1193,6 @@ weston_wm_window_draw_decoration(void *data)
 	uint32_t flags = 0;
 	struct weston_view *view;
 
-	weston_wm_window_read_properties(window);
-
 	window->repaint_source = NULL;
 
 	weston_wm_window_get_frame_size(window, &width, &height);
@@ -1151,18 +1296,22 @@ weston_wm_handle_property_notify(struct weston_wm *wm, xcb_generic_event_t *even
 	if (!wm_lookup_window(wm, property_notify->window, &window))
 		return;
 
-	window->properties_dirty = 1;
-
 	wm_log("XCB_PROPERTY_NOTIFY: window %d, ", property_notify->window);
+#ifdef WM_DEBUG
 	if (property_notify->state == XCB_PROPERTY_DELETE)
 		wm_log("deleted\n");
 	else
 		read_and_dump_property(wm, property_notify->window,
 				       property_notify->atom);
+#endif
 
-	if (property_notify->atom == wm->atom.net_wm_name ||
-	    property_notify->atom == XCB_ATOM_WM_NAME)
-		weston_wm_window_schedule_repaint(window);
+	/* Clients update e.g. _NET_WM_USER_TIME on every input event;
+	 * only refetch for the properties we track. */
+	if (!wm_is_window_property(wm, property_notify->atom))
+		return;
+
+	window->properties_dirty = 1;
+	weston_wm_window_fetch_properties(window);
 }
 
 static void
@@ -1171,8 +1320,6 @@ weston_wm_window_create(struct weston_wm *wm,
 {
 	struct weston_wm_window *window;
 	uint32_t values[1];
-	xcb_get_geometry_cookie_t geometry_cookie;
-	xcb_get_geometry_reply_t *geometry_reply;
 
 	window = zalloc(sizeof *window);
 	if (window == NULL) {
@@ -1180,8 +1327,6 @@ weston_wm_window_create(struct weston_wm *wm,
 		return;
 	}
 
-	geometry_cookie = xcb_get_geometry(wm->conn, id);
-
 	values[0] = XCB_EVENT_MASK_PROPERTY_CHANGE |
                     XCB_EVENT_MASK_FOCUS_CHANGE;
 	xcb_change_window_attributes(wm->conn, id, XCB_CW_EVENT_MASK, values);
@@ -1196,12 +1341,11 @@ weston_wm_window_create(struct weston_wm *wm,
 	window->y = y;
 	window->pos_dirty = false;
 
-	geometry_reply = xcb_get_geometry_reply(wm->conn, geometry_cookie, NULL);
-	/* technically we should use XRender and check the visual format's
-	alpha_mask, but checking depth is simpler and works in all known cases */
-	if (geometry_reply != NULL)
-		window->has_alpha = geometry_reply->depth == 32;
-	free(geometry_reply);
+	/* The geometry reply comes in first, with the properties, and
+	 * is handled in weston_wm_window_poll_replies(). */
+	window->geometry_cookie = xcb_get_geometry(wm->conn, id);
+	window->geometry_pending = true;
+	weston_wm_window_fetch_properties(window);
 
 	hash_table_insert(wm->window_hash, id, window);
 }
@@ -1216,6 +1360,9 @@ weston_wm_window_destroy(struct weston_wm_window *window)
 	if (window->cairo_surface)
 		cairo_surface_destroy(window->cairo_surface);
 
+	if (window->fetch_pending)
+		weston_wm_window_discard_replies(window);
+
 	if (window->frame_id) {
 		xcb_reparent_window(wm->conn, window->id, wm->wm_window, 0, 0);
 		xcb_destroy_window(wm->conn, window->frame_id);
@@ -1515,10 +1662,11 @@ weston_wm_window_handle_surface_id(struct weston_wm_window *window,
 	 * and thus when we try to look up the surface ID, the surface
 	 * hasn't been created yet.  In that case put the window on
 	 * the unpaired window list and continue when the surface gets
-	 * created. */
+	 * created. The same goes for windows whose properties are still
+	 * being fetched, the shell surface setup depends on them. */
 	uint32_t id = client_message->data.data32[0];
 	resource = wl_client_get_object(wm->server->client, id);
-	if (resource) {
+	if (resource && !window->fetch_pending) {
 		window->surface_id = 0;
 		xserver_map_shell_surface(window,
 					  wl_resource_get_user_data(resource));
@@ -1890,82 +2038,153 @@ weston_wm_handle_focus_in(struct weston_wm *wm, xcb_generic_event_t *event)
 		weston_wm_send_focus_window(wm, wm->focus_window);
 }
 
-static int
-weston_wm_handle_event(int fd, uint32_t mask, void *data)
+static void
+weston_wm_window_finish_fetch(struct weston_wm_window *window)
 {
-	struct weston_wm *wm = data;
-	xcb_generic_event_t *event;
-	int count = 0;
+	struct weston_wm *wm = window->wm;
+	struct wl_resource *resource;
 
-	while (event = xcb_poll_for_event(wm->conn), event != NULL) {
-		if (weston_wm_handle_selection_event(wm, event)) {
-			free(event);
-			count++;
-			continue;
-		}
+	wl_list_remove(&window->fetch_link);
+	window->fetch_pending = false;
 
-		if (weston_wm_handle_dnd_event(wm, event)) {
-			free(event);
-			count++;
-			continue;
+	weston_wm_window_apply_properties(window);
+
+	if (window->map_pending)
+		weston_wm_window_map(window);
+
+	/* Pair the surface we held back in
+	 * weston_wm_window_handle_surface_id() */
+	if (window->surface_id != 0) {
+		resource = wl_client_get_object(wm->server->client,
+						window->surface_id);
+		if (resource) {
+			wl_list_remove(&window->link);
+			window->surface_id = 0;
+			xserver_map_shell_surface(window,
+						  wl_resource_get_user_data(resource));
 		}
+	}
 
-		switch (EVENT_TYPE(event)) {
-		case XCB_BUTTON_PRESS:
-		case XCB_BUTTON_RELEASE:
-			weston_wm_handle_button(wm, event);
-			break;
-		case XCB_ENTER_NOTIFY:
-			weston_wm_handle_enter(wm, event);
-			break;
-		case XCB_LEAVE_NOTIFY:
-			weston_wm_handle_leave(wm, event);
-			break;
-		case XCB_MOTION_NOTIFY:
-			weston_wm_handle_motion(wm, event);
-			break;
-		case XCB_CREATE_NOTIFY:
-			weston_wm_handle_create_notify(wm, event);
-			break;
-		case XCB_MAP_REQUEST:
-			weston_wm_handle_map_request(wm, event);
-			break;
-		case XCB_MAP_NOTIFY:
-			weston_wm_handle_map_notify(wm, event);
-			break;
-		case XCB_UNMAP_NOTIFY:
-			weston_wm_handle_unmap_notify(wm, event);
-			break;
-		case XCB_REPARENT_NOTIFY:
-			weston_wm_handle_reparent_notify(wm, event);
-			break;
-		case XCB_CONFIGURE_REQUEST:
-			weston_wm_handle_configure_request(wm, event);
-			break;
-		case XCB_CONFIGURE_NOTIFY:
-			weston_wm_handle_configure_notify(wm, event);
-			break;
-		case XCB_DESTROY_NOTIFY:
-			weston_wm_handle_destroy_notify(wm, event);
-			break;
-		case XCB_MAPPING_NOTIFY:
-			wm_log("XCB_MAPPING_NOTIFY\n");
-			break;
-		case XCB_PROPERTY_NOTIFY:
-			weston_wm_handle_property_notify(wm, event);
-			break;
-		case XCB_CLIENT_MESSAGE:
-			weston_wm_handle_client_message(wm, event);
-			break;
-		case XCB_FOCUS_IN:
-			weston_wm_handle_focus_in(wm, event);
+	weston_wm_window_schedule_repaint(window);
+
+	/* Changed again while the replies were on their way */
+	weston_wm_window_fetch_properties(window);
+}
+
+/* Finishes the windows whose replies are all in, in request order.
+ * Returns the number of windows finished. */
+static int
+weston_wm_handle_replies(struct weston_wm *wm)
+{
+	struct weston_wm_window *window;
+	int count = 0;
+
+	while (!wl_list_empty(&wm->fetch_list)) {
+		window = container_of(wm->fetch_list.next,
+				      struct weston_wm_window, fetch_link);
+		if (!weston_wm_window_poll_replies(window))
 			break;
-		}
 
+		weston_wm_window_finish_fetch(window);
+		count++;
+	}
+
+	return count;
+}
+
+static void
+weston_wm_dispatch_event(struct weston_wm *wm, xcb_generic_event_t *event)
+{
+	if (weston_wm_handle_selection_event(wm, event))
+		return;
+
+	if (weston_wm_handle_dnd_event(wm, event))
+		return;
+
+	switch (EVENT_TYPE(event)) {
+	case XCB_BUTTON_PRESS:
+	case XCB_BUTTON_RELEASE:
+		weston_wm_handle_button(wm, event);
+		break;
+	case XCB_ENTER_NOTIFY:
+		weston_wm_handle_enter(wm, event);
+		break;
+	case XCB_LEAVE_NOTIFY:
+		weston_wm_handle_leave(wm, event);
+		break;
+	case XCB_MOTION_NOTIFY:
+		weston_wm_handle_motion(wm, event);
+		break;
+	case XCB_CREATE_NOTIFY:
+		weston_wm_handle_create_notify(wm, event);
+		break;
+	case XCB_MAP_REQUEST:
+		weston_wm_handle_map_request(wm, event);
+		break;
+	case XCB_MAP_NOTIFY:
+		weston_wm_handle_map_notify(wm, event);
+		break;
+	case XCB_UNMAP_NOTIFY:
+		weston_wm_handle_unmap_notify(wm, event);
+		break;
+	case XCB_REPARENT_NOTIFY:
+		weston_wm_handle_reparent_notify(wm, event);
+		break;
+	case XCB_CONFIGURE_REQUEST:
+		weston_wm_handle_configure_request(wm, event);
+		break;
+	case XCB_CONFIGURE_NOTIFY:
+		weston_wm_handle_configure_notify(wm, event);
+		break;
+	case XCB_DESTROY_NOTIFY:
+		weston_wm_handle_destroy_notify(wm, event);
+		break;
+	case XCB_MAPPING_NOTIFY:
+		wm_log("XCB_MAPPING_NOTIFY\n");
+		break;
+	case XCB_PROPERTY_NOTIFY:
+		weston_wm_handle_property_notify(wm, event);
+		break;
+	case XCB_CLIENT_MESSAGE:
+		weston_wm_handle_client_message(wm, event);
+		break;
+	case XCB_FOCUS_IN:
+		weston_wm_handle_focus_in(wm, event);
+		break;
+	}
+}
+
+static int
+weston_wm_handle_event(int fd, uint32_t mask, void *data)
+{
+	struct weston_wm *wm = data;
+	xcb_generic_event_t *event;
+	int count = 0, n;
+
+	while (event = xcb_poll_for_event(wm->conn), event != NULL) {
+		weston_wm_dispatch_event(wm, event);
 		free(event);
 		count++;
 	}
 
+	/* Polling for a reply that has not arrived reads whatever else
+	 * is on the socket, so dispatch the events that queues up too;
+	 * they would not wake us up again. */
+	do {
+		n = weston_wm_handle_replies(wm);
+#ifdef HAVE_XCB_POLL_FOR_QUEUED_EVENT
+		while (event = xcb_poll_for_queued_event(wm->conn),
+		       event != NULL) {
+#else
+		while (event = xcb_poll_for_event(wm->conn), event != NULL) {
+#endif
+			weston_wm_dispatch_event(wm, event);
+			free(event);
+			n++;
+		}
+		count += n;
+	} while (n != 0);
+
 	if (count != 0)
 		xcb_flush(wm->conn);
 
@@ -2289,6 +2508,7 @@ weston_wm_create(struct weston_xserver *wxs, int fd)
 	wl_signal_add(&wxs->compositor->kill_signal,
 		      &wm->kill_listener);
 	wl_list_init(&wm->unpaired_window_list);
+	wl_list_init(&wm->fetch_list);
 
 	weston_wm_create_cursors(wm);
 	weston_wm_window_set_cursor(wm, wm->screen->root, XWM_CURSOR_LEFT_PTR);
@@ -2504,8 +2724,6 @@ xserver_map_shell_surface(struct weston_wm_window *window,
 	struct weston_wm_window *parent;
 	int flags = 0;
 
-	weston_wm_window_read_properties(window);
-
 	/* A weston_wm_window may have many different surfaces assigned
 	 * throughout its life, so we must make sure to remove the listener
 	 * from the old surface signal list. */
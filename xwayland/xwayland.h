@@ -72,6 +72,7 @@ struct weston_wm {
 	struct wl_listener activate_listener;
 	struct wl_listener kill_listener;
 	struct wl_list unpaired_window_list;
+	struct wl_list fetch_list;
 
 	xcb_window_t selection_window;
 	xcb_window_t selection_owner;